@@ -0,0 +1,57 @@
+#include "beacon.h"
+#include "mkey_keys.h"
+
+#include <string.h>
+
+/****************************************************
+ * INTERNALS
+*****************************************************/
+// Looks for the key marker in the manufacturer specific and service data AD
+// structures of the report.
+static bool metadata_ok(const uint8_t *data, uint8_t len) {
+  static const uint8_t marker[] = MKEY_BEACON_MARKER;
+  const uint8_t marker_len = sizeof(marker) - 1;
+  uint8_t pos = 0;
+
+  while (pos + 1 < len) {
+    const uint8_t ad_len = data[pos];
+    if (ad_len == 0 || pos + 1 + ad_len > len) {
+      break;
+    }
+    const uint8_t type = data[pos + 1];
+    if (type == BLE_HS_ADV_TYPE_MFG_DATA || type == BLE_HS_ADV_TYPE_SVC_DATA_UUID16) {
+      const uint8_t *field = &data[pos + 2];
+      for (int i = 0; i + marker_len <= ad_len - 1; i++) {
+        if (field[i] == marker[0] && memcmp(&field[i], marker, marker_len) == 0) {
+          return true;
+        }
+      }
+    }
+    pos += 1 + ad_len;
+  }
+  return false;
+}
+
+/****************************************************
+ * PUBLIC API
+*****************************************************/
+bool beacon_match(const struct ble_gap_disc_desc *disc,
+                  mkey_beacon_event_t *out) {
+  const mkey_key_t *key;
+  uint16_t index;
+
+  if (disc->addr.type != BLE_ADDR_PUBLIC) {
+    return false;
+  }
+  key = mkey_keys_find(disc->addr.val, &index);
+  if (key == NULL) {
+    return false;
+  }
+
+  out->id = index;
+  memcpy(out->addr, disc->addr.val, sizeof(out->addr));
+  out->rssi = disc->rssi;
+  out->rssi_min = key->rssi_min;
+  out->metadata_ok = metadata_ok(disc->data, disc->length_data);
+  return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "host/ble_hs.h"
+#include "mkey.h"
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define LOG_TAG_BEACON "beacon"
+
+/****************************************************
+ * API
+*****************************************************/
+
+// Checks one advertising report against the enrolled key table (mkey_keys),
+// straight from the raw report. Returns true and fills `out` only for an
+// enabled tag; any other report is rejected after a single table lookup.
+bool beacon_match(const struct ble_gap_disc_desc *disc,
+                  mkey_beacon_event_t *out);
@@ -1,24 +1,195 @@
 #include "gap.h"
+#include "beacon.h"
+#include "mkey_keys.h"
 #include "gatt_svr.h"
+#include "telemetry.h"
 #include "driver/gpio.h"
-#include <stdio.h>
+#include "esp_timer.h"
 #include <string.h>
 
 uint8_t addr_type;
 
+static gap_link_t links[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+
+// Arbitrates air time between scanning, advertising and connections that
+// need throughput (any link in GAP_LINK_PROFILE_THROUGHPUT)
+typedef struct {
+	uint8_t busy_links;
+	bool scan_on;
+	uint8_t scan_profile;
+	uint8_t scan_policy;      // filter policy of the last scan, 0xFF before the first
+	uint16_t scan_itvl;
+	uint16_t scan_window;
+	bool adv_on;
+	bool adv_suspended;
+	int64_t last_us;
+	gap_radio_stats_t stats;
+} gap_radio_t;
+
+static gap_radio_t radio;
+
+typedef struct {
+	uint16_t itvl;
+	uint16_t window;
+	uint8_t passive;
+} gap_scan_params_t;
+
+// Searching (and pre-sleep, which still has to find a key) scans actively like
+// the legacy sketch; once the key is known the scanner just listens
+static const gap_scan_params_t scan_profiles[GAP_SCAN_PROFILE_COUNT] = {
+	[GAP_SCAN_PROFILE_SEARCH]    = {GAP_SCAN_SEARCH_ITVL, GAP_SCAN_SEARCH_WINDOW, 0},
+	[GAP_SCAN_PROFILE_PRESENT]   = {GAP_SCAN_PRESENT_ITVL, GAP_SCAN_PRESENT_WINDOW, 1},
+	[GAP_SCAN_PROFILE_IGN_ON]    = {GAP_SCAN_IGN_ON_ITVL, GAP_SCAN_IGN_ON_WINDOW, 1},
+	[GAP_SCAN_PROFILE_OTA]       = {GAP_SCAN_BUSY_ITVL, GAP_SCAN_BUSY_WINDOW, 1},
+	[GAP_SCAN_PROFILE_PRE_SLEEP] = {GAP_SCAN_PRE_SLEEP_ITVL, GAP_SCAN_PRE_SLEEP_WINDOW, 0},
+};
+
+static const char *const scan_profile_names[GAP_SCAN_PROFILE_COUNT] = {
+	"search", "present", "ign on", "ota", "pre-sleep",
+};
+
+// Profile requested by the key logic, applied on the host task
+static volatile uint8_t scan_profile_req = GAP_SCAN_PROFILE_SEARCH;
+static struct ble_npl_event scan_profile_ev;
+static volatile bool scan_profile_ev_ready;   // set up by sync_cb
+
+// Report filtering: which policy the scanner runs with and what reached the host
+typedef struct {
+	bool open_requested;
+	int64_t last_us;
+	gap_scan_stats_t stats;
+} gap_scan_filter_state_t;
+
+static gap_scan_filter_state_t scan_filter = {
+	.stats.filter = GAP_SCAN_FILTER_OPEN,
+};
+
+// Live status byte of the manufacturer data. Inputs come from the key logic,
+// the OTA bit from gatt_svr; both are merged and published on the host task.
+typedef struct {
+	volatile uint8_t inputs;
+	uint8_t published;
+	int64_t published_us;
+	struct ble_npl_event ev;
+	struct ble_npl_callout holdoff;   // publishes a change that came too soon
+	volatile bool ready;              // ev and holdoff set up by sync_cb
+	uint32_t patches;
+} gap_adv_status_t;
+
+static gap_adv_status_t adv_status;
+
+// manufacturer data payload: [company_id_le (2B)] [status (1B)] [version (1B)]
+static uint8_t mfg_data[4];
+static struct ble_hs_adv_fields adv_fields;
+
 int gap_event_handler(struct ble_gap_event *event, void *arg);
 static void start_scanning(void);
-static void log_ble_addr(const ble_addr_t *addr, int rssi);
+static gap_link_t *link_find(uint16_t conn_handle);
+static void link_open(uint16_t conn_handle);
+static void link_refresh(gap_link_t *link);
+static void link_log(const gap_link_t *link, const char *what);
+static void radio_account(void);
+static void radio_update(void);
+static void scan_filter_account(void);
+static void scan_filter_load(void);
+static void scan_restart(bool reload);
+static gap_scan_profile_t scan_profile_pick(void);
+static void scan_profile_apply(struct ble_npl_event *ev);
+static void adv_status_apply(struct ble_npl_event *ev);
+static void adv_status_init(void);
 
 #define ADV_GPIO_PIN    GPIO_NUM_0
-#define MFG_COMPANY_ID  0x02E5
+
+static uint8_t adv_status_value(void) {
+	return (adv_status.inputs & ~GAP_ADV_ST_OTA) | (ota_updating ? GAP_ADV_ST_OTA : 0);
+}
+
+#if CONFIG_BT_NIMBLE_EXT_ADV
+// With extended advertising the legacy calls are gone: the connectable set is
+// instance GAP_ADV_INSTANCE_LEGACY sending legacy PDUs, so every central still
+// finds it.
+static int adv_fields_send(const struct ble_hs_adv_fields *fields, bool rsp) {
+	uint8_t buf[BLE_HS_ADV_MAX_SZ];
+	uint8_t len;
+	struct os_mbuf *om;
+	int rc;
+
+	rc = ble_hs_adv_set_fields(fields, buf, &len, sizeof(buf));
+	if (rc != 0) {
+		return rc;
+	}
+	om = ble_hs_mbuf_from_flat(buf, len);
+	if (om == NULL) {
+		return BLE_HS_ENOMEM;
+	}
+	return rsp ? ble_gap_ext_adv_rsp_set_data(GAP_ADV_INSTANCE_LEGACY, om)
+	           : ble_gap_ext_adv_set_data(GAP_ADV_INSTANCE_LEGACY, om);
+}
+
+static int adv_configure(void) {
+	struct ble_gap_ext_adv_params params = {0};
+
+	params.connectable = 1;
+	params.scannable = 1;
+	params.legacy_pdu = 1;
+	params.own_addr_type = addr_type;
+	params.primary_phy = BLE_HCI_LE_PHY_1M;
+	params.secondary_phy = BLE_HCI_LE_PHY_1M;
+	return ble_gap_ext_adv_configure(GAP_ADV_INSTANCE_LEGACY, &params, NULL,
+	                                 gap_event_handler, NULL);
+}
+
+static int adv_data_set(const struct ble_hs_adv_fields *fields) {
+	return adv_fields_send(fields, false);
+}
+
+static int adv_rsp_set(const struct ble_hs_adv_fields *fields) {
+	return adv_fields_send(fields, true);
+}
+
+static int adv_start(void) {
+	return ble_gap_ext_adv_start(GAP_ADV_INSTANCE_LEGACY, 0, 0);
+}
+
+static int adv_stop(void) {
+	return ble_gap_ext_adv_stop(GAP_ADV_INSTANCE_LEGACY);
+}
+#else
+static int adv_configure(void) {
+	return 0;
+}
+
+static int adv_data_set(const struct ble_hs_adv_fields *fields) {
+	return ble_gap_adv_set_fields(fields);
+}
+
+static int adv_rsp_set(const struct ble_hs_adv_fields *fields) {
+	return ble_gap_adv_rsp_set_fields(fields);
+}
+
+static int adv_start(void) {
+	struct ble_gap_adv_params adv_params = {0};
+
+	adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+	adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+	return ble_gap_adv_start(addr_type, NULL, BLE_HS_FOREVER, &adv_params, gap_event_handler, NULL);
+}
+
+static int adv_stop(void) {
+	return ble_gap_adv_stop();
+}
+#endif
 
 void advertise() {
-	struct ble_gap_adv_params adv_params;
-	struct ble_hs_adv_fields adv_fields;
 	struct ble_hs_adv_fields rsp_fields;
 	int rc;
 
+	// no new centrals while a link is busy; resumed by the arbiter
+	if (radio.busy_links) {
+		radio.adv_suspended = true;
+		return;
+	}
+
 	memset(&adv_fields, 0, sizeof(adv_fields));
 	memset(&rsp_fields, 0, sizeof(rsp_fields));
 
@@ -31,24 +202,23 @@ void advertise() {
 	adv_fields.num_uuids128 = 1;
 	adv_fields.uuids128_is_complete = 1;
 
-	// manufacturer data payload: [company_id_le (2B)] [status (1B)] [reserved (1B)]
-	static uint8_t mfg_data[4];
-	mfg_data[0] = (uint8_t)(MFG_COMPANY_ID & 0xFF);
-	mfg_data[1] = (uint8_t)((MFG_COMPANY_ID >> 8) & 0xFF);
-	// Example bitfield (uncomment and adjust when wiring is final):
-	// mfg_data[2] = 0;
-	// mfg_data[2] |= gpio_get_level(GPIO_NUM_5) ? 0x01 : 0x00; // bit0: door/pin 5
-	// mfg_data[2] |= ota_updating               ? 0x02 : 0x00; // bit1: OTA in progress
-	// mfg_data[2] |= 1 ? 0x04 : 0x00; // bit2: IGN/pin 1
-	// mfg_data[2] |= gpio_get_level(GPIO_NUM_2) ? 0x08 : 0x00; // bit3: relay/pin 2
-	// mfg_data[2] |= gpio_get_level(GPIO_NUM_6) ? 0x10 : 0x00; // bit4: IN1/pin 6
-	// bits5-7 reserved
-	// mfg_data[2] = (gpio_get_level(ADV_GPIO_PIN) & 0x1) | (ota_updating ? 0x2 : 0);
+	// manufacturer data: the status byte (GAP_ADV_ST_*) is kept live by
+	// adv_status_apply() without restarting advertising
+	mfg_data[0] = (uint8_t)(GAP_MFG_COMPANY_ID & 0xFF);
+	mfg_data[1] = (uint8_t)((GAP_MFG_COMPANY_ID >> 8) & 0xFF);
+	mfg_data[2] = adv_status_value();
 	mfg_data[3] = version_fw; // version 1
+	adv_status.published = mfg_data[2];
+	adv_status.published_us = esp_timer_get_time();
 	adv_fields.mfg_data = mfg_data;
 	adv_fields.mfg_data_len = sizeof(mfg_data);
 
-	rc = ble_gap_adv_set_fields(&adv_fields);
+	rc = adv_configure();
+	if (rc != 0) {
+		ESP_LOGE(LOG_TAG_GAP, "Error configuring advertising: rc=%d", rc);
+		return;
+	}
+	rc = adv_data_set(&adv_fields);
 	if (rc != 0) {
 		ESP_LOGE(LOG_TAG_GAP, "Error setting advertisement data: rc=%d", rc);
 		return;
@@ -58,21 +228,20 @@ void advertise() {
 	rsp_fields.name = (uint8_t *)device_name;
 	rsp_fields.name_len = strlen(device_name);
 	rsp_fields.name_is_complete = 1;
-	rc = ble_gap_adv_rsp_set_fields(&rsp_fields);
+	rc = adv_rsp_set(&rsp_fields);
 	if (rc != 0) {
 		ESP_LOGE(LOG_TAG_GAP, "Error setting scan response data: rc=%d", rc);
 		return;
 	}
 
 	// start advertising
-	memset(&adv_params, 0, sizeof(adv_params));
-	adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
-	adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
-	rc = ble_gap_adv_start(addr_type, NULL, BLE_HS_FOREVER, &adv_params, gap_event_handler, NULL);
+	rc = adv_start();
 	if (rc != 0) {
 		ESP_LOGE(LOG_TAG_GAP, "Error enabling advertisement data: rc=%d", rc);
 		return;
 	}
+	radio_account();
+	radio.adv_on = true;
 }
 
 void reset_cb(int reason) {
@@ -80,17 +249,52 @@ void reset_cb(int reason) {
 }
 
 void sync_cb(void) {
+	// events other tasks post to the host, set up once on the host task
+	if (!scan_profile_ev_ready) {
+		ble_npl_event_init(&scan_profile_ev, scan_profile_apply, NULL);
+		scan_profile_ev_ready = true;
+	}
+	adv_status_init();
+
 	// determine best adress type
 	ble_hs_id_infer_auto(0, &addr_type);
 
+	// no connection survives a host reset
+	for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+		links[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+	}
+	radio_account();
+	radio.busy_links = 0;
+	radio.scan_on = false;
+	radio.scan_policy = 0xFF;
+	radio.adv_on = false;
+	radio.adv_suspended = false;
+
+	// the controller forgot its accept list with the reset
+	scan_filter_load();
+
 	// start advertising and scanning in parallel
 	advertise();
+	telemetry_start();
 	start_scanning();
 }
 
+// Device discovered while scanning: only enrolled tags go on to the key
+// logic, everything else is dropped by the matcher
+static void scan_report(const struct ble_gap_disc_desc *disc) {
+	mkey_beacon_event_t beacon;
+
+	scan_filter.stats.reports[scan_filter.stats.filter]++;
+	if (beacon_match(disc, &beacon)) {
+		scan_filter.stats.hits[scan_filter.stats.filter]++;
+		mkey_notify_beacon(&beacon);
+	}
+}
+
 int gap_event_handler(struct ble_gap_event *event, void *arg) {
 
     // ESP_LOGW("GAP","EVENT TYPE 0x%X",event->type);
+    gap_link_t *link;
     
     switch (event->type) {
         case BLE_GAP_EVENT_CONNECT:
@@ -101,40 +305,99 @@ int gap_event_handler(struct ble_gap_event *event, void *arg) {
             
             // Adjust the MTU size, concidering BLE_ATT_MTU_MAX 
             ble_att_set_preferred_mtu(512);
+            if (event->connect.status == 0) {
+                // legacy advertising stops once a central connects
+                radio_account();
+                radio.adv_on = false;
+                link_open(event->connect.conn_handle);
+            }
             break;
 
         case BLE_GAP_EVENT_DISCONNECT:
             ESP_LOGI(LOG_TAG_GAP, "GAP: Disconnect: reason=%d\n",
                     event->disconnect.reason);
+            gatt_svr_conn_closed(event->disconnect.conn.conn_handle);
+            link = link_find(event->disconnect.conn.conn_handle);
+            if (link) {
+                link->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+                radio_update();
+            }
 
             // Connection terminated; resume advertising
             advertise();
             break;
 
         case BLE_GAP_EVENT_ADV_COMPLETE:
+#if CONFIG_BT_NIMBLE_EXT_ADV
+            // the telemetry set runs on its own; a connection ends the
+            // connectable set and advertising resumes on disconnect
+            if (event->adv_complete.instance != GAP_ADV_INSTANCE_LEGACY) {
+                break;
+            }
+            if (event->adv_complete.reason == 0) {
+                radio_account();
+                radio.adv_on = false;
+                break;
+            }
+#endif
             ESP_LOGI(LOG_TAG_GAP, "GAP: adv complete");
+            radio_account();
+            radio.adv_on = false;
             advertise();
             break;
 
         case BLE_GAP_EVENT_DISC:
-            // Device discovered while scanning
-            
-            if(event->disc.addr.type != BLE_ADDR_PUBLIC) {
-              break;
-            }
-  
-            log_ble_addr(&event->disc.addr, event->disc.rssi);
-            // ESP_LOGI(LOG_TAG_GAP, "DISC: rssi=%d", event->disc.rssi);
+            scan_report(&event->disc);
+            break;
 
-            
+#if CONFIG_BT_NIMBLE_EXT_ADV
+        case BLE_GAP_EVENT_EXT_DISC: {
+            // the extended scanner reports the same advertisers
+            const struct ble_gap_disc_desc disc = {
+                .event_type = event->ext_disc.legacy_event_type,
+                .length_data = event->ext_disc.length_data,
+                .addr = event->ext_disc.addr,
+                .rssi = event->ext_disc.rssi,
+                .data = event->ext_disc.data,
+            };
+            scan_report(&disc);
             break;
+        }
+#endif
 
         case BLE_GAP_EVENT_DISC_COMPLETE:
-            // Restart scanning if it stops
-            ESP_LOGI(LOG_TAG_GAP, "DISC complete, restarting scan");
+            // Restart scanning if it stops (every GAP_SCAN_DUP_RESET_MS on
+            // an open scan)
+            ESP_LOGD(LOG_TAG_GAP, "DISC complete, restarting scan");
+            radio_account();
+            radio.scan_on = false;
             start_scanning();
             break;
 
+        case BLE_GAP_EVENT_PASSKEY_ACTION:
+            if (event->passkey.params.action == BLE_SM_IOACT_DISP) {
+                struct ble_sm_io pkey = {
+                    .action = BLE_SM_IOACT_DISP,
+                    .passkey = GAP_SM_PASSKEY,
+                };
+                ble_sm_inject_io(event->passkey.conn_handle, &pkey);
+            }
+            break;
+
+        case BLE_GAP_EVENT_ENC_CHANGE:
+            ESP_LOGI(LOG_TAG_GAP, "GAP: Encryption change: conn_handle=%d, status=%d",
+                    event->enc_change.conn_handle, event->enc_change.status);
+            break;
+
+        case BLE_GAP_EVENT_REPEAT_PAIRING: {
+            // the peer lost its bond: forget ours and let it pair again
+            struct ble_gap_conn_desc desc;
+            if (ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc) == 0) {
+                ble_store_util_delete_peer(&desc.peer_id_addr);
+            }
+            return BLE_GAP_REPEAT_PAIRING_RETRY;
+        }
+
         case BLE_GAP_EVENT_SUBSCRIBE:
             ESP_LOGI(LOG_TAG_GAP, "GAP: Subscribe: conn_handle=%d",
                     event->connect.conn_handle);
@@ -143,6 +406,40 @@ int gap_event_handler(struct ble_gap_event *event, void *arg) {
         case BLE_GAP_EVENT_MTU:
             ESP_LOGI(LOG_TAG_GAP, "GAP: MTU update: conn_handle=%d, mtu=%d",
                     event->mtu.conn_handle, event->mtu.value);
+            link = link_find(event->mtu.conn_handle);
+            if (link) {
+                link->mtu = event->mtu.value;
+                gatt_svr_link_changed(event->mtu.conn_handle);
+            }
+            break;
+
+        case BLE_GAP_EVENT_CONN_UPDATE:
+            link = link_find(event->conn_update.conn_handle);
+            if (link && event->conn_update.status == 0) {
+                link_refresh(link);
+                link_log(link, "conn params");
+                gatt_svr_link_changed(link->conn_handle);
+            }
+            break;
+
+        case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+            link = link_find(event->phy_updated.conn_handle);
+            if (link && event->phy_updated.status == 0) {
+                link->tx_phy = event->phy_updated.tx_phy;
+                link->rx_phy = event->phy_updated.rx_phy;
+                link_log(link, "PHY");
+                gatt_svr_link_changed(link->conn_handle);
+            }
+            break;
+
+        case BLE_GAP_EVENT_DATA_LEN_CHG:
+            link = link_find(event->data_len_chg.conn_handle);
+            if (link) {
+                link->max_tx_octets = event->data_len_chg.max_tx_octets;
+                link->max_rx_octets = event->data_len_chg.max_rx_octets;
+                link_log(link, "data length");
+                gatt_svr_link_changed(link->conn_handle);
+            }
             break;
     }
     return 0;
@@ -156,30 +453,418 @@ void host_task(void *param) {
 
 static void start_scanning(void) {
 	struct ble_gap_disc_params disc_params = {0};
+	const gap_scan_profile_t profile = scan_profile_pick();
+	const bool open = scan_filter.stats.filter != GAP_SCAN_FILTER_ACCEPT_LIST;
 	int rc;
 
-	disc_params.itvl = 0x30;   // 30 ms interval
-	disc_params.window = 0x30; // 30 ms window (100% duty cycle)
-	disc_params.filter_policy = BLE_HCI_SCAN_FILT_NO_WL;
+	disc_params.itvl = scan_profiles[profile].itvl;
+	disc_params.window = scan_profiles[profile].window;
+	disc_params.filter_policy = open ? BLE_HCI_SCAN_FILT_NO_WL : BLE_HCI_SCAN_FILT_USE_WL;
 	disc_params.limited = 0;
-	disc_params.passive = 0;           // active scan to request scan response
-	disc_params.filter_duplicates = 1; // avoid duplicates
+	disc_params.passive = scan_profiles[profile].passive;
+	disc_params.filter_duplicates = open;
 
-	rc = ble_gap_disc(addr_type, BLE_HS_FOREVER, &disc_params, gap_event_handler, NULL);
+	rc = ble_gap_disc(addr_type, open ? GAP_SCAN_DUP_RESET_MS : BLE_HS_FOREVER, &disc_params,
+	                  gap_event_handler, NULL);
 	if (rc != 0) {
 		ESP_LOGE(LOG_TAG_GAP, "Error starting scan: rc=%d", rc);
 	} else {
-		ESP_LOGI(LOG_TAG_GAP, "Scanning started");
+		// the periodic restarts of an open scan are not worth a line each
+		if (profile != radio.scan_profile || disc_params.filter_policy != radio.scan_policy) {
+			ESP_LOGI(LOG_TAG_GAP, "Scanning started (%s, window %d/%d, %s)",
+			         scan_profile_names[profile], disc_params.window, disc_params.itvl,
+			         open ? "open" : "accept list");
+		}
+		radio_account();
+		radio.scan_policy = disc_params.filter_policy;
+		radio.scan_on = true;
+		radio.scan_profile = profile;
+		radio.scan_itvl = disc_params.itvl;
+		radio.scan_window = disc_params.window;
 	}
 }
 
-static void log_ble_addr(const ble_addr_t *addr,int rssi){
-	char buf[18];
-	snprintf(buf, sizeof(buf), "%02X:%02X:%02X:%02X:%02X:%02X",
-	addr->val[5], addr->val[4], addr->val[3],
-	addr->val[2], addr->val[1], addr->val[0]);
-  
-	ESP_LOGI(LOG_TAG_GAP, "DISC: addr=%s type=%d -> RSSI: %d", buf, addr->type, rssi);
+/****************************************************
+ * LINK PROFILES
+*****************************************************/
+static gap_link_t *link_find(uint16_t conn_handle) {
+	for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+		if (links[i].conn_handle == conn_handle) {
+			return &links[i];
+		}
+	}
+	return NULL;
 }
 
+static void link_open(uint16_t conn_handle) {
+	gap_link_t *link = link_find(conn_handle);
+
+	if (link == NULL) {
+		link = link_find(BLE_HS_CONN_HANDLE_NONE);
+	}
+	if (link == NULL) {
+		return;
+	}
 
+	memset(link, 0, sizeof(*link));
+	link->conn_handle = conn_handle;
+	link->profile = GAP_LINK_PROFILE_IDLE;
+	link->tx_phy = BLE_GAP_LE_PHY_1M;
+	link->rx_phy = BLE_GAP_LE_PHY_1M;
+	link->max_tx_octets = 27;
+	link->max_rx_octets = 27;
+	link->mtu = ble_att_mtu(conn_handle);
+	ble_gap_read_le_phy(conn_handle, &link->tx_phy, &link->rx_phy);
+	link_refresh(link);
+}
+
+static void link_refresh(gap_link_t *link) {
+	struct ble_gap_conn_desc desc;
+
+	if (ble_gap_conn_find(link->conn_handle, &desc) == 0) {
+		link->conn_itvl = desc.conn_itvl;
+		link->conn_latency = desc.conn_latency;
+		link->supervision_timeout = desc.supervision_timeout;
+	}
+}
+
+static void link_log(const gap_link_t *link, const char *what) {
+	ESP_LOGI(LOG_TAG_GAP,
+	         "LINK %d (%s): phy tx/rx=%d/%d itvl=%d.%02d ms latency=%d "
+	         "timeout=%d ms octets tx/rx=%d/%d mtu=%d",
+	         link->conn_handle, what, link->tx_phy, link->rx_phy,
+	         link->conn_itvl * 125 / 100, link->conn_itvl * 125 % 100,
+	         link->conn_latency, link->supervision_timeout * 10,
+	         link->max_tx_octets, link->max_rx_octets, link->mtu);
+}
+
+void gap_link_profile_set(uint16_t conn_handle, gap_link_profile_t profile) {
+	struct ble_gap_upd_params params = {0};
+	gap_link_t *link = link_find(conn_handle);
+	int rc;
+
+	if (link == NULL || link->profile == profile) {
+		return;
+	}
+	link->profile = profile;
+
+	if (profile == GAP_LINK_PROFILE_THROUGHPUT) {
+		rc = ble_gap_set_prefered_le_phy(conn_handle, BLE_GAP_LE_PHY_2M_MASK,
+		                                 BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+		if (rc != 0) {
+			ESP_LOGW(LOG_TAG_GAP, "2M PHY request failed: rc=%d", rc);
+		}
+		rc = ble_gap_set_data_len(conn_handle, GAP_LINK_DLE_TX_OCTETS, GAP_LINK_DLE_TX_TIME);
+		if (rc != 0) {
+			ESP_LOGW(LOG_TAG_GAP, "Data length request failed: rc=%d", rc);
+		}
+		params.itvl_min = GAP_LINK_FAST_ITVL_MIN;
+		params.itvl_max = GAP_LINK_FAST_ITVL_MAX;
+		params.latency = GAP_LINK_FAST_LATENCY;
+		params.supervision_timeout = GAP_LINK_FAST_TIMEOUT;
+	} else {
+		// 1M is the more robust PHY for an idle link; data length is left as is
+		ble_gap_set_prefered_le_phy(conn_handle, BLE_GAP_LE_PHY_1M_MASK,
+		                            BLE_GAP_LE_PHY_1M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+		params.itvl_min = GAP_LINK_IDLE_ITVL_MIN;
+		params.itvl_max = GAP_LINK_IDLE_ITVL_MAX;
+		params.latency = GAP_LINK_IDLE_LATENCY;
+		params.supervision_timeout = GAP_LINK_IDLE_TIMEOUT;
+	}
+
+	rc = ble_gap_update_params(conn_handle, &params);
+	if (rc != 0) {
+		ESP_LOGW(LOG_TAG_GAP, "Connection update request failed: rc=%d", rc);
+	}
+	ESP_LOGI(LOG_TAG_GAP, "LINK %d: requested %s profile", conn_handle,
+	         profile == GAP_LINK_PROFILE_THROUGHPUT ? "throughput" : "idle");
+	radio_update();
+}
+
+bool gap_link_get(uint16_t conn_handle, gap_link_t *out) {
+	gap_link_t *link = link_find(conn_handle);
+
+	if (link == NULL) {
+		return false;
+	}
+	*out = *link;
+	return true;
+}
+
+/****************************************************
+ * RADIO ARBITER
+*****************************************************/
+
+// Charges the time since the last change to the activities that were on.
+static void radio_account(void) {
+	const int64_t now = esp_timer_get_time();
+	const uint64_t dt = radio.last_us ? now - radio.last_us : 0;
+
+	radio.last_us = now;
+	radio.stats.total_us += dt;
+	if (radio.scan_on && radio.scan_itvl) {
+		const uint64_t on_us = dt * radio.scan_window / radio.scan_itvl;
+		radio.stats.scan_us += on_us;
+		radio.stats.profile_us[radio.scan_profile] += dt;
+		radio.stats.profile_scan_us[radio.scan_profile] += on_us;
+	}
+	if (radio.adv_on) {
+		radio.stats.adv_us += dt;
+	}
+	if (radio.busy_links) {
+		radio.stats.busy_us += dt;
+	}
+}
+
+// Re-evaluates the schedule after a link profile changed or a link went away:
+// the first busy link pauses advertising and narrows the scan window, the last
+// one to leave restores both.
+static void radio_update(void) {
+	uint8_t busy = 0;
+
+	for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+		if (links[i].conn_handle != BLE_HS_CONN_HANDLE_NONE &&
+		    links[i].profile == GAP_LINK_PROFILE_THROUGHPUT) {
+			busy++;
+		}
+	}
+	if ((busy == 0) == (radio.busy_links == 0)) {
+		radio.busy_links = busy;
+		return;
+	}
+
+	radio_account();
+	radio.busy_links = busy;
+
+	if (busy) {
+		if (radio.adv_on && adv_stop() == 0) {
+			radio.adv_on = false;
+			radio.adv_suspended = true;
+		}
+	}
+
+	// restart the scanner with the schedule that matches the new state
+	scan_restart(false);
+
+	if (!busy && radio.adv_suspended) {
+		radio.adv_suspended = false;
+		advertise();
+	}
+
+	ESP_LOGI(LOG_TAG_GAP,
+	         "RADIO %s: scan %lu ms, adv %lu ms, busy %lu ms of %lu ms",
+	         busy ? "busy" : "idle", (unsigned long)(radio.stats.scan_us / 1000),
+	         (unsigned long)(radio.stats.adv_us / 1000),
+	         (unsigned long)(radio.stats.busy_us / 1000),
+	         (unsigned long)(radio.stats.total_us / 1000));
+}
+
+void gap_radio_stats_get(gap_radio_stats_t *out) {
+	radio_account();
+	*out = radio.stats;
+	out->scan_profile = radio.scan_profile;
+}
+
+/****************************************************
+ * SCAN PROFILES
+*****************************************************/
+static gap_scan_profile_t scan_profile_pick(void) {
+	// a busy link outranks the key state: keep the air free for it
+	return radio.busy_links ? GAP_SCAN_PROFILE_OTA : (gap_scan_profile_t)scan_profile_req;
+}
+
+static void scan_profile_apply(struct ble_npl_event *ev) {
+	if (radio.scan_on && scan_profile_pick() != radio.scan_profile) {
+		const uint8_t old = radio.scan_profile;
+		scan_restart(false);
+		ESP_LOGI(LOG_TAG_GAP, "Scan profile %s -> %s (%lu ms on air in %lu ms)",
+		         scan_profile_names[old], scan_profile_names[radio.scan_profile],
+		         (unsigned long)(radio.stats.profile_scan_us[old] / 1000),
+		         (unsigned long)(radio.stats.profile_us[old] / 1000));
+	}
+}
+
+void gap_scan_profile_set(gap_scan_profile_t profile) {
+	if (profile >= GAP_SCAN_PROFILE_COUNT || profile == scan_profile_req) {
+		return;
+	}
+	scan_profile_req = profile;
+
+	// before the host runs, sync_cb starts the scanner with the new profile
+	if (scan_profile_ev_ready && ble_hs_synced()) {
+		ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &scan_profile_ev);
+	}
+}
+
+/****************************************************
+ * SCAN FILTER
+*****************************************************/
+static void scan_filter_account(void) {
+	const int64_t now = esp_timer_get_time();
+
+	if (scan_filter.last_us) {
+		scan_filter.stats.time_us[scan_filter.stats.filter] += now - scan_filter.last_us;
+	}
+	scan_filter.last_us = now;
+}
+
+// Loads the enrolled tags into the controller and picks the filter policy for
+// the next scan. The scanner must be stopped: the accept list cannot change
+// while a scan uses it.
+static void scan_filter_load(void) {
+	ble_addr_t addrs[GAP_SCAN_ACCEPT_LIST_MAX];
+	const uint16_t enabled = mkey_keys_enabled();
+	uint8_t filter = GAP_SCAN_FILTER_OPEN;
+	uint8_t n = 0;
+	int rc;
+
+	scan_filter_account();
+	if (enabled > GAP_SCAN_ACCEPT_LIST_MAX) {
+		ESP_LOGI(LOG_TAG_GAP, "%u keys do not fit the accept list, scanning open", enabled);
+	} else {
+		for (uint16_t i = 0; i < mkey_keys_count(); i++) {
+			const mkey_key_t *key = mkey_keys_at(i);
+			if (!(key->flags & MKEY_KEY_F_DISABLED)) {
+				addrs[n].type = BLE_ADDR_PUBLIC;
+				memcpy(addrs[n].val, key->addr, sizeof(addrs[n].val));
+				n++;
+			}
+		}
+	}
+	if (GAP_SCAN_ACCEPT_LIST && !scan_filter.open_requested && n > 0) {
+		rc = ble_gap_wl_set(addrs, n);
+		if (rc == 0) {
+			filter = GAP_SCAN_FILTER_ACCEPT_LIST;
+		} else {
+			ESP_LOGW(LOG_TAG_GAP, "Accept list rejected (rc=%d), scanning open", rc);
+		}
+	}
+
+	if (filter != scan_filter.stats.filter) {
+		const gap_scan_stats_t *st = &scan_filter.stats;
+		const uint8_t old = st->filter;
+		ESP_LOGI(LOG_TAG_GAP, "Scan filter %s -> %s (%lu reports, %lu hits in %lu ms)",
+		         old == GAP_SCAN_FILTER_ACCEPT_LIST ? "accept list" : "open",
+		         filter == GAP_SCAN_FILTER_ACCEPT_LIST ? "accept list" : "open",
+		         (unsigned long)st->reports[old], (unsigned long)st->hits[old],
+		         (unsigned long)(st->time_us[old] / 1000));
+	}
+	scan_filter.stats.filter = filter;
+	scan_filter.stats.accept_list_len = filter == GAP_SCAN_FILTER_ACCEPT_LIST ? n : 0;
+}
+
+// Stops a running scan for a change that needs it stopped, then restarts it
+static void scan_restart(bool reload) {
+	const bool was_on = radio.scan_on;
+
+	if (was_on) {
+		ble_gap_disc_cancel();
+		radio_account();
+		radio.scan_on = false;
+	}
+	if (reload) {
+		scan_filter_load();
+	}
+	if (was_on) {
+		start_scanning();
+	}
+}
+
+void gap_scan_open(bool open) {
+	if (scan_filter.open_requested == open) {
+		return;
+	}
+	scan_filter.open_requested = open;
+	gap_scan_tags_changed();
+}
+
+void gap_scan_tags_changed(void) {
+	// before the first sync the list is loaded by sync_cb
+	if (ble_hs_synced()) {
+		scan_restart(true);
+	}
+}
+
+void gap_scan_stats_get(gap_scan_stats_t *out) {
+	scan_filter_account();
+	*out = scan_filter.stats;
+}
+
+/****************************************************
+ * LIVE ADVERTISING STATUS
+*****************************************************/
+
+// Publishes the status byte by rewriting the advertising data of the running
+// advertiser; scan response and advertising state are left alone.
+static void adv_status_apply(struct ble_npl_event *ev) {
+	const uint8_t status = adv_status_value();
+	const int64_t now = esp_timer_get_time();
+	const int64_t wait_us = adv_status.published_us + GAP_ADV_STATUS_MIN_MS * 1000LL - now;
+	int rc;
+
+	if (status == adv_status.published) {
+		return;
+	}
+	// a burst of changes goes out as one update at the end of the hold-off
+	if (wait_us > 0) {
+		if (!ble_npl_callout_is_active(&adv_status.holdoff)) {
+			ble_npl_callout_reset(&adv_status.holdoff,
+			                      ble_npl_time_ms_to_ticks32(wait_us / 1000 + 1));
+		}
+		return;
+	}
+
+	mfg_data[2] = status;
+	adv_status.published = status;
+	adv_status.published_us = now;
+	telemetry_update();
+	if (!radio.adv_on) {
+		// picked up by the next advertise()
+		return;
+	}
+	rc = adv_data_set(&adv_fields);
+	if (rc != 0) {
+		ESP_LOGW(LOG_TAG_GAP, "Status update of the advertising data failed: rc=%d", rc);
+		return;
+	}
+	adv_status.patches++;
+	ESP_LOGD(LOG_TAG_GAP, "ADV status 0x%02x (%lu updates)", status,
+	         (unsigned long)adv_status.patches);
+}
+
+// Runs on the host task at every sync; the event and the callout are set up
+// the first time only, the callout may still be armed after a host reset.
+static void adv_status_init(void) {
+	if (adv_status.ready) {
+		return;
+	}
+	ble_npl_event_init(&adv_status.ev, adv_status_apply, NULL);
+	ble_npl_callout_init(&adv_status.holdoff, nimble_port_get_dflt_eventq(),
+	                     adv_status_apply, NULL);
+	adv_status.ready = true;
+}
+
+// Callers run on any task. Until the first sync nothing is posted: the inputs
+// are kept and advertise() publishes them when the host comes up.
+static void adv_status_post(void) {
+	if (adv_status.ready && ble_hs_synced()) {
+		ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &adv_status.ev);
+	}
+}
+
+void gap_adv_status_inputs(uint8_t inputs) {
+	inputs &= ~GAP_ADV_ST_OTA;
+	if (inputs == adv_status.inputs) {
+		return;
+	}
+	adv_status.inputs = inputs;
+	adv_status_post();
+}
+
+void gap_adv_status_changed(void) {
+	adv_status_post();
+}
+
+uint8_t gap_adv_status_get(void) {
+	return adv_status.published;
+}
@@ -8,10 +8,169 @@
 
 #define LOG_TAG_GAP "gap"
 
+// Link profiles (connection interval in 1.25 ms units, timeout in 10 ms units)
+#define GAP_LINK_FAST_ITVL_MIN      6     // 7.5 ms
+#define GAP_LINK_FAST_ITVL_MAX      12    // 15 ms
+#define GAP_LINK_FAST_LATENCY       0
+#define GAP_LINK_FAST_TIMEOUT       400   // 4 s
+#define GAP_LINK_IDLE_ITVL_MIN      80    // 100 ms
+#define GAP_LINK_IDLE_ITVL_MAX      160   // 200 ms
+#define GAP_LINK_IDLE_LATENCY       4
+#define GAP_LINK_IDLE_TIMEOUT       600   // 6 s
+#define GAP_LINK_DLE_TX_OCTETS      251
+#define GAP_LINK_DLE_TX_TIME        2120
+
+// Scan profiles (0.625 ms units). Searching scans continuously for the lowest
+// unlock latency; once the key is present the scanner only has to hear it again
+// within MKEY_BEACON_STALE_MS, so it listens passively with a short window.
+#define GAP_SCAN_SEARCH_ITVL        0x30   // 30 ms
+#define GAP_SCAN_SEARCH_WINDOW      0x30   // 30 ms (100 % duty cycle)
+#define GAP_SCAN_PRESENT_ITVL       0x140  // 200 ms
+#define GAP_SCAN_PRESENT_WINDOW     0x30   // 30 ms (15 % duty cycle)
+#define GAP_SCAN_IGN_ON_ITVL        0x320  // 500 ms
+#define GAP_SCAN_IGN_ON_WINDOW      0x30   // 30 ms (6 % duty cycle)
+#define GAP_SCAN_BUSY_ITVL          0x140  // 200 ms
+#define GAP_SCAN_BUSY_WINDOW        0x10   // 10 ms (5 % duty cycle)
+#define GAP_SCAN_PRE_SLEEP_ITVL     0x640  // 1 s
+#define GAP_SCAN_PRE_SLEEP_WINDOW   0x30   // 30 ms (3 % duty cycle)
+
+// Scan through the controller's filter accept list (enrolled tags only) unless
+// enrollment asks for open scanning; 0 always scans open
+#define GAP_SCAN_ACCEPT_LIST        1
+
+// Entries the controller can hold; a larger key table scans open and relies
+// on the host side lookup alone
+#define GAP_SCAN_ACCEPT_LIST_MAX    CONFIG_BT_NIMBLE_WHITELIST_SIZE
+
+// Presence needs every refresh of a tag. Through the accept list the
+// controller reports duplicates (only enrolled tags get through); an open scan
+// keeps duplicate filtering and is restarted this often to reset it. The
+// tracker needs a full window (MKEY_PRESENCE_SAMPLES) to unlock, so at one
+// report per restart this is what keeps the unlock within 2 s; a restart
+// opens a new scan window, so profiles with a longer interval listen more.
+#define GAP_SCAN_DUP_RESET_MS       250
+
+// Manufacturer data of the connectable advertising and the telemetry set
+#define GAP_MFG_COMPANY_ID          0x02E5
+
+// Advertising sets with CONFIG_BT_NIMBLE_EXT_ADV: the connectable one (legacy
+// PDUs, what phones and the OTA client scan for) and the telemetry set of
+// telemetry.c
+#define GAP_ADV_INSTANCE_LEGACY     0
+#define GAP_ADV_INSTANCE_TELEMETRY  1
+
+// Status byte of the manufacturer data (decoded by py-client/scan_mfg.py):
+// pin levels of the tracked inputs and the relay, plus OTA in progress
+#define GAP_ADV_ST_DOOR             0x01   // door input (GPIO5), 0 = open
+#define GAP_ADV_ST_OTA              0x02   // OTA session running
+#define GAP_ADV_ST_IGN              0x04   // IGN input (GPIO1), 0 = on
+#define GAP_ADV_ST_RELAY            0x08   // relay output (GPIO2), 0 = unlocked
+#define GAP_ADV_ST_IN1              0x10   // IN1 input (GPIO6)
+
+// Minimum spacing of status updates; changes in between are merged into one
+#define GAP_ADV_STATUS_MIN_MS       250
+
+// Pairing: the unit has no display, the passkey it "shows" is the one on its
+// label. Clients bond with it (MITM protected) before touching the key table.
+#define GAP_SM_PASSKEY              123456
+
+typedef enum {
+	GAP_LINK_PROFILE_IDLE,        // long interval, 1M PHY, slave latency
+	GAP_LINK_PROFILE_THROUGHPUT,  // short interval, 2M PHY, max data length
+} gap_link_profile_t;
+
+// What the controller actually negotiated for a connection
+typedef struct {
+	uint16_t conn_handle;
+	uint8_t profile;          // gap_link_profile_t last requested
+	uint8_t tx_phy;
+	uint8_t rx_phy;
+	uint16_t conn_itvl;       // 1.25 ms units
+	uint16_t conn_latency;
+	uint16_t supervision_timeout;
+	uint16_t max_tx_octets;
+	uint16_t max_rx_octets;
+	uint16_t mtu;
+} gap_link_t;
+
+// Scan schedule picked from the key state; a link that needs throughput
+// (OTA) overrides whatever was requested
+typedef enum {
+	GAP_SCAN_PROFILE_SEARCH,      // after wake, no key yet
+	GAP_SCAN_PROFILE_PRESENT,     // key present, IGN off
+	GAP_SCAN_PROFILE_IGN_ON,      // key present, IGN on
+	GAP_SCAN_PROFILE_OTA,         // a link is busy
+	GAP_SCAN_PROFILE_PRE_SLEEP,   // no key for a while, heading to deep sleep
+	GAP_SCAN_PROFILE_COUNT,
+} gap_scan_profile_t;
+
+typedef enum {
+	GAP_SCAN_FILTER_ACCEPT_LIST,  // controller drops everything but enrolled tags
+	GAP_SCAN_FILTER_OPEN,         // every advertiser reaches the host
+	GAP_SCAN_FILTER_COUNT,
+} gap_scan_filter_t;
+
+// Advertising reports that reached the host per filter mode, how many of them
+// were enrolled tags, and how long each mode was active
+typedef struct {
+	uint8_t filter;                      // gap_scan_filter_t in use
+	uint8_t accept_list_len;
+	uint32_t reports[GAP_SCAN_FILTER_COUNT];
+	uint32_t hits[GAP_SCAN_FILTER_COUNT];
+	uint64_t time_us[GAP_SCAN_FILTER_COUNT];
+} gap_scan_stats_t;
+
+// Radio time handed to each activity since boot. Scan time is weighted by the
+// scan duty cycle; busy time is when at least one link asked for throughput.
+typedef struct {
+	uint64_t scan_us;
+	uint64_t adv_us;
+	uint64_t busy_us;
+	uint64_t total_us;
+	uint8_t scan_profile;                          // gap_scan_profile_t in use
+	uint64_t profile_us[GAP_SCAN_PROFILE_COUNT];   // time spent in each profile
+	uint64_t profile_scan_us[GAP_SCAN_PROFILE_COUNT]; // radio-on time per profile
+} gap_radio_stats_t;
+
 static const char device_name[] = "MKEY";
 static const uint8_t version_fw = 0x01; // firmware version: 001
 
 void advertise();
 void reset_cb(int reason);
 void sync_cb(void);
-void host_task(void *param);
\ No newline at end of file
+void host_task(void *param);
+
+// Requests the parameters of `profile` on a connection; results arrive
+// asynchronously and are tracked in the link table.
+void gap_link_profile_set(uint16_t conn_handle, gap_link_profile_t profile);
+
+// Copies the negotiated parameters of conn_handle. Returns false if unknown.
+bool gap_link_get(uint16_t conn_handle, gap_link_t *out);
+
+// Snapshot of the radio arbiter counters.
+void gap_radio_stats_get(gap_radio_stats_t *out);
+
+// Requests the scan schedule for the current key state. Safe from any task:
+// the scanner is reconfigured on the host task.
+void gap_scan_profile_set(gap_scan_profile_t profile);
+
+// Opens the scanner to every advertiser (while a key batch is open) or returns
+// it to the accept list. Host task only. Falls back to open scanning while no tag is enrolled or more
+// are enabled than the accept list holds.
+void gap_scan_open(bool open);
+
+// Reloads the accept list after the enrolled tags changed.
+void gap_scan_tags_changed(void);
+
+// Snapshot of the report counters.
+void gap_scan_stats_get(gap_scan_stats_t *out);
+
+// Sets the input bits of the advertised status (everything but
+// GAP_ADV_ST_OTA). Safe from any task; only a change reaches the radio.
+void gap_adv_status_inputs(uint8_t inputs);
+
+// Re-evaluates the host-side status bits (OTA) after they changed.
+void gap_adv_status_changed(void);
+
+// Status byte as last published (GAP_ADV_ST_*).
+uint8_t gap_adv_status_get(void);
\ No newline at end of file
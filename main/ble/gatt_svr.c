@@ -1,15 +1,77 @@
 #include "gatt_svr.h"
+#include "gap.h"
+#include "ota_dedup.h"
+#include "ota_resume.h"
+#include "ota_writer.h"
+#include "mkey.h"
+#include "mkey_keys.h"
+#include "mkey_power.h"
 
-uint8_t gatt_svr_chr_ota_control_val;
-uint8_t gatt_svr_chr_ota_data_val[512];
+#include "esp_image_format.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "ota_l2cap.h"
+#include "nimble/nimble_port.h"
+
+// a frame of a framed session that arrived ahead of the write cursor
+typedef struct {
+  ota_writer_buf_t *buf;
+  uint32_t offset;
+  uint32_t len;
+} ota_held_frame_t;
+
+// per-client state; any connected client gets one on its first write
+typedef struct {
+  uint16_t conn_handle;   // BLE_HS_CONN_HANDLE_NONE when unused
+  uint8_t control_val;    // last OTA control value of this client
+  uint8_t data_val[2];    // packet size handshake written outside a session
+} gatt_svr_conn_t;
+
+// the single OTA slot; only its owner may drive the session or send data
+typedef struct {
+  uint16_t owner;         // BLE_HS_CONN_HANDLE_NONE while the slot is free
+  const esp_partition_t *partition;
+  esp_ota_handle_t handle;  // reserves the partition; the writer programs it
+  bool opened;            // handle came from esp_ota_begin(), not given back
+  uint16_t packet_size;
+  uint16_t num_pkgs;
+  bool streaming;
+  bool resumable;
+  bool framed;
+  ota_resume_t image;
+  uint32_t start_offset;  // image offset this session started writing at
+  uint32_t image_size;    // announced image size, 0 when unknown
+  uint16_t hash_conn;     // client waiting for HASHES, NONE when idle
+  // framed sessions
+  uint32_t next_offset;   // next stream offset the writer expects
+  uint32_t gap_reported;  // last gap start sent to the client
+  bool gap_pending;
+  ota_held_frame_t held[GATT_SVR_OTA_REORDER_SLOTS];
+  uint16_t frames_bad;
+  uint16_t frames_dup;
+  uint16_t frames_held;
+  // throughput
+  uint32_t rx_bytes;      // image bytes received this session (any transport)
+  int64_t rx_start_us;
+  uint32_t rx_packets;
+  uint32_t rx_cb_us;      // total time spent in the receive path
+  uint32_t rx_cb_max_us;  // worst single packet, i.e. host stack blocked
+} ota_session_t;
+
+static gatt_svr_conn_t conns[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+static ota_session_t ota = {
+    .owner = BLE_HS_CONN_HANDLE_NONE,
+    .hash_conn = BLE_HS_CONN_HANDLE_NONE,
+};
 
 uint16_t ota_control_val_handle;
 uint16_t ota_data_val_handle;
 
-const esp_partition_t *update_partition;
-esp_ota_handle_t update_handle;
-uint16_t num_pkgs_received = 0;
-uint16_t packet_size = 0;
+// client that opened the current enrollment batch
+static uint16_t keys_owner = BLE_HS_CONN_HANDLE_NONE;
+
+// flash errors reach the host task through its event queue
+static struct ble_npl_event ota_write_error_ev;
 
 /*---> EXTERNAL VARIBLE <--*/
 bool ota_updating = false;
@@ -26,6 +88,33 @@ static int gatt_svr_chr_ota_control_cb(uint16_t conn_handle,
                                        struct ble_gatt_access_ctxt *ctxt,
                                        void *arg);
 
+static int gatt_svr_chr_keys_scan_cb(uint16_t conn_handle, uint16_t attr_handle,
+                                     struct ble_gatt_access_ctxt *ctxt,
+                                     void *arg) {
+  gap_scan_stats_t st;
+  uint32_t words[(GATT_SVR_KEYS_SCAN_LEN - 2) / 4];
+  uint8_t val[GATT_SVR_KEYS_SCAN_LEN];
+  int rc;
+
+  gap_scan_stats_get(&st);
+  for (int f = 0; f < GAP_SCAN_FILTER_COUNT; f++) {
+    words[f * 3] = st.reports[f];
+    words[f * 3 + 1] = st.hits[f];
+    words[f * 3 + 2] = (uint32_t)(st.time_us[f] / 1000);
+  }
+  val[0] = st.filter;
+  val[1] = st.accept_list_len;
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+    val[2 + i * 4] = words[i] & 0xFF;
+    val[2 + i * 4 + 1] = (words[i] >> 8) & 0xFF;
+    val[2 + i * 4 + 2] = (words[i] >> 16) & 0xFF;
+    val[2 + i * 4 + 3] = words[i] >> 24;
+  }
+
+  rc = os_mbuf_append(ctxt->om, val, sizeof(val));
+  return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
 static int gatt_svr_chr_ota_data_cb(uint16_t conn_handle, uint16_t attr_handle,
                                     struct ble_gatt_access_ctxt *ctxt,
                                     void *arg);
@@ -35,6 +124,27 @@ static int gatt_svr_chr_access_device_info(uint16_t conn_handle,
                                            struct ble_gatt_access_ctxt *ctxt,
                                            void *arg);
 
+static int gatt_svr_chr_ota_link_cb(uint16_t conn_handle, uint16_t attr_handle,
+                                    struct ble_gatt_access_ctxt *ctxt,
+                                    void *arg);
+
+static int gatt_svr_chr_ota_stats_cb(uint16_t conn_handle, uint16_t attr_handle,
+                                     struct ble_gatt_access_ctxt *ctxt,
+                                     void *arg);
+
+static int gatt_svr_chr_ota_radio_cb(uint16_t conn_handle, uint16_t attr_handle,
+                                     struct ble_gatt_access_ctxt *ctxt,
+                                     void *arg);
+
+static int gatt_svr_chr_keys_control_cb(uint16_t conn_handle,
+                                        uint16_t attr_handle,
+                                        struct ble_gatt_access_ctxt *ctxt,
+                                        void *arg);
+
+static int gatt_svr_chr_keys_scan_cb(uint16_t conn_handle, uint16_t attr_handle,
+                                     struct ble_gatt_access_ctxt *ctxt,
+                                     void *arg);
+
 static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
     {// Service: Device Information
      .type = BLE_GATT_SVC_TYPE_PRIMARY,
@@ -76,9 +186,52 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
                     // characteristic: OTA data
                     .uuid = &gatt_svr_chr_ota_data_uuid.u,
                     .access_cb = gatt_svr_chr_ota_data_cb,
-                    .flags = BLE_GATT_CHR_F_WRITE,
+                    .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP,
                     .val_handle = &ota_data_val_handle,
                 },
+                {
+                    // characteristic: OTA link
+                    .uuid = &gatt_svr_chr_ota_link_uuid.u,
+                    .access_cb = gatt_svr_chr_ota_link_cb,
+                    .flags = BLE_GATT_CHR_F_READ,
+                },
+                {
+                    // characteristic: OTA stats
+                    .uuid = &gatt_svr_chr_ota_stats_uuid.u,
+                    .access_cb = gatt_svr_chr_ota_stats_cb,
+                    .flags = BLE_GATT_CHR_F_READ,
+                },
+                {
+                    // characteristic: OTA radio
+                    .uuid = &gatt_svr_chr_ota_radio_uuid.u,
+                    .access_cb = gatt_svr_chr_ota_radio_cb,
+                    .flags = BLE_GATT_CHR_F_READ,
+                },
+                {
+                    0,
+                }},
+    },
+
+    {
+        // service: MKEY Keys
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = &gatt_svr_svc_keys_uuid.u,
+        .characteristics =
+            (struct ble_gatt_chr_def[]){
+                {
+                    // characteristic: Keys control
+                    .uuid = &gatt_svr_chr_keys_control_uuid.u,
+                    .access_cb = gatt_svr_chr_keys_control_cb,
+                    .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_ENC |
+                             BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC |
+                             BLE_GATT_CHR_F_WRITE_AUTHEN,
+                },
+                {
+                    // characteristic: Keys scan
+                    .uuid = &gatt_svr_chr_keys_scan_uuid.u,
+                    .access_cb = gatt_svr_chr_keys_scan_cb,
+                    .flags = BLE_GATT_CHR_F_READ,
+                },
                 {
                     0,
                 }},
@@ -130,60 +283,607 @@ static int gatt_svr_chr_write(struct os_mbuf *om, uint16_t min_len,
   return 0;
 }
 
-static void update_ota_control(uint16_t conn_handle) {
+static int notify_ota_control_msg(uint16_t conn_handle, const uint8_t *msg,
+                                  uint16_t len) {
   struct os_mbuf *om;
+
+  om = ble_hs_mbuf_from_flat(msg, len);
+  if (om == NULL) {
+    return BLE_HS_ENOMEM;
+  }
+  return ble_gattc_notify_custom(conn_handle, ota_control_val_handle, om);
+}
+
+static void notify_ota_control(const gatt_svr_conn_t *conn) {
+  notify_ota_control_msg(conn->conn_handle, &conn->control_val,
+                         sizeof(conn->control_val));
+}
+
+// Finds the state of a client, allocating it on first use if `create`.
+static gatt_svr_conn_t *conn_get(uint16_t conn_handle, bool create) {
+  gatt_svr_conn_t *free_slot = NULL;
+
+  for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+    if (conns[i].conn_handle == conn_handle) {
+      return &conns[i];
+    }
+    if (free_slot == NULL && conns[i].conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+      free_slot = &conns[i];
+    }
+  }
+  if (!create || free_slot == NULL) {
+    return NULL;
+  }
+
+  memset(free_slot, 0, sizeof(*free_slot));
+  free_slot->conn_handle = conn_handle;
+  return free_slot;
+}
+
+// runs on the OTA writer task as buffers reach flash (streaming mode only)
+static bool ota_credit_cb(uint16_t credits) {
+  uint8_t msg[3] = {SVR_CHR_OTA_CONTROL_CREDIT, credits & 0xFF, credits >> 8};
+
+  return notify_ota_control_msg(ota.owner, msg, sizeof(msg)) == 0;
+}
+
+// runs on the OTA writer task every OTA_WRITER_CHECKPOINT_BYTES
+static void ota_checkpoint_cb(uint32_t offset, uint32_t crc) {
+  if (!ota.resumable) {
+    return;
+  }
+
+  ota.image.offset = offset;
+  ota.image.crc = crc;
+  ota_resume_save(&ota.image);
+  ESP_LOGI(LOG_TAG_GATT_SVR, "OTA checkpoint at %lu bytes", (unsigned long)offset);
+}
+
+// runs on the OTA writer task for every block of a hash request; hashes are
+// batched into as few notifications as the MTU allows
+static void ota_hash_cb(uint32_t block, const uint8_t *hash, bool last) {
+  static uint8_t msg[4 + GATT_SVR_OTA_HASHES_MAX * OTA_DEDUP_HASH_LEN];
+  static uint8_t n = 0;
+  uint16_t max;
+
+  if (n == 0) {
+    msg[0] = SVR_CHR_OTA_CONTROL_HASHES;
+    msg[1] = block & 0xFF;
+    msg[2] = (block >> 8) & 0xFF;
+  }
+  memcpy(&msg[4 + n * OTA_DEDUP_HASH_LEN], hash, OTA_DEDUP_HASH_LEN);
+  n++;
+
+  max = (ble_att_mtu(ota.hash_conn) - 3 - 4) / OTA_DEDUP_HASH_LEN;
+  if (max > GATT_SVR_OTA_HASHES_MAX) {
+    max = GATT_SVR_OTA_HASHES_MAX;
+  }
+  if (!last && n < max) {
+    return;
+  }
+
+  msg[3] = n;
+  for (int retry = 0; retry < 10; retry++) {
+    if (notify_ota_control_msg(ota.hash_conn, msg,
+                               4 + n * OTA_DEDUP_HASH_LEN) != BLE_HS_ENOMEM) {
+      break;
+    }
+    vTaskDelay(pdMS_TO_TICKS(OTA_WRITER_CREDIT_RETRY_MS));
+  }
+  n = 0;
+  if (last) {
+    ota.hash_conn = BLE_HS_CONN_HANDLE_NONE;
+  }
+}
+
+static uint16_t get_le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+
+static uint32_t get_le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Picks where a resumable session starts: from the stored checkpoint if it
+// belongs to the same image and partition, otherwise from scratch.
+static void ota_resume_select(uint32_t image_size, uint32_t image_crc) {
+  ota_resume_t rec;
+
+  if (ota_resume_load(&rec) == ESP_OK && rec.image_size == image_size &&
+      rec.image_crc == image_crc &&
+      rec.partition_addr == ota.partition->address &&
+      rec.offset < image_size) {
+    ota.image = rec;
+    ESP_LOGI(LOG_TAG_GATT_SVR, "Resuming OTA at %lu/%lu bytes",
+             (unsigned long)rec.offset, (unsigned long)image_size);
+    return;
+  }
+
+  ota_resume_clear();
+  memset(&ota.image, 0, sizeof(ota.image));
+  ota.image.magic = OTA_RESUME_MAGIC;
+  ota.image.image_size = image_size;
+  ota.image.image_crc = image_crc;
+  ota.image.partition_addr = ota.partition->address;
+}
+
+// Packs the negotiated link parameters of conn_handle. The suggested chunk is
+// the largest ATT write payload that fills whole LL PDUs towards the device.
+static void ota_link_pack(uint16_t conn_handle,
+                          uint8_t out[GATT_SVR_OTA_LINK_LEN]) {
+  gap_link_t link;
+  uint16_t chunk;
+  uint16_t k;
+
+  memset(out, 0, GATT_SVR_OTA_LINK_LEN);
+  if (!gap_link_get(conn_handle, &link)) {
+    return;
+  }
+
+  chunk = link.mtu > 3 ? link.mtu - 3 : 0;
+  if (chunk > OTA_WRITER_BUF_SIZE) {
+    chunk = OTA_WRITER_BUF_SIZE;
+  }
+  // 4 bytes of L2CAP and 3 of ATT header travel with every write
+  k = link.max_rx_octets ? (chunk + 7) / link.max_rx_octets : 0;
+  if (k > 0 && k * link.max_rx_octets > 7) {
+    chunk = k * link.max_rx_octets - 7;
+  }
+
+  const uint16_t vals[] = {link.conn_itvl,     link.conn_latency,
+                           link.supervision_timeout, link.max_tx_octets,
+                           link.max_rx_octets, link.mtu, chunk};
+  out[0] = link.tx_phy;
+  out[1] = link.rx_phy;
+  for (size_t i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+    out[2 + 2 * i] = vals[i] & 0xFF;
+    out[3 + 2 * i] = vals[i] >> 8;
+  }
+}
+
+void gatt_svr_link_changed(uint16_t conn_handle) {
+  uint8_t msg[1 + GATT_SVR_OTA_LINK_LEN] = {SVR_CHR_OTA_CONTROL_LINK};
+
+  // only the client running a session cares about live updates
+  if (!ota_updating || conn_handle != ota.owner) {
+    return;
+  }
+  ota_link_pack(conn_handle, &msg[1]);
+  notify_ota_control_msg(conn_handle, msg, sizeof(msg));
+}
+
+// Ends the data phase of a failed session and NAKs its owner. Host task only
+// (the slot stays with its owner until it sends REQUEST/DONE or disconnects).
+static void ota_session_fail(esp_err_t err) {
+  const uint8_t nak = SVR_CHR_OTA_CONTROL_DATA_NAK;
+  gatt_svr_conn_t *conn = conn_get(ota.owner, false);
+
+  ota_updating = false;
+  mkey_power_hold(MKEY_POWER_LOCK_OTA, false);
+  gap_adv_status_changed();
+  gap_link_profile_set(ota.owner, GAP_LINK_PROFILE_IDLE);
+  if (conn) {
+    conn->control_val = nak;
+  }
+  notify_ota_control_msg(ota.owner, &nak, sizeof(nak));
+  ESP_LOGE(LOG_TAG_GATT_SVR, "OTA data rejected (%s), NAK has been sent.",
+           esp_err_to_name(err));
+}
+
+static void ota_write_error_apply(struct ble_npl_event *ev) {
+  const esp_err_t err = ota_writer_status();
+
+  // the session may have been closed, or a new one begun, since the post
+  if (!ota_updating || err == ESP_OK) {
+    return;
+  }
+  ota_session_fail(err);
+}
+
+// runs on the OTA writer task when flash rejects a packet
+static void ota_write_error_cb(esp_err_t err) {
+  ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &ota_write_error_ev);
+}
+
+// Tells the client which part of the stream is missing: from the write
+// cursor up to the first held frame (or the end of the image, if unknown).
+// Sent once per cursor position; DONE always re-reports.
+static void ota_report_gap(bool force) {
+  uint32_t end = 0;
+  uint32_t len;
+
+  if (!force && ota.gap_pending && ota.gap_reported == ota.next_offset) {
+    return;
+  }
+  for (int i = 0; i < GATT_SVR_OTA_REORDER_SLOTS; i++) {
+    if (ota.held[i].buf && (end == 0 || ota.held[i].offset < end)) {
+      end = ota.held[i].offset;
+    }
+  }
+  len = end ? end - ota.next_offset : 0;
+
+  uint8_t msg[9] = {SVR_CHR_OTA_CONTROL_GAP,
+                    ota.next_offset & 0xFF, (ota.next_offset >> 8) & 0xFF,
+                    (ota.next_offset >> 16) & 0xFF, ota.next_offset >> 24,
+                    len & 0xFF, (len >> 8) & 0xFF, (len >> 16) & 0xFF, len >> 24};
+  notify_ota_control_msg(ota.owner, msg, sizeof(msg));
+  ota.gap_reported = ota.next_offset;
+  ota.gap_pending = true;
+  ESP_LOGW(LOG_TAG_GATT_SVR, "OTA gap at %lu (+%lu)",
+           (unsigned long)ota.next_offset, (unsigned long)len);
+}
+
+// Discarded frames still go through the writer so their credit comes back.
+static void ota_frame_drop(ota_writer_buf_t *buf) {
+  buf->op = OTA_WRITER_OP_DROP;
+  ota_writer_submit(buf);
+}
+
+// Cuts the first `skip` stream bytes off a frame that overlaps the cursor.
+static void ota_frame_trim(ota_writer_buf_t *buf, uint32_t skip) {
+  if (buf->op == OTA_WRITER_OP_COPY) {
+    buf->arg -= skip;
+  } else {
+    memmove(buf->data, buf->data + skip, buf->len - skip);
+    buf->len -= skip;
+  }
+}
+
+// Hands held frames to the writer for as long as they continue the stream.
+static void ota_frames_drain(void) {
+  bool progress = true;
+
+  while (progress) {
+    progress = false;
+    for (int i = 0; i < GATT_SVR_OTA_REORDER_SLOTS; i++) {
+      ota_held_frame_t *held = &ota.held[i];
+      if (held->buf == NULL || held->offset > ota.next_offset) {
+        continue;
+      }
+      if (held->offset + held->len <= ota.next_offset) {
+        ota_frame_drop(held->buf);
+      } else {
+        ota_frame_trim(held->buf, ota.next_offset - held->offset);
+        ota.next_offset = held->offset + held->len;
+        ota_writer_submit(held->buf);
+      }
+      held->buf = NULL;
+      progress = true;
+    }
+  }
+}
+
+// Returns held buffers to the pool when a framed session goes away.
+static void ota_frames_reset(void) {
+  for (int i = 0; i < GATT_SVR_OTA_REORDER_SLOTS; i++) {
+    if (ota.held[i].buf) {
+      ota_writer_release(ota.held[i].buf);
+      ota.held[i].buf = NULL;
+    }
+  }
+  ota.gap_pending = false;
+  ota.frames_bad = 0;
+  ota.frames_dup = 0;
+  ota.frames_held = 0;
+}
+
+// Puts a validated frame covering [offset, offset + len) of the stream in
+// order: duplicates are dropped, frames past a gap are held back.
+static void ota_frame_accept(ota_writer_buf_t *buf, uint32_t offset,
+                             uint32_t len) {
+  if (offset + len <= ota.next_offset) {
+    ota.frames_dup++;
+    ota_frame_drop(buf);
+    return;
+  }
+
+  if (offset <= ota.next_offset) {
+    ota_frame_trim(buf, ota.next_offset - offset);
+    ota.next_offset = offset + len;
+    ota_writer_submit(buf);
+    ota_frames_drain();
+    return;
+  }
+
+  // ahead of the cursor: something before it got lost
+  int slot = -1;
+  for (int i = 0; i < GATT_SVR_OTA_REORDER_SLOTS; i++) {
+    if (ota.held[i].buf && ota.held[i].offset == offset) {
+      slot = -2;
+      break;
+    }
+    if (ota.held[i].buf == NULL && slot == -1) {
+      slot = i;
+    }
+  }
+  if (slot >= 0) {
+    ota.held[slot] = (ota_held_frame_t){.buf = buf, .offset = offset, .len = len};
+    ota.frames_held++;
+  } else {
+    ota.frames_dup += slot == -2;
+    ota_frame_drop(buf);
+  }
+  ota_report_gap(false);
+}
+
+// Takes a pool buffer for the next item of the session.
+static ota_writer_buf_t *ota_acquire_buf(void) {
+  ota_writer_buf_t *buf;
+
+  if (ota.streaming) {
+    // write-without-response: the client owns a credit for every free
+    // buffer, so an empty pool means it overran the window
+    buf = ota_writer_acquire(0);
+    if (buf == NULL) {
+      ESP_LOGE(LOG_TAG_GATT_SVR, "OTA stream overran the credit window");
+      ota_writer_fail(ESP_ERR_NO_MEM);
+      ota_session_fail(ESP_ERR_NO_MEM);
+    }
+  } else {
+    buf = ota_writer_acquire(OTA_WRITER_ACQUIRE_TIMEOUT_MS);
+    if (buf == NULL) {
+      ESP_LOGW(LOG_TAG_GATT_SVR, "OTA buffer pool exhausted, rejecting packet");
+    }
+  }
+
+  return buf;
+}
+
+// Gives the update handle back to the OTA layer, if one is open.
+static void ota_handle_abort(void) {
+  if (ota.opened) {
+    esp_ota_abort(ota.handle);
+    ota.opened = false;
+  }
+}
+
+// The image checks esp_ota_end() would run, on what the writer programmed.
+static esp_err_t ota_image_verify(const esp_partition_t *part) {
+  const esp_partition_pos_t pos = {
+      .offset = part->address,
+      .size = part->size,
+  };
+  esp_image_metadata_t data;
+
+  if (esp_image_verify(ESP_IMAGE_VERIFY, &pos, &data) != ESP_OK) {
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  return ESP_OK;
+}
+
+// Drops the open session, if any, and frees the OTA slot. A resume checkpoint
+// stays in NVS so the client can continue later.
+static void ota_session_close(void) {
+  if (ota.owner == BLE_HS_CONN_HANDLE_NONE) {
+    return;
+  }
+
+  ota_updating = false;
+  mkey_power_hold(MKEY_POWER_LOCK_OTA, false);
+  gap_adv_status_changed();
+  ota_frames_reset();
+  ota_writer_flush(OTA_WRITER_FLUSH_TIMEOUT_MS);
+  ota_handle_abort();
+  ota.owner = BLE_HS_CONN_HANDLE_NONE;
+}
+
+static void update_ota_control(gatt_svr_conn_t *conn, const uint8_t *args,
+                               uint16_t args_len) {
+  const uint16_t conn_handle = conn->conn_handle;
+  ota_writer_buf_t *buf;
   esp_err_t err;
+  uint8_t flags;
+  uint32_t offset;
+  uint32_t crc;
+  uint32_t image_size;
+  uint32_t ms;
+  ota_writer_stats_t wstats;
+
+  // the OTA slot belongs to one client at a time, everyone else is read-only
+  if (ota.owner != BLE_HS_CONN_HANDLE_NONE && ota.owner != conn_handle &&
+      conn->control_val != SVR_CHR_OTA_CONTROL_NOP) {
+    ESP_LOGW(LOG_TAG_GATT_SVR, "OTA slot owned by conn %d, rejecting op %d from conn %d",
+             ota.owner, conn->control_val, conn_handle);
+    if (conn->control_val == SVR_CHR_OTA_CONTROL_REQUEST ||
+        conn->control_val == SVR_CHR_OTA_CONTROL_RESUME) {
+      conn->control_val = SVR_CHR_OTA_CONTROL_REQUEST_NAK;
+      notify_ota_control(conn);
+    } else if (conn->control_val == SVR_CHR_OTA_CONTROL_DONE) {
+      conn->control_val = SVR_CHR_OTA_CONTROL_DONE_NAK;
+      notify_ota_control(conn);
+    }
+    return;
+  }
 
   // check which value has been received
-  switch (gatt_svr_chr_ota_control_val) {
+  switch (conn->control_val) {
     case SVR_CHR_OTA_CONTROL_REQUEST:
+    case SVR_CHR_OTA_CONTROL_RESUME:
       // OTA request
-      ESP_LOGI(LOG_TAG_GATT_SVR, "OTA has been requested via BLE.");
+      // args: [flags] [image size u32] for REQUEST (legacy clients send
+      // neither), [flags] [image size u32] [image crc32 u32] for RESUME
+      ota.resumable = conn->control_val == SVR_CHR_OTA_CONTROL_RESUME;
+      flags = args_len >= 1 ? args[0] : 0;
+      ESP_LOGI(LOG_TAG_GATT_SVR, "OTA has been requested via BLE (flags=0x%02x%s).",
+               flags, ota.resumable ? ", resumable" : "");
+      // a previous session of this client is still open: drain and drop it
+      ota_session_close();
       // get the next free OTA partition
-      update_partition = esp_ota_get_next_update_partition(NULL);
-      // start the ota update
-      err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES,
-                          &update_handle);
+      ota.partition = esp_ota_get_next_update_partition(NULL);
+      if (ota.resumable && args_len < 9) {
+        err = ESP_ERR_INVALID_ARG;
+      } else if ((flags & ~OTA_REQUEST_F_SUPPORTED) ||
+                 (ota.resumable && (flags & OTA_REQUEST_F_LZ))) {
+        // unknown flags, or a compressed stream (the decoder state cannot
+        // be checkpointed, so those sessions always start over)
+        err = ESP_ERR_NOT_SUPPORTED;
+      } else {
+        if (ota.resumable) {
+          ota_resume_select(get_le32(&args[1]), get_le32(&args[5]));
+        } else {
+          // a plain session overwrites whatever a checkpoint pointed at
+          ota_resume_clear();
+          memset(&ota.image, 0, sizeof(ota.image));
+        }
+        // the announced size lets the writer pre-erase the whole image
+        image_size = args_len >= 5 ? get_le32(&args[1]) : 0;
+        if (ota.partition && image_size > ota.partition->size) {
+          err = ESP_ERR_INVALID_SIZE;
+        } else {
+          // start the ota update; sectors are erased by the writer task
+          err = esp_ota_begin(ota.partition, OTA_WITH_SEQUENTIAL_WRITES,
+                              &ota.handle);
+          ota.opened = err == ESP_OK;
+        }
+      }
       if (err != ESP_OK) {
+        // nothing was opened: the previous session is closed already and a
+        // failed esp_ota_begin() leaves no handle behind
         ESP_LOGE(LOG_TAG_GATT_SVR, "esp_ota_begin failed (%s)",
                  esp_err_to_name(err));
-        esp_ota_abort(update_handle);
-        gatt_svr_chr_ota_control_val = SVR_CHR_OTA_CONTROL_REQUEST_NAK;
+        conn->control_val = SVR_CHR_OTA_CONTROL_REQUEST_NAK;
       } else {
-        gatt_svr_chr_ota_control_val = SVR_CHR_OTA_CONTROL_REQUEST_ACK;
+        conn->control_val = ota.resumable ? SVR_CHR_OTA_CONTROL_RESUME_ACK
+                                          : SVR_CHR_OTA_CONTROL_REQUEST_ACK;
+        ota.owner = conn_handle;
+        ota.start_offset = ota.image.offset;
+        ota.image_size = image_size;
+        ota.streaming = (flags & OTA_REQUEST_F_STREAM) != 0;
+        ota.framed = (flags & OTA_REQUEST_F_FRAMED) != 0;
+        ota.next_offset = ota.image.offset;
+        ota_frames_reset();
+        ota_writer_session_t session = {
+            .partition = ota.partition,
+            .offset = ota.image.offset,
+            .crc = ota.image.crc,
+            .image_size = image_size,
+            .grant_credits = ota.streaming,
+            .compressed = (flags & OTA_REQUEST_F_LZ) != 0,
+        };
+        ota_writer_begin(&session);
         ota_updating = true;
+        mkey_power_hold(MKEY_POWER_LOCK_OTA, true);
+        gap_adv_status_changed();
+        ota.rx_bytes = 0;
+        ota.rx_packets = 0;
+        ota.rx_cb_us = 0;
+        ota.rx_cb_max_us = 0;
+        ota.rx_start_us = esp_timer_get_time();
 
         // retrieve the packet size from OTA data
-        packet_size = (gatt_svr_chr_ota_data_val[1] << 8) + gatt_svr_chr_ota_data_val[0];
-        ESP_LOGI(LOG_TAG_GATT_SVR, "Packet size is: %d", packet_size);
+        ota.packet_size = (conn->data_val[1] << 8) + conn->data_val[0];
+        ESP_LOGI(LOG_TAG_GATT_SVR, "Packet size is: %d", ota.packet_size);
 
-        num_pkgs_received = 0;
+        ota.num_pkgs = 0;
       }
 
-      // notify the client via BLE that the OTA has been acknowledged (or not)
-      om = ble_hs_mbuf_from_flat(&gatt_svr_chr_ota_control_val,
-                                 sizeof(gatt_svr_chr_ota_control_val));
-      ble_gattc_notify_custom(conn_handle, ota_control_val_handle, om);
+      // notify the client via BLE that the OTA has been acknowledged (or not);
+      // a resume ack carries the offset the client has to continue from
+      if (conn->control_val == SVR_CHR_OTA_CONTROL_RESUME_ACK) {
+        uint8_t msg[5] = {SVR_CHR_OTA_CONTROL_RESUME_ACK,
+                          ota.image.offset & 0xFF, (ota.image.offset >> 8) & 0xFF,
+                          (ota.image.offset >> 16) & 0xFF, ota.image.offset >> 24};
+        notify_ota_control_msg(conn_handle, msg, sizeof(msg));
+      } else {
+        notify_ota_control(conn);
+      }
       ESP_LOGI(LOG_TAG_GATT_SVR, "OTA request acknowledgement has been sent.");
+
+      // streaming clients start with one credit per pool buffer
+      if (ota_updating && ota.streaming) {
+        ota_credit_cb(OTA_WRITER_BUF_COUNT);
+      }
+
+      // fast link for the transfer, reverted when the session ends
+      if (ota_updating) {
+        gap_link_profile_set(conn_handle, GAP_LINK_PROFILE_THROUGHPUT);
+      }
       break;
 
     case SVR_CHR_OTA_CONTROL_DONE:
+      if (!ota_updating || ota.owner != conn_handle) {
+        // no running session to finish; a failed one of this client (after
+        // a DATA_NAK) is dropped here
+        ESP_LOGW(LOG_TAG_GATT_SVR, "DONE from conn %d without a session",
+                 conn_handle);
+        ota_session_close();
+        conn->control_val = SVR_CHR_OTA_CONTROL_DONE_NAK;
+        notify_ota_control(conn);
+        break;
+      }
+      // framed clients send the stream length: anything still missing is
+      // reported and the session stays open for the retransmission
+      if (ota.framed && args_len >= 4) {
+        bool held = false;
+        for (int i = 0; i < GATT_SVR_OTA_REORDER_SLOTS; i++) {
+          held |= ota.held[i].buf != NULL;
+        }
+        if (held || ota.next_offset < get_le32(&args[0])) {
+          ota_report_gap(true);
+          break;
+        }
+      }
+      if (ota.framed) {
+        ESP_LOGI(LOG_TAG_GATT_SVR, "Frames: %u bad, %u duplicate, %u held",
+                 ota.frames_bad, ota.frames_dup, ota.frames_held);
+      }
+      ms = (esp_timer_get_time() - ota.rx_start_us) / 1000;
+      ESP_LOGI(LOG_TAG_GATT_SVR, "OTA data: %lu bytes in %lu ms (%lu B/s) over %s",
+               (unsigned long)ota.rx_bytes, (unsigned long)ms,
+               (unsigned long)(ms ? (uint64_t)ota.rx_bytes * 1000 / ms : 0),
+               ota_l2cap_connected(conn_handle) ? "L2CAP" : "GATT");
+      ESP_LOGI(LOG_TAG_GATT_SVR, "Rx path: %lu packets, %lu us avg, %lu us max",
+               (unsigned long)ota.rx_packets,
+               (unsigned long)(ota.rx_packets ? ota.rx_cb_us / ota.rx_packets : 0),
+               (unsigned long)ota.rx_cb_max_us);
 
       ota_updating = false;
+      mkey_power_hold(MKEY_POWER_LOCK_OTA, false);
+      gap_adv_status_changed();
+      // the session ends here whatever the outcome, and a failed one frees the
+      // slot without going through ota_session_close()
+      ota_frames_reset();
 
-      // end the OTA and start validation
-      err = esp_ota_end(update_handle);
+      // wait for the writer task to put every queued packet in flash
+      err = ota_writer_flush(OTA_WRITER_FLUSH_TIMEOUT_MS);
+      ota_writer_stats(&wstats);
+      ESP_LOGI(LOG_TAG_GATT_SVR,
+               "Flash: %lu B pre-erased, lead min %lu B, %lu stalls (%lu ms)",
+               (unsigned long)wstats.bg_erased,
+               (unsigned long)wstats.erase_ahead_min,
+               (unsigned long)wstats.stall_erases,
+               (unsigned long)(wstats.stall_us / 1000));
+      ESP_LOGI(LOG_TAG_GATT_SVR,
+               "Writer: %lu jobs, %lu ms busy, slowest %lu us, pool low %u",
+               (unsigned long)wstats.jobs, (unsigned long)(wstats.busy_us / 1000),
+               (unsigned long)wstats.job_max_us, wstats.pool_min_free);
+      if (err == ESP_OK && ota.resumable) {
+        // the image may have been assembled over several sessions: check it
+        // against what the client announced before handing it to the bootloader
+        ota_writer_progress(&offset, &crc);
+        if (offset != ota.image.image_size || crc != ota.image.image_crc) {
+          ESP_LOGE(LOG_TAG_GATT_SVR, "Image mismatch (%lu bytes, crc 0x%08lx)",
+                   (unsigned long)offset, (unsigned long)crc);
+          err = ESP_ERR_INVALID_CRC;
+        }
+      }
+      ota_resume_clear();
+      ota.resumable = false;
       if (err != ESP_OK) {
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+        ESP_LOGE(LOG_TAG_GATT_SVR, "OTA data path failed (%s)!",
+                 esp_err_to_name(err));
+      }
+      // nothing went through the handle (esp_ota_end() would refuse it): give
+      // it back and validate the image in flash
+      ota_handle_abort();
+      if (err == ESP_OK) {
+        err = ota_image_verify(ota.partition);
+        if (err != ESP_OK) {
           ESP_LOGE(LOG_TAG_GATT_SVR,
                    "Image validation failed, image is corrupted!");
-        } else {
-          ESP_LOGE(LOG_TAG_GATT_SVR, "esp_ota_end failed (%s)!",
-                   esp_err_to_name(err));
         }
-      } else {
+      }
+      if (err == ESP_OK) {
         // select the new partition for the next boot
-        err = esp_ota_set_boot_partition(update_partition);
+        err = esp_ota_set_boot_partition(ota.partition);
         if (err != ESP_OK) {
           ESP_LOGE(LOG_TAG_GATT_SVR, "esp_ota_set_boot_partition failed (%s)!",
                    esp_err_to_name(err));
@@ -192,19 +892,20 @@ static void update_ota_control(uint16_t conn_handle) {
 
       // set the control value
       if (err != ESP_OK) {
-        gatt_svr_chr_ota_control_val = SVR_CHR_OTA_CONTROL_DONE_NAK;
+        conn->control_val = SVR_CHR_OTA_CONTROL_DONE_NAK;
       } else {
-        gatt_svr_chr_ota_control_val = SVR_CHR_OTA_CONTROL_DONE_ACK;
+        conn->control_val = SVR_CHR_OTA_CONTROL_DONE_ACK;
       }
 
       // notify the client via BLE that DONE has been acknowledged
-      om = ble_hs_mbuf_from_flat(&gatt_svr_chr_ota_control_val,
-                                 sizeof(gatt_svr_chr_ota_control_val));
-      ble_gattc_notify_custom(conn_handle, ota_control_val_handle, om);
+      notify_ota_control(conn);
       ESP_LOGI(LOG_TAG_GATT_SVR, "OTA DONE acknowledgement has been sent.");
 
-      // restart the ESP to finish the OTA
-      if (err == ESP_OK) {
+      // restart the ESP to finish the OTA, or drop back to the idle link
+      if (err != ESP_OK) {
+        ota.owner = BLE_HS_CONN_HANDLE_NONE;
+        gap_link_profile_set(conn_handle, GAP_LINK_PROFILE_IDLE);
+      } else {
         ESP_LOGI(LOG_TAG_GATT_SVR, "Preparing to restart!");
         vTaskDelay(pdMS_TO_TICKS(REBOOT_DEEP_SLEEP_TIMEOUT));
         esp_restart();
@@ -212,6 +913,64 @@ static void update_ota_control(uint16_t conn_handle) {
 
       break;
 
+    case SVR_CHR_OTA_CONTROL_HASH_REQ:
+      // hashes of the running image, so the client can skip unchanged blocks;
+      // computed on the writer task, replies arrive as HASHES notifications.
+      // Only within the client's own session, like COPY
+      if (!ota_updating || ota.owner != conn_handle) {
+        ESP_LOGW(LOG_TAG_GATT_SVR, "Hash request from conn %d without a session",
+                 conn_handle);
+        break;
+      }
+      if (args_len < 4) {
+        ESP_LOGW(LOG_TAG_GATT_SVR, "Malformed hash request");
+        break;
+      }
+      if (ota.hash_conn != BLE_HS_CONN_HANDLE_NONE) {
+        ESP_LOGW(LOG_TAG_GATT_SVR, "Hash request of conn %d still running",
+                 ota.hash_conn);
+        break;
+      }
+      buf = ota_writer_acquire(OTA_WRITER_ACQUIRE_TIMEOUT_MS);
+      if (buf == NULL) {
+        ESP_LOGW(LOG_TAG_GATT_SVR, "OTA buffer pool exhausted, dropping hash request");
+        break;
+      }
+      ota.hash_conn = conn_handle;
+      buf->op = OTA_WRITER_OP_HASH;
+      buf->arg = get_le16(&args[0]);
+      buf->count = get_le16(&args[2]);
+      if (buf->count == 0) {
+        ota.hash_conn = BLE_HS_CONN_HANDLE_NONE;
+        ota_writer_release(buf);
+        break;
+      }
+      ESP_LOGI(LOG_TAG_GATT_SVR, "Hashing %lu blocks from block %lu",
+               (unsigned long)buf->count, (unsigned long)buf->arg);
+      ota_writer_submit(buf);
+      break;
+
+    case SVR_CHR_OTA_CONTROL_COPY:
+      // the next `length` image bytes equal the running image at the same
+      // offset; queued like a data packet so ordering is preserved
+      if (!ota_updating || ota.owner != conn_handle ||
+          args_len < (ota.framed ? 8 : 4)) {
+        break;
+      }
+      buf = ota_acquire_buf();
+      if (buf == NULL) {
+        break;
+      }
+      buf->op = OTA_WRITER_OP_COPY;
+      buf->arg = get_le32(&args[0]);
+      if (ota.framed) {
+        ota_frame_accept(buf, get_le32(&args[4]), buf->arg);
+      } else {
+        ota_writer_submit(buf);
+      }
+      ESP_LOGD(LOG_TAG_GATT_SVR, "Copying %lu bytes", (unsigned long)buf->arg);
+      break;
+
     default:
       break;
   }
@@ -222,21 +981,33 @@ static int gatt_svr_chr_ota_control_cb(uint16_t conn_handle,
                                        struct ble_gatt_access_ctxt *ctxt,
                                        void *arg) {
   int rc;
-  uint8_t length = sizeof(gatt_svr_chr_ota_control_val);
+  gatt_svr_conn_t *conn;
+  uint8_t val;
+  uint8_t req[GATT_SVR_OTA_CONTROL_MAX_LEN];
+  uint16_t req_len;
 
   switch (ctxt->op) {
     case BLE_GATT_ACCESS_OP_READ_CHR:
-      // a client is reading the current value of ota control
-      rc = os_mbuf_append(ctxt->om, &gatt_svr_chr_ota_control_val, length);
+      // a client is reading its own current value of ota control
+      conn = conn_get(conn_handle, false);
+      val = conn ? conn->control_val : SVR_CHR_OTA_CONTROL_NOP;
+      rc = os_mbuf_append(ctxt->om, &val, sizeof(val));
       return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
       break;
 
     case BLE_GATT_ACCESS_OP_WRITE_CHR:
-      // a client is writing a value to ota control
-      rc = gatt_svr_chr_write(ctxt->om, 1, length,
-                              &gatt_svr_chr_ota_control_val, NULL);
+      // a client is writing a value to ota control: [opcode] [args...]
+      rc = gatt_svr_chr_write(ctxt->om, 1, sizeof(req), req, &req_len);
+      if (rc != 0) {
+        return rc;
+      }
+      conn = conn_get(conn_handle, true);
+      if (conn == NULL) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+      }
       // update the OTA state with the new value
-      update_ota_control(conn_handle);
+      conn->control_val = req[0];
+      update_ota_control(conn, &req[1], req_len - 1);
       return rc;
       break;
 
@@ -249,35 +1020,370 @@ static int gatt_svr_chr_ota_control_cb(uint16_t conn_handle,
   return BLE_ATT_ERR_UNLIKELY;
 }
 
-static int gatt_svr_chr_ota_data_cb(uint16_t conn_handle, uint16_t attr_handle,
+static int gatt_svr_chr_ota_link_cb(uint16_t conn_handle, uint16_t attr_handle,
                                     struct ble_gatt_access_ctxt *ctxt,
                                     void *arg) {
+  uint8_t val[GATT_SVR_OTA_LINK_LEN];
+  int rc;
+
+  ota_link_pack(conn_handle, val);
+  rc = os_mbuf_append(ctxt->om, val, sizeof(val));
+  return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int gatt_svr_chr_ota_stats_cb(uint16_t conn_handle, uint16_t attr_handle,
+                                     struct ble_gatt_access_ctxt *ctxt,
+                                     void *arg) {
+  ota_writer_stats_t wstats;
+  uint32_t words[GATT_SVR_OTA_STATS_LEN / 4];
+  uint8_t val[GATT_SVR_OTA_STATS_LEN];
+  int rc;
+
+  ota_writer_stats(&wstats);
+  words[0] = ota.rx_bytes;
+  words[1] = ota.rx_start_us
+                 ? (uint32_t)((esp_timer_get_time() - ota.rx_start_us) / 1000)
+                 : 0;
+  words[2] = wstats.written;
+  words[3] = wstats.erase_ahead;
+  words[4] = wstats.erase_ahead_min;
+  words[5] = wstats.bg_erased;
+  words[6] = wstats.stall_erases;
+  words[7] = wstats.stall_us;
+  words[8] = ota.rx_packets;
+  words[9] = ota.rx_packets ? ota.rx_cb_us / ota.rx_packets : 0;
+  words[10] = ota.rx_cb_max_us;
+  words[11] = wstats.busy_us;
+  words[12] = wstats.job_max_us;
+  words[13] = wstats.pool_min_free;
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+    val[i * 4] = words[i] & 0xFF;
+    val[i * 4 + 1] = (words[i] >> 8) & 0xFF;
+    val[i * 4 + 2] = (words[i] >> 16) & 0xFF;
+    val[i * 4 + 3] = words[i] >> 24;
+  }
+
+  rc = os_mbuf_append(ctxt->om, val, sizeof(val));
+  return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int gatt_svr_chr_ota_radio_cb(uint16_t conn_handle, uint16_t attr_handle,
+                                     struct ble_gatt_access_ctxt *ctxt,
+                                     void *arg) {
+  gap_radio_stats_t st;
+  uint32_t words[(GATT_SVR_OTA_RADIO_LEN - 1) / 4];
+  uint8_t val[GATT_SVR_OTA_RADIO_LEN];
   int rc;
-  esp_err_t err;
 
-  // store the received data into gatt_svr_chr_ota_data_val
-  rc = gatt_svr_chr_write(ctxt->om, 1, sizeof(gatt_svr_chr_ota_data_val),
-                          gatt_svr_chr_ota_data_val, NULL);
-
-  // write the received packet to the partition
-  if (ota_updating) {
-    err = esp_ota_write(update_handle, (const void *)gatt_svr_chr_ota_data_val,
-                        packet_size);
-    if (err != ESP_OK) {
-      ESP_LOGE(LOG_TAG_GATT_SVR, "esp_ota_write failed (%s)!",
-               esp_err_to_name(err));
+  gap_radio_stats_get(&st);
+  words[0] = (uint32_t)(st.scan_us / 1000);
+  words[1] = (uint32_t)(st.adv_us / 1000);
+  words[2] = (uint32_t)(st.busy_us / 1000);
+  words[3] = (uint32_t)(st.total_us / 1000);
+  for (int p = 0; p < GAP_SCAN_PROFILE_COUNT; p++) {
+    words[4 + p * 2] = (uint32_t)(st.profile_us[p] / 1000);
+    words[4 + p * 2 + 1] = (uint32_t)(st.profile_scan_us[p] / 1000);
+  }
+  val[0] = st.scan_profile;
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+    val[1 + i * 4] = words[i] & 0xFF;
+    val[1 + i * 4 + 1] = (words[i] >> 8) & 0xFF;
+    val[1 + i * 4 + 2] = (words[i] >> 16) & 0xFF;
+    val[1 + i * 4 + 3] = words[i] >> 24;
+  }
+
+  rc = os_mbuf_append(ctxt->om, val, sizeof(val));
+  return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int keys_control_read(struct os_mbuf *om) {
+  uint8_t val[GATT_SVR_KEYS_STATUS_LEN];
+  uint16_t pending;
+  const uint16_t enrolled = mkey_keys_count();
+  const uint16_t enabled = mkey_keys_enabled();
+  const uint32_t generation = mkey_keys_generation();
+
+  if (!mkey_keys_pending(&pending)) {
+    pending = 0xFFFF;
+  }
+  val[0] = enrolled & 0xFF;
+  val[1] = enrolled >> 8;
+  val[2] = enabled & 0xFF;
+  val[3] = enabled >> 8;
+  val[4] = pending & 0xFF;
+  val[5] = pending >> 8;
+  val[6] = generation & 0xFF;
+  val[7] = (generation >> 8) & 0xFF;
+  val[8] = (generation >> 16) & 0xFF;
+  val[9] = generation >> 24;
+  val[10] = mkey_enroll_allowed();
+
+  return os_mbuf_append(om, val, sizeof(val)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int keys_control_write(uint16_t conn_handle, const uint8_t *req, uint16_t len) {
+  const uint8_t *args = &req[1];
+  const uint16_t args_len = len - 1;
+  uint16_t count;
+  esp_err_t err = ESP_OK;
+  struct ble_gap_conn_desc desc;
+
+  // the stack checked the link is encrypted and authenticated; the table is
+  // only changed from a client that keeps a bond with the unit
+  if (ble_gap_conn_find(conn_handle, &desc) != 0 || !desc.sec_state.bonded) {
+    return BLE_ATT_ERR_INSUFFICIENT_AUTHEN;
+  }
+  // changes to the key table need an authorized driver in the vehicle
+  if (!mkey_enroll_allowed()) {
+    return GATT_SVR_KEYS_ERR_DENIED;
+  }
+  if (mkey_keys_pending(NULL) && keys_owner != conn_handle) {
+    return GATT_SVR_KEYS_ERR_BUSY;
+  }
+  if (req[0] != SVR_CHR_KEYS_BEGIN && !mkey_keys_pending(NULL)) {
+    return GATT_SVR_KEYS_ERR_NO_BATCH;
+  }
+
+  switch (req[0]) {
+    case SVR_CHR_KEYS_BEGIN:
+      mkey_keys_begin();
+      keys_owner = conn_handle;
+      // let tags that are not on the accept list yet reach the host
+      gap_scan_open(true);
+      break;
+
+    case SVR_CHR_KEYS_PUT:
+      if (args_len % sizeof(mkey_key_t) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+      }
+      for (uint16_t i = 0; i < args_len && err == ESP_OK; i += sizeof(mkey_key_t)) {
+        mkey_key_t key;
+        memcpy(&key, &args[i], sizeof(key));
+        err = mkey_keys_put(&key);
+      }
+      if (err != ESP_OK) {
+        return GATT_SVR_KEYS_ERR_FULL;
+      }
+      break;
+
+    case SVR_CHR_KEYS_DEL:
+      if (args_len % 6 != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+      }
+      for (uint16_t i = 0; i < args_len; i += 6) {
+        mkey_keys_remove(&args[i]);
+      }
+      break;
+
+    case SVR_CHR_KEYS_CLEAR:
+      mkey_keys_clear();
+      break;
+
+    case SVR_CHR_KEYS_COMMIT:
+      mkey_keys_pending(&count);
+      if (mkey_keys_commit() != ESP_OK) {
+        return GATT_SVR_KEYS_ERR_STORAGE;
+      }
+      ESP_LOGI(LOG_TAG_GATT_SVR, "Key batch of conn %d committed (%u keys)",
+               conn_handle, count);
+      keys_owner = BLE_HS_CONN_HANDLE_NONE;
+      gap_scan_open(false);
+      break;
+
+    case SVR_CHR_KEYS_ABORT:
+      mkey_keys_abort();
+      keys_owner = BLE_HS_CONN_HANDLE_NONE;
+      gap_scan_open(false);
+      break;
+
+    default:
+      return BLE_ATT_ERR_REQ_NOT_SUPPORTED;
+  }
+  return 0;
+}
+
+static int gatt_svr_chr_keys_control_cb(uint16_t conn_handle,
+                                        uint16_t attr_handle,
+                                        struct ble_gatt_access_ctxt *ctxt,
+                                        void *arg) {
+  // host task only, like every other access callback
+  static uint8_t req[GATT_SVR_KEYS_CONTROL_MAX_LEN];
+  uint16_t req_len;
+  int rc;
+
+  switch (ctxt->op) {
+    case BLE_GATT_ACCESS_OP_READ_CHR:
+      return keys_control_read(ctxt->om);
+
+    case BLE_GATT_ACCESS_OP_WRITE_CHR:
+      rc = gatt_svr_chr_write(ctxt->om, 1, sizeof(req), req, &req_len);
+      if (rc != 0) {
+        return rc;
+      }
+      return keys_control_write(conn_handle, req, req_len);
+
+    default:
+      break;
+  }
+
+  assert(0);
+  return BLE_ATT_ERR_UNLIKELY;
+}
+
+static int gatt_svr_chr_ota_data_cb(uint16_t conn_handle, uint16_t attr_handle,
+                                    struct ble_gatt_access_ctxt *ctxt,
+                                    void *arg) {
+  const uint16_t len = OS_MBUF_PKTLEN(ctxt->om);
+  gatt_svr_conn_t *conn;
+
+  if (!ota_updating || ota.owner != conn_handle) {
+    // outside its own session a client's data writes carry the packet size
+    if (len < 1 || len > OTA_WRITER_BUF_SIZE) {
+      return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    conn = conn_get(conn_handle, true);
+    if (conn == NULL) {
+      return BLE_ATT_ERR_INSUFFICIENT_RES;
     }
+    memset(conn->data_val, 0, sizeof(conn->data_val));
+    os_mbuf_copydata(ctxt->om, 0, len < sizeof(conn->data_val) ? len : sizeof(conn->data_val),
+                     conn->data_val);
+    return 0;
+  }
+
+  return gatt_svr_ota_data_in(conn_handle, ctxt->om, 0, len);
+}
+
+static int ota_data_in(uint16_t conn_handle, const struct os_mbuf *om,
+                       uint16_t off, uint16_t len) {
+  ota_writer_buf_t *buf;
+  uint32_t offset;
+  uint32_t crc;
+
+  if (!ota_updating || ota.owner != conn_handle) {
+    return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+  }
+  if (len < (ota.framed ? GATT_SVR_OTA_FRAME_HDR_LEN + 1 : 1) ||
+      len > OTA_WRITER_BUF_SIZE) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  // only copy the packet into a pool buffer, flash is written by the
+  // OTA writer task so the NimBLE host is never blocked on erase/program
+  buf = ota_acquire_buf();
+  if (buf == NULL) {
+    return BLE_ATT_ERR_INSUFFICIENT_RES;
+  }
+
+  if (os_mbuf_copydata(om, off, len, buf->data) != 0) {
+    ota_writer_release(buf);
+    return BLE_ATT_ERR_UNLIKELY;
+  }
+  buf->len = len;
 
-    num_pkgs_received++;
-    ESP_LOGI(LOG_TAG_GATT_SVR, "Received packet %d", num_pkgs_received);
+  if (ota.framed) {
+    // v2 framing: the header says where the payload belongs, so loss,
+    // duplication and corruption are caught here instead of at esp_ota_end()
+    offset = get_le32(&buf->data[0]);
+    crc = get_le32(&buf->data[4]);
+    buf->len -= GATT_SVR_OTA_FRAME_HDR_LEN;
+    memmove(buf->data, buf->data + GATT_SVR_OTA_FRAME_HDR_LEN, buf->len);
+    if (esp_rom_crc32_le(0, buf->data, buf->len) != crc) {
+      ESP_LOGW(LOG_TAG_GATT_SVR, "Bad frame CRC at %lu", (unsigned long)offset);
+      ota.frames_bad++;
+      ota_frame_drop(buf);
+      ota_report_gap(false);
+      return 0;
+    }
+    // frame headers and frames that failed their CRC are not image bytes
+    ota.rx_bytes += buf->len;
+    ota_frame_accept(buf, offset, buf->len);
+  } else {
+    ota.rx_bytes += len;
+    ota_writer_submit(buf);
   }
+  ota.num_pkgs++;
+  ESP_LOGD(LOG_TAG_GATT_SVR, "Received packet %d", ota.num_pkgs);
+
+  return 0;
+}
 
+int gatt_svr_ota_data_in(uint16_t conn_handle, const struct os_mbuf *om,
+                         uint16_t off, uint16_t len) {
+  const int64_t t0 = esp_timer_get_time();
+  const int rc = ota_data_in(conn_handle, om, off, len);
+  const uint32_t dt = esp_timer_get_time() - t0;
+
+  // time the host task spends per packet, including waits for a pool buffer
+  if (rc == 0) {
+    ota.rx_packets++;
+    ota.rx_cb_us += dt;
+    if (dt > ota.rx_cb_max_us) {
+      ota.rx_cb_max_us = dt;
+    }
+  }
   return rc;
 }
 
+void gatt_svr_ota_data_abort(uint16_t conn_handle) {
+  if (!ota_updating || ota.owner != conn_handle) {
+    return;
+  }
+  // the image has a hole now: nothing more may reach flash
+  ota_writer_fail(ESP_ERR_INVALID_SIZE);
+  ota_session_fail(ESP_ERR_INVALID_SIZE);
+}
+
 void gatt_svr_init() {
+  static const ota_writer_cbs_t writer_cbs = {
+      .on_error = ota_write_error_cb,
+      .on_credit = ota_credit_cb,
+      .on_checkpoint = ota_checkpoint_cb,
+      .on_hash = ota_hash_cb,
+      .on_free = ota_l2cap_pool_freed,
+  };
+  ble_npl_event_init(&ota_write_error_ev, ota_write_error_apply, NULL);
+  ESP_ERROR_CHECK(ota_writer_init(&writer_cbs));
+  for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+    conns[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+  }
+  ota_l2cap_init();
+
   ble_svc_gap_init();
   ble_svc_gatt_init();
   ble_gatts_count_cfg(gatt_svr_svcs);
   ble_gatts_add_svcs(gatt_svr_svcs);
-}
\ No newline at end of file
+}
+
+void gatt_svr_conn_closed(uint16_t conn_handle) {
+  gatt_svr_conn_t *conn = conn_get(conn_handle, false);
+
+  if (conn) {
+    conn->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+  }
+  if (keys_owner == conn_handle) {
+    // an unfinished enrollment batch is never applied
+    ESP_LOGW(LOG_TAG_GATT_SVR, "Key batch of conn %d dropped", conn_handle);
+    mkey_keys_abort();
+    keys_owner = BLE_HS_CONN_HANDLE_NONE;
+    gap_scan_open(false);
+  }
+  if (ota.owner == conn_handle) {
+    ESP_LOGW(LOG_TAG_GATT_SVR, "OTA owner conn %d disconnected, dropping the session",
+             conn_handle);
+    ota_session_close();
+  }
+}
+
+uint8_t gatt_svr_ota_progress(void) {
+  ota_writer_stats_t wstats;
+  uint64_t done;
+
+  if (!ota_updating || ota.image_size == 0) {
+    return 0xFF;
+  }
+  // checkpoints move ota.image.offset, the session start stays put
+  ota_writer_stats(&wstats);
+  done = (uint64_t)ota.start_offset + wstats.written;
+  return done >= ota.image_size ? 100 : done * 100 / ota.image_size;
+}
@@ -16,6 +16,66 @@
 #define GATT_MANUFACTURER_NAME_UUID 0x2A29
 #define GATT_MODEL_NUMBER_UUID      0x2A24
 
+// OTA control writes are [opcode] [args...]
+#define GATT_SVR_OTA_CONTROL_MAX_LEN 16
+
+// SVR_CHR_OTA_CONTROL_REQUEST flags (first argument byte)
+#define OTA_REQUEST_F_STREAM        0x01  // write-without-response + credits
+#define OTA_REQUEST_F_LZ            0x02  // data is an ota_lz compressed stream
+#define OTA_REQUEST_F_FRAMED        0x04  // data packets carry a frame header
+#define OTA_REQUEST_F_SUPPORTED \
+  (OTA_REQUEST_F_STREAM | OTA_REQUEST_F_LZ | OTA_REQUEST_F_FRAMED)
+
+// Framed sessions: every data packet is [stream offset u32][crc32 u32][payload]
+// with the CRC32 taken over the payload only
+#define GATT_SVR_OTA_FRAME_HDR_LEN  8
+
+// Frames that arrive ahead of a gap are held back (in pool buffers) until the
+// missing ones are retransmitted
+#define GATT_SVR_OTA_REORDER_SLOTS  4
+
+// OTA link characteristic / LINK notification payload:
+// [tx phy] [rx phy] [interval u16] [latency u16] [timeout u16]
+// [max tx octets u16] [max rx octets u16] [mtu u16] [suggested chunk u16]
+#define GATT_SVR_OTA_LINK_LEN       18
+
+// OTA stats characteristic payload (all u32): [image bytes received, frame
+// headers excluded] [rx ms] [written] [erase ahead] [min erase ahead]
+// [pre-erased] [stalled erases] [stall us]
+// [packets] [avg rx callback us] [max rx callback us] [writer busy us]
+// [slowest writer job us] [fewest free pool buffers]
+#define GATT_SVR_OTA_STATS_LEN      56
+
+// OTA radio characteristic payload, radio time since boot as gap.c hands it
+// out (u32 ms unless noted): [scan profile u8, gap_scan_profile_t] [scan on]
+// [advertising] [busy links] [total], then per scan profile [ms in profile]
+// [scan on]
+#define GATT_SVR_OTA_RADIO_LEN      (1 + 4 * (4 + 2 * GAP_SCAN_PROFILE_COUNT))
+
+// Block hashes carried by a single SVR_CHR_OTA_CONTROL_HASHES notification
+// (further limited by the ATT MTU of the link).
+#define GATT_SVR_OTA_HASHES_MAX     32
+
+// Keys control writes are [opcode] [records...]: PUT carries mkey_key_t
+// records, DEL 6-byte addresses, as many as fit in one write
+#define GATT_SVR_KEYS_CONTROL_MAX_LEN (1 + 24 * 20)
+
+// Keys control read: [enrolled u16] [enabled u16] [batch size u16, 0xFFFF
+// without a batch] [generation u32] [enrollment allowed u8]
+#define GATT_SVR_KEYS_STATUS_LEN    11
+
+// Keys scan read (u32 unless noted): [filter u8, gap_scan_filter_t]
+// [accept list entries u8], then per filter (accept list, open): [reports]
+// [enrolled tag hits] [ms active]
+#define GATT_SVR_KEYS_SCAN_LEN      26
+
+// Keys control failures, returned as ATT application errors
+#define GATT_SVR_KEYS_ERR_DENIED    0x80  // no key present with IGN on
+#define GATT_SVR_KEYS_ERR_NO_BATCH  0x81  // BEGIN first
+#define GATT_SVR_KEYS_ERR_BUSY      0x82  // another client has a batch open
+#define GATT_SVR_KEYS_ERR_FULL      0x83  // MKEY_KEYS_MAX reached
+#define GATT_SVR_KEYS_ERR_STORAGE   0x84  // NVS write failed, batch kept
+
 /*--> EXTERNAL VARIALBLE <--*/
  extern  bool ota_updating;
 
@@ -24,14 +84,32 @@
 *****************************************************/
 typedef enum {
   SVR_CHR_OTA_CONTROL_NOP,
-  SVR_CHR_OTA_CONTROL_REQUEST,
+  SVR_CHR_OTA_CONTROL_REQUEST,     // [op] [flags] [image size u32], both optional
   SVR_CHR_OTA_CONTROL_REQUEST_ACK,
   SVR_CHR_OTA_CONTROL_REQUEST_NAK,
   SVR_CHR_OTA_CONTROL_DONE,
   SVR_CHR_OTA_CONTROL_DONE_ACK,
   SVR_CHR_OTA_CONTROL_DONE_NAK,
+  SVR_CHR_OTA_CONTROL_DATA_NAK,   // flash write failed, session aborted
+  SVR_CHR_OTA_CONTROL_CREDIT,     // notify: [op] [credits u16 le]
+  SVR_CHR_OTA_CONTROL_RESUME,     // [op] [flags] [image size u32] [crc32 u32]
+  SVR_CHR_OTA_CONTROL_RESUME_ACK, // notify: [op] [resume offset u32 le]
+  SVR_CHR_OTA_CONTROL_HASH_REQ,   // [op] [first block u16] [block count u16]
+  SVR_CHR_OTA_CONTROL_HASHES,     // notify: [op] [first block u16] [n] [n * hash]
+  SVR_CHR_OTA_CONTROL_COPY,       // [op] [length u32] ([offset u32] if framed)
+  SVR_CHR_OTA_CONTROL_GAP,        // notify: [op] [offset u32] [length u32, 0 = to the end]
+  SVR_CHR_OTA_CONTROL_LINK,       // notify: [op] [OTA link payload]
 } svr_chr_ota_control_val_t;
 
+typedef enum {
+  SVR_CHR_KEYS_BEGIN = 1,         // open a batch on a copy of the table
+  SVR_CHR_KEYS_PUT,               // [op] [n * mkey_key_t], add or replace
+  SVR_CHR_KEYS_DEL,               // [op] [n * addr], unknown ones are ignored
+  SVR_CHR_KEYS_CLEAR,             // drop every key of the batch
+  SVR_CHR_KEYS_COMMIT,            // write NVS once and apply
+  SVR_CHR_KEYS_ABORT,
+} svr_chr_keys_op_t;
+
 // service: OTA Service
 // f505f04b-2066-5069-8775-830fcfc57339
 static const ble_uuid128_t gatt_svr_svc_ota_uuid =
@@ -46,6 +124,42 @@ static const ble_uuid128_t gatt_svr_chr_ota_control_uuid =
 
 
                      
+// characteristic: OTA Link (negotiated link parameters)
+// a7c3e1d2-5b8f-4c6e-9d1a-2f4b6e8c0a13
+static const ble_uuid128_t gatt_svr_chr_ota_link_uuid =
+    BLE_UUID128_INIT(0x13, 0x0a, 0x8c, 0x6e, 0x4b, 0x2f, 0x1a, 0x9d, 0x6e, 0x4c,
+                     0x8f, 0x5b, 0xd2, 0xe1, 0xc3, 0xa7);
+
+// characteristic: OTA Stats (transfer, pre-erase and stall counters)
+// 3e9b5c71-2d4a-4f86-b0c3-7a1e5d9f2b64
+static const ble_uuid128_t gatt_svr_chr_ota_stats_uuid =
+    BLE_UUID128_INIT(0x64, 0x2b, 0x9f, 0x5d, 0x1e, 0x7a, 0xc3, 0xb0, 0x86, 0x4f,
+                     0x4a, 0x2d, 0x71, 0x5c, 0x9b, 0x3e);
+
+// characteristic: OTA Radio (radio arbiter counters)
+// 9b61c3e5-2f8a-4d17-8c4e-6a0d3b7f5e92
+static const ble_uuid128_t gatt_svr_chr_ota_radio_uuid =
+    BLE_UUID128_INIT(0x92, 0x5e, 0x7f, 0x3b, 0x0d, 0x6a, 0x4e, 0x8c, 0x17, 0x4d,
+                     0x8a, 0x2f, 0xe5, 0xc3, 0x61, 0x9b);
+
+// service: MKEY Keys (enrolled tag table)
+// 6a1f3c9e-8b27-4d05-a4e1-93c7b2d05f18
+static const ble_uuid128_t gatt_svr_svc_keys_uuid =
+    BLE_UUID128_INIT(0x18, 0x5f, 0xd0, 0xb2, 0xc7, 0x93, 0xe1, 0xa4, 0x05, 0x4d,
+                     0x27, 0x8b, 0x9e, 0x3c, 0x1f, 0x6a);
+
+// characteristic: Keys Control
+// 0c7e5a2b-91d4-4f63-8e0a-b5d2c4f71a96
+static const ble_uuid128_t gatt_svr_chr_keys_control_uuid =
+    BLE_UUID128_INIT(0x96, 0x1a, 0xf7, 0xc4, 0xd2, 0xb5, 0x0a, 0x8e, 0x63, 0x4f,
+                     0xd4, 0x91, 0x2b, 0x5a, 0x7e, 0x0c);
+
+// characteristic: Keys Scan (report counters of the scan filter)
+// 4d2e8f1a-6c3b-4a97-b5e0-1f7c9d3a2e64
+static const ble_uuid128_t gatt_svr_chr_keys_scan_uuid =
+    BLE_UUID128_INIT(0x64, 0x2e, 0x3a, 0x9d, 0x7c, 0x1f, 0xe0, 0xb5, 0x97, 0x4a,
+                     0x3b, 0x6c, 0x1a, 0x8f, 0x2e, 0x4d);
+
 // characteristic: OTA Data
 // bdda975f-9e48-5c04-b67e-f017f019b150
 static const ble_uuid128_t gatt_svr_chr_ota_data_uuid =
@@ -53,4 +167,24 @@ static const ble_uuid128_t gatt_svr_chr_ota_data_uuid =
                      0x48, 0x9e, 0x5f, 0x97, 0xda, 0xbd);
 
 
-void gatt_svr_init();
\ No newline at end of file
+void gatt_svr_init();
+
+// Called by the GAP layer whenever PHY, data length, MTU or connection
+// parameters of conn_handle change.
+void gatt_svr_link_changed(uint16_t conn_handle);
+
+// Releases the per-client state of conn_handle; if it owned the OTA slot the
+// session is aborted (a resume checkpoint is kept).
+void gatt_svr_conn_closed(uint16_t conn_handle);
+
+// Feeds one OTA data packet (len bytes of om from off) from conn_handle into
+// the current session. Shared by the GATT data characteristic and the L2CAP
+// channel; returns 0 or a BLE_ATT_ERR_* code.
+int gatt_svr_ota_data_in(uint16_t conn_handle, const struct os_mbuf *om,
+                         uint16_t off, uint16_t len);
+// Ends the session of conn_handle with DATA_NAK: a transport lost part of
+// the data it had already accepted (e.g. the tail of an L2CAP SDU).
+void gatt_svr_ota_data_abort(uint16_t conn_handle);
+// Image bytes programmed so far in percent (resumed part included), 0xFF
+// without an OTA session or when the client did not announce the image size.
+uint8_t gatt_svr_ota_progress(void);
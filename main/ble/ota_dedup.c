@@ -0,0 +1,38 @@
+#include "ota_dedup.h"
+
+#include <string.h>
+
+#include "mbedtls/sha256.h"
+
+esp_err_t ota_dedup_hash_block(const esp_partition_t *part, uint32_t block,
+                               uint8_t *scratch, size_t scratch_len,
+                               uint8_t hash[OTA_DEDUP_HASH_LEN]) {
+  const uint32_t start = block * OTA_DEDUP_BLOCK_SIZE;
+  mbedtls_sha256_context sha;
+  uint8_t digest[32];
+  esp_err_t err = ESP_OK;
+
+  if (start + OTA_DEDUP_BLOCK_SIZE > part->size) {
+    memset(hash, 0, OTA_DEDUP_HASH_LEN);
+    return ESP_OK;
+  }
+
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  for (uint32_t done = 0; done < OTA_DEDUP_BLOCK_SIZE; done += scratch_len) {
+    size_t n = OTA_DEDUP_BLOCK_SIZE - done;
+    if (n > scratch_len) {
+      n = scratch_len;
+    }
+    err = esp_partition_read(part, start + done, scratch, n);
+    if (err != ESP_OK) {
+      break;
+    }
+    mbedtls_sha256_update(&sha, scratch, n);
+  }
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+
+  memcpy(hash, digest, OTA_DEDUP_HASH_LEN);
+  return err;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+
+// Granularity of the dedup protocol: the client compares the new image with
+// the running one block by block and only sends blocks that differ.
+#define OTA_DEDUP_BLOCK_SIZE  4096
+
+// Truncated SHA-256 per block.
+#define OTA_DEDUP_HASH_LEN    8
+
+/****************************************************
+ * API
+*****************************************************/
+
+// Hashes block `block` of `part`, reading flash through `scratch`. Blocks past
+// the end of the partition hash to all zeros.
+esp_err_t ota_dedup_hash_block(const esp_partition_t *part, uint32_t block,
+                               uint8_t *scratch, size_t scratch_len,
+                               uint8_t hash[OTA_DEDUP_HASH_LEN]);
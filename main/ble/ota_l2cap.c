@@ -0,0 +1,165 @@
+#include "ota_l2cap.h"
+#include "gatt_svr.h"
+#include "ota_writer.h"
+
+#include "esp_log.h"
+#include "host/ble_l2cap.h"
+#include "nimble/nimble_port.h"
+
+#if CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM > 0
+
+typedef struct {
+  struct ble_l2cap_chan *chan;
+  uint16_t conn_handle;
+  uint32_t sdus;
+  uint32_t rx_waits;        // credits held back until the pool had room
+  volatile bool rx_wait;    // next receive buffer not posted yet
+  struct ble_npl_event pool_ev;
+} ota_l2cap_ctx_t;
+
+static ota_l2cap_ctx_t s_l2cap;
+
+// Gives the peer room for the next SDU (this is what returns its credits).
+static int ota_l2cap_rx_ready(struct ble_l2cap_chan *chan) {
+  struct os_mbuf *sdu;
+  int rc;
+
+  sdu = os_msys_get_pkthdr(OTA_L2CAP_SDU_SIZE, 0);
+  if (sdu == NULL) {
+    ESP_LOGE(LOG_TAG_OTA_L2CAP, "No mbuf for the next SDU");
+    return BLE_HS_ENOMEM;
+  }
+  rc = ble_l2cap_recv_ready(chan, sdu);
+  if (rc != 0) {
+    os_mbuf_free_chain(sdu);
+  }
+  return rc;
+}
+
+// Posts the next receive buffer once the pool can take a whole SDU. The
+// flag goes up before the count is read, so a buffer freed in between still
+// finds it and posts the pool event.
+static void ota_l2cap_rx_next(void) {
+  if (s_l2cap.chan == NULL) {
+    s_l2cap.rx_wait = false;
+    return;
+  }
+  s_l2cap.rx_wait = true;
+  if (ota_writer_free_count() < OTA_L2CAP_SDU_BUFS) {
+    return;
+  }
+  s_l2cap.rx_wait = false;
+  if (ota_l2cap_rx_ready(s_l2cap.chan) != 0) {
+    // no mbuf: try again when the next buffer is freed
+    s_l2cap.rx_wait = true;
+  }
+}
+
+static void ota_l2cap_pool_apply(struct ble_npl_event *ev) {
+  if (s_l2cap.rx_wait) {
+    ota_l2cap_rx_next();
+  }
+}
+
+static void ota_l2cap_rx(struct os_mbuf *sdu) {
+  const uint16_t len = OS_MBUF_PKTLEN(sdu);
+  int rc;
+
+  for (uint16_t off = 0; off < len; off += OTA_WRITER_BUF_SIZE) {
+    const uint16_t n = len - off > OTA_WRITER_BUF_SIZE ? OTA_WRITER_BUF_SIZE
+                                                       : len - off;
+    rc = gatt_svr_ota_data_in(s_l2cap.conn_handle, sdu, off, n);
+    if (rc != 0) {
+      // the peer got its credit back for the whole SDU: whatever of it did
+      // not make it is lost for good
+      ESP_LOGW(LOG_TAG_OTA_L2CAP, "SDU %lu dropped at %u/%u (rc=%d)",
+               (unsigned long)s_l2cap.sdus, off, len, rc);
+      gatt_svr_ota_data_abort(s_l2cap.conn_handle);
+      break;
+    }
+  }
+  s_l2cap.sdus++;
+}
+
+static int ota_l2cap_event(struct ble_l2cap_event *event, void *arg) {
+  switch (event->type) {
+    case BLE_L2CAP_EVENT_COC_ACCEPT:
+      // a single OTA channel at a time
+      if (s_l2cap.chan != NULL) {
+        return BLE_HS_EBUSY;
+      }
+      return ota_l2cap_rx_ready(event->accept.chan);
+
+    case BLE_L2CAP_EVENT_COC_CONNECTED:
+      if (event->connect.status != 0) {
+        ESP_LOGW(LOG_TAG_OTA_L2CAP, "Channel setup failed (status=%d)",
+                 event->connect.status);
+        break;
+      }
+      s_l2cap.chan = event->connect.chan;
+      s_l2cap.conn_handle = event->connect.conn_handle;
+      s_l2cap.sdus = 0;
+      s_l2cap.rx_waits = 0;
+      ESP_LOGI(LOG_TAG_OTA_L2CAP, "OTA channel open (conn=%d)",
+               event->connect.conn_handle);
+      break;
+
+    case BLE_L2CAP_EVENT_COC_DISCONNECTED:
+      if (event->disconnect.chan == s_l2cap.chan) {
+        ESP_LOGI(LOG_TAG_OTA_L2CAP,
+                 "OTA channel closed after %lu SDUs (%lu waited for the pool)",
+                 (unsigned long)s_l2cap.sdus, (unsigned long)s_l2cap.rx_waits);
+        s_l2cap.chan = NULL;
+        s_l2cap.rx_wait = false;
+      }
+      break;
+
+    case BLE_L2CAP_EVENT_COC_DATA_RECEIVED:
+      if (event->receive.sdu_rx != NULL) {
+        ota_l2cap_rx(event->receive.sdu_rx);
+        os_mbuf_free_chain(event->receive.sdu_rx);
+      }
+      ota_l2cap_rx_next();
+      s_l2cap.rx_waits += s_l2cap.rx_wait;
+      break;
+
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+void ota_l2cap_init(void) {
+  int rc;
+
+  ble_npl_event_init(&s_l2cap.pool_ev, ota_l2cap_pool_apply, NULL);
+  rc = ble_l2cap_create_server(OTA_L2CAP_PSM, OTA_L2CAP_SDU_SIZE,
+                               ota_l2cap_event, NULL);
+  if (rc != 0) {
+    ESP_LOGE(LOG_TAG_OTA_L2CAP, "Failed to register PSM 0x%04x (rc=%d)",
+             OTA_L2CAP_PSM, rc);
+    return;
+  }
+  ESP_LOGI(LOG_TAG_OTA_L2CAP, "OTA data channel on PSM 0x%04x", OTA_L2CAP_PSM);
+}
+
+bool ota_l2cap_connected(uint16_t conn_handle) {
+  return s_l2cap.chan != NULL && s_l2cap.conn_handle == conn_handle;
+}
+
+void ota_l2cap_pool_freed(void) {
+  if (s_l2cap.rx_wait) {
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &s_l2cap.pool_ev);
+  }
+}
+
+#else
+
+void ota_l2cap_init(void) {}
+
+bool ota_l2cap_connected(uint16_t conn_handle) { return false; }
+
+void ota_l2cap_pool_freed(void) {}
+
+#endif
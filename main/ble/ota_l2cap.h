@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ota_writer.h"
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define LOG_TAG_OTA_L2CAP "ota_l2cap"
+
+// LE credit based channel for the OTA data path (dynamic PSM range). The OTA
+// session is still driven through the GATT control characteristic; only the
+// data packets move to the channel.
+#define OTA_L2CAP_PSM       0x00F5
+
+// Largest SDU accepted. Each SDU is cut into OTA_WRITER_BUF_SIZE packets that
+// are handled exactly like GATT data writes.
+#define OTA_L2CAP_SDU_SIZE  2048
+
+// Pool buffers one full SDU takes. The channel only returns a credit (posts
+// the next receive buffer) once that many are free, so an SDU never waits on
+// the writer inside the host task.
+#define OTA_L2CAP_SDU_BUFS \
+  ((OTA_L2CAP_SDU_SIZE + OTA_WRITER_BUF_SIZE - 1) / OTA_WRITER_BUF_SIZE)
+
+/****************************************************
+ * API
+*****************************************************/
+
+// Registers the L2CAP server. No-op when CoC support is disabled in sdkconfig.
+void ota_l2cap_init(void);
+
+// True while conn_handle has the OTA channel open.
+bool ota_l2cap_connected(uint16_t conn_handle);
+
+// The writer put a buffer back in the pool (any task): a credit held back for
+// lack of room is returned from the host task.
+void ota_l2cap_pool_freed(void);
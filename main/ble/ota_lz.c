@@ -0,0 +1,100 @@
+#include "ota_lz.h"
+
+#define OTA_LZ_WINDOW_MASK ((1 << OTA_LZ_WINDOW_BITS) - 1)
+
+typedef enum {
+  OTA_LZ_TAG = 0,
+  OTA_LZ_LITERAL,
+  OTA_LZ_BACKREF_INDEX,
+  OTA_LZ_BACKREF_COUNT,
+} ota_lz_state_t;
+
+static const uint8_t state_bits[] = {
+    [OTA_LZ_TAG] = 1,
+    [OTA_LZ_LITERAL] = 8,
+    [OTA_LZ_BACKREF_INDEX] = OTA_LZ_WINDOW_BITS,
+    [OTA_LZ_BACKREF_COUNT] = OTA_LZ_LOOKAHEAD_BITS,
+};
+
+void ota_lz_reset(ota_lz_decoder_t *dec, ota_lz_sink_t sink) {
+  dec->produced = 0;
+  dec->bit_acc = 0;
+  dec->bit_cnt = 0;
+  dec->state = OTA_LZ_TAG;
+  dec->index = 0;
+  dec->out_len = 0;
+  dec->sink = sink;
+}
+
+esp_err_t ota_lz_flush(ota_lz_decoder_t *dec) {
+  esp_err_t err = ESP_OK;
+
+  if (dec->out_len) {
+    err = dec->sink(dec->out, dec->out_len);
+    dec->out_len = 0;
+  }
+  return err;
+}
+
+static inline esp_err_t ota_lz_emit(ota_lz_decoder_t *dec, uint8_t byte) {
+  dec->window[dec->produced & OTA_LZ_WINDOW_MASK] = byte;
+  dec->produced++;
+  dec->out[dec->out_len++] = byte;
+
+  if (dec->out_len == sizeof(dec->out)) {
+    return ota_lz_flush(dec);
+  }
+  return ESP_OK;
+}
+
+esp_err_t ota_lz_decode(ota_lz_decoder_t *dec, const uint8_t *in, uint32_t len) {
+  uint32_t pos = 0;
+  esp_err_t err;
+
+  while (1) {
+    // pull whole bytes until the current field is complete
+    const uint8_t need = state_bits[dec->state];
+    while (dec->bit_cnt < need) {
+      if (pos == len) {
+        return ESP_OK;
+      }
+      dec->bit_acc = (dec->bit_acc << 8) | in[pos++];
+      dec->bit_cnt += 8;
+    }
+    const uint32_t val = (dec->bit_acc >> (dec->bit_cnt - need)) & ((1u << need) - 1);
+    dec->bit_cnt -= need;
+
+    switch (dec->state) {
+      case OTA_LZ_TAG:
+        dec->state = val ? OTA_LZ_LITERAL : OTA_LZ_BACKREF_INDEX;
+        break;
+
+      case OTA_LZ_LITERAL:
+        err = ota_lz_emit(dec, (uint8_t)val);
+        if (err != ESP_OK) {
+          return err;
+        }
+        dec->state = OTA_LZ_TAG;
+        break;
+
+      case OTA_LZ_BACKREF_INDEX:
+        dec->index = val + 1;
+        if (dec->index > dec->produced) {
+          return ESP_ERR_INVALID_CRC;  // reference before the start of the image
+        }
+        dec->state = OTA_LZ_BACKREF_COUNT;
+        break;
+
+      case OTA_LZ_BACKREF_COUNT:
+        for (uint32_t i = 0; i <= val; i++) {
+          err = ota_lz_emit(dec, dec->window[(dec->produced - dec->index) &
+                                             OTA_LZ_WINDOW_MASK]);
+          if (err != ESP_OK) {
+            return err;
+          }
+        }
+        dec->state = OTA_LZ_TAG;
+        break;
+    }
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+
+// Stream format: heatshrink-compatible LZSS (`heatshrink -e -w 11 -l 4`),
+// produced on the host by py-client/compress_fw.py. The window is the only
+// history the decoder needs, so RAM use is bounded by 1 << WINDOW_BITS.
+#define OTA_LZ_WINDOW_BITS    11
+#define OTA_LZ_LOOKAHEAD_BITS 4
+#define OTA_LZ_OUT_CHUNK      512
+
+/****************************************************
+ * ESTRUCUTURES
+*****************************************************/
+
+// Receives decoded bytes in chunks of up to OTA_LZ_OUT_CHUNK.
+typedef esp_err_t (*ota_lz_sink_t)(const uint8_t *data, uint32_t len);
+
+typedef struct {
+  uint8_t window[1 << OTA_LZ_WINDOW_BITS];
+  uint8_t out[OTA_LZ_OUT_CHUNK];
+  uint32_t produced;   // total decoded bytes
+  uint32_t bit_acc;
+  uint8_t bit_cnt;
+  uint8_t state;
+  uint16_t index;
+  uint16_t out_len;
+  ota_lz_sink_t sink;
+} ota_lz_decoder_t;
+
+/****************************************************
+ * API
+*****************************************************/
+void ota_lz_reset(ota_lz_decoder_t *dec, ota_lz_sink_t sink);
+
+// Decodes the next piece of the compressed stream. Input can be split at any
+// byte boundary. Returns the first sink error or ESP_ERR_INVALID_CRC on a
+// corrupt stream.
+esp_err_t ota_lz_decode(ota_lz_decoder_t *dec, const uint8_t *in, uint32_t len);
+
+// Hands the pending decoded bytes to the sink.
+esp_err_t ota_lz_flush(ota_lz_decoder_t *dec);
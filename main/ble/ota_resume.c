@@ -0,0 +1,60 @@
+#include "ota_resume.h"
+
+#include "esp_log.h"
+#include "nvs.h"
+
+esp_err_t ota_resume_load(ota_resume_t *rec) {
+  nvs_handle_t nvs;
+  size_t len = sizeof(*rec);
+  esp_err_t err;
+
+  err = nvs_open(OTA_RESUME_NVS_NAMESPACE, NVS_READONLY, &nvs);
+  if (err != ESP_OK) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  err = nvs_get_blob(nvs, OTA_RESUME_NVS_KEY, rec, &len);
+  nvs_close(nvs);
+
+  if (err != ESP_OK || len != sizeof(*rec) || rec->magic != OTA_RESUME_MAGIC) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t ota_resume_save(const ota_resume_t *rec) {
+  nvs_handle_t nvs;
+  esp_err_t err;
+
+  err = nvs_open(OTA_RESUME_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG_OTA_RESUME, "nvs_open failed (%s)", esp_err_to_name(err));
+    return err;
+  }
+
+  err = nvs_set_blob(nvs, OTA_RESUME_NVS_KEY, rec, sizeof(*rec));
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG_OTA_RESUME, "Saving checkpoint failed (%s)",
+             esp_err_to_name(err));
+  }
+  return err;
+}
+
+void ota_resume_clear(void) {
+  nvs_handle_t nvs;
+
+  if (nvs_open(OTA_RESUME_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+    return;
+  }
+
+  if (nvs_erase_key(nvs, OTA_RESUME_NVS_KEY) == ESP_OK) {
+    nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define LOG_TAG_OTA_RESUME "ota_resume"
+
+#define OTA_RESUME_NVS_NAMESPACE "ota"
+#define OTA_RESUME_NVS_KEY       "resume"
+#define OTA_RESUME_MAGIC         0x4F544152  // "OTAR"
+
+/****************************************************
+ * ESTRUCUTURES
+*****************************************************/
+
+// Checkpoint of an interrupted update, persisted in NVS. An image is
+// identified by its size and CRC32 as announced by the client.
+typedef struct {
+  uint32_t magic;
+  uint32_t image_size;
+  uint32_t image_crc;
+  uint32_t partition_addr;  // update partition the bytes were written to
+  uint32_t offset;          // bytes committed to flash (sector aligned)
+  uint32_t crc;             // CRC32 of the image bytes [0, offset)
+} ota_resume_t;
+
+/****************************************************
+ * API
+*****************************************************/
+
+// Loads the stored checkpoint. Returns ESP_ERR_NOT_FOUND if there is none.
+esp_err_t ota_resume_load(ota_resume_t *rec);
+
+esp_err_t ota_resume_save(const ota_resume_t *rec);
+
+void ota_resume_clear(void);
@@ -0,0 +1,418 @@
+#include "ota_writer.h"
+#include "ota_dedup.h"
+#include "ota_lz.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+/****************************************************
+ * STATE
+*****************************************************/
+typedef struct {
+  QueueHandle_t free_q;  // ota_writer_buf_t * ready to be filled
+  QueueHandle_t data_q;  // ota_writer_buf_t * waiting for flash (NULL = flush)
+  SemaphoreHandle_t flushed;
+  TaskHandle_t task;
+  ota_writer_session_t session;
+  volatile esp_err_t err;
+  volatile bool active;   // between begin and the flush marker
+  // write cursor state, only touched by the writer task
+  uint32_t offset;
+  uint32_t crc;
+  uint32_t erased_end;
+  uint16_t credits_pending;
+  ota_writer_stats_t stats;
+  ota_writer_cbs_t cbs;
+} ota_writer_ctx_t;
+
+static ota_writer_buf_t s_bufs[OTA_WRITER_BUF_COUNT];
+static ota_writer_ctx_t s_writer;
+static ota_lz_decoder_t s_lz;
+
+static void ota_writer_task(void *arg);
+static void ota_writer_put_free(ota_writer_buf_t *buf);
+static void ota_writer_grant_credits(void);
+static void ota_writer_check(esp_err_t err);
+static esp_err_t ota_writer_program(const uint8_t *data, uint32_t len);
+static esp_err_t ota_writer_copy(uint32_t len, uint8_t *scratch);
+static void ota_writer_hash(const ota_writer_buf_t *job, uint8_t *scratch);
+static uint32_t ota_writer_erase_goal(void);
+static void ota_writer_erase_ahead(void);
+
+/****************************************************
+ * PUBLIC API
+*****************************************************/
+esp_err_t ota_writer_init(const ota_writer_cbs_t *cbs) {
+  if (s_writer.task != NULL) {
+    return ESP_OK;
+  }
+
+  s_writer.cbs = *cbs;
+  s_writer.free_q = xQueueCreate(OTA_WRITER_BUF_COUNT, sizeof(ota_writer_buf_t *));
+  s_writer.data_q = xQueueCreate(OTA_WRITER_BUF_COUNT + 1, sizeof(ota_writer_buf_t *));
+  s_writer.flushed = xSemaphoreCreateBinary();
+  if (!s_writer.free_q || !s_writer.data_q || !s_writer.flushed) {
+    ESP_LOGE(LOG_TAG_OTA_WRITER, "Failed to allocate writer queues");
+    return ESP_ERR_NO_MEM;
+  }
+
+  for (int i = 0; i < OTA_WRITER_BUF_COUNT; i++) {
+    ota_writer_buf_t *buf = &s_bufs[i];
+    xQueueSend(s_writer.free_q, &buf, 0);
+  }
+
+  BaseType_t ok = xTaskCreate(ota_writer_task, "ota_writer",
+                              OTA_WRITER_TASK_STACK, NULL,
+                              OTA_WRITER_TASK_PRIO, &s_writer.task);
+  if (ok != pdPASS) {
+    ESP_LOGE(LOG_TAG_OTA_WRITER, "Failed to start writer task");
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
+
+void ota_writer_begin(const ota_writer_session_t *session) {
+  // the pipeline is idle here (previous session flushed), so the cursor can
+  // be set from this task
+  s_writer.session = *session;
+  s_writer.offset = session->offset;
+  s_writer.crc = session->crc;
+  s_writer.erased_end = session->offset;
+  s_writer.credits_pending = 0;
+  s_writer.err = ESP_OK;
+  memset(&s_writer.stats, 0, sizeof(s_writer.stats));
+  s_writer.stats.erase_ahead_min = UINT32_MAX;
+  s_writer.stats.pool_min_free = OTA_WRITER_BUF_COUNT;
+  ota_lz_reset(&s_lz, ota_writer_program);
+  xSemaphoreTake(s_writer.flushed, 0);
+  s_writer.active = true;
+}
+
+ota_writer_buf_t *ota_writer_acquire(uint32_t timeout_ms) {
+  ota_writer_buf_t *buf = NULL;
+  const UBaseType_t free_bufs = uxQueueMessagesWaiting(s_writer.free_q);
+  if (free_bufs < s_writer.stats.pool_min_free) {
+    s_writer.stats.pool_min_free = free_bufs;
+  }
+  if (xQueueReceive(s_writer.free_q, &buf, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+    return NULL;
+  }
+  buf->op = OTA_WRITER_OP_DATA;
+  return buf;
+}
+
+uint16_t ota_writer_free_count(void) {
+  return uxQueueMessagesWaiting(s_writer.free_q);
+}
+
+void ota_writer_submit(ota_writer_buf_t *buf) {
+  xQueueSend(s_writer.data_q, &buf, portMAX_DELAY);
+}
+
+void ota_writer_release(ota_writer_buf_t *buf) {
+  xQueueSend(s_writer.free_q, &buf, portMAX_DELAY);
+}
+
+esp_err_t ota_writer_flush(uint32_t timeout_ms) {
+  ota_writer_buf_t *marker = NULL;
+
+  xQueueSend(s_writer.data_q, &marker, portMAX_DELAY);
+  if (xSemaphoreTake(s_writer.flushed, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+    ESP_LOGE(LOG_TAG_OTA_WRITER, "Timeout draining the OTA pipeline");
+    return ESP_ERR_TIMEOUT;
+  }
+
+  return s_writer.err;
+}
+
+void ota_writer_fail(esp_err_t err) {
+  if (s_writer.err == ESP_OK) {
+    s_writer.err = err;
+  }
+}
+
+esp_err_t ota_writer_status(void) { return s_writer.err; }
+
+void ota_writer_progress(uint32_t *offset, uint32_t *crc) {
+  *offset = s_writer.offset;
+  *crc = s_writer.crc;
+}
+
+void ota_writer_stats(ota_writer_stats_t *out) {
+  *out = s_writer.stats;
+  out->erase_ahead = s_writer.erased_end > s_writer.offset
+                         ? s_writer.erased_end - s_writer.offset
+                         : 0;
+  if (out->erase_ahead_min == UINT32_MAX) {
+    out->erase_ahead_min = 0;
+  }
+}
+
+/****************************************************
+ * INTERNALS
+*****************************************************/
+static void ota_writer_task(void *arg) {
+  ota_writer_buf_t *buf;
+
+  while (1) {
+    // undelivered credits are retried periodically, idle time goes to
+    // pre-erasing, otherwise sleep
+    TickType_t wait = portMAX_DELAY;
+    if (s_writer.credits_pending) {
+      wait = pdMS_TO_TICKS(OTA_WRITER_CREDIT_RETRY_MS);
+    }
+    if (ota_writer_erase_goal() > s_writer.erased_end &&
+        wait > pdMS_TO_TICKS(OTA_WRITER_ERASE_PERIOD_MS)) {
+      wait = pdMS_TO_TICKS(OTA_WRITER_ERASE_PERIOD_MS);
+    }
+    if (xQueueReceive(s_writer.data_q, &buf, wait) != pdTRUE) {
+      ota_writer_grant_credits();
+      ota_writer_erase_ahead();
+      continue;
+    }
+
+    if (buf == NULL) {
+      s_writer.active = false;
+      // push out the tail of a compressed stream
+      if (s_writer.session.compressed && s_writer.err == ESP_OK) {
+        ota_writer_check(ota_lz_flush(&s_lz));
+      }
+      // credits of an ended session are meaningless
+      s_writer.credits_pending = 0;
+      // flush marker: everything queued before it has been handled
+      xSemaphoreGive(s_writer.flushed);
+      continue;
+    }
+
+    if (buf->op == OTA_WRITER_OP_HASH) {
+      // read-only query, not part of the session's credit window
+      ota_writer_hash(buf, buf->data);
+      ota_writer_put_free(buf);
+      continue;
+    }
+
+    // once a write failed the rest of the session is dropped
+    if (s_writer.err == ESP_OK && buf->op != OTA_WRITER_OP_DROP) {
+      const int64_t t0 = esp_timer_get_time();
+      if (buf->op == OTA_WRITER_OP_COPY) {
+        ota_writer_check(ota_writer_copy(buf->arg, buf->data));
+      } else if (s_writer.session.compressed) {
+        ota_writer_check(ota_lz_decode(&s_lz, buf->data, buf->len));
+      } else {
+        ota_writer_check(ota_writer_program(buf->data, buf->len));
+      }
+      const uint32_t dt = esp_timer_get_time() - t0;
+      s_writer.stats.jobs++;
+      s_writer.stats.busy_us += dt;
+      if (dt > s_writer.stats.job_max_us) {
+        s_writer.stats.job_max_us = dt;
+      }
+    }
+
+    ota_writer_put_free(buf);
+
+    if (s_writer.session.grant_credits) {
+      s_writer.credits_pending++;
+      if (s_writer.credits_pending >= OTA_WRITER_CREDIT_BATCH ||
+          uxQueueMessagesWaiting(s_writer.data_q) == 0) {
+        ota_writer_grant_credits();
+      }
+    }
+  }
+}
+
+// Returns a handled buffer to the pool and tells whoever waits for room.
+static void ota_writer_put_free(ota_writer_buf_t *buf) {
+  xQueueSend(s_writer.free_q, &buf, portMAX_DELAY);
+  if (s_writer.cbs.on_free) {
+    s_writer.cbs.on_free();
+  }
+}
+
+// Latches the first error of the session and reports it once.
+static void ota_writer_check(esp_err_t err) {
+  if (err == ESP_OK || s_writer.err != ESP_OK) {
+    return;
+  }
+
+  if (err == ESP_ERR_INVALID_CRC) {
+    ESP_LOGE(LOG_TAG_OTA_WRITER, "Corrupt compressed stream");
+  }
+  s_writer.err = err;
+  if (s_writer.cbs.on_error) {
+    s_writer.cbs.on_error(err);
+  }
+}
+
+static void ota_writer_grant_credits(void) {
+  if (!s_writer.session.grant_credits || s_writer.err != ESP_OK) {
+    s_writer.credits_pending = 0;
+    return;
+  }
+
+  if (s_writer.credits_pending && s_writer.cbs.on_credit &&
+      s_writer.cbs.on_credit(s_writer.credits_pending)) {
+    s_writer.credits_pending = 0;
+  }
+}
+
+// Writes the next len bytes of the image at the cursor. Sectors are erased
+// lazily right before their first byte is programmed so a resumed session
+// never touches flash below its start offset.
+static esp_err_t ota_writer_program(const uint8_t *data, uint32_t len) {
+  const esp_partition_t *part = s_writer.session.partition;
+  const uint32_t end = s_writer.offset + len;
+  esp_err_t err;
+
+  if (end > part->size) {
+    ESP_LOGE(LOG_TAG_OTA_WRITER, "Image exceeds partition (%lu > %lu)",
+             (unsigned long)end, (unsigned long)part->size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  if (s_writer.erased_end - s_writer.offset < s_writer.stats.erase_ahead_min) {
+    s_writer.stats.erase_ahead_min = s_writer.erased_end - s_writer.offset;
+  }
+
+  if (end > s_writer.erased_end) {
+    // the pre-erase fell behind: the data path has to wait for flash
+    uint32_t erase_len = ((end - s_writer.erased_end + SPI_FLASH_SEC_SIZE - 1) /
+                          SPI_FLASH_SEC_SIZE) * SPI_FLASH_SEC_SIZE;
+    const int64_t t0 = esp_timer_get_time();
+    err = esp_partition_erase_range(part, s_writer.erased_end, erase_len);
+    if (err != ESP_OK) {
+      ESP_LOGE(LOG_TAG_OTA_WRITER, "Erase at 0x%lx failed (%s)!",
+               (unsigned long)s_writer.erased_end, esp_err_to_name(err));
+      return err;
+    }
+    s_writer.erased_end += erase_len;
+    s_writer.stats.stall_erases++;
+    s_writer.stats.stall_us += esp_timer_get_time() - t0;
+  }
+
+  // the sectors are erased above, so program the partition directly: an
+  // OTA handle begun with OTA_WITH_SEQUENTIAL_WRITES must not be written
+  // at an offset
+  err = esp_partition_write(part, s_writer.offset, data, len);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG_OTA_WRITER, "Program at 0x%lx failed (%s)!",
+             (unsigned long)s_writer.offset, esp_err_to_name(err));
+    return err;
+  }
+
+  // split the CRC at a checkpoint boundary so the reported CRC covers
+  // exactly [0, checkpoint)
+  const uint32_t next_ckpt =
+      (s_writer.offset / OTA_WRITER_CHECKPOINT_BYTES + 1) *
+      OTA_WRITER_CHECKPOINT_BYTES;
+  if (end >= next_ckpt) {
+    const uint32_t head = next_ckpt - s_writer.offset;
+    s_writer.crc = esp_rom_crc32_le(s_writer.crc, data, head);
+    if (s_writer.cbs.on_checkpoint) {
+      s_writer.cbs.on_checkpoint(next_ckpt, s_writer.crc);
+    }
+    s_writer.crc = esp_rom_crc32_le(s_writer.crc, data + head, len - head);
+  } else {
+    s_writer.crc = esp_rom_crc32_le(s_writer.crc, data, len);
+  }
+  s_writer.offset = end;
+  s_writer.stats.written += len;
+
+  return ESP_OK;
+}
+
+// How far the background eraser should get: the end of the announced image,
+// or a fixed lead over the cursor when the size is unknown.
+static uint32_t ota_writer_erase_goal(void) {
+  const esp_partition_t *part = s_writer.session.partition;
+  uint32_t goal;
+
+  if (!s_writer.active || s_writer.err != ESP_OK || part == NULL) {
+    return 0;
+  }
+
+  if (s_writer.session.image_size) {
+    goal = ((s_writer.session.image_size + SPI_FLASH_SEC_SIZE - 1) /
+            SPI_FLASH_SEC_SIZE) * SPI_FLASH_SEC_SIZE;
+  } else {
+    goal = s_writer.offset + OTA_WRITER_ERASE_AHEAD_BYTES;
+  }
+  return goal < part->size ? goal : part->size;
+}
+
+// Erases one sector in front of the cursor; runs only while the queue is
+// idle, so it never delays a packet by more than a single sector erase.
+static void ota_writer_erase_ahead(void) {
+  esp_err_t err;
+
+  if (ota_writer_erase_goal() <= s_writer.erased_end) {
+    return;
+  }
+
+  err = esp_partition_erase_range(s_writer.session.partition,
+                                  s_writer.erased_end, SPI_FLASH_SEC_SIZE);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG_OTA_WRITER, "Pre-erase at 0x%lx failed (%s)!",
+             (unsigned long)s_writer.erased_end, esp_err_to_name(err));
+    ota_writer_check(err);
+    return;
+  }
+  s_writer.erased_end += SPI_FLASH_SEC_SIZE;
+  s_writer.stats.bg_erased += SPI_FLASH_SEC_SIZE;
+}
+
+// Copies len bytes of the running image at the write cursor into the update
+// partition, as if the client had sent them.
+static esp_err_t ota_writer_copy(uint32_t len, uint8_t *scratch) {
+  const esp_partition_t *src = esp_ota_get_running_partition();
+  esp_err_t err;
+
+  if (s_writer.session.compressed || src == NULL ||
+      s_writer.offset + len > src->size) {
+    ESP_LOGE(LOG_TAG_OTA_WRITER, "Invalid copy of %lu bytes at 0x%lx",
+             (unsigned long)len, (unsigned long)s_writer.offset);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  while (len) {
+    const uint32_t n = len > OTA_WRITER_BUF_SIZE ? OTA_WRITER_BUF_SIZE : len;
+    err = esp_partition_read(src, s_writer.offset, scratch, n);
+    if (err != ESP_OK) {
+      ESP_LOGE(LOG_TAG_OTA_WRITER, "Read of running image at 0x%lx failed (%s)!",
+               (unsigned long)s_writer.offset, esp_err_to_name(err));
+      return err;
+    }
+    err = ota_writer_program(scratch, n);
+    if (err != ESP_OK) {
+      return err;
+    }
+    len -= n;
+  }
+
+  return ESP_OK;
+}
+
+static void ota_writer_hash(const ota_writer_buf_t *job, uint8_t *scratch) {
+  const esp_partition_t *src = esp_ota_get_running_partition();
+  uint8_t hash[OTA_DEDUP_HASH_LEN];
+
+  for (uint32_t i = 0; i < job->count; i++) {
+    if (ota_dedup_hash_block(src, job->arg + i, scratch, OTA_WRITER_BUF_SIZE,
+                             hash) != ESP_OK) {
+      // a zero hash never matches, so the client just sends that block
+      memset(hash, 0, sizeof(hash));
+    }
+    if (s_writer.cbs.on_hash) {
+      s_writer.cbs.on_hash(job->arg + i, hash, i + 1 == job->count);
+    }
+  }
+}
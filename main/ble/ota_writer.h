@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_ota_ops.h"
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define LOG_TAG_OTA_WRITER "ota_writer"
+
+// Number of pre-allocated packet buffers shared between the GATT callback and
+// the writer task. The BLE side can run this many packets ahead of flash.
+#define OTA_WRITER_BUF_COUNT          8
+#define OTA_WRITER_BUF_SIZE           512
+
+// How long the GATT callback may wait for a free buffer before rejecting the
+// write (backpressure towards the client).
+#define OTA_WRITER_ACQUIRE_TIMEOUT_MS 500
+
+// Upper bound for draining the pipeline on OTA DONE.
+#define OTA_WRITER_FLUSH_TIMEOUT_MS   5000
+
+// Streaming sessions: freed buffers are returned to the client as credits in
+// batches of this size (or as soon as the pipeline runs dry).
+#define OTA_WRITER_CREDIT_BATCH       (OTA_WRITER_BUF_COUNT / 2)
+#define OTA_WRITER_CREDIT_RETRY_MS    20
+
+// A resume checkpoint is reported every time the write cursor crosses a
+// multiple of this size. Must be a multiple of the flash sector size.
+#define OTA_WRITER_CHECKPOINT_BYTES   (32 * 1024)
+
+// Background pre-erase: while the queue is idle the writer erases one sector
+// ahead of the cursor per period, up to the announced image end (or this far
+// ahead of the cursor when the size is unknown).
+#define OTA_WRITER_ERASE_PERIOD_MS    10
+#define OTA_WRITER_ERASE_AHEAD_BYTES  (64 * 1024)
+
+#define OTA_WRITER_TASK_STACK         4096
+#define OTA_WRITER_TASK_PRIO          4
+
+/****************************************************
+ * ESTRUCUTURES
+*****************************************************/
+typedef enum {
+  OTA_WRITER_OP_DATA = 0,  // data[0, len) is the next chunk of the image
+  OTA_WRITER_OP_COPY,      // copy `arg` bytes of the running image at the cursor
+  OTA_WRITER_OP_HASH,      // hash `count` blocks of the running image from `arg`
+  OTA_WRITER_OP_DROP,      // discarded packet, only returns the buffer's credit
+} ota_writer_op_t;
+
+typedef struct {
+  uint8_t op;      // ota_writer_op_t, reset to OTA_WRITER_OP_DATA on acquire
+  uint16_t len;
+  uint32_t arg;
+  uint32_t count;
+  uint8_t data[OTA_WRITER_BUF_SIZE];
+} ota_writer_buf_t;
+
+// Called from the writer task the first time a flash write fails.
+typedef void (*ota_writer_error_cb_t)(esp_err_t err);
+
+// Called from the writer task to hand `credits` freed buffers back to a
+// streaming client. Returns false if they could not be delivered yet, in which
+// case the writer retries later.
+typedef bool (*ota_writer_credit_cb_t)(uint16_t credits);
+
+// Called from the writer task once [0, offset) is in flash; crc is the CRC32
+// of exactly those bytes.
+typedef void (*ota_writer_checkpoint_cb_t)(uint32_t offset, uint32_t crc);
+
+// Called from the writer task for every block of an OTA_WRITER_OP_HASH job;
+// `last` is set on the final block of the job.
+typedef void (*ota_writer_hash_cb_t)(uint32_t block, const uint8_t *hash,
+                                     bool last);
+
+// Called from the writer task each time it puts a buffer back in the pool.
+typedef void (*ota_writer_free_cb_t)(void);
+
+typedef struct {
+  ota_writer_error_cb_t on_error;
+  ota_writer_credit_cb_t on_credit;
+  ota_writer_checkpoint_cb_t on_checkpoint;
+  ota_writer_hash_cb_t on_hash;
+  ota_writer_free_cb_t on_free;
+} ota_writer_cbs_t;
+
+typedef struct {
+  const esp_partition_t *partition;
+  uint32_t offset;     // first image byte this session writes (sector aligned)
+  uint32_t crc;        // CRC32 of the image bytes before offset
+  uint32_t image_size; // announced (decompressed) image size, 0 if unknown
+  bool grant_credits;  // write-without-response streaming
+  bool compressed;     // buffers carry an ota_lz stream, not raw image bytes
+} ota_writer_session_t;
+
+typedef struct {
+  uint32_t written;         // image bytes programmed this session
+  uint32_t erase_ahead;     // erased bytes in front of the cursor right now
+  uint32_t erase_ahead_min; // smallest lead seen when programming
+  uint32_t bg_erased;       // bytes erased in the background
+  uint32_t stall_erases;    // erases the data path had to wait for
+  uint32_t stall_us;        // time spent in those erases
+  uint32_t jobs;            // data/copy jobs handled
+  uint32_t busy_us;         // writer time spent on those jobs
+  uint32_t job_max_us;      // slowest single job (decode + erase + program)
+  uint16_t pool_min_free;   // fewest free buffers seen on acquire
+} ota_writer_stats_t;
+
+/****************************************************
+ * API
+*****************************************************/
+
+// Allocates the buffer pool and starts the writer task.
+esp_err_t ota_writer_init(const ota_writer_cbs_t *cbs);
+
+// Arms the pipeline for a new OTA session. Sectors from session->offset on are
+// erased by the writer in its idle time, ahead of the cursor; a sector that is
+// still blank when its data arrives is erased inline (a counted stall). With
+// grant_credits set, every buffer that reaches flash is reported through the
+// credit callback. Compressed sessions are decoded on the writer task, so
+// offsets, CRC and checkpoints always refer to the decompressed image.
+void ota_writer_begin(const ota_writer_session_t *session);
+
+// Takes a free buffer from the pool, waiting at most timeout_ms. Returns NULL
+// when the pool stays exhausted.
+ota_writer_buf_t *ota_writer_acquire(uint32_t timeout_ms);
+
+// Buffers in the pool right now, i.e. what can be acquired without waiting.
+uint16_t ota_writer_free_count(void);
+
+// Hands a filled buffer to the writer task (buf->len, or buf->op and its
+// arguments, must be set). Jobs run strictly in submission order, so a COPY
+// lands between the data buffers around it. HASH jobs may be queued outside a
+// session; they only read the running partition.
+void ota_writer_submit(ota_writer_buf_t *buf);
+
+// Returns a buffer to the pool without writing it.
+void ota_writer_release(ota_writer_buf_t *buf);
+
+// Blocks until every submitted buffer has reached flash and returns the first
+// write error of the session (ESP_OK if none).
+esp_err_t ota_writer_flush(uint32_t timeout_ms);
+
+// Marks the current session as failed from outside the writer task; queued
+// and future buffers are dropped.
+void ota_writer_fail(esp_err_t err);
+
+// First write error of the current session, ESP_OK while healthy.
+esp_err_t ota_writer_status(void);
+
+// Write cursor and CRC32 of [0, offset). Only stable after ota_writer_flush().
+void ota_writer_progress(uint32_t *offset, uint32_t *crc);
+
+// Pre-erase and stall counters of the current session.
+void ota_writer_stats(ota_writer_stats_t *out);
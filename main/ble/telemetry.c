@@ -0,0 +1,219 @@
+#include "telemetry.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "gap.h"
+#include "gatt_svr.h"
+#include "mkey.h"
+#include "mkey_keys.h"
+
+// [len] [type] [company id] [record]
+#define TELEMETRY_AD_LEN        (2 + 2 + TELEMETRY_LEN)
+
+typedef struct {
+  uint8_t seq;
+  uint8_t sent[TELEMETRY_LEN];  // last record on air
+  bool running;
+  bool periodic;
+  struct ble_npl_callout refresh;
+  bool ready;
+} telemetry_t;
+
+static telemetry_t telemetry;
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  put_le16(p, v & 0xFFFF);
+  put_le16(p + 2, v >> 16);
+}
+
+void telemetry_pack(uint8_t *out) {
+  mkey_counters_t counters;
+
+  mkey_counters_get(&counters);
+  memset(out, 0, TELEMETRY_LEN);
+  out[0] = TELEMETRY_MAGIC;
+  out[1] = TELEMETRY_VERSION;
+  out[2] = telemetry.seq;
+  out[3] = gap_adv_status_get();
+  out[4] = counters.last_unlock;
+  out[5] = version_fw;
+  out[6] = gatt_svr_ota_progress();
+  put_le32(&out[8], (uint32_t)(esp_timer_get_time() / 1000000));
+  put_le16(&out[12], counters.unlocks);
+  put_le16(&out[14], counters.relocks);
+  put_le16(&out[16], mkey_keys_count());
+}
+
+#if TELEMETRY_ENABLED
+
+// Both the extended and the periodic advertising carry the same AD structure
+static struct os_mbuf *telemetry_ad(const uint8_t *record) {
+  uint8_t ad[TELEMETRY_AD_LEN];
+
+  ad[0] = TELEMETRY_AD_LEN - 1;
+  ad[1] = BLE_HS_ADV_TYPE_MFG_DATA;
+  put_le16(&ad[2], GAP_MFG_COMPANY_ID);
+  memcpy(&ad[4], record, TELEMETRY_LEN);
+  return ble_hs_mbuf_from_flat(ad, sizeof(ad));
+}
+
+static int telemetry_send(const uint8_t *record) {
+  struct os_mbuf *om;
+  int rc;
+
+  om = telemetry_ad(record);
+  if (om == NULL) {
+    return BLE_HS_ENOMEM;
+  }
+  rc = ble_gap_ext_adv_set_data(GAP_ADV_INSTANCE_TELEMETRY, om);
+  if (rc != 0 || !telemetry.periodic) {
+    return rc;
+  }
+
+#if CONFIG_BT_NIMBLE_ENABLE_PERIODIC_ADV
+  om = telemetry_ad(record);
+  if (om == NULL) {
+    return BLE_HS_ENOMEM;
+  }
+#if CONFIG_BT_NIMBLE_PERIODIC_ADV_ENH
+  rc = ble_gap_periodic_adv_set_data(GAP_ADV_INSTANCE_TELEMETRY, om, NULL);
+#else
+  rc = ble_gap_periodic_adv_set_data(GAP_ADV_INSTANCE_TELEMETRY, om);
+#endif
+#endif
+  return rc;
+}
+
+// Pushes the current record; `force` also sends when only the uptime moved.
+static void telemetry_publish(bool force) {
+  uint8_t record[TELEMETRY_LEN];
+  int rc;
+
+  if (!telemetry.running) {
+    return;
+  }
+  telemetry_pack(record);
+  // the sequence and uptime fields do not count as a change
+  record[2] = telemetry.sent[2];
+  memcpy(&record[8], &telemetry.sent[8], 4);
+  if (!force && memcmp(record, telemetry.sent, TELEMETRY_LEN) == 0) {
+    return;
+  }
+  telemetry.seq++;
+  telemetry_pack(record);
+
+  rc = telemetry_send(record);
+  if (rc != 0) {
+    ESP_LOGW(LOG_TAG_TELEMETRY, "Updating the telemetry data failed: rc=%d", rc);
+    return;
+  }
+  memcpy(telemetry.sent, record, TELEMETRY_LEN);
+}
+
+static void telemetry_refresh(struct ble_npl_event *ev) {
+  telemetry_publish(true);
+  ble_npl_callout_reset(&telemetry.refresh,
+                        ble_npl_time_ms_to_ticks32(TELEMETRY_REFRESH_MS));
+}
+
+static int telemetry_configure(void) {
+  struct ble_gap_ext_adv_params params = {0};
+  uint8_t own_addr_type;
+  int rc;
+
+  rc = ble_hs_id_infer_auto(0, &own_addr_type);
+  if (rc != 0) {
+    return rc;
+  }
+  // non-connectable, non-scannable: gateways only listen
+  params.own_addr_type = own_addr_type;
+  params.primary_phy = BLE_HCI_LE_PHY_1M;
+  params.secondary_phy = BLE_HCI_LE_PHY_2M;
+  params.itvl_min = TELEMETRY_ADV_ITVL;
+  params.itvl_max = TELEMETRY_ADV_ITVL;
+  params.sid = TELEMETRY_SID;
+  return ble_gap_ext_adv_configure(GAP_ADV_INSTANCE_TELEMETRY, &params, NULL,
+                                   NULL, NULL);
+}
+
+// Optional: without periodic advertising the extended set alone carries the
+// record, gateways then have to scan for it.
+static void telemetry_periodic_start(void) {
+#if CONFIG_BT_NIMBLE_ENABLE_PERIODIC_ADV
+  struct ble_gap_periodic_adv_params params = {0};
+  int rc;
+
+  params.itvl_min = TELEMETRY_PERIODIC_ITVL;
+  params.itvl_max = TELEMETRY_PERIODIC_ITVL;
+  rc = ble_gap_periodic_adv_configure(GAP_ADV_INSTANCE_TELEMETRY, &params);
+  if (rc == 0) {
+    telemetry.periodic = true;
+    rc = telemetry_send(telemetry.sent);
+  }
+  if (rc == 0) {
+#if CONFIG_BT_NIMBLE_PERIODIC_ADV_ENH
+    rc = ble_gap_periodic_adv_start(GAP_ADV_INSTANCE_TELEMETRY, NULL);
+#else
+    rc = ble_gap_periodic_adv_start(GAP_ADV_INSTANCE_TELEMETRY);
+#endif
+  }
+  if (rc != 0) {
+    ESP_LOGW(LOG_TAG_TELEMETRY, "Periodic advertising not started: rc=%d", rc);
+    telemetry.periodic = false;
+  }
+#endif
+}
+
+void telemetry_start(void) {
+  int rc;
+
+  if (!telemetry.ready) {
+    ble_npl_callout_init(&telemetry.refresh, nimble_port_get_dflt_eventq(),
+                         telemetry_refresh, NULL);
+    telemetry.ready = true;
+  }
+  // after a host reset the controller has forgotten the set
+  telemetry.running = false;
+  telemetry.periodic = false;
+
+  rc = telemetry_configure();
+  if (rc == 0) {
+    telemetry_pack(telemetry.sent);
+    rc = telemetry_send(telemetry.sent);
+  }
+  if (rc == 0) {
+    telemetry_periodic_start();
+    rc = ble_gap_ext_adv_start(GAP_ADV_INSTANCE_TELEMETRY, 0, 0);
+  }
+  if (rc != 0) {
+    ESP_LOGE(LOG_TAG_TELEMETRY, "Telemetry advertising not started: rc=%d", rc);
+    return;
+  }
+  telemetry.running = true;
+  ble_npl_callout_reset(&telemetry.refresh,
+                        ble_npl_time_ms_to_ticks32(TELEMETRY_REFRESH_MS));
+  ESP_LOGI(LOG_TAG_TELEMETRY, "Telemetry advertising started (periodic %s)",
+           telemetry.periodic ? "on" : "off");
+}
+
+void telemetry_update(void) {
+  telemetry_publish(false);
+}
+
+#else
+
+void telemetry_start(void) {
+}
+
+void telemetry_update(void) {
+}
+
+#endif
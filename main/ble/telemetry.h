@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define LOG_TAG_TELEMETRY "telemetry"
+
+// Connectionless telemetry for yard gateways: a non-connectable extended
+// advertising set carries the record, and periodic advertising on the same set
+// repeats it so a gateway syncs once and then just listens. Needs
+// CONFIG_BT_NIMBLE_EXT_ADV with two advertising instances
+// (CONFIG_BT_NIMBLE_MAX_EXT_ADV_INSTANCES); periodic advertising additionally
+// CONFIG_BT_NIMBLE_ENABLE_PERIODIC_ADV. Without them the record is not sent.
+#if CONFIG_BT_NIMBLE_EXT_ADV && CONFIG_BT_NIMBLE_MAX_EXT_ADV_INSTANCES > 1
+#define TELEMETRY_ENABLED       1
+#else
+#define TELEMETRY_ENABLED       0
+#endif
+
+#define TELEMETRY_ADV_ITVL      1600   // 1 s, 0.625 ms units
+#define TELEMETRY_PERIODIC_ITVL 800    // 1 s, 1.25 ms units
+#define TELEMETRY_SID           1
+
+// Status changes go out with the status byte of the connectable advertising
+// (at most every GAP_ADV_STATUS_MIN_MS); uptime, counters and OTA progress are
+// picked up by a refresh this often
+#define TELEMETRY_REFRESH_MS    10000
+
+// Record, in the manufacturer data after the company id (little endian):
+// [0]  magic 'T'               [1]  record version
+// [2]  sequence (bumped per change)
+// [3]  status (GAP_ADV_ST_*)   [4]  last unlock reason (mkey_unlock_reason_t)
+// [5]  firmware version        [6]  OTA progress % (0xFF = no session)
+// [7]  reserved, 0
+// [8]  uptime s u32            [12] unlocks u16     [14] relocks u16
+// [16] enrolled keys u16
+#define TELEMETRY_MAGIC         0x54
+#define TELEMETRY_VERSION       1
+#define TELEMETRY_LEN           18
+
+/****************************************************
+ * API
+*****************************************************/
+
+// Fills `out` (TELEMETRY_LEN bytes) with the current record.
+void telemetry_pack(uint8_t *out);
+
+// Starts the telemetry set after a host sync. No-op when disabled.
+void telemetry_start(void);
+
+// Re-sends the record if anything but the uptime changed (the refresh timer
+// covers that). Host task only.
+void telemetry_update(void);
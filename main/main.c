@@ -3,6 +3,7 @@
 #include "gap.h"
 #include "gatt_svr.h"
 #include "nvs_flash.h"
+#include "store/config/ble_store_config.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/FreeRTOS.h"
@@ -80,6 +81,16 @@ void app_main(void) {
   ble_hs_cfg.sync_cb = sync_cb;
   ble_hs_cfg.reset_cb = reset_cb;
 
+  // bonding with passkey entry (GAP_SM_PASSKEY), bonds kept in NVS
+  ble_hs_cfg.sm_io_cap = BLE_SM_IO_CAP_DISP_ONLY;
+  ble_hs_cfg.sm_bonding = 1;
+  ble_hs_cfg.sm_mitm = 1;
+  ble_hs_cfg.sm_sc = 1;
+  ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+  ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+  ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+  ble_store_config_init();
+
   // initialize service table
   gatt_svr_init();
 
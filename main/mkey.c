@@ -16,6 +16,12 @@
 #include "freertos/task.h"
 
 #include "mkey.h"
+#include "mkey_act.h"
+#include "mkey_keys.h"
+#include "mkey_fsm.h"
+#include "mkey_presence.h"
+#include "mkey_power.h"
+#include "gap.h"
 
 /****************************************************
  * DEFINES
@@ -25,15 +31,24 @@
 
 #define MKEY_CTRL_TASK_STACK   4096
 #define MKEY_CTRL_TASK_PRIO    5
-#define MKEY_CTRL_TICK_MS      10
-#define MKEY_SCAN_TICK_MS      1000
+
+// The loop sleeps until its next deadline, but never longer than half the
+// task watchdog timeout
+#define MKEY_CTRL_MAX_WAIT_MS  (CONFIG_ESP_TASK_WDT_TIMEOUT_S * 1000 / 2)
+
+// A pass over the events taking longer than this is logged: nothing on the
+// control path should wait for an output
+#define MKEY_CTRL_STALL_WARN_MS 5
+
+#define MKEY_INPUT_PINS \
+    ((1ULL << PIN_IN_DOOR) | (1ULL << PIN_IN_01) | (1ULL << PIN_IN_IGN))
 
 /****************************************************
  * TYPES
 *****************************************************/
 typedef enum {
     MKEY_EVT_BEACON = 0,
-    MKEY_EVT_SCAN_TICK,
+    MKEY_EVT_INPUT,     // edge on a tracked input, sent by the GPIO ISR
 } mkey_evt_type_t;
 
 typedef struct {
@@ -41,28 +56,26 @@ typedef struct {
     mkey_beacon_event_t beacon;
 } mkey_evt_t;
 
+// Responsiveness of the control loop since boot
+typedef struct {
+    uint32_t wakes;
+    uint32_t late_max_us;       // worst wake behind a deadline
+    uint32_t busy_max_us;       // longest pass over events and step
+    uint64_t busy_us;           // all passes, for the average
+} mkey_loop_stats_t;
+
 typedef struct {
     bool started;
-    bool beacon_authorized;
-    bool door_latched; // mirrors flanco_door (1 until door opens)
-    int rssi_threshold_dev1;
-    int rssi_threshold_dev2;
-    uint32_t scan_cycles;
-    int64_t last_beacon_us;
-    int64_t ign_off_start_us;
+    int64_t input_rearm_us;     // end of the debounce window, 0 when armed
+    mkey_loop_stats_t loop;
+    mkey_presence_t presence;
+    mkey_fsm_t fsm;
     QueueHandle_t queue;
     TaskHandle_t task;
 } mkey_ctx_t;
 
 static mkey_ctx_t s_ctx = {
     .started = false,
-    .beacon_authorized = false,
-    .door_latched = true,
-    .rssi_threshold_dev1 = MKEY_RSSI_MIN_DEVICE1,
-    .rssi_threshold_dev2 = MKEY_RSSI_MIN_DEVICE2,
-    .scan_cycles = 0,
-    .last_beacon_us = 0,
-    .ign_off_start_us = 0,
     .queue = NULL,
     .task = NULL,
 };
@@ -71,14 +84,33 @@ static mkey_ctx_t s_ctx = {
  * FORWARD DECLARATIONS
 *****************************************************/
 static void mkey_control_task(void *arg);
+static void mkey_control_step(int64_t now_us);
+static int64_t mkey_next_deadline(int64_t now_us);
+static void mkey_input_isr(void *arg);
+static void mkey_setup_input_irqs(void);
+static void mkey_arm_input(gpio_num_t pin);
+static void mkey_service_inputs(int64_t now_us);
 static void mkey_process_beacon(const mkey_beacon_event_t *event);
-static void mkey_process_inputs(int64_t now_us);
-static void mkey_prepare_sleep(const char *reason);
-static void mkey_beep(uint32_t duration_ms);
+static void mkey_hal_outputs(void *ctx, bool relay_locked, bool led);
+static void mkey_hal_beep(void *ctx);
+static void mkey_prepare_sleep(void *ctx, const char *reason);
+static void mkey_update_scan_profile(int64_t now_us);
+static void mkey_update_adv_status(void);
+static void mkey_update_power_state(void);
+static void mkey_loop_account(int64_t deadline_us, int64_t wake_us,
+                              bool timed_out);
+static void mkey_loop_log(void);
 static void mkey_configure_wake_source(void);
 static void mkey_setup_wdt(void);
 static const char *mkey_reset_reason_str(esp_reset_reason_t reason);
 
+// The control state machine acts on the pins through these
+static const mkey_fsm_hal_t s_fsm_hal = {
+    .outputs = mkey_hal_outputs,
+    .beep = mkey_hal_beep,
+    .sleep = mkey_prepare_sleep,
+};
+
 /****************************************************
  * PUBLIC API
 *****************************************************/
@@ -96,11 +128,19 @@ void mkey_init(void) {
     mkey_configure_wake_source();
     mkey_setup_wdt();
 
+    mkey_power_init();
+    mkey_act_init();
+    mkey_keys_init();
+    mkey_presence_init(&s_ctx.presence, (int64_t)MKEY_BEACON_STALE_MS * 1000);
+
     s_ctx.queue = xQueueCreate(8, sizeof(mkey_evt_t));
     if (s_ctx.queue == NULL) {
         ESP_LOGE(LOG_TAG_MKEY, "Failed to create mkey queue");
         return;
     }
+    mkey_fsm_init(&s_ctx.fsm, &s_fsm_hal, gpio_get_level(PIN_IN_IGN) == 0,
+                  gpio_get_level(PIN_IN_DOOR) == 0, esp_timer_get_time());
+    mkey_setup_input_irqs();
 
     BaseType_t ok = xTaskCreate(mkey_control_task, "mkey_ctrl",
                                 MKEY_CTRL_TASK_STACK, NULL,
@@ -128,16 +168,12 @@ void mkey_notify_beacon(const mkey_beacon_event_t *event) {
     xQueueSend(s_ctx.queue, &msg, 0);
 }
 
-void mkey_notify_scan_cycle(void) {
-    if (!s_ctx.queue) {
-        return;
-    }
-
-    mkey_evt_t msg = {
-        .type = MKEY_EVT_SCAN_TICK,
-    };
+bool mkey_enroll_allowed(void) {
+    return s_ctx.fsm.state == MKEY_FSM_IGN_ON;
+}
 
-    xQueueSend(s_ctx.queue, &msg, 0);
+void mkey_counters_get(mkey_counters_t *out) {
+    *out = s_ctx.fsm.counters;
 }
 
 /****************************************************
@@ -150,133 +186,293 @@ static void mkey_control_task(void *arg) {
                  esp_err_to_name(wdt_ret));
     }
 
-    int64_t last_scan_tick_us = esp_timer_get_time();
-
     while (1) {
         mkey_evt_t evt;
-        while (xQueueReceive(s_ctx.queue, &evt, 0) == pdTRUE) {
-            switch (evt.type) {
-                case MKEY_EVT_BEACON:
-                    mkey_process_beacon(&evt.beacon);
-                    break;
-                case MKEY_EVT_SCAN_TICK:
-                    s_ctx.scan_cycles++;
-                    break;
-            }
+        int64_t now_us = esp_timer_get_time();
+        const int64_t deadline_us = mkey_next_deadline(now_us);
+        int64_t wait_us = deadline_us - now_us;
+
+        // block until an event arrives or the next deadline is due, rounding
+        // up so a deadline is never checked a tick early
+        if (wait_us < 0) {
+            wait_us = 0;
+        }
+        const TickType_t wait = (wait_us + portTICK_PERIOD_MS * 1000 - 1) /
+                                (portTICK_PERIOD_MS * 1000);
+
+        const bool got = xQueueReceive(s_ctx.queue, &evt, wait) == pdTRUE;
+        const int64_t wake_us = esp_timer_get_time();
+
+        if (got) {
+            do {
+                switch (evt.type) {
+                    case MKEY_EVT_BEACON:
+                        mkey_process_beacon(&evt.beacon);
+                        break;
+                    case MKEY_EVT_INPUT:
+                        // levels are read by mkey_control_step()
+                        if (s_ctx.input_rearm_us == 0) {
+                            s_ctx.input_rearm_us = esp_timer_get_time() +
+                                (int64_t)MKEY_INPUT_DEBOUNCE_MS * 1000;
+                        }
+                        break;
+                }
+            } while (xQueueReceive(s_ctx.queue, &evt, 0) == pdTRUE);
         }
 
-        const int64_t now_us = esp_timer_get_time();
+        now_us = esp_timer_get_time();
+        mkey_service_inputs(now_us);
+        mkey_control_step(now_us);
+        mkey_loop_account(deadline_us, wake_us, !got);
 
-        // Synthetic scan tick every second to mimic SCAN_BLE() loops
-        if ((now_us - last_scan_tick_us) >= (int64_t)MKEY_SCAN_TICK_MS * 1000) {
-            s_ctx.scan_cycles++;
-            last_scan_tick_us = now_us;
-        }
+        esp_task_wdt_reset();
+    }
+}
+
+// Feeds time, presence and pin levels to the state machine; runs after every
+// wake, whatever caused it.
+static void mkey_control_step(int64_t now_us) {
+    // Drop authorization once no tag is present any more
+    if (mkey_presence_update(&s_ctx.presence, now_us) &&
+        mkey_fsm_dispatch(&s_ctx.fsm, MKEY_FSM_EV_KEY_LOST, now_us)) {
+        ESP_LOGW(LOG_TAG_MKEY, "Beacon lost, relocking outputs");
+    }
+
+    mkey_fsm_inputs(&s_ctx.fsm, gpio_get_level(PIN_IN_IGN) == 0,
+                    gpio_get_level(PIN_IN_DOOR) == 0, now_us);
+    mkey_fsm_step(&s_ctx.fsm, now_us);
 
-        // Drop authorization if we stop hearing the beacon
-        if (s_ctx.beacon_authorized && s_ctx.last_beacon_us > 0 &&
-            (now_us - s_ctx.last_beacon_us) >
-                (int64_t)MKEY_BEACON_STALE_MS * 1000) {
-            ESP_LOGW(LOG_TAG_MKEY, "Beacon stale, relocking outputs");
-            s_ctx.beacon_authorized = false;
-            s_ctx.ign_off_start_us = 0;
-            s_ctx.door_latched = true;
-            gpio_set_level(PIN_OUT_RELAY, 1);
-            gpio_set_level(PIN_OUT_LED, 0);
+    mkey_update_scan_profile(now_us);
+    mkey_update_adv_status();
+    mkey_update_power_state();
+}
+
+// Earliest time at which mkey_control_step() would act without any event:
+// debounce end, a tag going stale, the state machine timeouts and the switch
+// to the slower search scan.
+static int64_t mkey_next_deadline(int64_t now_us) {
+    int64_t t[4];
+    int n = 0;
+    int64_t deadline = now_us + (int64_t)MKEY_CTRL_MAX_WAIT_MS * 1000;
+
+    t[n++] = s_ctx.input_rearm_us;
+    t[n++] = mkey_fsm_deadline(&s_ctx.fsm, now_us);
+    if (mkey_fsm_unlocked(&s_ctx.fsm)) {
+        t[n++] = mkey_presence_deadline(&s_ctx.presence);
+    } else if (mkey_fsm_scan_cycles(&s_ctx.fsm, now_us) < MKEY_SCAN_SEARCH_CYCLES) {
+        t[n++] = s_ctx.fsm.search_start_us +
+                 (int64_t)MKEY_SCAN_SEARCH_CYCLES * MKEY_SCAN_TICK_MS * 1000;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (t[i] && t[i] < deadline) {
+            deadline = t[i];
         }
+    }
+    return deadline;
+}
+
+// A pin leaving its armed level wakes the control task, from light sleep too.
+// The pin stays masked until the debounce window ends, so a bouncing contact
+// costs one event.
+static void mkey_input_isr(void *arg) {
+    const mkey_evt_t msg = {
+        .type = MKEY_EVT_INPUT,
+    };
+    BaseType_t woken = pdFALSE;
+
+    gpio_intr_disable((gpio_num_t)(intptr_t)arg);
+    // with the queue full the task is awake anyway and reads the levels
+    xQueueSendFromISR(s_ctx.queue, &msg, &woken);
+    portYIELD_FROM_ISR(woken);
+}
 
-        // When a beacon is around, mirror the ignition/door logic.
-        if (s_ctx.beacon_authorized) {
-            s_ctx.scan_cycles = 0; // hold off the low power timer
-            mkey_process_inputs(now_us);
-        } else if (s_ctx.scan_cycles >= MKEY_SCAN_LIMIT_CYCLES) {
-            mkey_prepare_sleep("scan timeout (no beacon detected)");
+static void mkey_setup_input_irqs(void) {
+    static const gpio_num_t pins[] = {PIN_IN_DOOR, PIN_IN_IGN, PIN_IN_01};
+    esp_err_t ret;
+
+    ret = gpio_install_isr_service(0);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(LOG_TAG_MKEY, "GPIO ISR service failed (%s)",
+                 esp_err_to_name(ret));
+        return;
+    }
+    for (size_t i = 0; i < sizeof(pins) / sizeof(pins[0]); i++) {
+        ret = gpio_isr_handler_add(pins[i], mkey_input_isr,
+                                   (void *)(intptr_t)pins[i]);
+        if (ret != ESP_OK) {
+            ESP_LOGE(LOG_TAG_MKEY, "GPIO%d interrupt failed (%s)", pins[i],
+                     esp_err_to_name(ret));
+            continue;
         }
+        mkey_arm_input(pins[i]);
+    }
+    esp_sleep_enable_gpio_wakeup();
+}
 
-        esp_task_wdt_reset();
-        vTaskDelay(pdMS_TO_TICKS(MKEY_CTRL_TICK_MS));
+// Edge interrupts cannot wake the chip from light sleep, so each input waits
+// for the level opposite to the one it has now. A change between the read and
+// the enable fires right away.
+static void mkey_arm_input(gpio_num_t pin) {
+    gpio_wakeup_enable(pin, gpio_get_level(pin) ? GPIO_INTR_LOW_LEVEL
+                                                : GPIO_INTR_HIGH_LEVEL);
+    gpio_intr_enable(pin);
+}
+
+// Unmasks the inputs once the debounce window is over; the step that follows
+// samples the settled levels.
+static void mkey_service_inputs(int64_t now_us) {
+    if (s_ctx.input_rearm_us == 0 || now_us < s_ctx.input_rearm_us) {
+        return;
     }
+    s_ctx.input_rearm_us = 0;
+    mkey_arm_input(PIN_IN_DOOR);
+    mkey_arm_input(PIN_IN_IGN);
+    mkey_arm_input(PIN_IN_01);
 }
 
 static void mkey_process_beacon(const mkey_beacon_event_t *event) {
-    const int threshold = (event->id == MKEY_BEACON_DEVICE1)
-                              ? s_ctx.rssi_threshold_dev1
-                              : s_ctx.rssi_threshold_dev2;
-
     if (!event->metadata_ok) {
-        ESP_LOGI(LOG_TAG_MKEY,
+        ESP_LOGD(LOG_TAG_MKEY,
                  "Beacon %d ignored (metadata missing/invalid)", event->id);
         return;
     }
 
-    if (event->rssi < threshold) {
-        ESP_LOGI(LOG_TAG_MKEY, "Beacon %d ignored (rssi=%d < %d)", event->id,
-                 event->rssi, threshold);
+    // every report refreshes the tracker; only a tag becoming present acts
+    if (!mkey_presence_sample(&s_ctx.presence, event->addr, event->rssi,
+                              event->rssi_min, esp_timer_get_time())) {
         return;
     }
 
-    s_ctx.beacon_authorized = true;
-    s_ctx.scan_cycles = 0;
-    s_ctx.door_latched = true; // wait for the first door open event
-    s_ctx.ign_off_start_us = 0;
-    s_ctx.last_beacon_us = esp_timer_get_time();
-
-    gpio_set_level(PIN_OUT_RELAY, 0); // unlock pulse
-    gpio_set_level(PIN_OUT_LED, 1);
-    mkey_beep(MKEY_BUZZER_PULSE_MS);
-
+    // IGN picks the state to unlock into; an edge may still be queued
+    const int64_t now_us = esp_timer_get_time();
+    mkey_fsm_inputs(&s_ctx.fsm, gpio_get_level(PIN_IN_IGN) == 0,
+                    gpio_get_level(PIN_IN_DOOR) == 0, now_us);
+    if (!mkey_fsm_dispatch(&s_ctx.fsm, MKEY_FSM_EV_KEY_PRESENT, now_us)) {
+        ESP_LOGI(LOG_TAG_MKEY, "Beacon %d present (rssi=%d)", event->id,
+                 event->rssi);
+        return;
+    }
     ESP_LOGI(LOG_TAG_MKEY, "Beacon %d accepted (rssi=%d, metadata ok)",
              event->id, event->rssi);
 }
 
-static void mkey_process_inputs(int64_t now_us) {
-    const bool ign_off = gpio_get_level(PIN_IN_IGN);
-    const bool door_open = gpio_get_level(PIN_IN_DOOR) == 0;
+static void mkey_hal_outputs(void *ctx, bool relay_locked, bool led) {
+    mkey_act_set(MKEY_ACT_RELAY, relay_locked);
+    mkey_act_set(MKEY_ACT_LED, led);
+}
 
-    if (ign_off) {
-        if (s_ctx.ign_off_start_us == 0) {
-            s_ctx.ign_off_start_us = now_us;
-        }
+// Played by the step timer; the relay stays released for the beep, as it did
+// while the control task waited for the pulse to end.
+static void mkey_hal_beep(void *ctx) {
+    static const mkey_act_pattern_t beep = {
+        .name = "unlock beep",
+        .len = 1,
+        .steps = {{1, MKEY_BUZZER_PULSE_MS}},
+    };
+    static const mkey_act_pattern_t relay_pulse = {
+        .name = "unlock pulse",
+        .len = 1,
+        .steps = {{0, MKEY_BUZZER_PULSE_MS}},
+    };
 
-        if (door_open) {
-            s_ctx.door_latched = false; // flanco_door = 0
-            s_ctx.ign_off_start_us = now_us; // restart the 30s window
-        }
+    mkey_act_play(MKEY_ACT_BUZZER, &beep, MKEY_ACT_PRIO_NORMAL);
+    mkey_act_play(MKEY_ACT_RELAY, &relay_pulse, MKEY_ACT_PRIO_HIGH);
+}
 
-        gpio_set_level(PIN_OUT_RELAY, 1);
-        gpio_set_level(PIN_OUT_LED, 1);
+static void mkey_prepare_sleep(void *ctx, const char *reason) {
+    ESP_LOGI(LOG_TAG_MKEY, "Entering deep sleep: %s", reason);
+    mkey_power_log();
+    mkey_loop_log();
 
-        const int64_t elapsed = now_us - s_ctx.ign_off_start_us;
-        if (!s_ctx.door_latched &&
-            elapsed >= (int64_t)MKEY_IGN_DOOR_SLEEP_MS * 1000) {
-            mkey_prepare_sleep("IGN off with door open timeout");
-        } else if (elapsed >= (int64_t)MKEY_IGN_MAX_SLEEP_MS * 1000) {
-            mkey_prepare_sleep("IGN off hard timeout");
-        }
+    // Safe output levels before sleep: cut running patterns, buzzer off,
+    // relay and LED as last set by the machine
+    mkey_act_stop_all();
+
+    esp_deep_sleep_start(); // does not return
+}
+
+// Scan hard right after wake, back off once the key is present (further with
+// IGN on) and when no key showed up for a while.
+static void mkey_update_scan_profile(int64_t now_us) {
+    gap_scan_profile_t profile;
+
+    if (s_ctx.fsm.state == MKEY_FSM_IGN_ON) {
+        profile = GAP_SCAN_PROFILE_IGN_ON;
+    } else if (mkey_fsm_unlocked(&s_ctx.fsm)) {
+        profile = GAP_SCAN_PROFILE_PRESENT;
+    } else if (mkey_fsm_scan_cycles(&s_ctx.fsm, now_us) < MKEY_SCAN_SEARCH_CYCLES) {
+        profile = GAP_SCAN_PROFILE_SEARCH;
     } else {
-        // IGN on: stay awake and unlocked
-        s_ctx.door_latched = true;
-        s_ctx.ign_off_start_us = 0;
-        gpio_set_level(PIN_OUT_RELAY, 0);
-        gpio_set_level(PIN_OUT_LED, 0);
+        profile = GAP_SCAN_PROFILE_PRE_SLEEP;
     }
+    gap_scan_profile_set(profile);
 }
 
-static void mkey_prepare_sleep(const char *reason) {
-    ESP_LOGI(LOG_TAG_MKEY, "Entering deep sleep: %s", reason);
+// Pin levels of the tracked inputs and the relay for the advertised status;
+// gap only touches the radio when one of them changed.
+static void mkey_update_adv_status(void) {
+    uint8_t inputs = 0;
 
-    // Safe output levels before sleep
-    gpio_set_level(PIN_OUT_BUZZER, 0);
-    gpio_set_level(PIN_OUT_LED, 0);
-    gpio_set_level(PIN_OUT_RELAY, 1);
+    inputs |= gpio_get_level(PIN_IN_DOOR) ? GAP_ADV_ST_DOOR : 0;
+    inputs |= gpio_get_level(PIN_IN_IGN) ? GAP_ADV_ST_IGN : 0;
+    inputs |= gpio_get_level(PIN_OUT_RELAY) ? GAP_ADV_ST_RELAY : 0;
+    inputs |= gpio_get_level(PIN_IN_01) ? GAP_ADV_ST_IN1 : 0;
+    gap_adv_status_inputs(inputs);
+}
 
-    esp_deep_sleep_start(); // does not return
+// State for the power accounting; OTA is tracked by its lock.
+static void mkey_update_power_state(void) {
+    switch (s_ctx.fsm.state) {
+        case MKEY_FSM_IGN_ON:
+            mkey_power_state_set(MKEY_POWER_PRESENT);
+            break;
+        case MKEY_FSM_IGN_OFF:
+            mkey_power_state_set(MKEY_POWER_IGN_OFF);
+            break;
+        default:
+            mkey_power_state_set(MKEY_POWER_SEARCH);
+            break;
+    }
 }
 
-static void mkey_beep(uint32_t duration_ms) {
-    gpio_set_level(PIN_OUT_BUZZER, 1);
-    vTaskDelay(pdMS_TO_TICKS(duration_ms));
-    gpio_set_level(PIN_OUT_BUZZER, 0);
+// Wake lateness counts timeouts only (an event wakes the task early on
+// purpose); the tick rounding of the wait shows up in it.
+static void mkey_loop_account(int64_t deadline_us, int64_t wake_us,
+                              bool timed_out) {
+    mkey_loop_stats_t *st = &s_ctx.loop;
+    const uint32_t busy = (uint32_t)(esp_timer_get_time() - wake_us);
+
+    st->wakes++;
+    st->busy_us += busy;
+    if (busy > st->busy_max_us) {
+        st->busy_max_us = busy;
+    }
+    if (timed_out && wake_us > deadline_us &&
+        (uint32_t)(wake_us - deadline_us) > st->late_max_us) {
+        st->late_max_us = (uint32_t)(wake_us - deadline_us);
+    }
+    if (busy > MKEY_CTRL_STALL_WARN_MS * 1000) {
+        ESP_LOGW(LOG_TAG_MKEY, "Control loop stalled %lu us",
+                 (unsigned long)busy);
+    }
+}
+
+static void mkey_loop_log(void) {
+    const mkey_loop_stats_t *st = &s_ctx.loop;
+    mkey_act_stats_t act;
+
+    mkey_act_stats_get(&act);
+    ESP_LOGI(LOG_TAG_MKEY, "loop: %lu wakes, busy avg %lu us max %lu us, "
+             "deadline late max %lu us",
+             (unsigned long)st->wakes,
+             (unsigned long)(st->wakes ? st->busy_us / st->wakes : 0),
+             (unsigned long)st->busy_max_us, (unsigned long)st->late_max_us);
+    ESP_LOGI(LOG_TAG_MKEY_ACT, "%lu patterns (%lu preempted, %lu dropped), "
+             "%lu steps, step late max %lu us, %lu timer errors",
+             (unsigned long)act.played, (unsigned long)act.preempted,
+             (unsigned long)act.dropped, (unsigned long)act.steps,
+             (unsigned long)act.late_max_us, (unsigned long)act.timer_errors);
 }
 
 static void mkey_configure_wake_source(void) {
@@ -352,7 +548,7 @@ static const char *mkey_reset_reason_str(esp_reset_reason_t reason) {
 }
 
 /****************************************************
- * HARDWARE SETUP (unchanged)
+ * HARDWARE SETUP
 *****************************************************/
 void mkey_init_pins(void) {
 
@@ -362,10 +558,9 @@ void mkey_init_pins(void) {
 
     // configure input pins
     gpio_config_t io_conf_in = {
-        .intr_type = GPIO_INTR_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE, // edges are enabled by mkey_init
         .mode = GPIO_MODE_INPUT,
-        .pin_bit_mask =
-            (1ULL << PIN_IN_DOOR) | (1ULL << PIN_IN_01) | (1ULL << PIN_IN_IGN),
+        .pin_bit_mask = MKEY_INPUT_PINS,
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
         .pull_up_en = GPIO_PULLUP_ENABLE,
     };
@@ -375,10 +570,11 @@ void mkey_init_pins(void) {
                  esp_err_to_name(ret));
     }
 
-    // configure output pins
+    // configure output pins (input enabled too, so the advertised status can
+    // read the relay back)
     gpio_config_t io_conf_out = {
         .intr_type = GPIO_INTR_DISABLE,
-        .mode = GPIO_MODE_OUTPUT,
+        .mode = GPIO_MODE_INPUT_OUTPUT,
         .pin_bit_mask = (1ULL << PIN_OUT_BUZZER) | (1ULL << PIN_OUT_RELAY) |
                         (1ULL << PIN_OUT_01) | (1ULL << PIN_OUT_02) |
                         (1ULL << PIN_OUT_LED),
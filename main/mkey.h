@@ -3,7 +3,6 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include "driver/gpio.h"
 
 // ----------------------------------------------------
 // MKEY BEACON / TIMING CONSTANTS (ported from mkey.ino)
@@ -12,6 +11,9 @@
 // Maximum number of scan loops before forcing low power (approx 250 seconds).
 #define MKEY_SCAN_LIMIT_CYCLES        250
 
+// Length of one scan loop when the scanner does not report its own.
+#define MKEY_SCAN_TICK_MS             1000
+
 // Time with IGN off and door open before sleeping (ms) - ~30s in the .ino.
 #define MKEY_IGN_DOOR_SLEEP_MS        (30 * 1000)
 
@@ -21,10 +23,26 @@
 // Drop presence if no beacon refresh is received within this window (ms).
 #define MKEY_BEACON_STALE_MS          5000
 
+// Scan cycles without a key before the scanner slows down ahead of sleep.
+#define MKEY_SCAN_SEARCH_CYCLES       30
+
+// Door/IGN/IN1 edges act at once; further edges of a bouncing contact are
+// ignored for this long, then the pins are sampled again.
+#define MKEY_INPUT_DEBOUNCE_MS        30
+
 // Duration of the audible pulse when a valid beacon is seen (ms).
 #define MKEY_BUZZER_PULSE_MS          50
 
-// RSSI thresholds used to accept a beacon as "nearby".
+// Factory key tags (Device1/Device2 in the .ino), enrolled until a key table
+// is stored (see mkey_keys.h), LSB first:
+// bc:57:29:0b:29:a7 and bc:57:29:0b:29:e0.
+#define MKEY_TAG1_ADDR  {0xa7, 0x29, 0x0b, 0x29, 0x57, 0xbc}
+#define MKEY_TAG2_ADDR  {0xe0, 0x29, 0x0b, 0x29, 0x57, 0xbc}
+
+// Marker a genuine tag carries in its advertising payload (metaData in the .ino).
+#define MKEY_BEACON_MARKER            "&H123$"
+
+// RSSI thresholds of the factory tags; enrolled tags carry their own.
 #define MKEY_RSSI_MIN_DEVICE1         (-120)
 #define MKEY_RSSI_MIN_DEVICE2         (-120)
 
@@ -54,14 +72,14 @@
 // MKEY BLE FACING API
 // ----------------------------------------------------
 
-typedef enum {
-    MKEY_BEACON_DEVICE1 = 0,
-    MKEY_BEACON_DEVICE2,
-} mkey_beacon_id_t;
+// Position of a tag in the enrolled key table when it was seen.
+typedef uint16_t mkey_beacon_id_t;
 
 typedef struct {
     mkey_beacon_id_t id;   // Which key/tag was seen
+    uint8_t addr[6];       // Its address, LSB first
     int rssi;              // RSSI reported by the scan
+    int rssi_min;          // Threshold enrolled for this tag
     bool metadata_ok;      // True when manufacturer payload matched (&H123$ in the .ino)
 } mkey_beacon_event_t;
 
@@ -74,9 +92,25 @@ void mkey_init(void);
 // callbacks once RSSI and payload have been validated.
 void mkey_notify_beacon(const mkey_beacon_event_t *event);
 
-// Inform the control loop that a scan cycle finished. If unused, the loop
-// will increment its own scan counter on time.
-void mkey_notify_scan_cycle(void);
+// True while enrollment changes are allowed: a key is present and IGN is on,
+// i.e. an authorized driver is in the vehicle.
+bool mkey_enroll_allowed(void);
+
+// What last opened the outputs.
+typedef enum {
+    MKEY_UNLOCK_NONE = 0,
+    MKEY_UNLOCK_BEACON,    // an enrolled tag became present
+    MKEY_UNLOCK_IGN,       // IGN switched on with a tag present
+} mkey_unlock_reason_t;
+
+// Since boot; read from any task, a torn read only costs one stale count.
+typedef struct {
+    mkey_unlock_reason_t last_unlock;
+    uint16_t unlocks;
+    uint16_t relocks;
+} mkey_counters_t;
+
+void mkey_counters_get(mkey_counters_t *out);
 
 void mkey_init_pins(void);
 
@@ -0,0 +1,293 @@
+#include <string.h>
+
+#include "driver/gpio.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+
+#include "mkey.h"
+#include "mkey_act.h"
+#include "mkey_power.h"
+
+/****************************************************
+ * TYPES
+*****************************************************/
+typedef struct {
+    const mkey_act_pattern_t *pattern;
+    uint8_t prio;
+} mkey_act_cmd_t;
+
+typedef struct {
+    const mkey_act_pattern_t *pattern;  // playing, NULL at rest
+    uint8_t prio;
+    uint8_t step;
+    uint8_t runs;                       // repeats left after this run
+    int64_t due_us;                     // end of the step, 0: not started
+    bool rest;
+    uint8_t queued;
+    mkey_act_cmd_t queue[MKEY_ACT_QUEUE_LEN];
+} mkey_act_chan_t;
+
+typedef struct {
+    esp_timer_handle_t timer;
+    mkey_act_chan_t chans[MKEY_ACT_COUNT];
+    mkey_act_stats_t stats;
+} mkey_act_t;
+
+/****************************************************
+ * VARIABLES
+*****************************************************/
+static mkey_act_t s_act;
+
+// shared by the control task and the esp_timer task
+static portMUX_TYPE s_act_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static const gpio_num_t s_pins[MKEY_ACT_COUNT] = {
+    [MKEY_ACT_BUZZER] = PIN_OUT_BUZZER,
+    [MKEY_ACT_RELAY] = PIN_OUT_RELAY,
+    [MKEY_ACT_LED] = PIN_OUT_LED,
+};
+
+/****************************************************
+ * INTERNALS
+*****************************************************/
+
+// Enters step `ch->step` at `at_us`. Caller holds the lock.
+static void mkey_act_enter(mkey_act_out_t out, int64_t at_us) {
+    mkey_act_chan_t *ch = &s_act.chans[out];
+    const mkey_act_step_t *st = &ch->pattern->steps[ch->step];
+
+    gpio_set_level(s_pins[out], st->level);
+    ch->due_us = at_us + (int64_t)st->ms * 1000;
+}
+
+// The current step ended at `at_us`: next step, next run, next queued pattern
+// or back to rest. Caller holds the lock.
+static void mkey_act_advance(mkey_act_out_t out, int64_t at_us) {
+    mkey_act_chan_t *ch = &s_act.chans[out];
+
+    if (++ch->step < ch->pattern->len) {
+        mkey_act_enter(out, at_us);
+        return;
+    }
+    ch->step = 0;
+    if (ch->runs > 0) {
+        ch->runs--;
+        mkey_act_enter(out, at_us);
+        return;
+    }
+    if (ch->queued > 0) {
+        ch->pattern = ch->queue[0].pattern;
+        ch->prio = ch->queue[0].prio;
+        ch->runs = ch->pattern->repeat;
+        memmove(&ch->queue[0], &ch->queue[1],
+                (MKEY_ACT_QUEUE_LEN - 1) * sizeof(ch->queue[0]));
+        ch->queued--;
+        s_act.stats.played++;
+        mkey_act_enter(out, at_us);
+        return;
+    }
+    ch->pattern = NULL;
+    ch->due_us = 0;
+    gpio_set_level(s_pins[out], ch->rest);
+}
+
+// Cancels every pattern and drives the rest levels, as mkey_act_set does
+// with nothing playing.
+static void mkey_act_drop_all(void) {
+    portENTER_CRITICAL(&s_act_mux);
+    for (int out = 0; out < MKEY_ACT_COUNT; out++) {
+        mkey_act_chan_t *ch = &s_act.chans[out];
+
+        if (ch->pattern) {
+            s_act.stats.preempted++;
+        }
+        s_act.stats.dropped += ch->queued;
+        ch->pattern = NULL;
+        ch->queued = 0;
+        ch->due_us = 0;
+        gpio_set_level(s_pins[out], ch->rest);
+    }
+    portEXIT_CRITICAL(&s_act_mux);
+}
+
+// The step timer could not be armed, so nothing would end the patterns:
+// the outputs fall back to their rest levels and light sleep is allowed
+// again.
+static void mkey_act_fail(esp_err_t err) {
+    ESP_LOGE(LOG_TAG_MKEY_ACT, "Step timer failed (%s), outputs back to rest",
+             esp_err_to_name(err));
+    portENTER_CRITICAL(&s_act_mux);
+    s_act.stats.timer_errors++;
+    portEXIT_CRITICAL(&s_act_mux);
+    mkey_act_drop_all();
+    mkey_power_hold(MKEY_POWER_LOCK_ACTUATOR, false);
+}
+
+// Runs in the esp_timer task: starts new patterns, ends the steps that are
+// due and rearms for the next one. Only this callback (and mkey_act_fail)
+// moves the power lock.
+static void mkey_act_timer_cb(void *arg) {
+    const int64_t now = esp_timer_get_time();
+    int64_t next = 0;
+    bool busy = false;
+
+    portENTER_CRITICAL(&s_act_mux);
+    for (int out = 0; out < MKEY_ACT_COUNT; out++) {
+        mkey_act_chan_t *ch = &s_act.chans[out];
+
+        if (ch->pattern && ch->due_us == 0) {
+            mkey_act_enter(out, now);
+        }
+        // a late callback keeps the pattern on its schedule
+        while (ch->pattern && ch->due_us <= now) {
+            const uint32_t late = (uint32_t)(now - ch->due_us);
+            if (late > s_act.stats.late_max_us) {
+                s_act.stats.late_max_us = late;
+            }
+            s_act.stats.steps++;
+            mkey_act_advance(out, ch->due_us);
+        }
+        if (ch->pattern) {
+            busy = true;
+            if (next == 0 || ch->due_us < next) {
+                next = ch->due_us;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&s_act_mux);
+
+    // no light sleep while a pattern plays, the pins must switch on time
+    mkey_power_hold(MKEY_POWER_LOCK_ACTUATOR, busy);
+    if (next) {
+        // already armed means a kick got in first; it looks at every output
+        esp_err_t ret = esp_timer_start_once(s_act.timer, next - now);
+        if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+            mkey_act_fail(ret);
+        }
+    }
+}
+
+// Has the timer task look at the outputs now. It preempts the control task,
+// so a callback cannot run between the stop and the start. Returns false
+// when the timer could not be armed; the patterns are dropped then.
+static bool mkey_act_kick(void) {
+    esp_err_t ret;
+
+    if (!s_act.timer) {
+        return false;
+    }
+    // not running is fine, the start arms it
+    ret = esp_timer_stop(s_act.timer);
+    if (ret == ESP_OK || ret == ESP_ERR_INVALID_STATE) {
+        ret = esp_timer_start_once(s_act.timer, 0);
+    }
+    if (ret != ESP_OK) {
+        mkey_act_fail(ret);
+        return false;
+    }
+    return true;
+}
+
+/****************************************************
+ * PUBLIC API
+*****************************************************/
+void mkey_act_init(void) {
+    const esp_timer_create_args_t args = {
+        .callback = mkey_act_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "mkey_act",
+    };
+
+    for (int out = 0; out < MKEY_ACT_COUNT; out++) {
+        s_act.chans[out].rest = gpio_get_level(s_pins[out]);
+    }
+    esp_err_t ret = esp_timer_create(&args, &s_act.timer);
+    if (ret != ESP_OK) {
+        ESP_LOGE(LOG_TAG_MKEY_ACT, "Step timer failed (%s), patterns disabled",
+                 esp_err_to_name(ret));
+        s_act.timer = NULL;
+    }
+}
+
+bool mkey_act_play(mkey_act_out_t out, const mkey_act_pattern_t *pattern,
+                   mkey_act_prio_t prio) {
+    mkey_act_chan_t *ch = &s_act.chans[out];
+    bool start = false;
+    bool queued = true;
+
+    if (!s_act.timer || pattern == NULL || pattern->len == 0) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&s_act_mux);
+    if (ch->pattern == NULL || prio > ch->prio) {
+        if (ch->pattern) {
+            s_act.stats.preempted++;
+            s_act.stats.dropped += ch->queued;
+            ch->queued = 0;
+        }
+        ch->pattern = pattern;
+        ch->prio = prio;
+        ch->step = 0;
+        ch->runs = pattern->repeat;
+        ch->due_us = 0;
+        s_act.stats.played++;
+        start = true;
+    } else if (ch->queued < MKEY_ACT_QUEUE_LEN) {
+        ch->queue[ch->queued++] = (mkey_act_cmd_t){pattern, prio};
+    } else if (prio >= ch->queue[MKEY_ACT_QUEUE_LEN - 1].prio) {
+        ch->queue[MKEY_ACT_QUEUE_LEN - 1] = (mkey_act_cmd_t){pattern, prio};
+        s_act.stats.dropped++;
+    } else {
+        s_act.stats.dropped++;
+        queued = false;
+    }
+    portEXIT_CRITICAL(&s_act_mux);
+
+    if (start) {
+        return mkey_act_kick();
+    }
+    if (!queued) {
+        ESP_LOGD(LOG_TAG_MKEY_ACT, "%s dropped, output %d busy", pattern->name,
+                 out);
+    }
+    return queued;
+}
+
+void mkey_act_set(mkey_act_out_t out, bool level) {
+    mkey_act_chan_t *ch = &s_act.chans[out];
+
+    portENTER_CRITICAL(&s_act_mux);
+    ch->rest = level;
+    if (ch->pattern == NULL) {
+        gpio_set_level(s_pins[out], level);
+    }
+    portEXIT_CRITICAL(&s_act_mux);
+}
+
+void mkey_act_stop_all(void) {
+    if (s_act.timer) {
+        esp_timer_stop(s_act.timer);
+    }
+    mkey_act_drop_all();
+}
+
+bool mkey_act_busy(void) {
+    bool busy = false;
+
+    portENTER_CRITICAL(&s_act_mux);
+    for (int out = 0; out < MKEY_ACT_COUNT; out++) {
+        busy |= s_act.chans[out].pattern != NULL;
+    }
+    portEXIT_CRITICAL(&s_act_mux);
+    return busy;
+}
+
+void mkey_act_stats_get(mkey_act_stats_t *out) {
+    portENTER_CRITICAL(&s_act_mux);
+    *out = s_act.stats;
+    portEXIT_CRITICAL(&s_act_mux);
+}
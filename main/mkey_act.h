@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ----------------------------------------------------
+// ACTUATOR SEQUENCER CONSTANTS
+// ----------------------------------------------------
+
+#define LOG_TAG_MKEY_ACT "mkey_act"
+
+// Steps in one pattern and patterns waiting behind the one playing, per
+// output.
+#define MKEY_ACT_STEPS_MAX            8
+#define MKEY_ACT_QUEUE_LEN            2
+
+// ----------------------------------------------------
+// ACTUATOR SEQUENCER API
+// ----------------------------------------------------
+
+// Plays timed patterns on the outputs from an esp_timer, so the control task
+// never waits for a pulse to end. Each output has a rest level (what the
+// control logic wants) and at most one pattern playing on top of it; when the
+// last queued pattern ends the output goes back to its rest level.
+
+typedef enum {
+    MKEY_ACT_BUZZER = 0,
+    MKEY_ACT_RELAY,
+    MKEY_ACT_LED,
+    MKEY_ACT_COUNT,
+} mkey_act_out_t;
+
+// A pattern of higher priority preempts the one playing and clears the queue
+// of its output; otherwise it waits its turn, and with the queue full it
+// replaces the last waiting pattern unless that one ranks higher.
+typedef enum {
+    MKEY_ACT_PRIO_LOW = 0,    // status blinks
+    MKEY_ACT_PRIO_NORMAL,     // feedback beeps
+    MKEY_ACT_PRIO_HIGH,       // relay pulses, alarms
+} mkey_act_prio_t;
+
+typedef struct {
+    uint8_t level;            // pin level during the step
+    uint16_t ms;              // step length
+} mkey_act_step_t;
+
+typedef struct {
+    const char *name;
+    uint8_t len;              // steps used
+    uint8_t repeat;           // extra runs of the steps (0: play once)
+    mkey_act_step_t steps[MKEY_ACT_STEPS_MAX];
+} mkey_act_pattern_t;
+
+typedef struct {
+    uint32_t played;          // patterns started
+    uint32_t preempted;       // cut short by a higher priority
+    uint32_t dropped;         // never started (queue full or flushed)
+    uint32_t steps;           // timer callbacks that changed a pin
+    uint32_t late_max_us;     // worst delay of a step behind its schedule
+    uint32_t timer_errors;    // step timer not armed, patterns dropped
+} mkey_act_stats_t;
+
+// Creates the step timer. The pins must be configured and at rest already
+// (mkey_init_pins).
+void mkey_act_init(void);
+
+// Queues `pattern` (static storage) on an output. Returns false when it was
+// dropped, also when the step timer failed (the outputs are at rest then).
+bool mkey_act_play(mkey_act_out_t out, const mkey_act_pattern_t *pattern,
+                   mkey_act_prio_t prio);
+
+// Sets the rest level of an output; applied at once when nothing plays on it,
+// otherwise when its patterns end.
+void mkey_act_set(mkey_act_out_t out, bool level);
+
+// Cancels every pattern and drives the rest levels, e.g. before deep sleep.
+void mkey_act_stop_all(void);
+
+// True while a pattern plays on any output.
+bool mkey_act_busy(void);
+
+void mkey_act_stats_get(mkey_act_stats_t *out);
@@ -0,0 +1,229 @@
+#include <stddef.h>
+
+#include "mkey_fsm.h"
+
+/****************************************************
+ * TYPES
+*****************************************************/
+typedef bool (*mkey_fsm_guard_t)(const mkey_fsm_t *fsm);
+typedef void (*mkey_fsm_action_t)(mkey_fsm_t *fsm, int64_t now_us);
+
+typedef struct {
+    uint8_t state;                // mkey_fsm_state_t
+    uint8_t event;                // mkey_fsm_event_t
+    mkey_fsm_guard_t guard;       // NULL: always
+    uint8_t next;                 // entry actions run only on a state change
+    mkey_fsm_action_t action;     // NULL: none
+} mkey_fsm_row_t;
+
+/****************************************************
+ * GUARDS AND ACTIONS
+*****************************************************/
+static bool mkey_fsm_ign_is_on(const mkey_fsm_t *fsm) {
+    return fsm->ign_on;
+}
+
+// A key became present: unlock pulse and beep, IGN decides the next state.
+static void mkey_fsm_unlock(mkey_fsm_t *fsm, int64_t now_us) {
+    (void)now_us;
+    fsm->door_latched = true; // wait for the first door open event
+    fsm->ign_off_start_us = 0;
+    fsm->counters.last_unlock = MKEY_UNLOCK_BEACON;
+    fsm->counters.unlocks++;
+    fsm->hal->outputs(fsm->hal->ctx, false, true);
+    fsm->hal->beep(fsm->hal->ctx);
+}
+
+// IGN switched on with the key already present. A key that arrives with IGN
+// on was counted by mkey_fsm_unlock, so this is not an entry action.
+static void mkey_fsm_ign_unlock(mkey_fsm_t *fsm, int64_t now_us) {
+    (void)now_us;
+    fsm->counters.last_unlock = MKEY_UNLOCK_IGN;
+    fsm->counters.unlocks++;
+}
+
+static void mkey_fsm_relock(mkey_fsm_t *fsm, int64_t now_us) {
+    fsm->counters.relocks++;
+    fsm->door_latched = true;
+    fsm->ign_off_start_us = 0;
+    fsm->search_start_us = now_us;
+    fsm->hal->outputs(fsm->hal->ctx, true, false);
+}
+
+// The 30s window runs from the door closing again; while it is open neither
+// timeout runs (the .ino kept resetting its counter).
+static void mkey_fsm_door_open(mkey_fsm_t *fsm, int64_t now_us) {
+    fsm->door_latched = false; // flanco_door = 0
+    fsm->ign_off_start_us = now_us;
+}
+
+static void mkey_fsm_door_closed(mkey_fsm_t *fsm, int64_t now_us) {
+    fsm->ign_off_start_us = now_us;
+}
+
+/****************************************************
+ * TABLES
+*****************************************************/
+static const mkey_fsm_row_t s_rows[] = {
+    {MKEY_FSM_LOCKED, MKEY_FSM_EV_KEY_PRESENT, mkey_fsm_ign_is_on, MKEY_FSM_IGN_ON, mkey_fsm_unlock},
+    {MKEY_FSM_LOCKED, MKEY_FSM_EV_KEY_PRESENT, NULL, MKEY_FSM_IGN_OFF, mkey_fsm_unlock},
+    {MKEY_FSM_LOCKED, MKEY_FSM_EV_SCAN_TIMEOUT, NULL, MKEY_FSM_SLEEP, NULL},
+
+    {MKEY_FSM_IGN_ON, MKEY_FSM_EV_IGN_OFF, NULL, MKEY_FSM_IGN_OFF, NULL},
+    {MKEY_FSM_IGN_ON, MKEY_FSM_EV_KEY_LOST, NULL, MKEY_FSM_LOCKED, mkey_fsm_relock},
+
+    {MKEY_FSM_IGN_OFF, MKEY_FSM_EV_IGN_ON, NULL, MKEY_FSM_IGN_ON, mkey_fsm_ign_unlock},
+    {MKEY_FSM_IGN_OFF, MKEY_FSM_EV_DOOR_OPEN, NULL, MKEY_FSM_IGN_OFF, mkey_fsm_door_open},
+    {MKEY_FSM_IGN_OFF, MKEY_FSM_EV_DOOR_CLOSED, NULL, MKEY_FSM_IGN_OFF, mkey_fsm_door_closed},
+    {MKEY_FSM_IGN_OFF, MKEY_FSM_EV_DOOR_TIMEOUT, NULL, MKEY_FSM_SLEEP, NULL},
+    {MKEY_FSM_IGN_OFF, MKEY_FSM_EV_HARD_TIMEOUT, NULL, MKEY_FSM_SLEEP, NULL},
+    {MKEY_FSM_IGN_OFF, MKEY_FSM_EV_KEY_LOST, NULL, MKEY_FSM_LOCKED, mkey_fsm_relock},
+};
+
+static const char *const s_state_names[MKEY_FSM_STATE_COUNT] = {
+    "locked", "ign_on", "ign_off", "sleep",
+};
+
+static const char *const s_event_names[MKEY_FSM_EV_COUNT] = {
+    "key_present", "key_lost", "ign_on", "ign_off", "door_open",
+    "door_closed", "door_timeout", "hard_timeout", "scan_timeout",
+};
+
+/****************************************************
+ * INTERNALS
+*****************************************************/
+static void mkey_fsm_enter(mkey_fsm_t *fsm, mkey_fsm_event_t event,
+                           int64_t now_us) {
+    switch (fsm->state) {
+        case MKEY_FSM_IGN_ON:
+            // stay awake and unlocked
+            fsm->door_latched = true;
+            fsm->ign_off_start_us = 0;
+            fsm->hal->outputs(fsm->hal->ctx, false, false);
+            break;
+        case MKEY_FSM_IGN_OFF:
+            fsm->ign_off_start_us = now_us;
+            if (fsm->door_open) {
+                fsm->door_latched = false;
+            }
+            fsm->hal->outputs(fsm->hal->ctx, true, true);
+            break;
+        case MKEY_FSM_SLEEP:
+            // safe output levels before sleep
+            fsm->hal->outputs(fsm->hal->ctx, true, false);
+            fsm->hal->sleep(fsm->hal->ctx,
+                            event == MKEY_FSM_EV_SCAN_TIMEOUT ? "scan timeout (no beacon detected)"
+                            : event == MKEY_FSM_EV_DOOR_TIMEOUT ? "IGN off with door open timeout"
+                                                                : "IGN off hard timeout");
+            break;
+        default:
+            break;
+    }
+}
+
+/****************************************************
+ * PUBLIC API
+*****************************************************/
+void mkey_fsm_init(mkey_fsm_t *fsm, const mkey_fsm_hal_t *hal, bool ign_on,
+                   bool door_open, int64_t now_us) {
+    *fsm = (mkey_fsm_t){
+        .hal = hal,
+        .state = MKEY_FSM_LOCKED,
+        .ign_on = ign_on,
+        .door_open = door_open,
+        .door_latched = true,
+        .search_start_us = now_us,
+    };
+}
+
+bool mkey_fsm_dispatch(mkey_fsm_t *fsm, mkey_fsm_event_t event, int64_t now_us) {
+    for (size_t i = 0; i < sizeof(s_rows) / sizeof(s_rows[0]); i++) {
+        const mkey_fsm_row_t *row = &s_rows[i];
+        if (row->state != fsm->state || row->event != event ||
+            (row->guard && !row->guard(fsm))) {
+            continue;
+        }
+        if (row->action) {
+            row->action(fsm, now_us);
+        }
+        if (row->next != fsm->state) {
+            fsm->state = row->next;
+            mkey_fsm_enter(fsm, event, now_us);
+        }
+        return true;
+    }
+    return false;
+}
+
+void mkey_fsm_inputs(mkey_fsm_t *fsm, bool ign_on, bool door_open,
+                     int64_t now_us) {
+    const bool ign_changed = ign_on != fsm->ign_on;
+    const bool door_changed = door_open != fsm->door_open;
+
+    // entry actions look at both levels, so store them before dispatching
+    fsm->ign_on = ign_on;
+    fsm->door_open = door_open;
+    if (ign_changed) {
+        mkey_fsm_dispatch(fsm, ign_on ? MKEY_FSM_EV_IGN_ON : MKEY_FSM_EV_IGN_OFF,
+                          now_us);
+    }
+    if (door_changed) {
+        mkey_fsm_dispatch(fsm, door_open ? MKEY_FSM_EV_DOOR_OPEN
+                                         : MKEY_FSM_EV_DOOR_CLOSED, now_us);
+    }
+}
+
+void mkey_fsm_step(mkey_fsm_t *fsm, int64_t now_us) {
+    const int64_t deadline = mkey_fsm_deadline(fsm, now_us);
+
+    if (deadline == 0 || now_us < deadline) {
+        return;
+    }
+    if (fsm->state == MKEY_FSM_LOCKED) {
+        mkey_fsm_dispatch(fsm, MKEY_FSM_EV_SCAN_TIMEOUT, now_us);
+    } else if (fsm->state == MKEY_FSM_IGN_OFF) {
+        const int64_t elapsed = now_us - fsm->ign_off_start_us;
+        mkey_fsm_dispatch(fsm,
+                          !fsm->door_latched &&
+                                  elapsed >= (int64_t)MKEY_IGN_DOOR_SLEEP_MS * 1000
+                              ? MKEY_FSM_EV_DOOR_TIMEOUT
+                              : MKEY_FSM_EV_HARD_TIMEOUT,
+                          now_us);
+    }
+}
+
+int64_t mkey_fsm_deadline(const mkey_fsm_t *fsm, int64_t now_us) {
+    const int64_t tick_us = (int64_t)MKEY_SCAN_TICK_MS * 1000;
+
+    switch (fsm->state) {
+        case MKEY_FSM_LOCKED:
+            return fsm->search_start_us + MKEY_SCAN_LIMIT_CYCLES * tick_us;
+        case MKEY_FSM_IGN_OFF:
+            if (fsm->door_open) {
+                return 0;
+            }
+            if (!fsm->door_latched) {
+                return fsm->ign_off_start_us + (int64_t)MKEY_IGN_DOOR_SLEEP_MS * 1000;
+            }
+            return fsm->ign_off_start_us + (int64_t)MKEY_IGN_MAX_SLEEP_MS * 1000;
+        default:
+            return 0;
+    }
+}
+
+uint32_t mkey_fsm_scan_cycles(const mkey_fsm_t *fsm, int64_t now_us) {
+    return (uint32_t)((now_us - fsm->search_start_us) /
+                      ((int64_t)MKEY_SCAN_TICK_MS * 1000));
+}
+
+bool mkey_fsm_unlocked(const mkey_fsm_t *fsm) {
+    return fsm->state == MKEY_FSM_IGN_ON || fsm->state == MKEY_FSM_IGN_OFF;
+}
+
+const char *mkey_fsm_state_name(mkey_fsm_state_t state) {
+    return state < MKEY_FSM_STATE_COUNT ? s_state_names[state] : "?";
+}
+
+const char *mkey_fsm_event_name(mkey_fsm_event_t event) {
+    return event < MKEY_FSM_EV_COUNT ? s_event_names[event] : "?";
+}
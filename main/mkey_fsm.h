@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mkey.h"
+
+// ----------------------------------------------------
+// CONTROL STATE MACHINE API
+// ----------------------------------------------------
+
+// Authorization, ignition/door and sleep decisions of the .ino main loop.
+// Pure like the presence tracker: the caller passes the time and the input
+// levels, and the machine only acts through the HAL, so it runs unchanged on
+// the device and in a simulation that jumps from deadline to deadline.
+
+typedef enum {
+    MKEY_FSM_LOCKED = 0,      // no key: searching, relay locked
+    MKEY_FSM_IGN_ON,          // key present, IGN on: relay released
+    MKEY_FSM_IGN_OFF,         // key present, IGN off: counting down to sleep
+    MKEY_FSM_SLEEP,           // deep sleep requested (final)
+    MKEY_FSM_STATE_COUNT,
+} mkey_fsm_state_t;
+
+typedef enum {
+    MKEY_FSM_EV_KEY_PRESENT = 0,
+    MKEY_FSM_EV_KEY_LOST,
+    MKEY_FSM_EV_IGN_ON,
+    MKEY_FSM_EV_IGN_OFF,
+    MKEY_FSM_EV_DOOR_OPEN,
+    MKEY_FSM_EV_DOOR_CLOSED,
+    MKEY_FSM_EV_DOOR_TIMEOUT,     // MKEY_IGN_DOOR_SLEEP_MS after the door closed
+    MKEY_FSM_EV_HARD_TIMEOUT,     // MKEY_IGN_MAX_SLEEP_MS with IGN off
+    MKEY_FSM_EV_SCAN_TIMEOUT,     // MKEY_SCAN_LIMIT_CYCLES without a key
+    MKEY_FSM_EV_COUNT,
+} mkey_fsm_event_t;
+
+// Everything the machine does to the outside world.
+typedef struct {
+    // relay level (1 = locked, as the pin) and LED
+    void (*outputs)(void *ctx, bool relay_locked, bool led);
+    // audible confirmation of an unlock; must not block
+    void (*beep)(void *ctx);
+    // enter deep sleep; does not return on the device
+    void (*sleep)(void *ctx, const char *reason);
+    void *ctx;
+} mkey_fsm_hal_t;
+
+typedef struct {
+    const mkey_fsm_hal_t *hal;
+    uint8_t state;                // mkey_fsm_state_t
+    bool ign_on;                  // input levels as last reported
+    bool door_open;
+    bool door_latched;            // flanco_door: 1 until the door opens
+    int64_t ign_off_start_us;     // start of the running IGN off window
+    int64_t search_start_us;      // when the last key went away (or boot)
+    mkey_counters_t counters;
+} mkey_fsm_t;
+
+// Starts LOCKED and searching at `now_us` with the given input levels.
+void mkey_fsm_init(mkey_fsm_t *fsm, const mkey_fsm_hal_t *hal, bool ign_on,
+                   bool door_open, int64_t now_us);
+
+// Feeds one event. Returns true when the current state has a transition for
+// it (events without one are ignored, e.g. the door while IGN is on).
+bool mkey_fsm_dispatch(mkey_fsm_t *fsm, mkey_fsm_event_t event, int64_t now_us);
+
+// Reports the input levels; changes become IGN/DOOR events.
+void mkey_fsm_inputs(mkey_fsm_t *fsm, bool ign_on, bool door_open,
+                     int64_t now_us);
+
+// Fires the timeouts that are due at `now_us`.
+void mkey_fsm_step(mkey_fsm_t *fsm, int64_t now_us);
+
+// Earliest time at which mkey_fsm_step() has something to do, or 0 when no
+// timeout is running (IGN on, door held open).
+int64_t mkey_fsm_deadline(const mkey_fsm_t *fsm, int64_t now_us);
+
+// Scan loops without a key: one per MKEY_SCAN_TICK_MS.
+uint32_t mkey_fsm_scan_cycles(const mkey_fsm_t *fsm, int64_t now_us);
+
+// True in the states where a key is present.
+bool mkey_fsm_unlocked(const mkey_fsm_t *fsm);
+
+const char *mkey_fsm_state_name(mkey_fsm_state_t state);
+const char *mkey_fsm_event_name(mkey_fsm_event_t event);
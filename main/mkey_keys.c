@@ -0,0 +1,308 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "mkey.h"
+#include "mkey_keys.h"
+#include "gap.h"
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+
+#define MKEY_KEYS_SLOT_FREE    0xFFFF
+
+_Static_assert(sizeof(mkey_key_t) == 20, "mkey_key_t is a wire format");
+_Static_assert((MKEY_KEYS_HASH_SLOTS & (MKEY_KEYS_HASH_SLOTS - 1)) == 0,
+               "MKEY_KEYS_HASH_SLOTS must be a power of two");
+_Static_assert(MKEY_KEYS_HASH_SLOTS >= 2 * MKEY_KEYS_MAX,
+               "hash index would be more than half full");
+
+/****************************************************
+ * TYPES
+*****************************************************/
+
+// What goes to NVS: header plus `count` keys sorted by address
+typedef struct {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t reserved;
+    uint32_t generation;
+    mkey_key_t keys[MKEY_KEYS_MAX];
+} mkey_keys_blob_t;
+
+typedef struct {
+    mkey_keys_blob_t blob;
+    uint16_t enabled;
+    uint16_t index[MKEY_KEYS_HASH_SLOTS];  // positions in blob.keys
+    uint32_t filter[256 / 32];             // one bit per address LSB
+} mkey_keys_table_t;
+
+/****************************************************
+ * VARIABLES
+*****************************************************/
+
+// One table serves lookups while a batch edits the other; commit swaps them
+static mkey_keys_table_t s_tables[2];
+static mkey_keys_table_t *s_active = &s_tables[0];
+static bool s_batch_open;
+
+/****************************************************
+ * INTERNALS
+*****************************************************/
+static mkey_keys_table_t *mkey_keys_staging(void) {
+    return s_active == &s_tables[0] ? &s_tables[1] : &s_tables[0];
+}
+
+static uint16_t mkey_keys_hash(const uint8_t addr[6]) {
+    uint32_t v = addr[0] | (addr[1] << 8) | (addr[2] << 16) |
+                 ((uint32_t)addr[3] << 24);
+
+    v ^= addr[4] | (addr[5] << 8);
+    return ((v * 2654435761u) >> 16) & (MKEY_KEYS_HASH_SLOTS - 1);
+}
+
+// Position of `addr` in the sorted keys, or where it would be inserted.
+static uint16_t mkey_keys_search(const mkey_keys_blob_t *blob,
+                                 const uint8_t addr[6], bool *found) {
+    uint16_t lo = 0;
+    uint16_t hi = blob->count;
+
+    while (lo < hi) {
+        const uint16_t mid = (lo + hi) / 2;
+        const int cmp = memcmp(blob->keys[mid].addr, addr, 6);
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = false;
+    return lo;
+}
+
+static void mkey_keys_index(mkey_keys_table_t *t) {
+    memset(t->index, 0xFF, sizeof(t->index));
+    memset(t->filter, 0, sizeof(t->filter));
+    t->enabled = 0;
+
+    for (uint16_t i = 0; i < t->blob.count; i++) {
+        const mkey_key_t *key = &t->blob.keys[i];
+        if (key->flags & MKEY_KEY_F_DISABLED) {
+            continue;
+        }
+        uint16_t h = mkey_keys_hash(key->addr);
+        while (t->index[h] != MKEY_KEYS_SLOT_FREE) {
+            h = (h + 1) & (MKEY_KEYS_HASH_SLOTS - 1);
+        }
+        t->index[h] = i;
+        t->filter[key->addr[0] >> 5] |= 1u << (key->addr[0] & 31);
+        t->enabled++;
+    }
+}
+
+static esp_err_t mkey_keys_insert(mkey_keys_blob_t *blob, const mkey_key_t *key) {
+    bool found;
+    const uint16_t pos = mkey_keys_search(blob, key->addr, &found);
+
+    if (!found) {
+        if (blob->count >= MKEY_KEYS_MAX) {
+            return ESP_ERR_NO_MEM;
+        }
+        memmove(&blob->keys[pos + 1], &blob->keys[pos],
+                (blob->count - pos) * sizeof(mkey_key_t));
+        blob->count++;
+    }
+    blob->keys[pos] = *key;
+    return ESP_OK;
+}
+
+static bool mkey_keys_load(mkey_keys_blob_t *blob) {
+    const size_t header = offsetof(mkey_keys_blob_t, keys);
+    nvs_handle_t nvs;
+    size_t len = sizeof(*blob);
+    esp_err_t err;
+
+    if (nvs_open(MKEY_KEYS_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    err = nvs_get_blob(nvs, MKEY_KEYS_NVS_KEY, blob, &len);
+    nvs_close(nvs);
+
+    return err == ESP_OK && len >= header && blob->magic == MKEY_KEYS_MAGIC &&
+           blob->count <= MKEY_KEYS_MAX &&
+           len == header + blob->count * sizeof(mkey_key_t);
+}
+
+static esp_err_t mkey_keys_save(const mkey_keys_blob_t *blob) {
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    err = nvs_open(MKEY_KEYS_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, MKEY_KEYS_NVS_KEY, blob,
+                       offsetof(mkey_keys_blob_t, keys) +
+                           blob->count * sizeof(mkey_key_t));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+static void mkey_keys_factory(mkey_keys_blob_t *blob) {
+    const mkey_key_t tag1 = {
+        .addr = MKEY_TAG1_ADDR, .rssi_min = MKEY_RSSI_MIN_DEVICE1, .label = "TAG1",
+    };
+    const mkey_key_t tag2 = {
+        .addr = MKEY_TAG2_ADDR, .rssi_min = MKEY_RSSI_MIN_DEVICE2, .label = "TAG2",
+    };
+
+    memset(blob, 0, sizeof(*blob));
+    blob->magic = MKEY_KEYS_MAGIC;
+    mkey_keys_insert(blob, &tag1);
+    mkey_keys_insert(blob, &tag2);
+}
+
+/****************************************************
+ * PUBLIC API
+*****************************************************/
+void mkey_keys_init(void) {
+    s_active = &s_tables[0];
+    s_batch_open = false;
+
+    if (!mkey_keys_load(&s_active->blob)) {
+        ESP_LOGI(LOG_TAG_MKEY_KEYS, "No stored keys, using the factory tags");
+        mkey_keys_factory(&s_active->blob);
+    }
+    mkey_keys_index(s_active);
+    ESP_LOGI(LOG_TAG_MKEY_KEYS, "%u keys enrolled (%u enabled), generation %lu",
+             s_active->blob.count, s_active->enabled,
+             (unsigned long)s_active->blob.generation);
+}
+
+const mkey_key_t *mkey_keys_find(const uint8_t addr[6], uint16_t *index) {
+    const mkey_keys_table_t *t = s_active;
+
+    if (!(t->filter[addr[0] >> 5] & (1u << (addr[0] & 31)))) {
+        return NULL;
+    }
+    for (uint16_t h = mkey_keys_hash(addr);; h = (h + 1) & (MKEY_KEYS_HASH_SLOTS - 1)) {
+        const uint16_t i = t->index[h];
+        if (i == MKEY_KEYS_SLOT_FREE) {
+            return NULL;
+        }
+        if (memcmp(t->blob.keys[i].addr, addr, 6) == 0) {
+            if (index) {
+                *index = i;
+            }
+            return &t->blob.keys[i];
+        }
+    }
+}
+
+const mkey_key_t *mkey_keys_at(uint16_t index) {
+    return index < s_active->blob.count ? &s_active->blob.keys[index] : NULL;
+}
+
+uint16_t mkey_keys_count(void) {
+    return s_active->blob.count;
+}
+
+uint16_t mkey_keys_enabled(void) {
+    return s_active->enabled;
+}
+
+uint32_t mkey_keys_generation(void) {
+    return s_active->blob.generation;
+}
+
+esp_err_t mkey_keys_begin(void) {
+    mkey_keys_table_t *staging = mkey_keys_staging();
+
+    // a second BEGIN restarts the batch
+    memcpy(&staging->blob, &s_active->blob,
+           offsetof(mkey_keys_blob_t, keys) +
+               s_active->blob.count * sizeof(mkey_key_t));
+    s_batch_open = true;
+    return ESP_OK;
+}
+
+esp_err_t mkey_keys_put(const mkey_key_t *key) {
+    if (!s_batch_open) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return mkey_keys_insert(&mkey_keys_staging()->blob, key);
+}
+
+esp_err_t mkey_keys_remove(const uint8_t addr[6]) {
+    mkey_keys_blob_t *blob = &mkey_keys_staging()->blob;
+    bool found;
+
+    if (!s_batch_open) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    const uint16_t pos = mkey_keys_search(blob, addr, &found);
+    if (!found) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    blob->count--;
+    memmove(&blob->keys[pos], &blob->keys[pos + 1],
+            (blob->count - pos) * sizeof(mkey_key_t));
+    return ESP_OK;
+}
+
+esp_err_t mkey_keys_clear(void) {
+    if (!s_batch_open) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    mkey_keys_staging()->blob.count = 0;
+    return ESP_OK;
+}
+
+esp_err_t mkey_keys_commit(void) {
+    mkey_keys_table_t *staging = mkey_keys_staging();
+    esp_err_t err;
+
+    if (!s_batch_open) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    staging->blob.magic = MKEY_KEYS_MAGIC;
+    staging->blob.generation = s_active->blob.generation + 1;
+
+    // the batch stays open on failure so the client can retry the commit
+    err = mkey_keys_save(&staging->blob);
+    if (err != ESP_OK) {
+        ESP_LOGE(LOG_TAG_MKEY_KEYS, "Saving keys failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    mkey_keys_index(staging);
+    s_active = staging;
+    s_batch_open = false;
+    ESP_LOGI(LOG_TAG_MKEY_KEYS, "Committed %u keys (%u enabled), generation %lu",
+             s_active->blob.count, s_active->enabled,
+             (unsigned long)s_active->blob.generation);
+
+    gap_scan_tags_changed();
+    return ESP_OK;
+}
+
+void mkey_keys_abort(void) {
+    s_batch_open = false;
+}
+
+bool mkey_keys_pending(uint16_t *count) {
+    if (count) {
+        *count = s_batch_open ? mkey_keys_staging()->blob.count : 0;
+    }
+    return s_batch_open;
+}
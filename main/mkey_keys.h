@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+// ----------------------------------------------------
+// ENROLLED KEY TABLE CONSTANTS
+// ----------------------------------------------------
+
+#define LOG_TAG_MKEY_KEYS "mkey_keys"
+
+// Tags that can be enrolled; the table lives in one NVS blob.
+#define MKEY_KEYS_MAX                 256
+
+// Open addressing index, kept at most half full so a lookup probes about
+// one slot.
+#define MKEY_KEYS_HASH_SLOTS          512
+
+#define MKEY_KEYS_NVS_NAMESPACE       "mkey"
+#define MKEY_KEYS_NVS_KEY             "keys"
+#define MKEY_KEYS_MAGIC               0x4B594B4D  // "MKYK"
+
+#define MKEY_KEY_LABEL_LEN            12
+
+// mkey_key_t flags
+#define MKEY_KEY_F_DISABLED           0x01  // kept enrolled but never matched
+
+// ----------------------------------------------------
+// ENROLLED KEY TABLE API
+// ----------------------------------------------------
+
+// One enrolled tag. Also the record format of the GATT enrollment service,
+// 20 bytes with no padding.
+typedef struct {
+    uint8_t addr[6];                    // public address, LSB first
+    int8_t rssi_min;                    // threshold to accept the tag (dBm)
+    uint8_t flags;                      // MKEY_KEY_F_*
+    char label[MKEY_KEY_LABEL_LEN];     // driver / fob name, not terminated
+} mkey_key_t;
+
+// Loads the table from NVS, or the factory tags when nothing was stored.
+void mkey_keys_init(void);
+
+// Enabled tag with this address, or NULL. Safe from the scan callback:
+// a bitmap test rejects most foreign addresses, the rest is one hash probe.
+// `index` (optional) receives the position of the tag in the table.
+const mkey_key_t *mkey_keys_find(const uint8_t addr[6], uint16_t *index);
+
+// Tag at `index` of the table (sorted by address), or NULL past the end.
+const mkey_key_t *mkey_keys_at(uint16_t index);
+
+// Enrolled tags, and how many of them are enabled.
+uint16_t mkey_keys_count(void);
+uint16_t mkey_keys_enabled(void);
+
+// Bumped by every committed batch.
+uint32_t mkey_keys_generation(void);
+
+// Batched changes. A batch edits a copy of the table; mkey_keys_commit()
+// writes NVS once and swaps the copy in, so a failed or abandoned batch leaves
+// the enrolled tags untouched. Host task only, like the lookups.
+esp_err_t mkey_keys_begin(void);
+esp_err_t mkey_keys_put(const mkey_key_t *key);  // add or replace
+esp_err_t mkey_keys_remove(const uint8_t addr[6]);
+esp_err_t mkey_keys_clear(void);
+esp_err_t mkey_keys_commit(void);
+void mkey_keys_abort(void);
+
+// True while a batch is open, with the number of tags it holds.
+bool mkey_keys_pending(uint16_t *count);
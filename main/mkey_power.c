@@ -0,0 +1,199 @@
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+
+#include "mkey_power.h"
+
+/****************************************************
+ * TYPES
+*****************************************************/
+typedef struct {
+    uint8_t base;                 // state set by the control loop
+    uint8_t state;                // accounted state (OTA overrides base)
+    int64_t since_us;             // when `state` was entered
+    bool held[MKEY_POWER_LOCK_COUNT];
+    mkey_power_state_stats_t states[MKEY_POWER_STATE_COUNT];
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_handle_t locks[MKEY_POWER_LOCK_COUNT];
+#endif
+} mkey_power_t;
+
+/****************************************************
+ * VARIABLES
+*****************************************************/
+static mkey_power_t s_power;
+
+// the light sleep callback runs with the scheduler stopped
+static portMUX_TYPE s_power_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *const s_state_names[MKEY_POWER_STATE_COUNT] = {
+    "search", "present", "ign_off", "ota",
+};
+
+/****************************************************
+ * INTERNALS
+*****************************************************/
+
+// Closes the time slice of the current state and enters the effective one.
+// Called from the control task (state) and the host task (OTA lock).
+static void mkey_power_switch(void) {
+    const int64_t now = esp_timer_get_time();
+    mkey_power_state_stats_t st;
+    uint8_t prev;
+    uint8_t next;
+
+    portENTER_CRITICAL(&s_power_mux);
+    prev = s_power.state;
+    next = s_power.held[MKEY_POWER_LOCK_OTA] ? MKEY_POWER_OTA : s_power.base;
+    if (next != prev) {
+        s_power.states[prev].time_us += now - s_power.since_us;
+        s_power.state = next;
+        s_power.since_us = now;
+    }
+    st = s_power.states[prev];
+    portEXIT_CRITICAL(&s_power_mux);
+
+    if (next == prev) {
+        return;
+    }
+    ESP_LOGI(LOG_TAG_MKEY_POWER, "%s -> %s (%s so far: %llu ms, %lu wakes, est. ~%lu uA)",
+             s_state_names[prev], s_state_names[next], s_state_names[prev],
+             (unsigned long long)(st.time_us / 1000), (unsigned long)st.wakes,
+             (unsigned long)mkey_power_est_ua(&st));
+}
+
+#if CONFIG_PM_ENABLE
+static esp_err_t IRAM_ATTR mkey_power_sleep_exit(int64_t sleep_time_us, void *arg) {
+    portENTER_CRITICAL_ISR(&s_power_mux);
+    s_power.states[s_power.state].sleep_us += sleep_time_us;
+    s_power.states[s_power.state].wakes++;
+    portEXIT_CRITICAL_ISR(&s_power_mux);
+    return ESP_OK;
+}
+#endif
+
+/****************************************************
+ * PUBLIC API
+*****************************************************/
+void mkey_power_init(void) {
+    s_power.state = MKEY_POWER_SEARCH;
+    s_power.base = MKEY_POWER_SEARCH;
+    s_power.since_us = esp_timer_get_time();
+
+#if CONFIG_PM_ENABLE
+    static const esp_pm_lock_type_t types[MKEY_POWER_LOCK_COUNT] = {
+        [MKEY_POWER_LOCK_OTA] = ESP_PM_CPU_FREQ_MAX,
+        [MKEY_POWER_LOCK_ACTUATOR] = ESP_PM_NO_LIGHT_SLEEP,
+    };
+    static const char *const names[MKEY_POWER_LOCK_COUNT] = {"ota", "actuator"};
+    const esp_pm_config_t config = {
+        .max_freq_mhz = MKEY_POWER_MAX_FREQ_MHZ,
+        .min_freq_mhz = MKEY_POWER_MIN_FREQ_MHZ,
+        .light_sleep_enable = true,
+    };
+    esp_pm_sleep_cbs_register_config_t cbs = {
+        .exit_cb = mkey_power_sleep_exit,
+    };
+    esp_err_t ret;
+
+    for (int i = 0; i < MKEY_POWER_LOCK_COUNT; i++) {
+        ret = esp_pm_lock_create(types[i], 0, names[i], &s_power.locks[i]);
+        if (ret != ESP_OK) {
+            ESP_LOGE(LOG_TAG_MKEY_POWER, "PM lock %s failed (%s)", names[i],
+                     esp_err_to_name(ret));
+        }
+    }
+    ret = esp_pm_light_sleep_register_cbs(&cbs);
+    if (ret != ESP_OK) {
+        ESP_LOGW(LOG_TAG_MKEY_POWER, "No light sleep accounting (%s)",
+                 esp_err_to_name(ret));
+    }
+    ret = esp_pm_configure(&config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(LOG_TAG_MKEY_POWER, "PM configuration failed (%s)",
+                 esp_err_to_name(ret));
+        return;
+    }
+    ESP_LOGI(LOG_TAG_MKEY_POWER, "DFS %d-%d MHz, automatic light sleep on",
+             MKEY_POWER_MIN_FREQ_MHZ, MKEY_POWER_MAX_FREQ_MHZ);
+#else
+    ESP_LOGI(LOG_TAG_MKEY_POWER, "CONFIG_PM_ENABLE off, running at full speed");
+#endif
+}
+
+void mkey_power_hold(mkey_power_lock_t lock, bool on) {
+    // callers on different tasks share held[]: test and flip it in one go,
+    // so each change takes or gives back the PM lock exactly once
+    portENTER_CRITICAL(&s_power_mux);
+    if (s_power.held[lock] == on) {
+        portEXIT_CRITICAL(&s_power_mux);
+        return;
+    }
+    s_power.held[lock] = on;
+#if CONFIG_PM_ENABLE
+    // both are ISR safe, and inside the lock they stay in the order of the
+    // flag changes
+    if (s_power.locks[lock]) {
+        if (on) {
+            esp_pm_lock_acquire(s_power.locks[lock]);
+        } else {
+            esp_pm_lock_release(s_power.locks[lock]);
+        }
+    }
+#endif
+    portEXIT_CRITICAL(&s_power_mux);
+
+    if (lock == MKEY_POWER_LOCK_OTA) {
+        mkey_power_switch();
+    }
+}
+
+void mkey_power_state_set(mkey_power_state_t state) {
+    if (s_power.base == state) {
+        return;
+    }
+    s_power.base = state;
+    mkey_power_switch();
+}
+
+void mkey_power_stats_get(mkey_power_stats_t *out) {
+    const int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_power_mux);
+    out->state = s_power.state;
+    memcpy(out->states, s_power.states, sizeof(out->states));
+    out->states[s_power.state].time_us += now - s_power.since_us;
+    portEXIT_CRITICAL(&s_power_mux);
+}
+
+uint32_t mkey_power_est_ua(const mkey_power_state_stats_t *s) {
+    if (s->time_us == 0) {
+        return 0;
+    }
+    const uint64_t sleep_us = s->sleep_us < s->time_us ? s->sleep_us : s->time_us;
+    const uint64_t awake_us = s->time_us - sleep_us;
+
+    return (uint32_t)((awake_us * MKEY_POWER_AWAKE_UA +
+                       sleep_us * MKEY_POWER_SLEEP_UA) / s->time_us);
+}
+
+void mkey_power_log(void) {
+    mkey_power_stats_t stats;
+
+    mkey_power_stats_get(&stats);
+    for (int i = 0; i < MKEY_POWER_STATE_COUNT; i++) {
+        const mkey_power_state_stats_t *st = &stats.states[i];
+        if (st->time_us == 0) {
+            continue;
+        }
+        ESP_LOGI(LOG_TAG_MKEY_POWER, "%-8s %llu ms, %llu%% asleep, %lu wakes, est. ~%lu uA",
+                 s_state_names[i], (unsigned long long)(st->time_us / 1000),
+                 (unsigned long long)(st->sleep_us * 100 / st->time_us),
+                 (unsigned long)st->wakes, (unsigned long)mkey_power_est_ua(st));
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+
+// ----------------------------------------------------
+// POWER MANAGEMENT CONSTANTS
+// ----------------------------------------------------
+
+#define LOG_TAG_MKEY_POWER "mkey_power"
+
+// With CONFIG_PM_ENABLE the CPU scales between these and sleeps whenever the
+// scheduler is idle (CONFIG_FREERTOS_USE_TICKLESS_IDLE); the BLE controller
+// sleeps between radio events (CONFIG_BT_LE_SLEEP_ENABLE).
+#define MKEY_POWER_MAX_FREQ_MHZ       CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#define MKEY_POWER_MIN_FREQ_MHZ       CONFIG_XTAL_FREQ
+
+// Board supply current awake (CPU and radio averaged) and in light sleep,
+// used to turn the measured sleep share into an average current. Rough
+// figures; calibrate them against a meter on the real board.
+#define MKEY_POWER_AWAKE_UA           22000
+#define MKEY_POWER_SLEEP_UA           250
+
+// ----------------------------------------------------
+// POWER MANAGEMENT API
+// ----------------------------------------------------
+
+// What the unit is doing, for the per-state accounting.
+typedef enum {
+    MKEY_POWER_SEARCH = 0,    // no key present, scanning before deep sleep
+    MKEY_POWER_PRESENT,       // key present, IGN on
+    MKEY_POWER_IGN_OFF,       // key present, IGN off, counting down to sleep
+    MKEY_POWER_OTA,           // firmware update running (follows the OTA lock)
+    MKEY_POWER_STATE_COUNT,
+} mkey_power_state_t;
+
+// Work that must not be slowed down or put to sleep.
+typedef enum {
+    MKEY_POWER_LOCK_OTA = 0,  // full CPU speed, no light sleep
+    MKEY_POWER_LOCK_ACTUATOR, // no light sleep while an output pulse runs
+    MKEY_POWER_LOCK_COUNT,
+} mkey_power_lock_t;
+
+typedef struct {
+    uint64_t time_us;         // time spent in the state
+    uint64_t sleep_us;        // of which in light sleep
+    uint32_t wakes;           // light sleep exits
+} mkey_power_state_stats_t;
+
+typedef struct {
+    uint8_t state;            // mkey_power_state_t right now
+    mkey_power_state_stats_t states[MKEY_POWER_STATE_COUNT];
+} mkey_power_stats_t;
+
+// Configures DFS and automatic light sleep; without CONFIG_PM_ENABLE only
+// the time accounting runs.
+void mkey_power_init(void);
+
+// Takes (on) or gives back (off) a lock. Idempotent, so callers can mirror
+// a flag without counting. Safe to call from any task.
+void mkey_power_hold(mkey_power_lock_t lock, bool on);
+
+// Current state of the control loop; cheap when unchanged.
+void mkey_power_state_set(mkey_power_state_t state);
+
+// Snapshot of the accounting, the current state included up to now.
+void mkey_power_stats_get(mkey_power_stats_t *out);
+
+// Average supply current of a state (uA), 0 before any time was spent in
+// it. An estimate, not a measurement: the sleep share weighted with
+// MKEY_POWER_AWAKE_UA and MKEY_POWER_SLEEP_UA.
+uint32_t mkey_power_est_ua(const mkey_power_state_stats_t *s);
+
+// One log line per state that was entered since boot.
+void mkey_power_log(void);
@@ -0,0 +1,148 @@
+#include <string.h>
+
+#include "mkey_presence.h"
+
+_Static_assert(MKEY_PRESENCE_ENTER_SAMPLES <= MKEY_PRESENCE_SAMPLES,
+               "entering needs a full median window at most");
+
+/****************************************************
+ * INTERNALS
+*****************************************************/
+static int8_t mkey_presence_median(const mkey_presence_tag_t *tag) {
+    int8_t sorted[MKEY_PRESENCE_SAMPLES];
+
+    // insertion sort, at most MKEY_PRESENCE_SAMPLES entries
+    for (uint8_t i = 0; i < tag->count; i++) {
+        int8_t v = tag->rssi[i];
+        uint8_t j = i;
+        while (j > 0 && sorted[j - 1] > v) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = v;
+    }
+    return sorted[tag->count / 2];
+}
+
+static void mkey_presence_forget(mkey_presence_tag_t *tag) {
+    tag->present = false;
+    tag->count = 0;
+    tag->head = 0;
+}
+
+// Slot of `addr`, else a free one, else the absent tag heard least recently.
+// NULL when every slot holds a present tag.
+static mkey_presence_tag_t *mkey_presence_slot(mkey_presence_t *p,
+                                               const uint8_t addr[6]) {
+    mkey_presence_tag_t *victim = NULL;
+
+    for (int i = 0; i < MKEY_PRESENCE_TAGS; i++) {
+        mkey_presence_tag_t *tag = &p->tags[i];
+        if (tag->samples && memcmp(tag->addr, addr, 6) == 0) {
+            return tag;
+        }
+        if (tag->present) {
+            continue;
+        }
+        if (victim == NULL || !tag->samples ||
+            (victim->samples && tag->last_seen_us < victim->last_seen_us)) {
+            victim = tag;
+        }
+    }
+    if (victim) {
+        memset(victim, 0, sizeof(*victim));
+        memcpy(victim->addr, addr, 6);
+    }
+    return victim;
+}
+
+/****************************************************
+ * PUBLIC API
+*****************************************************/
+void mkey_presence_init(mkey_presence_t *p, int64_t stale_us) {
+    memset(p, 0, sizeof(*p));
+    p->stale_us = stale_us;
+}
+
+bool mkey_presence_sample(mkey_presence_t *p, const uint8_t addr[6], int rssi,
+                          int enter_dbm, int64_t now_us) {
+    mkey_presence_tag_t *tag = mkey_presence_slot(p, addr);
+
+    if (tag == NULL) {
+        return false;
+    }
+    // re-enrolling can move the threshold; it applies from the next decision
+    tag->enter_dbm = (int8_t)enter_dbm;
+
+    // samples from before a gap say nothing about where the key is now
+    if (tag->count && now_us - tag->last_seen_us > p->stale_us) {
+        mkey_presence_forget(tag);
+    }
+
+    tag->rssi[tag->head] = (int8_t)(rssi < -128 ? -128 : rssi > 127 ? 127 : rssi);
+    tag->head = (tag->head + 1) % MKEY_PRESENCE_SAMPLES;
+    if (tag->count < MKEY_PRESENCE_SAMPLES) {
+        tag->count++;
+    }
+    tag->median = mkey_presence_median(tag);
+    if (tag->count == 1) {
+        tag->ewma_q4 = tag->median * 16;
+    } else {
+        tag->ewma_q4 += (tag->median * 16 - tag->ewma_q4) >> MKEY_PRESENCE_EWMA_SHIFT;
+    }
+    tag->last_seen_us = now_us;
+    tag->samples++;
+
+    // entering needs the median of a full window, so one strong reflection
+    // does not unlock; leaving needs the average well below that
+    if (!tag->present && tag->count >= MKEY_PRESENCE_ENTER_SAMPLES &&
+        tag->median >= tag->enter_dbm) {
+        tag->present = true;
+        tag->ewma_q4 = tag->median * 16;
+        return true;
+    }
+    if (tag->present &&
+        tag->ewma_q4 < (tag->enter_dbm - MKEY_PRESENCE_HYST_DB) * 16) {
+        mkey_presence_forget(tag);
+    }
+    return false;
+}
+
+bool mkey_presence_update(mkey_presence_t *p, int64_t now_us) {
+    const bool was_present = p->any;
+
+    for (int i = 0; i < MKEY_PRESENCE_TAGS; i++) {
+        mkey_presence_tag_t *tag = &p->tags[i];
+        if (tag->present && now_us - tag->last_seen_us > p->stale_us) {
+            mkey_presence_forget(tag);
+        }
+    }
+    p->any = mkey_presence_any(p);
+    return was_present && !p->any;
+}
+
+int64_t mkey_presence_deadline(const mkey_presence_t *p) {
+    int64_t deadline = 0;
+
+    for (int i = 0; i < MKEY_PRESENCE_TAGS; i++) {
+        const mkey_presence_tag_t *tag = &p->tags[i];
+        if (!tag->present) {
+            continue;
+        }
+        // update() drops a tag once it is strictly older than stale_us
+        const int64_t t = tag->last_seen_us + p->stale_us + 1;
+        if (deadline == 0 || t < deadline) {
+            deadline = t;
+        }
+    }
+    return deadline;
+}
+
+bool mkey_presence_any(const mkey_presence_t *p) {
+    for (int i = 0; i < MKEY_PRESENCE_TAGS; i++) {
+        if (p->tags[i].present) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mkey.h"
+
+// ----------------------------------------------------
+// PRESENCE TRACKER CONSTANTS
+// ----------------------------------------------------
+
+// Tags tracked at the same time (any enrolled tag can take a slot; the one
+// heard least recently is recycled).
+#define MKEY_PRESENCE_TAGS            4
+
+// RSSI samples kept per tag. Their median rejects single fades and
+// reflections; an EWMA of the median (weight 1/2^SHIFT) then decides when a
+// present tag has really moved away.
+#define MKEY_PRESENCE_SAMPLES         5
+#define MKEY_PRESENCE_EWMA_SHIFT      3
+
+// Samples a tag needs before it can become present. The median of a partly
+// filled window is skewed towards its strongest report (of one sample, it is
+// that report), so a reflection heard right after a gap could unlock; with a
+// full window most of the reports must clear the threshold.
+#define MKEY_PRESENCE_ENTER_SAMPLES   MKEY_PRESENCE_SAMPLES
+
+// A present tag is dropped only once its median falls this far below the
+// threshold that admitted it.
+#define MKEY_PRESENCE_HYST_DB         6
+
+// ----------------------------------------------------
+// PRESENCE TRACKER API
+// ----------------------------------------------------
+
+typedef struct {
+    uint8_t addr[6];                     // tag in this slot, valid when samples > 0
+    int8_t enter_dbm;                    // its threshold to become present
+    int8_t rssi[MKEY_PRESENCE_SAMPLES];  // ring of recent samples
+    uint8_t head;
+    uint8_t count;
+    int8_t median;                       // median of the ring, valid when count > 0
+    int16_t ewma_q4;                     // EWMA of the median, dBm * 16
+    bool present;
+    int64_t last_seen_us;
+    uint32_t samples;                    // samples taken since the slot was taken
+} mkey_presence_tag_t;
+
+typedef struct {
+    mkey_presence_tag_t tags[MKEY_PRESENCE_TAGS];
+    int64_t stale_us;                    // age after which a tag is dropped
+    bool any;                            // any tag present at the last update
+} mkey_presence_t;
+
+// Pure state machine: no clocks or I/O, every call takes the time, so the
+// same code runs on the device and against recorded traces.
+
+// Starts with no tag present.
+void mkey_presence_init(mkey_presence_t *p, int64_t stale_us);
+
+// Feeds one validated beacon report of the tag at `addr`, whose threshold is
+// `enter_dbm`. Returns true when it made the tag present.
+bool mkey_presence_sample(mkey_presence_t *p, const uint8_t addr[6], int rssi,
+                          int enter_dbm, int64_t now_us);
+
+// Ages the table. Returns true when the last present tag was dropped (weak
+// signal or not heard within stale_us).
+bool mkey_presence_update(mkey_presence_t *p, int64_t now_us);
+
+// Earliest time at which mkey_presence_update() would drop a present tag for
+// not being heard, or 0 while no tag is present.
+int64_t mkey_presence_deadline(const mkey_presence_t *p);
+
+// True while any tag is present.
+bool mkey_presence_any(const mkey_presence_t *p);
@@ -0,0 +1,148 @@
+import argparse
+import time
+
+# Compressed OTA stream: heatshrink-compatible LZSS, must match main/ble/ota_lz.h
+WINDOW_BITS = 11
+LOOKAHEAD_BITS = 4
+MIN_MATCH = 3          # a backref costs 1 + W + L bits, a literal 9 bits
+MAX_CHAIN = 32         # candidates checked per position (speed vs ratio)
+
+# Tunables for the air time estimate
+DEFAULT_LINK_KIBPS = 20.0
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.bits = 0
+
+    def put(self, value: int, nbits: int):
+        self.acc = (self.acc << nbits) | value
+        self.bits += nbits
+        while self.bits >= 8:
+            self.bits -= 8
+            self.out.append((self.acc >> self.bits) & 0xFF)
+        self.acc &= (1 << self.bits) - 1
+
+    def finish(self) -> bytes:
+        if self.bits:
+            self.out.append((self.acc << (8 - self.bits)) & 0xFF)
+            self.bits = 0
+        return bytes(self.out)
+
+
+def compress(data: bytes) -> bytes:
+    window = 1 << WINDOW_BITS
+    max_len = 1 << LOOKAHEAD_BITS
+    chains = {}
+    writer = BitWriter()
+    n = len(data)
+    i = 0
+
+    def insert(pos):
+        if pos + 2 < n:
+            key = (data[pos] << 16) | (data[pos + 1] << 8) | data[pos + 2]
+            chains.setdefault(key, []).append(pos)
+
+    while i < n:
+        best_len = 0
+        best_dist = 0
+        if i + MIN_MATCH <= n:
+            key = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2]
+            candidates = chains.get(key, ())
+            limit = min(max_len, n - i)
+            for pos in reversed(candidates[-MAX_CHAIN:]):
+                dist = i - pos
+                if dist > window:
+                    break
+                length = MIN_MATCH
+                while length < limit and data[pos + length] == data[i + length]:
+                    length += 1
+                if length > best_len:
+                    best_len, best_dist = length, dist
+                    if length == limit:
+                        break
+
+        if best_len >= MIN_MATCH:
+            writer.put(0, 1)
+            writer.put(best_dist - 1, WINDOW_BITS)
+            writer.put(best_len - 1, LOOKAHEAD_BITS)
+            for pos in range(i, i + best_len):
+                insert(pos)
+            i += best_len
+        else:
+            writer.put(0x100 | data[i], 9)
+            insert(i)
+            i += 1
+
+    return writer.finish()
+
+
+def decompress(stream: bytes) -> bytes:
+    out = bytearray()
+    acc = 0
+    bits = 0
+    pos = 0
+
+    def get(nbits):
+        nonlocal acc, bits, pos
+        while bits < nbits:
+            if pos == len(stream):
+                return None
+            acc = (acc << 8) | stream[pos]
+            pos += 1
+            bits += 8
+        bits -= nbits
+        value = (acc >> bits) & ((1 << nbits) - 1)
+        acc &= (1 << bits) - 1
+        return value
+
+    while True:
+        tag = get(1)
+        if tag is None:
+            break
+        if tag:
+            lit = get(8)
+            if lit is None:
+                break
+            out.append(lit)
+        else:
+            index = get(WINDOW_BITS)
+            if index is None:
+                break
+            count = get(LOOKAHEAD_BITS)
+            if count is None:
+                break
+            for _ in range(count + 1):
+                out.append(out[-(index + 1)])
+    return bytes(out)
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Compress a firmware image for compressed BLE OTA")
+    parser.add_argument("--file", "-f", default="ota-ble.bin", help="Firmware binary path")
+    parser.add_argument("--out", "-o", help="Output path (default: <file>.hs)")
+    parser.add_argument("--link-kibps", type=float, default=DEFAULT_LINK_KIBPS, help="Measured raw OTA throughput used for the air time estimate")
+    return parser.parse_args()
+
+
+if __name__ == "__main__":
+    args = parse_args()
+    out_path = args.out or f"{args.file}.hs"
+    with open(args.file, "rb") as file:
+        raw = file.read()
+
+    t0 = time.perf_counter()
+    packed = compress(raw)
+    dt = time.perf_counter() - t0
+    if decompress(packed) != raw:
+        raise SystemExit("Round trip check failed, not writing output.")
+
+    with open(out_path, "wb") as file:
+        file.write(packed)
+
+    ratio = len(packed) / len(raw) if raw else 1.0
+    print(f"{args.file}: {len(raw)} -> {len(packed)} bytes ({ratio * 100:0.1f}%) in {dt:0.1f}s -> {out_path}")
+    rate = args.link_kibps * 1024
+    print(f"Air time at {args.link_kibps:0.1f} KiB/s: raw {len(raw) / rate:0.1f}s, compressed {len(packed) / rate:0.1f}s")
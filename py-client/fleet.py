@@ -0,0 +1,140 @@
+"""Updates every MKEY unit in range with the same image, several at a time.
+
+    python fleet.py -f ota-ble.bin --concurrency 2 --report fleet.json
+"""
+import argparse
+import asyncio
+import contextvars
+import datetime
+import json
+import sys
+
+import main as ota
+
+FLEET_CONCURRENCY = 2     # sessions in flight (central-side connection budget)
+FLEET_RETRIES = 2         # extra attempts per device before it is skipped
+FLEET_RETRY_BACKOFF_S = 3
+FLEET_CONNECT_STAGGER_S = 1.0  # spacing between connection attempts
+
+# address of the device the current task works on, used to tag its output
+current_device = contextvars.ContextVar("current_device", default=None)
+
+
+class TaggedOutput:
+    """stdout wrapper that prefixes every line with the device of the printing task."""
+
+    def __init__(self, stream):
+        self.stream = stream
+        self.line_start = True
+
+    def write(self, text):
+        tag = current_device.get()
+        if tag is None:
+            return self.stream.write(text)
+        for line in text.splitlines(keepends=True):
+            if self.line_start:
+                self.stream.write(f"[{tag}] ")
+            self.stream.write(line)
+            self.line_start = line.endswith("\n")
+        return len(text)
+
+    def flush(self):
+        self.stream.flush()
+
+
+async def update_one(target, image: ota.FirmwareImage, slots: asyncio.Semaphore, gate: asyncio.Lock, retries: int, options: dict):
+    current_device.set(target.address)
+    entry = {"address": target.address, "name": target.name, "result": "skipped", "attempts": 0}
+    t0 = datetime.datetime.now()
+
+    async with slots:
+        for attempt in range(1, retries + 2):
+            entry["attempts"] = attempt
+            # most stacks handle one connection setup at a time
+            async with gate:
+                await asyncio.sleep(FLEET_CONNECT_STAGGER_S)
+            try:
+                # a retried session resumes from the device's last checkpoint
+                result = await ota.update_device(target, image, **options)
+            except Exception as exc:
+                entry["error"] = ota.short_ble_error(exc)
+                print(f"Attempt {attempt} failed: {entry['error']}")
+                if attempt <= retries:
+                    await asyncio.sleep(FLEET_RETRY_BACKOFF_S * attempt)
+                continue
+            entry.pop("error", None)
+            entry.update(result="ok", transport=result["transport"], bytes=result["bytes"],
+                         data_s=round(result["data_s"], 2),
+                         kib_s=round(result["bytes"] / result["data_s"] / 1024, 1) if result["data_s"] else 0.0)
+            break
+        else:
+            entry["result"] = "failed"
+
+    entry["duration_s"] = round((datetime.datetime.now() - t0).total_seconds(), 1)
+    return entry
+
+
+def print_report(report):
+    print(f"{'device':<20} {'result':<8} {'tries':>5} {'time s':>8} {'KiB/s':>7}  detail")
+    for e in report:
+        detail = e.get("error") or e.get("transport", "")
+        print(f"{e['address']:<20} {e['result']:<8} {e['attempts']:>5} {e['duration_s']:>8} {e.get('kib_s', 0.0):>7}  {detail}")
+    ok = sum(1 for e in report if e["result"] == "ok")
+    print(f"{ok}/{len(report)} devices updated.")
+
+
+async def run_fleet(args):
+    with ota.FirmwareImage(args.file) as image:
+        print(f"Image: {image.size} bytes, crc 0x{image.crc:08x}")
+        targets = await ota.discover_targets(args.scan_timeout)
+        if args.only:
+            wanted = {a.lower() for a in args.only}
+            targets = [t for t in targets if t.address.lower() in wanted]
+        if not targets:
+            raise RuntimeError("No OTA targets found.")
+        print(f"Updating {len(targets)} device(s), {args.concurrency} at a time...")
+
+        options = dict(
+            max_payload=args.max_payload,
+            stream=not args.no_stream,
+            resume=True,
+            compress=args.compress,
+            dedup=args.dedup,
+            framing=not args.no_framing,
+            l2cap=not args.no_l2cap,
+        )
+        slots = asyncio.Semaphore(args.concurrency)
+        gate = asyncio.Lock()
+        report = await asyncio.gather(
+            *(update_one(t, image, slots, gate, args.retries, options) for t in targets))
+
+    print_report(report)
+    if args.report:
+        with open(args.report, "w") as file:
+            json.dump(report, file, indent=2)
+        print(f"Report written to {args.report}")
+    return report
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="ESP32 OTA via BLE, every device in range")
+    parser.add_argument("--file", "-f", default="ota-ble.bin", help="Firmware binary path")
+    parser.add_argument("--scan-timeout", type=float, default=ota.SCAN_TIMEOUT_S * 2, help="Discovery scan time (s)")
+    parser.add_argument("--concurrency", "-j", type=int, default=FLEET_CONCURRENCY, help="Devices updated at the same time")
+    parser.add_argument("--retries", type=int, default=FLEET_RETRIES, help="Retries per device before it is skipped")
+    parser.add_argument("--only", action="append", metavar="ADDR", help="Only update this address (repeatable)")
+    parser.add_argument("--report", metavar="PATH", help="Write the per-device report as JSON")
+    parser.add_argument("--max-payload", type=int, default=ota.MAX_PAYLOAD_DEFAULT, help="Max payload per packet (bytes)")
+    parser.add_argument("--no-stream", action="store_true", help="Force acknowledged writes")
+    parser.add_argument("--compress", action="store_true", help="Send the image LZ-compressed")
+    parser.add_argument("--dedup", action="store_true", help="Only send blocks that differ from the running firmware")
+    parser.add_argument("--no-framing", action="store_true", help="Send raw data packets without the frame header")
+    parser.add_argument("--no-l2cap", action="store_true", help="Send data over GATT only")
+    return parser.parse_args()
+
+
+if __name__ == "__main__":
+    args = parse_args()
+    sys.stdout = TaggedOutput(sys.stdout)
+    report = asyncio.run(run_fleet(args))
+    sys.exit(0 if all(e["result"] == "ok" for e in report) else 1)
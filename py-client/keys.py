@@ -0,0 +1,165 @@
+"""Manages the enrolled key tags of an MKEY unit (MKEY Keys service).
+
+    python keys.py --status
+    python keys.py --sync fleet_keys.csv           # replace the whole table
+    python keys.py --add bc:57:29:0b:29:a7,-80,ANA --remove bc:57:29:0b:29:e0
+
+CSV rows are: address, rssi_min, label[, disabled]. All changes of one run go
+out as a single batch and are written to the device's flash once, on commit.
+Enrollment only works while an enrolled key is present and IGN is on, and
+from a bonded client: the first run pairs with the unit, the OS asks for the
+passkey on its label (GAP_SM_PASSKEY).
+"""
+import argparse
+import asyncio
+import csv
+import struct
+
+from bleak import BleakClient
+
+import main as ota
+
+KEYS_SERVICE_UUID = "6a1f3c9e-8b27-4d05-a4e1-93c7b2d05f18"
+KEYS_CONTROL_UUID = "0c7e5a2b-91d4-4f63-8e0a-b5d2c4f71a96"
+KEYS_SCAN_UUID = "4d2e8f1a-6c3b-4a97-b5e0-1f7c9d3a2e64"
+
+# Keys control opcodes (must match svr_chr_keys_op_t)
+KEYS_BEGIN = 1
+KEYS_PUT = 2
+KEYS_DEL = 3
+KEYS_CLEAR = 4
+KEYS_COMMIT = 5
+KEYS_ABORT = 6
+
+# mkey_key_t: [addr 6, LSB first][rssi_min i8][flags u8][label 12]
+KEY_RECORD = struct.Struct("<6sbB12s")
+KEY_F_DISABLED = 0x01
+KEYS_PER_WRITE = 24  # GATT_SVR_KEYS_CONTROL_MAX_LEN
+ADDRS_PER_WRITE = 80
+
+KEYS_ERRORS = {
+    0x80: "denied (needs an enrolled key present and IGN on)",
+    0x81: "no batch open",
+    0x82: "another client has a batch open",
+    0x83: "key table full",
+    0x84: "flash write failed",
+    0x05: "not bonded with the unit (pair first)",
+}
+
+
+def parse_addr(text: str) -> bytes:
+    """'bc:57:29:0b:29:a7' -> LSB-first bytes, as the controller reports them."""
+    raw = bytes.fromhex(text.replace(":", "").replace("-", ""))
+    if len(raw) != 6:
+        raise ValueError(f"bad address {text!r}")
+    return raw[::-1]
+
+
+def pack_key(addr: str, rssi_min: int, label: str = "", disabled: bool = False) -> bytes:
+    return KEY_RECORD.pack(parse_addr(addr), int(rssi_min), KEY_F_DISABLED if disabled else 0,
+                           label.encode()[:12])
+
+
+def load_csv(path: str):
+    keys = []
+    with open(path, newline="") as f:
+        for row in csv.reader(f):
+            if not row or row[0].startswith("#"):
+                continue
+            addr, rssi = row[0].strip(), int(row[1])
+            label = row[2].strip() if len(row) > 2 else ""
+            disabled = len(row) > 3 and row[3].strip().lower() in ("1", "yes", "true", "disabled")
+            keys.append(pack_key(addr, rssi, label, disabled))
+    return keys
+
+
+def parse_status(raw: bytes) -> dict:
+    enrolled, enabled, pending, generation, allowed = struct.unpack_from("<HHHIB", raw)
+    return {"enrolled": enrolled, "enabled": enabled,
+            "batch": None if pending == 0xFFFF else pending,
+            "generation": generation, "allowed": bool(allowed)}
+
+
+def print_scan(raw: bytes):
+    """Report counters of the scanner per filter mode (accept list, open)."""
+    raw = bytes(raw)
+    if len(raw) < 26:
+        return
+    words = struct.unpack_from("<6I", raw, 2)
+    mode = "accept list" if raw[0] == 0 else "open"
+    print(f"Scan: {mode} now ({raw[1]} tags on the accept list)")
+    for i, name in enumerate(("accept list", "open")):
+        reports, hits, ms = words[i * 3:i * 3 + 3]
+        print(f"  {name:11}: {reports} reports, {hits} from enrolled tags, {ms / 1000:0.0f} s")
+
+
+async def keys_op(client: BleakClient, op: int, payload: bytes = b""):
+    try:
+        await client.write_gatt_char(KEYS_CONTROL_UUID, bytes([op]) + payload, response=True)
+    except Exception as exc:
+        code = getattr(exc, "att_error", None) or getattr(exc, "code", None)
+        raise RuntimeError(f"keys op {op} failed: {KEYS_ERRORS.get(code, ota.short_ble_error(exc))}")
+
+
+async def apply_batch(client: BleakClient, puts, removes, replace: bool):
+    await keys_op(client, KEYS_BEGIN)
+    try:
+        if replace:
+            await keys_op(client, KEYS_CLEAR)
+        for i in range(0, len(removes), ADDRS_PER_WRITE):
+            await keys_op(client, KEYS_DEL, b"".join(removes[i:i + ADDRS_PER_WRITE]))
+        for i in range(0, len(puts), KEYS_PER_WRITE):
+            await keys_op(client, KEYS_PUT, b"".join(puts[i:i + KEYS_PER_WRITE]))
+        await keys_op(client, KEYS_COMMIT)
+    except Exception:
+        try:
+            await keys_op(client, KEYS_ABORT)
+        except Exception:
+            pass
+        raise
+
+
+async def run(args):
+    target = await ota.discover_target(args.scan_retries, args.scan_timeout)
+    client = BleakClient(target, timeout=ota.CONNECT_TIMEOUT_S)
+    await client.connect(timeout=ota.CONNECT_TIMEOUT_S)
+    try:
+        # the key table only talks to bonded clients (no-op once bonded)
+        await client.pair()
+        services = await ota.get_services_safe(client)
+        if not services.get_service(KEYS_SERVICE_UUID):
+            raise RuntimeError("Keys service not found on device (firmware too old?).")
+
+        puts = load_csv(args.sync) if args.sync else []
+        for spec in args.add or []:
+            fields = spec.split(",")
+            puts.append(pack_key(fields[0], int(fields[1]) if len(fields) > 1 else -90,
+                                 fields[2] if len(fields) > 2 else ""))
+        removes = [parse_addr(a) for a in args.remove or []]
+
+        if puts or removes or args.sync:
+            await apply_batch(client, puts, removes, replace=bool(args.sync))
+            print(f"Committed {len(puts)} put(s), {len(removes)} removal(s).")
+
+        status = parse_status(await client.read_gatt_char(KEYS_CONTROL_UUID))
+        print(f"Keys: {status['enrolled']} enrolled, {status['enabled']} enabled, "
+              f"generation {status['generation']}, enrollment {'allowed' if status['allowed'] else 'locked'}")
+        if services.get_characteristic(KEYS_SCAN_UUID):
+            print_scan(await client.read_gatt_char(KEYS_SCAN_UUID))
+    finally:
+        await client.disconnect()
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="MKEY enrolled key management via BLE")
+    parser.add_argument("--sync", metavar="CSV", help="Replace the key table with the tags of this file")
+    parser.add_argument("--add", action="append", metavar="ADDR[,RSSI[,LABEL]]", help="Enroll or update a tag")
+    parser.add_argument("--remove", action="append", metavar="ADDR", help="Remove a tag")
+    parser.add_argument("--status", action="store_true", help="Only print the table status")
+    parser.add_argument("--scan-timeout", type=float, default=ota.SCAN_TIMEOUT_S, help="Scan timeout per attempt (s)")
+    parser.add_argument("--scan-retries", type=int, default=ota.SCAN_RETRIES, help="Scan retries")
+    return parser.parse_args()
+
+
+if __name__ == "__main__":
+    asyncio.run(run(parse_args()))
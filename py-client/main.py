@@ -1,13 +1,25 @@
 import argparse
 import asyncio
 import datetime
+import hashlib
 import inspect
+import mmap
+import os
+import socket
+import struct
+import sys
+import zlib
 from bleak import BleakClient, BleakScanner
 
+import compress_fw
+
 
 OTA_DATA_UUID = "bdda975f-9e48-5c04-b67e-f017f019b150"
 OTA_CONTROL_UUID = "834bb43d-8419-5109-b6a4-a0da03786bc6"
 OTA_SERVICE_UUID = "f505f04b-2066-5069-8775-830fcfc57339"
+OTA_LINK_UUID = "a7c3e1d2-5b8f-4c6e-9d1a-2f4b6e8c0a13"
+OTA_STATS_UUID = "3e9b5c71-2d4a-4f86-b0c3-7a1e5d9f2b64"
+OTA_RADIO_UUID = "9b61c3e5-2f8a-4d17-8c4e-6a0d3b7f5e92"
 
 # Device names we accept (lowercase)
 TARGET_DEVICE_NAMES = {"esp32", "mkey"}
@@ -29,6 +41,55 @@ SVR_CHR_OTA_CONTROL_REQUEST_NAK = bytearray.fromhex("03")
 SVR_CHR_OTA_CONTROL_DONE = bytearray.fromhex("04")
 SVR_CHR_OTA_CONTROL_DONE_ACK = bytearray.fromhex("05")
 SVR_CHR_OTA_CONTROL_DONE_NAK = bytearray.fromhex("06")
+SVR_CHR_OTA_CONTROL_DATA_NAK = bytearray.fromhex("07")
+SVR_CHR_OTA_CONTROL_CREDIT = bytearray.fromhex("08")
+SVR_CHR_OTA_CONTROL_RESUME = bytearray.fromhex("09")
+SVR_CHR_OTA_CONTROL_RESUME_ACK = bytearray.fromhex("0a")
+SVR_CHR_OTA_CONTROL_HASH_REQ = bytearray.fromhex("0b")
+SVR_CHR_OTA_CONTROL_HASHES = bytearray.fromhex("0c")
+SVR_CHR_OTA_CONTROL_COPY = bytearray.fromhex("0d")
+SVR_CHR_OTA_CONTROL_GAP = bytearray.fromhex("0e")
+SVR_CHR_OTA_CONTROL_LINK = bytearray.fromhex("0f")
+
+# OTA request flags (argument byte after SVR_CHR_OTA_CONTROL_REQUEST)
+OTA_REQUEST_F_STREAM = 0x01
+OTA_REQUEST_F_LZ = 0x02
+OTA_REQUEST_F_FRAMED = 0x04
+
+# Scan profiles of the device (gap_scan_profile_t), as the radio stats report them
+SCAN_PROFILES = ("search", "present", "ign on", "ota", "pre-sleep")
+
+# Framed sessions: [offset u32][crc32 u32] in front of every data packet
+FRAME_HDR_LEN = 8
+FRAME_DONE_ROUNDS = 5  # DONE -> GAP -> retransmit cycles without progress before giving up
+
+# The device switches to a fast link profile when a session opens; give the
+# controller this long to renegotiate before packets are sized
+LINK_SETTLE_S = 1.0
+
+# L2CAP CoC data channel (must match ota_l2cap.h)
+OTA_L2CAP_PSM = 0x00F5
+L2CAP_SDU_SIZE = 2048
+BDADDR_LE_PUBLIC = 1
+BDADDR_LE_RANDOM = 2
+
+# Block dedup (must match ota_dedup.h)
+DEDUP_BLOCK_SIZE = 4096
+DEDUP_HASH_LEN = 8
+
+
+def is_target(device) -> bool:
+    name = (device.name or "").lower()
+    metadata = getattr(device, "metadata", {}) or {}
+    uuids = [u.lower() for u in (metadata.get("uuids") or [])]
+    print(f"[scan] {device.name} | {device.address} | uuids={uuids}")
+    return name in TARGET_DEVICE_NAMES or OTA_SERVICE_UUID in uuids
+
+
+async def discover_targets(scan_timeout: float):
+    """Every device in range that looks like an OTA target."""
+    devices = await BleakScanner.discover(timeout=scan_timeout)
+    return [d for d in devices if is_target(d)]
 
 
 async def discover_target(retries: int, scan_timeout: float):
@@ -38,11 +99,7 @@ async def discover_target(retries: int, scan_timeout: float):
     for attempt in range(1, retries + 1):
         devices = await BleakScanner.discover(timeout=scan_timeout)
         for device in devices:
-            name = (device.name or "").lower()
-            metadata = getattr(device, "metadata", {}) or {}
-            uuids = [u.lower() for u in (metadata.get("uuids") or [])]
-            print(f"[scan] {device.name} | {device.address} | uuids={uuids}")
-            if name in TARGET_DEVICE_NAMES or OTA_SERVICE_UUID in uuids:
+            if is_target(device):
                 target = device
                 break
 
@@ -86,18 +143,102 @@ async def choose_device(scan_timeout: float):
     return selected
 
 
-def chunk_firmware(file_path: str, packet_size: int):
+class FirmwareImage:
+    """Read-only memory map of the firmware file; packets are zero-copy slices, so
+    any number of concurrent sessions share one copy of the image."""
+
+    def __init__(self, file_path: str):
+        self.path = file_path
+        with open(file_path, "rb") as file:
+            if os.fstat(file.fileno()).st_size == 0:
+                raise ValueError("Firmware file is empty.")
+            self.map = mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+        self.data = memoryview(self.map)
+        self.size = len(self.data)
+        self._crc = None
+        self._packed = None
+
+    @property
+    def crc(self) -> int:
+        # Size + CRC32 identify an image across sessions (same CRC as esp_rom_crc32_le).
+        if self._crc is None:
+            self._crc = zlib.crc32(self.data)
+        return self._crc
+
+    def compressed(self) -> bytes:
+        # compressing is slow, fleet sessions share the result
+        if self._packed is None:
+            self._packed = compress_fw.compress(bytes(self.data))
+        return self._packed
+
+    def chunks(self, packet_size: int, offset: int = 0):
+        return chunk_bytes(self.data[offset:], packet_size)
+
+    def close(self):
+        try:
+            self.data.release()
+            self.map.close()
+        except BufferError:
+            pass  # packets still reference the map, it is unmapped with them
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+def chunk_bytes(data: bytes, packet_size: int):
     if packet_size <= 0:
         raise ValueError("Packet size must be > 0")
+    return [data[i:i + packet_size] for i in range(0, len(data), packet_size)]
+
+
+class CopyRun:
+    """Image bytes the device copies from its running firmware instead of receiving them."""
+
+    def __init__(self, length: int):
+        self.length = length
+
+    def __len__(self):
+        return self.length
+
+
+def block_hash(block: bytes) -> bytes:
+    return hashlib.sha256(block).digest()[:DEDUP_HASH_LEN]
+
+
+def plan_dedup(data: bytes, offset: int, packet_size: int, remote_hashes):
+    """Packets for data[offset:], with blocks the device already runs replaced by CopyRun entries."""
     packets = []
-    with open(file_path, "rb") as file:
-        while chunk := file.read(packet_size):
-            packets.append(chunk)
-    if not packets:
-        raise ValueError("Firmware file is empty.")
+    span_start = None
+    copy_len = 0
+    for start in range(offset, len(data), DEDUP_BLOCK_SIZE):
+        block = data[start:start + DEDUP_BLOCK_SIZE]
+        idx = start // DEDUP_BLOCK_SIZE
+        same = len(block) == DEDUP_BLOCK_SIZE and idx < len(remote_hashes) and remote_hashes[idx] == block_hash(block)
+        if same:
+            if span_start is not None:
+                packets.extend(chunk_bytes(data[span_start:start], packet_size))
+                span_start = None
+            copy_len += DEDUP_BLOCK_SIZE
+        else:
+            if copy_len:
+                packets.append(CopyRun(copy_len))
+                copy_len = 0
+            if span_start is None:
+                span_start = start
+    if span_start is not None:
+        packets.extend(chunk_bytes(data[span_start:], packet_size))
+    if copy_len:
+        packets.append(CopyRun(copy_len))
     return packets
 
 
+def wire_bytes(packets) -> int:
+    return sum(len(p) for p in packets if not isinstance(p, CopyRun))
+
+
 async def wait_for_queue(queue: asyncio.Queue, label: str):
     try:
         return await asyncio.wait_for(queue.get(), timeout=ACK_TIMEOUT_S)
@@ -132,15 +273,326 @@ async def get_services_safe(client: BleakClient):
     raise RuntimeError("Unable to retrieve services from device (Bleak version limitation).")
 
 
-async def send_packets(client: BleakClient, packets):
+def check_data_nak(queue: asyncio.Queue):
+    # The device reports flash write failures asynchronously on the control characteristic.
+    while not queue.empty():
+        resp = queue.get_nowait()
+        if resp == SVR_CHR_OTA_CONTROL_DATA_NAK:
+            raise RuntimeError("Device rejected OTA data (flash write failed).")
+
+
+class CreditWindow:
+    """Write-without-response window; the device grants credits as it drains packets to flash."""
+
+    def __init__(self):
+        self.credits = 0
+        self.event = asyncio.Event()
+
+    def grant(self, credits: int):
+        self.credits += credits
+        self.event.set()
+
+    async def take(self):
+        while self.credits == 0:
+            self.event.clear()
+            try:
+                await asyncio.wait_for(self.event.wait(), timeout=ACK_TIMEOUT_S)
+            except asyncio.TimeoutError:
+                raise TimeoutError("Timeout waiting for OTA credits.")
+        self.credits -= 1
+
+
+def supports_streaming(svc) -> bool:
+    data_chr = svc.get_characteristic(OTA_DATA_UUID)
+    return "write-without-response" in (data_chr.properties or [])
+
+
+class FramedStream:
+    """Packets of a framed session with the stream offset each one starts at."""
+
+    def __init__(self, packets, base_offset: int):
+        self.packets = packets
+        self.offsets = []
+        pos = base_offset
+        for pkg in packets:
+            self.offsets.append(pos)
+            pos += len(pkg)
+        self.end = pos
+
+    def covering(self, start: int, length: int):
+        stop = start + length if length else self.end
+        return [i for i, off in enumerate(self.offsets) if off < stop and off + len(self.packets[i]) > start]
+
+    def frame(self, idx: int) -> bytes:
+        pkg = self.packets[idx]
+        return self.offsets[idx].to_bytes(4, "little") + zlib.crc32(pkg).to_bytes(4, "little") + pkg
+
+
+def parse_gap(resp: bytes):
+    return int.from_bytes(resp[1:5], "little"), int.from_bytes(resp[5:9], "little")
+
+
+def poll_gaps(queue: asyncio.Queue):
+    # Like check_data_nak(), but keeps the gap reports of a framed session.
+    gaps = []
+    while not queue.empty():
+        resp = queue.get_nowait()
+        if resp == SVR_CHR_OTA_CONTROL_DATA_NAK:
+            raise RuntimeError("Device rejected OTA data (flash write failed).")
+        if len(resp) >= 9 and resp[0] == SVR_CHR_OTA_CONTROL_GAP[0]:
+            gaps.append(parse_gap(resp))
+    return gaps
+
+
+async def send_frames(client: BleakClient, frames: FramedStream, indices, queue: asyncio.Queue, window, stream: bool):
+    """Sends the given frames; gaps reported meanwhile are retransmitted before continuing."""
+    pending = list(indices)
+    sent = 0
+    retransmitted = 0
+    while pending:
+        for start, length in poll_gaps(queue):
+            missing = [i for i in frames.covering(start, length) if i not in pending]
+            print(f"Device reports a gap at {start} (+{length or 'end'}), resending {len(missing)} packets")
+            retransmitted += len(missing)
+            pending = missing + pending
+        idx = pending.pop(0)
+        pkg = frames.packets[idx]
+        if stream:
+            await window.take()
+        if isinstance(pkg, CopyRun):
+            await send_copy(client, pkg, frames.offsets[idx])
+        else:
+            await client.write_gatt_char(OTA_DATA_UUID, frames.frame(idx), response=not stream)
+        sent += 1
+        if sent % 20 == 0 or not pending:
+            print(f"Progress: {sent} frames sent, {len(pending)} queued, {retransmitted} retransmitted")
+
+
+async def finish_framed(client: BleakClient, frames: FramedStream, queue: asyncio.Queue, window, stream: bool):
+    """DONE carries the stream length; the device answers with a GAP until it has all of it."""
+    done = SVR_CHR_OTA_CONTROL_DONE + frames.end.to_bytes(4, "little")
+    stalled = 0
+    last_start = None
+    while stalled < FRAME_DONE_ROUNDS:
+        poll_gaps(queue)  # anything older is superseded by the answer to DONE
+        await client.write_gatt_char(OTA_CONTROL_UUID, done, response=True)
+        resp = await wait_for_queue(queue, "OTA done")
+        if len(resp) >= 9 and resp[0] == SVR_CHR_OTA_CONTROL_GAP[0]:
+            start, length = parse_gap(resp)
+            # a lossy link may need many rounds, only give up once the device stops advancing
+            stalled = stalled + 1 if start == last_start else 0
+            last_start = start
+            missing = frames.covering(start, length)
+            print(f"Device still misses {start} (+{length or 'end'}), resending {len(missing)} packets")
+            await send_frames(client, frames, missing, queue, window, stream)
+            continue
+        return resp
+    raise RuntimeError("Device kept reporting missing data.")
+
+
+async def query_block_hashes(client: BleakClient, queue: asyncio.Queue, count: int):
+    """Hashes of the first `count` blocks of the running firmware, or None if the device cannot dedup."""
+    print(f"Requesting {count} block hashes from the device...")
+    hashes = {}
+    try:
+        await client.write_gatt_char(
+            OTA_CONTROL_UUID,
+            SVR_CHR_OTA_CONTROL_HASH_REQ + (0).to_bytes(2, "little") + count.to_bytes(2, "little"),
+            response=True,
+        )
+        while len(hashes) < count:
+            resp = await wait_for_queue(queue, "block hashes")
+            if len(resp) < 4 or resp[0] != SVR_CHR_OTA_CONTROL_HASHES[0]:
+                continue
+            first = int.from_bytes(resp[1:3], "little")
+            for i in range(resp[3]):
+                hashes[first + i] = bytes(resp[4 + i * DEDUP_HASH_LEN:4 + (i + 1) * DEDUP_HASH_LEN])
+    except TimeoutError:
+        print("Device did not answer the hash request, sending the full image.")
+        return None
+    except Exception as exc:
+        print(f"Hash request not supported ({short_ble_error(exc)}), sending the full image.")
+        return None
+    return [hashes[i] for i in range(count)]
+
+
+async def send_copy(client: BleakClient, run: CopyRun, offset=None):
+    msg = SVR_CHR_OTA_CONTROL_COPY + run.length.to_bytes(4, "little")
+    if offset is not None:
+        msg += offset.to_bytes(4, "little")
+    await client.write_gatt_char(OTA_CONTROL_UUID, msg, response=True)
+
+
+async def open_session(client: BleakClient, queue: asyncio.Queue, flags: int, image: FirmwareImage, resume: bool) -> int:
+    """Starts an OTA session and returns the image offset the device wants next."""
+    if resume:
+        size, crc = image.size, image.crc
+        args = bytes([flags]) + size.to_bytes(4, "little") + crc.to_bytes(4, "little")
+        print(f"Querying resume point (size={size}, crc=0x{crc:08x})...")
+        try:
+            await client.write_gatt_char(OTA_CONTROL_UUID, SVR_CHR_OTA_CONTROL_RESUME + args, response=True)
+            resp = await wait_for_queue(queue, "OTA resume")
+        except TimeoutError:
+            print("Device did not answer RESUME, falling back to a full transfer.")
+        except Exception as exc:
+            print(f"RESUME not supported ({short_ble_error(exc)}), falling back to a full transfer.")
+        else:
+            if len(resp) >= 5 and resp[0] == SVR_CHR_OTA_CONTROL_RESUME_ACK[0]:
+                return int.from_bytes(resp[1:5], "little")
+            raise RuntimeError(f"Resume not acknowledged (resp={resp.hex()}).")
+
+    print("Sending OTA request...")
+    request = SVR_CHR_OTA_CONTROL_REQUEST
+    if flags:
+        # the announced (decompressed) size lets the device pre-erase the whole image
+        request += bytes([flags]) + image.size.to_bytes(4, "little")
+    await client.write_gatt_char(OTA_CONTROL_UUID, request, response=True)
+    resp = await wait_for_queue(queue, "OTA request")
+    if resp != SVR_CHR_OTA_CONTROL_REQUEST_ACK:
+        raise RuntimeError(f"Request not acknowledged (resp={resp.hex()}).")
+    return 0
+
+
+class LinkInfo:
+    """Link parameters negotiated by the device (OTA link characteristic / LINK notification)."""
+
+    FIELDS = ("interval", "latency", "timeout", "tx_octets", "rx_octets", "mtu", "chunk")
+
+    def __init__(self, data: bytes):
+        self.tx_phy, self.rx_phy = data[0], data[1]
+        for i, name in enumerate(self.FIELDS):
+            setattr(self, name, int.from_bytes(data[2 + 2 * i:4 + 2 * i], "little"))
+
+    def __str__(self):
+        return (f"PHY {self.tx_phy}M/{self.rx_phy}M, interval {self.interval * 1.25:g} ms, latency {self.latency}, "
+                f"data length {self.tx_octets}/{self.rx_octets}, MTU {self.mtu}, chunk {self.chunk}")
+
+
+async def read_link(client: BleakClient, svc, updated: asyncio.Event):
+    """Waits for the fast profile to settle and returns the negotiated link, or None on old firmware."""
+    if not svc.get_characteristic(OTA_LINK_UUID):
+        return None
+    try:
+        await asyncio.wait_for(updated.wait(), timeout=LINK_SETTLE_S)
+    except asyncio.TimeoutError:
+        pass
+    data = await client.read_gatt_char(OTA_LINK_UUID)
+    return LinkInfo(bytes(data)) if len(data) >= 18 else None
+
+
+async def read_stats(client: BleakClient, svc):
+    """Prints the device's transfer and flash pre-erase counters, if it exposes them."""
+    if not svc.get_characteristic(OTA_STATS_UUID):
+        return
+    data = await client.read_gatt_char(OTA_STATS_UUID)
+    if len(data) < 32:
+        return
+    words = [int.from_bytes(data[i:i + 4], "little") for i in range(0, len(data) - 3, 4)]
+    rx, rx_ms, written, ahead, ahead_min, pre, stalls, stall_us = words[:8]
+    print(f"Device: {rx} bytes received in {rx_ms} ms, {written} written; erase-ahead {ahead // 1024} KiB "
+          f"(min {ahead_min // 1024} KiB), {pre // 1024} KiB pre-erased, {stalls} stalls ({stall_us / 1000:0.1f} ms)")
+    if len(words) >= 14:
+        packets, cb_avg, cb_max, busy_us, job_max, pool_low = words[8:14]
+        print(f"Device: {packets} packets, rx callback {cb_avg} us avg / {cb_max} us max, "
+              f"writer busy {busy_us / 1000:0.1f} ms (slowest job {job_max} us), pool low-water {pool_low}")
+    if not svc.get_characteristic(OTA_RADIO_UUID):
+        return
+    data = await client.read_gatt_char(OTA_RADIO_UUID)
+    if len(data) < 17:
+        return
+    words = [int.from_bytes(data[i:i + 4], "little") for i in range(1, len(data) - 3, 4)]
+    scan_ms, adv_ms, busy_ms, total_ms = words[:4]
+    profile = SCAN_PROFILES[data[0]] if data[0] < len(SCAN_PROFILES) else str(data[0])
+    print(f"Radio: {total_ms / 1000:0.1f} s up, scan on {scan_ms / 1000:0.1f} s ({profile} now), "
+          f"advertising {adv_ms / 1000:0.1f} s, busy links {busy_ms / 1000:0.1f} s")
+    times = words[4:]
+    print("Radio: " + ", ".join(f"{name} {times[i * 2] / 1000:0.1f} s ({times[i * 2 + 1] / 1000:0.1f} s on)"
+                                for i, name in enumerate(SCAN_PROFILES) if i * 2 + 1 < len(times)))
+
+
+def open_l2cap(address: str):
+    """Opens the OTA CoC channel next to the GATT connection (Linux/BlueZ only), or returns None."""
+    if not sys.platform.startswith("linux") or not hasattr(socket, "BTPROTO_L2CAP"):
+        return None
+    last_exc = None
+    for addr_type in (BDADDR_LE_PUBLIC, BDADDR_LE_RANDOM):
+        sock = socket.socket(socket.AF_BLUETOOTH, socket.SOCK_SEQPACKET, socket.BTPROTO_L2CAP)
+        sock.settimeout(CONNECT_TIMEOUT_S)
+        try:
+            # LE channels need the (bdaddr, psm, cid, bdaddr_type) form (Python 3.14+)
+            sock.connect((address, OTA_L2CAP_PSM, 0, addr_type))
+            sock.settimeout(None)
+            return sock
+        except (OSError, TypeError) as exc:
+            last_exc = exc
+            sock.close()
+    print(f"L2CAP channel not available ({last_exc}), using GATT.")
+    return None
+
+
+def l2cap_send_room(sock) -> int:
+    import fcntl  # Linux only, like the channel itself
+    import termios
+
+    # TIOCOUTQ on Bluetooth sockets reports the free send buffer space
+    return struct.unpack("i", fcntl.ioctl(sock.fileno(), termios.TIOCOUTQ, b"\0\0\0\0"))[0]
+
+
+async def send_packets_l2cap(sock, packets, queue: asyncio.Queue):
+    loop = asyncio.get_running_loop()
+    total_packets = len(packets)
+    total_bytes = sum(len(p) for p in packets)
+    sent_bytes = 0
+    idle_room = l2cap_send_room(sock)
+
+    for idx, sdu in enumerate(packets, start=1):
+        check_data_nak(queue)
+        # blocks while the device has no L2CAP credits left
+        await loop.run_in_executor(None, sock.send, sdu)
+        sent_bytes += len(sdu)
+        if idx % 10 == 0 or idx == total_packets:
+            percent = (idx / total_packets) * 100
+            print(f"Progress: {idx}/{total_packets} SDUs ({percent:0.1f}%) | {sent_bytes}/{total_bytes} bytes")
+
+    # DONE travels over ATT, which could overtake SDUs still queued in the kernel
+    deadline = loop.time() + ACK_TIMEOUT_S
+    while l2cap_send_room(sock) < idle_room:
+        if loop.time() > deadline:
+            raise TimeoutError("Timeout draining the L2CAP channel.")
+        await asyncio.sleep(0.05)
+
+
+async def send_packets_stream(client: BleakClient, packets, queue: asyncio.Queue, window: CreditWindow):
     total_packets = len(packets)
     total_bytes = sum(len(p) for p in packets)
     sent_bytes = 0
 
     for idx, pkg in enumerate(packets, start=1):
+        check_data_nak(queue)
+        await window.take()
+        if isinstance(pkg, CopyRun):
+            await send_copy(client, pkg)
+        else:
+            await client.write_gatt_char(OTA_DATA_UUID, bytes(pkg), response=False)
+        sent_bytes += len(pkg)
+        if idx % 20 == 0 or idx == total_packets:
+            percent = (idx / total_packets) * 100
+            print(f"Progress: {idx}/{total_packets} packets ({percent:0.1f}%) | {sent_bytes}/{total_bytes} bytes")
+
+
+async def send_packets(client: BleakClient, packets, queue: asyncio.Queue):
+    total_packets = len(packets)
+    total_bytes = sum(len(p) for p in packets)
+    sent_bytes = 0
+
+    for idx, pkg in enumerate(packets, start=1):
+        check_data_nak(queue)
         for attempt in range(1, PKT_WRITE_RETRIES + 1):
             try:
-                await client.write_gatt_char(OTA_DATA_UUID, pkg, response=True)
+                if isinstance(pkg, CopyRun):
+                    await send_copy(client, pkg)
+                else:
+                    await client.write_gatt_char(OTA_DATA_UUID, bytes(pkg), response=True)
                 break
             except Exception as exc:
                 if attempt >= PKT_WRITE_RETRIES:
@@ -153,18 +605,42 @@ async def send_packets(client: BleakClient, packets):
             print(f"Progress: {idx}/{total_packets} packets ({percent:0.1f}%) | {sent_bytes}/{total_bytes} bytes")
 
 
-async def send_ota(file_path, dry_run=False, scan_retries=SCAN_RETRIES, scan_timeout=SCAN_TIMEOUT_S, select_device=True, max_payload=MAX_PAYLOAD_DEFAULT):
-    t0 = datetime.datetime.now()
+class BleTransport:
+    """The radio: a bleak GATT client plus the Linux L2CAP socket. The simulator
+    (sim_device.py) provides the same two calls."""
+
+    def client(self, target):
+        return BleakClient(target, timeout=CONNECT_TIMEOUT_S)
+
+    def open_l2cap(self, target):
+        return open_l2cap(target.address)
 
-    if dry_run:
-        packets = chunk_firmware(file_path, DRY_RUN_PACKET_SIZE)
-        print(f"[dry-run] Would send {len(packets)} packets of size <= {DRY_RUN_PACKET_SIZE} bytes.")
-        return
 
+async def send_ota(file_path, dry_run=False, scan_retries=SCAN_RETRIES, scan_timeout=SCAN_TIMEOUT_S, select_device=True, max_payload=MAX_PAYLOAD_DEFAULT, stream=True, resume=True, compress=False, dedup=False, framing=True, l2cap=True, transport=None):
+    with FirmwareImage(file_path) as image:
+        if dry_run:
+            packets = image.chunks(DRY_RUN_PACKET_SIZE)
+            print(f"[dry-run] Would send {len(packets)} packets of size <= {DRY_RUN_PACKET_SIZE} bytes.")
+            return
+
+        if transport is not None:
+            target = transport.target
+        else:
+            target = await choose_device(scan_timeout) if select_device else await discover_target(scan_retries, scan_timeout)
+        return await update_device(target, image, max_payload=max_payload, stream=stream, resume=resume,
+                                   compress=compress, dedup=dedup, framing=framing, l2cap=l2cap, transport=transport)
+
+
+async def update_device(target, image: FirmwareImage, max_payload=MAX_PAYLOAD_DEFAULT, stream=True, resume=True, compress=False, dedup=False, framing=True, l2cap=True, transport=None):
+    """Runs one OTA session against target. Returns a summary dict, raises on failure."""
+    t0 = datetime.datetime.now()
+    result = {"transport": "GATT", "bytes": 0, "data_s": 0.0}
     queue: asyncio.Queue[bytes] = asyncio.Queue()
-    target = await choose_device(scan_timeout) if select_device else await discover_target(scan_retries, scan_timeout)
+    window = CreditWindow()
+    transport = transport or BleTransport()
 
-    client = BleakClient(target, timeout=CONNECT_TIMEOUT_S)
+    client = transport.client(target)
+    sock = None
     try:
         print("Connecting...")
         await client.connect(timeout=CONNECT_TIMEOUT_S)
@@ -177,10 +653,28 @@ async def send_ota(file_path, dry_run=False, scan_retries=SCAN_RETRIES, scan_tim
         if not svc.get_characteristic(OTA_CONTROL_UUID) or not svc.get_characteristic(OTA_DATA_UUID):
             raise RuntimeError("OTA characteristics not present on device.")
 
-        await client.start_notify(
-            OTA_CONTROL_UUID,
-            lambda sender, data: queue.put_nowait(data)
-        )
+        link_updated = asyncio.Event()
+
+        def on_control(sender, data):
+            if len(data) >= 3 and data[0] == SVR_CHR_OTA_CONTROL_CREDIT[0]:
+                window.grant(int.from_bytes(data[1:3], "little"))
+            elif len(data) >= 19 and data[0] == SVR_CHR_OTA_CONTROL_LINK[0]:
+                print(f"Link update: {LinkInfo(bytes(data[1:]))}")
+                link_updated.set()
+            else:
+                queue.put_nowait(data)
+
+        await client.start_notify(OTA_CONTROL_UUID, on_control)
+
+        # COPY commands travel over ATT and could overtake queued SDUs, so
+        # dedup sessions stay on GATT
+        if l2cap and not dedup:
+            sock = transport.open_l2cap(target)
+        stream = stream and not sock and supports_streaming(svc)
+        if sock:
+            print(f"Transfer mode: L2CAP CoC (PSM 0x{OTA_L2CAP_PSM:04x}, SDU {L2CAP_SDU_SIZE} bytes)")
+        else:
+            print(f"Transfer mode: {'streaming (write without response)' if stream else 'acknowledged writes'}")
 
         packet_size = min(client.mtu_size - 3, max_payload)
         if packet_size <= 0:
@@ -192,22 +686,95 @@ async def send_ota(file_path, dry_run=False, scan_retries=SCAN_RETRIES, scan_tim
             response=True,
         )
 
-        packets = chunk_firmware(file_path, packet_size)
-        print(f"Prepared {len(packets)} packets.")
-
-        print("Sending OTA request...")
-        await client.write_gatt_char(OTA_CONTROL_UUID, SVR_CHR_OTA_CONTROL_REQUEST, response=True)
-        resp = await wait_for_queue(queue, "OTA request")
-        if resp != SVR_CHR_OTA_CONTROL_REQUEST_ACK:
-            raise RuntimeError(f"Request not acknowledged (resp={resp.hex()}).")
+        flags = OTA_REQUEST_F_STREAM if stream else 0
+        # framing makes unacknowledged writes safe; firmware without it NAKs the flag
+        framed = framing and stream
+
+        async def start(session_flags, session_resume):
+            nonlocal framed
+            if framed:
+                try:
+                    return await sized(await open_session(client, queue, session_flags | OTA_REQUEST_F_FRAMED, image, session_resume))
+                except RuntimeError as exc:
+                    print(f"Framing rejected ({exc}), sending plain packets.")
+                    framed = False
+            return await sized(await open_session(client, queue, session_flags, image, session_resume))
+
+        async def sized(session_offset):
+            # chunks that fill whole LL packets on the link the device negotiated
+            nonlocal packet_size
+            link = await read_link(client, svc, link_updated)
+            if link:
+                print(f"Negotiated link: {link}")
+                if 0 < link.chunk < packet_size:
+                    packet_size = link.chunk
+                    print(f"Using packet size: {packet_size}")
+            return session_offset
+
+        packets = None
+        image_size = image.size
+        if compress:
+            packed = image.compressed()
+            print(f"Compressed image: {image_size} -> {len(packed)} bytes ({len(packed) / image_size * 100:0.1f}%)")
+            try:
+                # compressed sessions cannot be resumed, the device always starts over
+                await start(flags | OTA_REQUEST_F_LZ, False)
+                packets = chunk_bytes(packed, L2CAP_SDU_SIZE if sock else packet_size - (FRAME_HDR_LEN if framed else 0))
+                offset = 0
+            except RuntimeError as exc:
+                print(f"Compressed mode rejected ({exc}), sending the raw image.")
+
+        if packets is None:
+            offset = await start(flags, resume)
+            if offset:
+                print(f"Device already holds {offset} bytes, resuming from there.")
+            # the device only hashes for the client that owns the session
+            remote_hashes = None
+            if dedup:
+                remote_hashes = await query_block_hashes(client, queue, image_size // DEDUP_BLOCK_SIZE)
+            payload_size = L2CAP_SDU_SIZE if sock else packet_size - (FRAME_HDR_LEN if framed else 0)
+            if remote_hashes is not None:
+                packets = plan_dedup(image.data, offset, payload_size, remote_hashes)
+                copied = sum(len(p) for p in packets if isinstance(p, CopyRun))
+                print(f"Dedup: {copied} of {image_size - offset} bytes reused from the running firmware.")
+            else:
+                packets = image.chunks(payload_size, offset)
+        print(f"Prepared {len(packets)} {'framed ' if framed else ''}packets.")
+
+        t_data = datetime.datetime.now()
+        frames = FramedStream(packets, offset) if framed else None
+        if framed:
+            await send_frames(client, frames, range(len(packets)), queue, window, stream)
+        elif sock:
+            await send_packets_l2cap(sock, packets, queue)
+        elif stream:
+            await send_packets_stream(client, packets, queue, window)
+        else:
+            await send_packets(client, packets, queue)
+        if not framed:
+            check_data_nak(queue)
+        data_s = (datetime.datetime.now() - t_data).total_seconds()
+        total_bytes = wire_bytes(packets)
+        link_kind = "L2CAP" if sock else "GATT"
+        result.update(transport=link_kind, bytes=image_size - offset, data_s=data_s)
+        if data_s > 0:
+            # wire rate vs. effective rate of the image that ends up in flash
+            print(f"Data phase ({link_kind}): {total_bytes} bytes in {data_s:0.1f}s ({total_bytes / data_s / 1024:0.1f} KiB/s on air, "
+                  f"{(image_size - offset) / data_s / 1024:0.1f} KiB/s of image)")
 
-        await send_packets(client, packets)
+        try:
+            await read_stats(client, svc)
+        except Exception as exc:
+            print(f"Could not read OTA stats ({short_ble_error(exc)}).")
 
         print("Sending OTA done...")
         ota_done_ack = False
         try:
-            await client.write_gatt_char(OTA_CONTROL_UUID, SVR_CHR_OTA_CONTROL_DONE, response=True)
-            resp = await wait_for_queue(queue, "OTA done")
+            if framed:
+                resp = await finish_framed(client, frames, queue, window, stream)
+            else:
+                await client.write_gatt_char(OTA_CONTROL_UUID, SVR_CHR_OTA_CONTROL_DONE, response=True)
+                resp = await wait_for_queue(queue, "OTA done")
             if resp != SVR_CHR_OTA_CONTROL_DONE_ACK:
                 raise RuntimeError(f"OTA done not acknowledged (resp={resp.hex()}).")
             ota_done_ack = True
@@ -222,7 +789,11 @@ async def send_ota(file_path, dry_run=False, scan_retries=SCAN_RETRIES, scan_tim
         if ota_done_ack:
             dt = datetime.datetime.now() - t0
             print(f"OTA successful! Total time: {dt}")
+        result["total_s"] = (datetime.datetime.now() - t0).total_seconds()
+        return result
     finally:
+        if sock:
+            sock.close()
         try:
             await client.stop_notify(OTA_CONTROL_UUID)
         except Exception:
@@ -239,11 +810,24 @@ def parse_args():
     parser.add_argument("--scan-retries", type=int, default=SCAN_RETRIES, help="Scan retries")
     parser.add_argument("--auto", action="store_true", help="Auto-select device by name/UUID without prompt")
     parser.add_argument("--max-payload", type=int, default=MAX_PAYLOAD_DEFAULT, help="Max payload per packet (bytes)")
+    parser.add_argument("--no-stream", action="store_true", help="Force acknowledged writes even if the device supports streaming")
+    parser.add_argument("--compress", action="store_true", help="Send the image LZ-compressed (decoded on the device)")
+    parser.add_argument("--dedup", action="store_true", help="Only send 4 KiB blocks that differ from the firmware the device is running")
+    parser.add_argument("--no-framing", action="store_true", help="Send raw data packets without the offset/CRC frame header")
+    parser.add_argument("--no-l2cap", action="store_true", help="Send data over GATT even if an L2CAP CoC channel can be opened")
+    parser.add_argument("--no-resume", action="store_true", help="Always start from byte 0 instead of asking the device for a resume point")
+    parser.add_argument("--sim", metavar="HOST:PORT", help="Update the simulated device served by sim_device.py --listen")
     return parser.parse_args()
 
 
 if __name__ == "__main__":
     args = parse_args()
+    transport = None
+    if args.sim:
+        import sim_device
+
+        host, port = args.sim.rsplit(":", 1)
+        transport = sim_device.SocketTransport(host, int(port))
     asyncio.run(
         send_ota(
             args.file,
@@ -252,5 +836,12 @@ if __name__ == "__main__":
             scan_timeout=args.scan_timeout,
             select_device=not args.auto,
             max_payload=args.max_payload,
+            stream=not args.no_stream,
+            resume=not args.no_resume,
+            compress=args.compress,
+            dedup=args.dedup,
+            framing=not args.no_framing,
+            l2cap=not args.no_l2cap,
+            transport=transport,
         )
     )
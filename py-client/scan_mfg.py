@@ -1,4 +1,6 @@
 import asyncio
+import struct
+
 from bleak import BleakScanner
 
 # MAC a filtrar (en mayúsculas). Si está vacío, muestra todos.
@@ -12,6 +14,12 @@ OTA_DATA_UUID = "bdda975f-9e48-5c04-b67e-f017f019b150"
 # Company ID que usamos en manufacturer data (Espressif 0x02E5)
 MFG_COMPANY_ID = 0x02E5
 
+# Registro de telemetría (telemetry.h): set extendido no conectable + periodic
+# advertising. Requiere un adaptador con BLE 5 para verse.
+TELEMETRY_MAGIC = 0x54
+TELEMETRY_RECORD = struct.Struct("<BBBBBBBBIHHH")
+UNLOCK_REASONS = {0: "ninguno", 1: "beacon", 2: "IGN"}
+
 
 def format_mfg(manufacturer_data: dict) -> str:
     parts = []
@@ -35,23 +43,40 @@ def decode_service_data(service_data: dict) -> str:
     ota_flag = payload[1] if len(payload) > 1 else None
     return f"OTA_DATA gpio={gpio_level} ota_updating={ota_flag}"
 
+def describe_status(status: int) -> str:
+    # Bit mapping (GAP_ADV_ST_* en gap.h): nivel del pin, el equipo lo
+    # actualiza en vivo cuando cambia (como mucho cada 250 ms)
+    door = 1 if (status & 0x01) else 0          # bit0: GPIO5 puerta (0 = abierta)
+    ota_flag = 1 if (status & 0x02) else 0       # bit1: OTA en curso
+    ign = 1 if (status & 0x04) else 0            # bit2: IGN GPIO1 (0 = encendida)
+    relay = 1 if (status & 0x08) else 0          # bit3: relay GPIO2 (0 = desbloqueado)
+    in1 = 1 if (status & 0x10) else 0            # bit4: IN1 GPIO6
+    state = f"puerta {'cerrada' if door else 'abierta'}, IGN {'off' if ign else 'on'}, {'bloqueado' if relay else 'desbloqueado'}"
+    return f"door={door} ota={ota_flag} ign={ign} relay={relay} in1={in1} raw=0x{status:02x} ({state})"
+
+def decode_telemetry(payload: bytes) -> str:
+    if len(payload) < TELEMETRY_RECORD.size or payload[0] != TELEMETRY_MAGIC:
+        return ""
+    (_, version, seq, status, reason, fw, ota_pct, _, uptime,
+     unlocks, relocks, keys) = TELEMETRY_RECORD.unpack_from(payload)
+    ota = "idle" if ota_pct == 0xFF else f"{ota_pct}%"
+    return (f"TELEMETRY v{version} seq={seq} fw={fw} uptime={uptime}s "
+            f"unlocks={unlocks} (último: {UNLOCK_REASONS.get(reason, reason)}) "
+            f"relocks={relocks} keys={keys} ota={ota} | {describe_status(status)}")
+
 def decode_mfg_data(manufacturer_data: dict) -> str:
     payload = manufacturer_data.get(MFG_COMPANY_ID)
     if not payload:
         return ""
+    telemetry = decode_telemetry(payload)
+    if telemetry:
+        return telemetry
     # Bleak entrega solo la parte después del Company ID, pero en caso de recibir todo, manejamos ambos
     if len(payload) >= 4 and payload[0] == (MFG_COMPANY_ID & 0xFF) and payload[1] == (MFG_COMPANY_ID >> 8):
         status = payload[2]
     else:
         status = payload[0] if len(payload) > 0 else 0
-    # Bit mapping (see gap.c comments):
-    door = 1 if (status & 0x01) else 0          # bit0: GPIO5 puerta
-    ota_flag = 1 if (status & 0x02) else 0       # bit1: OTA en curso
-    ign = 1 if (status & 0x04) else 0            # bit2: IGN GPIO1
-    relay = 1 if (status & 0x08) else 0          # bit3: relay GPIO2
-    in1 = 1 if (status & 0x10) else 0            # bit4: IN1 GPIO6
-    return f"MFG door={door} ota={ota_flag} ign={ign} relay={relay} in1={in1} raw=0x{status:02x}"
-
+    return f"MFG {describe_status(status)}"
 
 async def main():
     target_mac = TARGET_MAC.strip().upper()
@@ -0,0 +1,709 @@
+"""Simulated MKEY OTA peripheral, for running the client without a radio.
+
+The device side of the OTA service (control/data/link/stats characteristics,
+the SVR_CHR_OTA_CONTROL_* state machine, credits, framing, resume, dedup) is
+modelled in-process, with a configurable MTU, one-way latency, link rate and
+flash write speed. It is reachable in two ways:
+
+    # end-to-end run against an in-process device
+    python sim_device.py -f ota-ble.bin --mtu 247 --latency-ms 7.5 --rate-kbps 700 --flash-ms-per-kib 2
+
+    # serve it on a socket and point the real client at it
+    python sim_device.py --listen 127.0.0.1:8765
+    python main.py -f ota-ble.bin --sim 127.0.0.1:8765
+"""
+import argparse
+import asyncio
+import hashlib
+import json
+import random
+import time
+import zlib
+from dataclasses import dataclass
+
+import compress_fw
+import main as ota
+
+# must match the firmware (ota_writer.h / gatt_svr.h)
+POOL_BUFS = 8
+CREDIT_BATCH = POOL_BUFS // 2
+ACQUIRE_TIMEOUT_S = 0.5
+REORDER_SLOTS = 4
+CHECKPOINT_BYTES = 32 * 1024
+BUF_SIZE = 512
+HASHES_MAX = 32
+PARTITION_SIZE = 0x180000
+LL_OVERHEAD = 7  # L2CAP + ATT header of every write
+LINK_LEN = 18
+
+CHARACTERISTICS = {
+    ota.OTA_CONTROL_UUID: ["read", "write", "notify"],
+    ota.OTA_DATA_UUID: ["write", "write-without-response"],
+    ota.OTA_LINK_UUID: ["read"],
+    ota.OTA_STATS_UUID: ["read"],
+}
+
+
+class SimAttError(Exception):
+    """ATT error returned to a write, like BleakError on a real link."""
+
+
+@dataclass
+class SimConfig:
+    mtu: int = 247
+    latency_ms: float = 0.0        # one way, host to host
+    rate_kbps: float = 0.0         # link throughput, 0 = unlimited
+    flash_ms_per_kib: float = 0.0  # program time of the writer task
+    corrupt: float = 0.0           # probability a data packet arrives damaged
+    seed: int = 0
+    running: bytes = b""           # firmware the device runs (for dedup)
+
+
+def le32(data, pos=0) -> int:
+    return int.from_bytes(data[pos:pos + 4], "little")
+
+
+class SimSession:
+    """One OTA session: buffer pool, writer task and framed-stream reassembly."""
+
+    def __init__(self, dev, flags: int, image_size: int, offset: int, crc: int, image_crc):
+        self.dev = dev
+        self.streaming = bool(flags & ota.OTA_REQUEST_F_STREAM)
+        self.framed = bool(flags & ota.OTA_REQUEST_F_FRAMED)
+        self.compressed = bool(flags & ota.OTA_REQUEST_F_LZ)
+        self.image_size = image_size
+        self.image_crc = image_crc  # None unless the session was resumed
+        self.offset = offset
+        self.crc = crc
+        self.next_offset = offset
+        self.held = [None] * REORDER_SLOTS  # (offset, length, job)
+        self.gap_pending = False
+        self.gap_reported = 0
+        self.lz = bytearray()
+        self.failed = False
+        self.free = POOL_BUFS
+        self.pool_event = asyncio.Event()
+        self.credits_pending = 0
+        self.jobs = asyncio.Queue()
+        self.stats = dict(rx_bytes=0, packets=0, written=0, busy_s=0.0, job_max_s=0.0, pool_min=POOL_BUFS,
+                          bad=0, dup=0, held=0)
+        self.t0 = time.monotonic()
+        self.task = asyncio.create_task(self.writer())
+
+    # buffer pool, like ota_acquire_buf()
+    async def acquire(self) -> bool:
+        self.stats["pool_min"] = min(self.stats["pool_min"], self.free)
+        if self.streaming:
+            if self.free == 0:
+                print("[sim] stream overran the credit window")
+                self.fail()
+                return False
+        else:
+            deadline = time.monotonic() + ACQUIRE_TIMEOUT_S
+            while self.free == 0:
+                self.pool_event.clear()
+                try:
+                    await asyncio.wait_for(self.pool_event.wait(), deadline - time.monotonic())
+                except asyncio.TimeoutError:
+                    raise SimAttError("insufficient resources (buffer pool exhausted)")
+        self.free -= 1
+        return True
+
+    def fail(self):
+        if not self.failed:
+            self.failed = True
+            self.dev.send(ota.SVR_CHR_OTA_CONTROL_DATA_NAK)
+
+    async def writer(self):
+        while True:
+            kind, arg = await self.jobs.get()
+            if kind == "flush":
+                arg.set_result(None)
+                continue
+            if not self.failed and kind != "drop":
+                t = time.monotonic()
+                length = arg if kind == "copy" else len(arg)
+                await asyncio.sleep(self.dev.config.flash_ms_per_kib * length / 1024 / 1000)
+                if kind == "copy":
+                    src = self.dev.running[self.offset:self.offset + arg]
+                    self.program(src + b"\xff" * (arg - len(src)))
+                elif self.compressed:
+                    self.lz += arg
+                else:
+                    self.program(arg)
+                dt = time.monotonic() - t
+                self.stats["busy_s"] += dt
+                self.stats["job_max_s"] = max(self.stats["job_max_s"], dt)
+            self.free += 1
+            self.pool_event.set()
+            if self.streaming and not self.failed:
+                self.credits_pending += 1
+                if self.credits_pending >= CREDIT_BATCH or self.jobs.empty():
+                    self.dev.send(ota.SVR_CHR_OTA_CONTROL_CREDIT + self.credits_pending.to_bytes(2, "little"))
+                    self.credits_pending = 0
+
+    def program(self, data):
+        end = self.offset + len(data)
+        if end > PARTITION_SIZE:
+            self.fail()
+            return
+        part = self.dev.partition
+        if len(part) < end:
+            part.extend(b"\xff" * (end - len(part)))
+        # checkpoints land exactly on CHECKPOINT_BYTES multiples
+        while data:
+            room = CHECKPOINT_BYTES - self.offset % CHECKPOINT_BYTES
+            piece, data = data[:room], data[room:]
+            part[self.offset:self.offset + len(piece)] = piece
+            self.crc = zlib.crc32(piece, self.crc)
+            self.offset += len(piece)
+            self.stats["written"] += len(piece)
+            if self.offset % CHECKPOINT_BYTES == 0 and self.image_crc is not None:
+                self.dev.checkpoint = (self.image_size, self.image_crc, self.offset, self.crc)
+
+    async def flush(self):
+        done = asyncio.get_running_loop().create_future()
+        self.jobs.put_nowait(("flush", done))
+        await done
+
+    def close(self):
+        self.task.cancel()
+
+    # framed streams, like ota_frame_accept()
+    def report_gap(self, force: bool):
+        if not force and self.gap_pending and self.gap_reported == self.next_offset:
+            return
+        ahead = [h[0] for h in self.held if h]
+        length = min(ahead) - self.next_offset if ahead else 0
+        self.dev.send(ota.SVR_CHR_OTA_CONTROL_GAP + self.next_offset.to_bytes(4, "little") + length.to_bytes(4, "little"))
+        self.gap_reported = self.next_offset
+        self.gap_pending = True
+
+    @staticmethod
+    def trim(job, skip):
+        kind, arg = job
+        return (kind, arg - skip) if kind == "copy" else (kind, arg[skip:])
+
+    def accept(self, job, offset: int, length: int):
+        if offset + length <= self.next_offset:
+            self.stats["dup"] += 1
+            self.jobs.put_nowait(("drop", None))
+            return
+        if offset <= self.next_offset:
+            self.jobs.put_nowait(self.trim(job, self.next_offset - offset))
+            self.next_offset = offset + length
+            self.drain()
+            return
+        if any(h and h[0] == offset for h in self.held) or None not in self.held:
+            self.stats["dup"] += any(h and h[0] == offset for h in self.held)
+            self.jobs.put_nowait(("drop", None))
+        else:
+            self.held[self.held.index(None)] = (offset, length, job)
+            self.stats["held"] += 1
+        self.report_gap(False)
+
+    def drain(self):
+        progress = True
+        while progress:
+            progress = False
+            for i, h in enumerate(self.held):
+                if not h or h[0] > self.next_offset:
+                    continue
+                offset, length, job = h
+                if offset + length <= self.next_offset:
+                    self.jobs.put_nowait(("drop", None))
+                else:
+                    self.jobs.put_nowait(self.trim(job, self.next_offset - offset))
+                    self.next_offset = offset + length
+                self.held[i] = None
+                progress = True
+
+
+class SimDevice:
+    """The peripheral: GATT server plus the flash the sessions write to."""
+
+    def __init__(self, config: SimConfig):
+        self.config = config
+        self.rng = random.Random(config.seed)
+        self.running = config.running
+        self.partition = bytearray()
+        self.checkpoint = None  # (image size, image crc, offset, crc of [0, offset))
+        self.image = None       # last image that passed DONE
+        self.session = None
+        self.control_val = ota.SVR_CHR_OTA_CONTROL_NOP
+        self.packet_size = 0
+        self.connected = False
+
+    # link model
+    async def connect(self, notify):
+        if self.connected:
+            raise SimAttError("already connected")
+        self.connected = True
+        self._notify = notify
+        self._inbox = asyncio.Queue()
+        self._outbox = asyncio.Queue()
+        self._air_free = 0.0
+        self._tasks = [asyncio.create_task(self._host()), asyncio.create_task(self._notifier())]
+
+    async def disconnect(self):
+        for task in self._tasks:
+            task.cancel()
+        self.close_session()
+        self.connected = False
+
+    def _arrival(self, length: int) -> float:
+        now = time.monotonic()
+        air = (length + LL_OVERHEAD) * 8 / (self.config.rate_kbps * 1000) if self.config.rate_kbps else 0.0
+        self._air_free = max(now, self._air_free) + air
+        return self._air_free + self.config.latency_ms / 1000
+
+    def submit(self, uuid: str, data: bytes, response: bool):
+        """Queues a write in arrival order; returns a future for its ATT response."""
+        done = asyncio.get_running_loop().create_future() if response else None
+        self._inbox.put_nowait((self._arrival(len(data)), uuid.lower(), bytes(data), done))
+        return done
+
+    async def write(self, uuid: str, data: bytes, response: bool):
+        done = self.submit(uuid, data, response)
+        if done:
+            await done
+            await asyncio.sleep(self.config.latency_ms / 1000)
+
+    async def read(self, uuid: str) -> bytes:
+        await asyncio.sleep(2 * self.config.latency_ms / 1000)
+        uuid = uuid.lower()
+        if uuid == ota.OTA_CONTROL_UUID:
+            return bytes(self.control_val[:1])
+        if uuid == ota.OTA_LINK_UUID:
+            return self.link()
+        if uuid == ota.OTA_STATS_UUID:
+            return self.stats()
+        raise SimAttError("read not permitted")
+
+    def send(self, data: bytes):
+        self._outbox.put_nowait((time.monotonic() + self.config.latency_ms / 1000, bytes(data)))
+
+    async def _host(self):
+        # one write at a time, in order, like the NimBLE host task
+        while True:
+            at, uuid, data, done = await self._inbox.get()
+            await asyncio.sleep(max(0.0, at - time.monotonic()))
+            try:
+                await self.handle_write(uuid, data)
+            except SimAttError as exc:
+                if done:
+                    done.set_exception(exc)
+                    continue
+                print(f"[sim] dropped write: {exc}")
+            if done:
+                done.set_result(None)
+
+    async def _notifier(self):
+        while True:
+            at, data = await self._outbox.get()
+            await asyncio.sleep(max(0.0, at - time.monotonic()))
+            self._notify(ota.OTA_CONTROL_UUID, bytearray(data))
+
+    # GATT server
+    async def handle_write(self, uuid: str, data: bytes):
+        if uuid == ota.OTA_DATA_UUID:
+            if self.session:
+                await self.data_in(data)
+            elif 1 <= len(data) <= BUF_SIZE:
+                self.packet_size = int.from_bytes(data[:2], "little")
+            else:
+                raise SimAttError("invalid attribute value length")
+        elif uuid == ota.OTA_CONTROL_UUID:
+            if not data:
+                raise SimAttError("invalid attribute value length")
+            await self.control(data[0], data[1:])
+        else:
+            raise SimAttError("write not permitted")
+
+    async def data_in(self, data: bytes):
+        s = self.session
+        if len(data) < (ota.FRAME_HDR_LEN + 1 if s.framed else 1) or len(data) > BUF_SIZE:
+            raise SimAttError("invalid attribute value length")
+        if not await s.acquire():
+            return
+        s.stats["packets"] += 1
+        if self.config.corrupt and self.rng.random() < self.config.corrupt:
+            pos = self.rng.randrange(len(data))
+            data = data[:pos] + bytes([data[pos] ^ 0x5a]) + data[pos + 1:]
+        if not s.framed:
+            s.stats["rx_bytes"] += len(data)
+            s.jobs.put_nowait(("data", data))
+            return
+        offset, payload = le32(data), data[ota.FRAME_HDR_LEN:]
+        if zlib.crc32(payload) != le32(data, 4):
+            s.stats["bad"] += 1
+            s.jobs.put_nowait(("drop", None))
+            s.report_gap(False)
+            return
+        s.stats["rx_bytes"] += len(payload)
+        s.accept(("data", payload), offset, len(payload))
+
+    async def control(self, op: int, args: bytes):
+        if op in (ota.SVR_CHR_OTA_CONTROL_REQUEST[0], ota.SVR_CHR_OTA_CONTROL_RESUME[0]):
+            await self.request(op == ota.SVR_CHR_OTA_CONTROL_RESUME[0], args)
+        elif op == ota.SVR_CHR_OTA_CONTROL_DONE[0]:
+            await self.done(args)
+        elif op == ota.SVR_CHR_OTA_CONTROL_HASH_REQ[0] and self.session and not self.session.failed and len(args) >= 4:
+            self.hashes(int.from_bytes(args[0:2], "little"), int.from_bytes(args[2:4], "little"))
+        elif op == ota.SVR_CHR_OTA_CONTROL_COPY[0] and self.session:
+            s = self.session
+            if len(args) < (8 if s.framed else 4) or not await s.acquire():
+                return
+            if s.framed:
+                s.accept(("copy", le32(args)), le32(args, 4), le32(args))
+            else:
+                s.jobs.put_nowait(("copy", le32(args)))
+
+    def close_session(self):
+        if self.session:
+            self.session.close()
+            self.session = None
+
+    def reply(self, value: bytes):
+        self.control_val = value
+        self.send(value)
+
+    async def request(self, resumable: bool, args: bytes):
+        self.close_session()
+        flags = args[0] if args else 0
+        image_size = le32(args, 1) if len(args) >= 5 else 0
+        supported = ota.OTA_REQUEST_F_STREAM | ota.OTA_REQUEST_F_LZ | ota.OTA_REQUEST_F_FRAMED
+        if (flags & ~supported or (resumable and (flags & ota.OTA_REQUEST_F_LZ)) or (resumable and len(args) < 9)
+                or image_size > PARTITION_SIZE):
+            self.reply(ota.SVR_CHR_OTA_CONTROL_REQUEST_NAK)
+            return
+        offset, crc, image_crc = 0, 0, None
+        if resumable:
+            image_crc = le32(args, 5)
+            cp = self.checkpoint
+            if cp and cp[0] == image_size and cp[1] == image_crc and cp[2] < image_size:
+                offset, crc = cp[2], cp[3]
+            else:
+                self.checkpoint = (image_size, image_crc, 0, 0)
+        else:
+            self.checkpoint = None
+        self.session = SimSession(self, flags, image_size, offset, crc, image_crc)
+        if resumable:
+            self.reply(ota.SVR_CHR_OTA_CONTROL_RESUME_ACK + offset.to_bytes(4, "little"))
+        else:
+            self.reply(ota.SVR_CHR_OTA_CONTROL_REQUEST_ACK)
+        if self.session.streaming:
+            self.send(ota.SVR_CHR_OTA_CONTROL_CREDIT + POOL_BUFS.to_bytes(2, "little"))
+        # the fast link profile the firmware negotiates for the session
+        self.send(ota.SVR_CHR_OTA_CONTROL_LINK + self.link())
+
+    async def done(self, args: bytes):
+        s = self.session
+        if s and s.framed and len(args) >= 4:
+            if any(s.held) or s.next_offset < le32(args):
+                s.report_gap(True)
+                return
+        ok = s is not None
+        if s:
+            await s.flush()
+            if s.compressed and not s.failed:
+                try:
+                    s.program(compress_fw.decompress(bytes(s.lz)))
+                except Exception:
+                    s.failed = True
+            ok = not s.failed
+            if ok and s.image_crc is not None:
+                ok = s.offset == s.image_size and s.crc == s.image_crc
+            elapsed = time.monotonic() - s.t0
+            print(f"[sim] {s.stats['rx_bytes']} bytes in {elapsed:0.2f}s, {s.stats['packets']} packets, "
+                  f"frames {s.stats['bad']} bad / {s.stats['dup']} duplicate / {s.stats['held']} held")
+            if ok:
+                self.image = bytes(self.partition[:s.offset])
+            self.checkpoint = None
+            self.close_session()
+        self.reply(ota.SVR_CHR_OTA_CONTROL_DONE_ACK if ok else ota.SVR_CHR_OTA_CONTROL_DONE_NAK)
+
+    def hashes(self, first: int, count: int):
+        per_msg = max(1, min(HASHES_MAX, (self.config.mtu - 3 - 4) // ota.DEDUP_HASH_LEN))
+        for start in range(first, first + count, per_msg):
+            n = min(per_msg, first + count - start)
+            msg = ota.SVR_CHR_OTA_CONTROL_HASHES + start.to_bytes(2, "little") + bytes([n])
+            for block in range(start, start + n):
+                data = self.running[block * ota.DEDUP_BLOCK_SIZE:(block + 1) * ota.DEDUP_BLOCK_SIZE]
+                data += b"\xff" * (ota.DEDUP_BLOCK_SIZE - len(data))
+                msg += hashlib.sha256(data).digest()[:ota.DEDUP_HASH_LEN]
+            self.send(msg)
+
+    def link(self) -> bytes:
+        octets = 251
+        chunk = min(self.config.mtu - 3, BUF_SIZE)
+        k = (chunk + LL_OVERHEAD) // octets
+        if k:
+            chunk = k * octets - LL_OVERHEAD
+        vals = (6, 0, 400, octets, octets, self.config.mtu, chunk)
+        payload = bytes([2, 2]) + b"".join(v.to_bytes(2, "little") for v in vals)
+        return payload.ljust(LINK_LEN, b"\0")
+
+    def stats(self) -> bytes:
+        s = self.session
+        if not s:
+            return bytes(56)
+        st = s.stats
+        words = (st["rx_bytes"], int((time.monotonic() - s.t0) * 1000), st["written"], 0, 0, 0, 0, 0,
+                 st["packets"], 0, 0, int(st["busy_s"] * 1e6), int(st["job_max_s"] * 1e6), st["pool_min"])
+        return b"".join(w.to_bytes(4, "little") for w in words)
+
+
+# bleak stand-ins
+class SimCharacteristic:
+    def __init__(self, uuid, properties):
+        self.uuid = uuid
+        self.properties = properties
+
+
+class SimService:
+    def __init__(self):
+        self.uuid = ota.OTA_SERVICE_UUID
+        self.characteristics = {u: SimCharacteristic(u, p) for u, p in CHARACTERISTICS.items()}
+
+    def get_characteristic(self, uuid):
+        return self.characteristics.get(uuid.lower())
+
+
+class SimServices:
+    def __init__(self):
+        self.service = SimService()
+
+    def get_service(self, uuid):
+        return self.service if uuid.lower() == self.service.uuid else None
+
+
+class SimTarget:
+    def __init__(self, name, address):
+        self.name = name
+        self.address = address
+
+
+class SimClient:
+    """The subset of BleakClient the OTA client uses, bound to an in-process SimDevice."""
+
+    def __init__(self, device: SimDevice):
+        self.device = device
+        self.mtu_size = device.config.mtu
+        self.services = SimServices()
+        self.handlers = {}
+
+    def _notify(self, uuid, data):
+        handler = self.handlers.get(uuid)
+        if handler:
+            handler(uuid, data)
+
+    async def connect(self, timeout=None):
+        await self.device.connect(self._notify)
+
+    async def disconnect(self):
+        if self.device.connected:
+            await self.device.disconnect()
+
+    async def start_notify(self, uuid, handler):
+        self.handlers[uuid.lower()] = handler
+
+    async def stop_notify(self, uuid):
+        self.handlers.pop(uuid.lower(), None)
+
+    async def write_gatt_char(self, uuid, data, response=False):
+        await self.device.write(uuid, bytes(data), response)
+
+    async def read_gatt_char(self, uuid):
+        return bytearray(await self.device.read(uuid))
+
+
+class SimTransport:
+    """main.update_device() transport for an in-process device."""
+
+    def __init__(self, device: SimDevice):
+        self.device = device
+        self.target = SimTarget("MKEY-SIM", "sim")
+
+    def client(self, target):
+        return SimClient(self.device)
+
+    def open_l2cap(self, target):
+        return None
+
+
+# socket transport: newline-delimited JSON, one device per server
+class RemoteSimClient:
+    """SimClient over a TCP connection to `sim_device.py --listen`."""
+
+    def __init__(self, host: str, port: int):
+        self.host, self.port = host, port
+        self.services = SimServices()
+        self.handlers = {}
+        self.pending = {}
+        self.next_id = 0
+        self.mtu_size = 23
+
+    async def connect(self, timeout=None):
+        self.reader, self.writer = await asyncio.wait_for(asyncio.open_connection(self.host, self.port), timeout)
+        self.rx_task = asyncio.create_task(self._receive())
+        self.mtu_size = (await self._call("connect"))["mtu"]
+
+    async def _receive(self):
+        while line := await self.reader.readline():
+            msg = json.loads(line)
+            if msg.get("op") == "notify":
+                handler = self.handlers.get(msg["uuid"])
+                if handler:
+                    handler(msg["uuid"], bytearray.fromhex(msg["data"]))
+                continue
+            fut = self.pending.pop(msg["id"], None)
+            if fut and not fut.done():
+                if "error" in msg:
+                    fut.set_exception(SimAttError(msg["error"]))
+                else:
+                    fut.set_result(msg)
+        for fut in self.pending.values():
+            if not fut.done():
+                fut.set_exception(ConnectionError("simulator closed the connection"))
+
+    def _post(self, msg: dict):
+        self.writer.write(json.dumps(msg).encode() + b"\n")
+
+    async def _call(self, op: str, **kwargs):
+        self.next_id += 1
+        fut = asyncio.get_running_loop().create_future()
+        self.pending[self.next_id] = fut
+        self._post(dict(op=op, id=self.next_id, **kwargs))
+        return await fut
+
+    async def disconnect(self):
+        if getattr(self, "writer", None):
+            self.writer.close()
+            self.rx_task.cancel()
+            self.writer = None
+
+    async def start_notify(self, uuid, handler):
+        self.handlers[uuid.lower()] = handler
+
+    async def stop_notify(self, uuid):
+        self.handlers.pop(uuid.lower(), None)
+
+    async def write_gatt_char(self, uuid, data, response=False):
+        if response:
+            await self._call("write", uuid=uuid, data=bytes(data).hex())
+        else:
+            self._post(dict(op="write", uuid=uuid, data=bytes(data).hex()))
+            await self.writer.drain()
+
+    async def read_gatt_char(self, uuid):
+        return bytearray.fromhex((await self._call("read", uuid=uuid))["data"])
+
+
+class SocketTransport:
+    """main.update_device() transport for a simulator served with --listen."""
+
+    def __init__(self, host: str, port: int):
+        self.host, self.port = host, port
+        self.target = SimTarget("MKEY-SIM", f"{host}:{port}")
+
+    def client(self, target):
+        return RemoteSimClient(self.host, self.port)
+
+    def open_l2cap(self, target):
+        return None
+
+
+async def serve(device: SimDevice, host: str, port: int):
+    async def session(reader, writer):
+        def post(msg):
+            writer.write(json.dumps(msg).encode() + b"\n")
+
+        def notify(uuid, data):
+            post(dict(op="notify", uuid=uuid, data=bytes(data).hex()))
+
+        async def run(msg, done=None):
+            try:
+                if msg["op"] == "connect":
+                    await device.connect(notify)
+                    reply = dict(mtu=device.config.mtu)
+                elif msg["op"] == "write":
+                    await done
+                    await asyncio.sleep(device.config.latency_ms / 1000)
+                    reply = {}
+                else:
+                    reply = dict(data=(await device.read(msg["uuid"])).hex())
+            except SimAttError as exc:
+                reply = dict(error=str(exc))
+            post(dict(id=msg["id"], **reply))
+
+        print("[sim] client connected")
+        tasks = []
+        try:
+            while line := await reader.readline():
+                msg = json.loads(line)
+                done = None
+                if msg["op"] == "write":
+                    # queued right away so writes keep their order
+                    done = device.submit(msg["uuid"], bytes.fromhex(msg["data"]), "id" in msg)
+                if "id" in msg:
+                    tasks.append(asyncio.create_task(run(msg, done)))
+        finally:
+            for task in tasks:
+                task.cancel()
+            if device.connected:
+                await device.disconnect()
+            writer.close()
+            print("[sim] client disconnected")
+
+    server = await asyncio.start_server(session, host, port)
+    print(f"[sim] MKEY simulator listening on {host}:{port} (MTU {device.config.mtu})")
+    async with server:
+        await server.serve_forever()
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Simulated MKEY OTA peripheral")
+    parser.add_argument("--file", "-f", help="Run an in-process OTA of this image and verify the result")
+    parser.add_argument("--listen", metavar="HOST:PORT", help="Serve the simulator for main.py --sim")
+    parser.add_argument("--mtu", type=int, default=SimConfig.mtu, help="ATT MTU")
+    parser.add_argument("--latency-ms", type=float, default=0.0, help="One-way link latency")
+    parser.add_argument("--rate-kbps", type=float, default=0.0, help="Link throughput (0 = unlimited)")
+    parser.add_argument("--flash-ms-per-kib", type=float, default=0.0, help="Flash program time")
+    parser.add_argument("--corrupt", type=float, default=0.0, help="Probability a data packet is damaged")
+    parser.add_argument("--seed", type=int, default=0, help="Seed for --corrupt")
+    parser.add_argument("--running", help="Image the device runs (enables dedup)")
+    parser.add_argument("--compress", action="store_true", help="Client option, see main.py")
+    parser.add_argument("--dedup", action="store_true", help="Client option, see main.py")
+    parser.add_argument("--no-stream", action="store_true", help="Client option, see main.py")
+    parser.add_argument("--no-framing", action="store_true", help="Client option, see main.py")
+    return parser.parse_args()
+
+
+async def run(args):
+    running = b""
+    if args.running:
+        with open(args.running, "rb") as file:
+            running = file.read()
+    device = SimDevice(SimConfig(mtu=args.mtu, latency_ms=args.latency_ms, rate_kbps=args.rate_kbps,
+                                 flash_ms_per_kib=args.flash_ms_per_kib, corrupt=args.corrupt,
+                                 seed=args.seed, running=running))
+    if args.listen:
+        host, port = args.listen.rsplit(":", 1)
+        await serve(device, host, int(port))
+        return True
+
+    t0 = time.monotonic()
+    await ota.send_ota(args.file, stream=not args.no_stream, compress=args.compress, dedup=args.dedup,
+                       framing=not args.no_framing, transport=SimTransport(device))
+    with open(args.file, "rb") as file:
+        ok = device.image == file.read()
+    print(f"[sim] image {'verified' if ok else 'MISMATCH'}, {time.monotonic() - t0:0.2f}s end to end")
+    return ok
+
+
+if __name__ == "__main__":
+    args = parse_args()
+    if not args.file and not args.listen:
+        raise SystemExit("Either --file or --listen is required.")
+    raise SystemExit(0 if asyncio.run(run(args)) else 1)
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mkey.h"
+#include "mkey_act.h"
+
+#include "esp_timer.h"
+#include "driver/gpio.h"
+
+#include "mock.h"
+
+// Plays the control loop against a schedule of beacon reports and input
+// edges and measures how long each pass keeps the loop busy and how late
+// each event is handled, once with the unlock beep done the old way (buzzer
+// on, wait, buzzer off in the control task) and once through the actuator
+// sequencer. The buzzer pin is watched to check the sequencer still produces
+// the pulse it was asked for. The last checks break the step timer and
+// expect the outputs back at rest.
+//
+// Times are in us. Lateness includes the wakeup jitter of the host
+// scheduler, a few ms on a loaded machine; the busy time is what the loop
+// itself costs.
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define JIT_MS(ms)            ((int64_t)(ms) * 1000)
+#define JIT_RUN_MS            4000
+#define JIT_BEACON_MS         100     // scanner report interval
+#define JIT_INPUT_MS          370     // mean gap between IGN/door edges
+#define JIT_UNLOCK_EVERY      5       // beacons per key that becomes present
+#define JIT_SAMPLES_MAX       512
+
+// Acceptance for the sequencer: no pass busier than the stall warning of
+// the control loop (MKEY_CTRL_STALL_WARN_MS), pulses within this much of
+// their length (host scheduler jitter included).
+#define JIT_STALL_MAX_US      JIT_MS(5)
+#define JIT_PULSE_TOL_US      JIT_MS(10)
+
+/****************************************************
+ * TYPES
+*****************************************************/
+typedef enum {
+    JIT_BLOCKING = 0,         // buzzer on, vTaskDelay, buzzer off
+    JIT_SEQUENCER,            // mkey_act_play
+} jit_mode_t;
+
+typedef struct {
+    uint32_t events;
+    uint32_t stalled;         // passes busy longer than JIT_STALL_MAX_US
+    int64_t busy_max_us;      // longest pass
+    int64_t lat_sum_us;
+    int64_t lat_max_us;
+    int64_t lat_us[JIT_SAMPLES_MAX];
+    uint32_t pulses;          // buzzer pulses seen on the pin
+    int64_t pulse_err_max_us; // worst deviation from MKEY_BUZZER_PULSE_MS
+} jit_result_t;
+
+/****************************************************
+ * VARIABLES
+*****************************************************/
+static uint32_t s_rng = 0x2545F491u;
+
+static struct {
+    int64_t rise_us;          // buzzer went up, 0 while low
+    uint32_t pulses;
+    int64_t err_max_us;
+} s_buzzer;
+
+static const mkey_act_pattern_t s_beep = {
+    .name = "beep",
+    .len = 1,
+    .steps = {{1, MKEY_BUZZER_PULSE_MS}},
+};
+
+static const mkey_act_pattern_t s_relay_pulse = {
+    .name = "relay_pulse",
+    .len = 1,
+    .steps = {{0, MKEY_BUZZER_PULSE_MS}},
+};
+
+static const mkey_act_pattern_t s_blink = {
+    .name = "blink",
+    .len = 2,
+    .repeat = 4,
+    .steps = {{1, 100}, {0, 100}},
+};
+
+/****************************************************
+ * HELPERS
+*****************************************************/
+static uint32_t rng(void) {
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+static void sleep_until(int64_t at_us) {
+    const int64_t wait = at_us - esp_timer_get_time();
+    const struct timespec ts = {
+        .tv_sec = wait / 1000000,
+        .tv_nsec = (long)(wait % 1000000) * 1000,
+    };
+
+    if (wait > 0) {
+        nanosleep(&ts, NULL);
+    }
+}
+
+// gpio mock hook: times the buzzer pulses
+static void on_gpio(int pin, uint32_t level, int64_t at_us) {
+    if (pin != PIN_OUT_BUZZER) {
+        return;
+    }
+    if (level && s_buzzer.rise_us == 0) {
+        s_buzzer.rise_us = at_us;
+    } else if (!level && s_buzzer.rise_us) {
+        int64_t err = at_us - s_buzzer.rise_us - JIT_MS(MKEY_BUZZER_PULSE_MS);
+        if (err < 0) {
+            err = -err;
+        }
+        if (err > s_buzzer.err_max_us) {
+            s_buzzer.err_max_us = err;
+        }
+        s_buzzer.pulses++;
+        s_buzzer.rise_us = 0;
+    }
+}
+
+static int cmp_i64(const void *a, const void *b) {
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/****************************************************
+ * CONTROL LOOP
+*****************************************************/
+
+// What the control task does for a key that became present.
+static void unlock_feedback(jit_mode_t mode) {
+    if (mode == JIT_BLOCKING) {
+        gpio_set_level(PIN_OUT_BUZZER, 1);
+        sleep_until(esp_timer_get_time() + JIT_MS(MKEY_BUZZER_PULSE_MS));
+        gpio_set_level(PIN_OUT_BUZZER, 0);
+        return;
+    }
+    mkey_act_play(MKEY_ACT_BUZZER, &s_beep, MKEY_ACT_PRIO_NORMAL);
+    mkey_act_play(MKEY_ACT_RELAY, &s_relay_pulse, MKEY_ACT_PRIO_HIGH);
+}
+
+static void run(jit_mode_t mode, jit_result_t *res) {
+    const int64_t start = esp_timer_get_time();
+    const int64_t end = start + JIT_MS(JIT_RUN_MS);
+    int64_t next_beacon = start + JIT_MS(JIT_BEACON_MS);
+    int64_t next_input = start + JIT_MS(rng() % (2 * JIT_INPUT_MS));
+    uint32_t beacons = 0;
+
+    s_buzzer.pulses = 0;
+    s_buzzer.err_max_us = 0;
+    while (1) {
+        const bool beacon = next_beacon <= next_input;
+        const int64_t due = beacon ? next_beacon : next_input;
+
+        if (due >= end) {
+            break;
+        }
+        sleep_until(due);
+        const int64_t lat = esp_timer_get_time() - due;
+
+        if (res->events < JIT_SAMPLES_MAX) {
+            res->lat_us[res->events] = lat;
+        }
+        res->events++;
+        res->lat_sum_us += lat;
+        if (lat > res->lat_max_us) {
+            res->lat_max_us = lat;
+        }
+
+        if (beacon) {
+            // the scanner keeps its own rhythm, a slow loop does not delay it
+            next_beacon += JIT_MS(JIT_BEACON_MS - 20 + rng() % 41);
+            if (++beacons % JIT_UNLOCK_EVERY == 0) {
+                unlock_feedback(mode);
+            }
+        } else {
+            next_input += JIT_MS(1 + rng() % (2 * JIT_INPUT_MS));
+        }
+        const int64_t busy = esp_timer_get_time() - due - lat;
+        res->stalled += busy > JIT_STALL_MAX_US;
+        if (busy > res->busy_max_us) {
+            res->busy_max_us = busy;
+        }
+    }
+    // let the last pattern end before reading the pin statistics
+    while (mkey_act_busy()) {
+        sleep_until(esp_timer_get_time() + JIT_MS(5));
+    }
+    res->pulses = s_buzzer.pulses;
+    res->pulse_err_max_us = s_buzzer.err_max_us;
+}
+
+static void report(const char *name, jit_result_t *res) {
+    const uint32_t n = res->events < JIT_SAMPLES_MAX ? res->events : JIT_SAMPLES_MAX;
+
+    qsort(res->lat_us, n, sizeof(res->lat_us[0]), cmp_i64);
+    printf("%-10s %6lu %8lu %8lu %8lu %8lu %7lu %6lu %9lu\n", name,
+           (unsigned long)res->events,
+           (unsigned long)(res->events ? res->lat_sum_us / res->events : 0),
+           (unsigned long)(n ? res->lat_us[n * 99 / 100] : 0),
+           (unsigned long)res->lat_max_us, (unsigned long)res->busy_max_us,
+           (unsigned long)res->stalled,
+           (unsigned long)res->pulses, (unsigned long)res->pulse_err_max_us);
+}
+
+/****************************************************
+ * TIMER FAILURE
+*****************************************************/
+static int check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+    }
+    return !ok;
+}
+
+static bool at_rest(void) {
+    mock_app_state_t app;
+
+    mock_app_state(&app);
+    return !mkey_act_busy() && !app.actuator_lock &&
+           gpio_get_level(PIN_OUT_BUZZER) == 0 &&
+           gpio_get_level(PIN_OUT_RELAY) == 1 && gpio_get_level(PIN_OUT_LED) == 0;
+}
+
+static int check_timer_failure(void) {
+    mkey_act_stats_t st;
+    int failed = 0;
+
+    // the kick cannot arm the timer: nothing starts
+    mock_timer_fail(true);
+    failed += check(!mkey_act_play(MKEY_ACT_BUZZER, &s_beep, MKEY_ACT_PRIO_NORMAL),
+                    "play reports a dead step timer");
+    failed += check(at_rest(), "outputs at rest after a failed kick");
+
+    // the rearm after a step fails: the pattern playing is cut
+    mock_timer_fail(false);
+    failed += check(mkey_act_play(MKEY_ACT_LED, &s_blink, MKEY_ACT_PRIO_LOW),
+                    "blink starts");
+    sleep_until(esp_timer_get_time() + JIT_MS(50));
+    failed += check(gpio_get_level(PIN_OUT_LED) == 1, "blink drives the LED");
+    mock_timer_fail(true);
+    sleep_until(esp_timer_get_time() + JIT_MS(120));
+    failed += check(at_rest(), "outputs at rest after a failed rearm");
+
+    // and patterns play again once the timer works
+    mock_timer_fail(false);
+    failed += check(mkey_act_play(MKEY_ACT_BUZZER, &s_beep, MKEY_ACT_PRIO_NORMAL),
+                    "beep after recovery");
+    sleep_until(esp_timer_get_time() + JIT_MS(MKEY_BUZZER_PULSE_MS + 20));
+    failed += check(at_rest(), "outputs at rest after the beep");
+
+    mkey_act_stats_get(&st);
+    failed += check(st.timer_errors == 2, "two timer errors counted");
+    printf("timer failure: %lu errors, outputs back to rest: %s\n",
+           (unsigned long)st.timer_errors, failed ? "FAIL" : "ok");
+    return failed;
+}
+
+int main(void) {
+    static jit_result_t blocking;
+    static jit_result_t sequencer;
+    mkey_act_stats_t st;
+    int failed = 0;
+
+    mock_gpio_set(on_gpio);
+    gpio_set_level(PIN_OUT_RELAY, 1);     // relay locked at rest
+    mkey_act_init();
+
+    printf("%-10s %6s %8s %8s %8s %8s %7s %6s %9s\n", "mode", "events",
+           "late avg", "late p99", "late max", "busy max", "stalled", "pulses",
+           "pulse err");
+    run(JIT_BLOCKING, &blocking);
+    report("blocking", &blocking);
+    run(JIT_SEQUENCER, &sequencer);
+    report("sequencer", &sequencer);
+
+    mkey_act_stats_get(&st);
+    printf("sequencer: %lu patterns, %lu steps, step late max %lu us\n",
+           (unsigned long)st.played, (unsigned long)st.steps,
+           (unsigned long)st.late_max_us);
+
+    failed += check(sequencer.stalled == 0, "control loop stalled with the sequencer");
+    failed += check(sequencer.pulses > 0 &&
+                        sequencer.pulse_err_max_us <= JIT_PULSE_TOL_US,
+                    "sequencer pulse length");
+    failed += check(st.late_max_us <= JIT_PULSE_TOL_US, "sequencer step lateness");
+    failed += check(at_rest(), "outputs at rest after the run");
+    failed += check_timer_failure();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mkey_fsm.h"
+
+// Runs the control state machine through scripted and random beacon, IGN
+// and door histories, jumping from deadline to deadline so hours pass in
+// milliseconds. A reference model tracks when the unit must sleep:
+// MKEY_IGN_DOOR_SLEEP_MS after the door closed, MKEY_IGN_MAX_SLEEP_MS after
+// IGN went off with the door untouched, MKEY_SCAN_LIMIT_CYCLES scan loops
+// without a key; every step checks the machine against it.
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define SIM_S(s)            ((int64_t)(s) * 1000000)
+#define SIM_MIN(m)          SIM_S((m) * 60)
+#define SIM_RANDOM_HOURS    72
+
+/****************************************************
+ * TYPES
+*****************************************************/
+typedef enum {
+    SIM_KEY,              // arg: key present
+    SIM_IGN,              // arg: IGN on
+    SIM_DOOR,             // arg: door open
+    SIM_END,
+} sim_input_t;
+
+typedef struct {
+    int64_t at_us;        // since the script started
+    uint8_t input;        // sim_input_t
+    bool arg;
+} sim_step_t;
+
+typedef struct {
+    // what the unit sees
+    bool key;
+    bool ign;
+    bool door;
+    // reference model
+    int64_t search_start_us;
+    bool ign_off_window;      // key present, IGN off
+    int64_t window_start_us;
+    bool door_seen;           // the door opened during the window
+    int64_t door_closed_us;
+    // what the machine did
+    bool relay_locked;
+    bool led;
+    uint32_t beeps;
+    uint16_t wake_unlocks;    // unlocks the machine must have counted
+    bool slept;
+    const char *sleep_reason;
+    // run totals
+    uint32_t violations;
+    uint32_t sleeps_scan;
+    uint32_t sleeps_door;
+    uint32_t sleeps_hard;
+    uint32_t unlocks;
+    uint32_t events;
+} sim_t;
+
+static mkey_fsm_t s_fsm;
+static sim_t s_sim;
+static uint32_t s_rng = 0x9E3779B9;
+
+/****************************************************
+ * HAL
+*****************************************************/
+static void sim_outputs(void *ctx, bool relay_locked, bool led) {
+    s_sim.relay_locked = relay_locked;
+    s_sim.led = led;
+}
+
+static void sim_beep(void *ctx) {
+    s_sim.beeps++;
+}
+
+static void sim_sleep(void *ctx, const char *reason) {
+    s_sim.slept = true;
+    s_sim.sleep_reason = reason;
+}
+
+static const mkey_fsm_hal_t s_hal = {
+    .outputs = sim_outputs,
+    .beep = sim_beep,
+    .sleep = sim_sleep,
+};
+
+/****************************************************
+ * REFERENCE MODEL
+*****************************************************/
+static void violation(int64_t now_us, const char *what) {
+    s_sim.violations++;
+    if (s_sim.violations <= 10) {
+        printf("  VIOLATION at %.3f s: %s (state %s)\n", now_us / 1e6, what,
+               mkey_fsm_state_name(s_fsm.state));
+    }
+}
+
+static mkey_fsm_state_t ref_state(void) {
+    if (!s_sim.key) {
+        return MKEY_FSM_LOCKED;
+    }
+    return s_sim.ign ? MKEY_FSM_IGN_ON : MKEY_FSM_IGN_OFF;
+}
+
+// When the unit has to go to sleep, 0 if it must stay awake.
+static int64_t ref_deadline(void) {
+    switch (ref_state()) {
+        case MKEY_FSM_LOCKED:
+            return s_sim.search_start_us + SIM_S(MKEY_SCAN_LIMIT_CYCLES);
+        case MKEY_FSM_IGN_OFF:
+            if (s_sim.door) {
+                return 0;
+            }
+            if (s_sim.door_seen) {
+                return s_sim.door_closed_us + (int64_t)MKEY_IGN_DOOR_SLEEP_MS * 1000;
+            }
+            return s_sim.window_start_us + (int64_t)MKEY_IGN_MAX_SLEEP_MS * 1000;
+        default:
+            return 0;
+    }
+}
+
+// Follows the IGN off window after the inputs changed at `now_us`.
+static void ref_update(int64_t now_us) {
+    const bool window = ref_state() == MKEY_FSM_IGN_OFF;
+
+    if (window && !s_sim.ign_off_window) {
+        s_sim.window_start_us = now_us;
+        s_sim.door_seen = s_sim.door;
+    }
+    s_sim.ign_off_window = window;
+}
+
+// Checks the machine after everything due at `now_us` ran.
+static void ref_check(int64_t now_us) {
+    const int64_t due = ref_deadline();
+
+    if (s_sim.slept) {
+        const char *want = ref_state() == MKEY_FSM_LOCKED ? "scan"
+                           : s_sim.door_seen              ? "door"
+                                                          : "hard";
+        if (due == 0 || now_us != due) {
+            violation(now_us, "slept off schedule");
+        } else if (strstr(s_sim.sleep_reason, want) == NULL) {
+            violation(now_us, "slept for the wrong reason");
+        }
+        if (ref_state() == MKEY_FSM_LOCKED &&
+            mkey_fsm_scan_cycles(&s_fsm, now_us) != MKEY_SCAN_LIMIT_CYCLES) {
+            violation(now_us, "scan limit missed");
+        }
+        return;
+    }
+    if (due != 0 && now_us >= due) {
+        violation(now_us, "still awake past the deadline");
+    }
+    if (s_fsm.state != ref_state()) {
+        violation(now_us, "state does not follow key/IGN");
+    }
+    if (!s_sim.relay_locked && ref_state() != MKEY_FSM_IGN_ON) {
+        violation(now_us, "relay released without key and IGN");
+    }
+    if (s_sim.relay_locked && ref_state() == MKEY_FSM_IGN_ON) {
+        violation(now_us, "relay locked with key and IGN");
+    }
+    if (s_fsm.counters.unlocks != s_sim.wake_unlocks) {
+        violation(now_us, "unlock counted twice or missed");
+    }
+}
+
+/****************************************************
+ * DRIVER
+*****************************************************/
+// Powers the unit up (boot or wake from deep sleep) at `now_us`.
+static void sim_wake(int64_t now_us) {
+    s_sim.slept = false;
+    s_sim.search_start_us = now_us;
+    s_sim.ign_off_window = false;
+    s_sim.relay_locked = true;
+    s_sim.wake_unlocks = 0;
+    mkey_fsm_init(&s_fsm, &s_hal, s_sim.ign, s_sim.door, now_us);
+    if (s_sim.key) {
+        s_sim.unlocks++;
+        s_sim.wake_unlocks++;
+        mkey_fsm_dispatch(&s_fsm, MKEY_FSM_EV_KEY_PRESENT, now_us);
+    }
+    ref_update(now_us);
+}
+
+static void sim_input(int64_t now_us, sim_input_t input, bool arg) {
+    s_sim.events++;
+    switch (input) {
+        case SIM_KEY:
+            if (arg == s_sim.key) {
+                break;
+            }
+            s_sim.key = arg;
+            if (arg) {
+                // one unlock per arrival, whatever IGN is doing
+                s_sim.unlocks++;
+                s_sim.wake_unlocks++;
+                mkey_fsm_inputs(&s_fsm, s_sim.ign, s_sim.door, now_us);
+                mkey_fsm_dispatch(&s_fsm, MKEY_FSM_EV_KEY_PRESENT, now_us);
+            } else {
+                s_sim.search_start_us = now_us;
+                mkey_fsm_dispatch(&s_fsm, MKEY_FSM_EV_KEY_LOST, now_us);
+            }
+            break;
+        case SIM_IGN:
+            if (arg && !s_sim.ign && s_sim.key) {
+                s_sim.unlocks++;
+                s_sim.wake_unlocks++;
+            }
+            s_sim.ign = arg;
+            mkey_fsm_inputs(&s_fsm, s_sim.ign, s_sim.door, now_us);
+            break;
+        case SIM_DOOR:
+            s_sim.door = arg;
+            if (s_sim.ign_off_window) {
+                s_sim.door_seen |= arg;
+                s_sim.door_closed_us = now_us;
+            }
+            mkey_fsm_inputs(&s_fsm, s_sim.ign, s_sim.door, now_us);
+            break;
+        default:
+            break;
+    }
+    ref_update(now_us);
+}
+
+// Advances to `until_us`, stepping the machine at its own deadlines and at
+// the reference ones. Returns false when the unit went to sleep.
+static bool sim_run_until(int64_t *now_us, int64_t until_us) {
+    while (true) {
+        const int64_t fsm_due = mkey_fsm_deadline(&s_fsm, *now_us);
+        const int64_t ref_due = ref_deadline();
+        int64_t next = until_us;
+
+        if (fsm_due && fsm_due < next) {
+            next = fsm_due;
+        }
+        if (ref_due && ref_due < next) {
+            next = ref_due;
+        }
+        if (next < *now_us) {
+            next = *now_us;
+        }
+        *now_us = next;
+        mkey_fsm_step(&s_fsm, next);
+        ref_check(next);
+        if (s_sim.slept) {
+            if (strstr(s_sim.sleep_reason, "scan")) {
+                s_sim.sleeps_scan++;
+            } else if (strstr(s_sim.sleep_reason, "door")) {
+                s_sim.sleeps_door++;
+            } else {
+                s_sim.sleeps_hard++;
+            }
+            return false;
+        }
+        if (next == until_us) {
+            return true;
+        }
+    }
+}
+
+static void sim_reset(void) {
+    memset(&s_sim, 0, sizeof(s_sim));
+}
+
+// Plays a script from a fresh boot; `want` is the sleep it must end in
+// (NULL: awake at SIM_END) and `want_at_us` when.
+static bool sim_script(const char *name, const sim_step_t *steps,
+                       const char *want, int64_t want_at_us) {
+    int64_t now = 0;
+    bool awake = true;
+
+    sim_reset();
+    sim_wake(0);
+    for (const sim_step_t *st = steps; awake; st++) {
+        awake = sim_run_until(&now, st->at_us);
+        if (!awake || st->input == SIM_END) {
+            break;
+        }
+        sim_input(now, st->input, st->arg);
+        ref_check(now);
+    }
+
+    if (want == NULL ? !awake
+                     : awake || strstr(s_sim.sleep_reason, want) == NULL ||
+                           now != want_at_us) {
+        violation(now, "script ended off plan");
+    }
+    printf("%-36s %-10s at %9.1f s, %u unlocks, %u beeps  %s\n", name,
+           awake ? "awake" : want, now / 1e6, s_fsm.counters.unlocks,
+           s_sim.beeps, s_sim.violations ? "FAIL" : "ok");
+    return s_sim.violations == 0;
+}
+
+static uint32_t rng(void) {
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+// Spread of everyday gaps between two events: seconds to an hour.
+static int64_t rng_gap_us(void) {
+    static const int64_t spans[] = {SIM_S(5), SIM_S(40), SIM_MIN(5), SIM_MIN(15),
+                                    SIM_MIN(60)};
+    return 1 + rng() % spans[rng() % (sizeof(spans) / sizeof(spans[0]))];
+}
+
+// Random days of a vehicle: the driver walks up, drives, parks, opens and
+// closes doors, leaves; the unit sleeps and wakes in between.
+static bool sim_random(uint32_t hours) {
+    const int64_t end = SIM_MIN(60 * (int64_t)hours);
+    int64_t now = 0;
+
+    sim_reset();
+    sim_wake(0);
+    while (now < end) {
+        const int64_t at = now + rng_gap_us();
+        const uint32_t pick = rng() % 100;
+
+        if (!sim_run_until(&now, at < end ? at : end)) {
+            // deep sleep until something happens, then wake with the inputs
+            // as they are by then
+            now += rng_gap_us();
+            s_sim.key = rng() % 2;
+            s_sim.ign = s_sim.key && rng() % 3 == 0;
+            s_sim.door = rng() % 4 == 0;
+            sim_wake(now);
+            ref_check(now);
+            continue;
+        }
+        if (now >= end) {
+            break;
+        }
+        if (pick < 25) {
+            sim_input(now, SIM_KEY, !s_sim.key);
+        } else if (pick < 50) {
+            sim_input(now, SIM_IGN, !s_sim.ign);
+        } else {
+            sim_input(now, SIM_DOOR, !s_sim.door);
+        }
+        ref_check(now);
+    }
+
+    printf("%-36s %u h, %u events, sleeps %u scan / %u door / %u hard, "
+           "%u unlocks  %s\n", "random", hours, s_sim.events, s_sim.sleeps_scan,
+           s_sim.sleeps_door, s_sim.sleeps_hard, s_sim.unlocks,
+           s_sim.violations ? "FAIL" : "ok");
+    return s_sim.violations == 0;
+}
+
+int main(void) {
+    static const sim_step_t no_key[] = {
+        {SIM_S(3600), SIM_END},
+    };
+    static const sim_step_t park_and_leave[] = {
+        {SIM_S(2), SIM_KEY, true},
+        {SIM_S(5), SIM_DOOR, true},
+        {SIM_S(20), SIM_DOOR, false},
+        {SIM_S(3600), SIM_END},
+    };
+    static const sim_step_t park_no_door[] = {
+        {SIM_S(2), SIM_KEY, true},
+        {SIM_S(3600), SIM_END},
+    };
+    static const sim_step_t drive_then_park[] = {
+        {SIM_S(1), SIM_IGN, true},
+        {SIM_S(2), SIM_KEY, true},
+        {SIM_MIN(120), SIM_IGN, false},
+        {SIM_MIN(121), SIM_DOOR, true},
+        {SIM_MIN(121) + SIM_S(4), SIM_DOOR, false},
+        {SIM_MIN(300), SIM_END},
+    };
+    static const sim_step_t door_held_open[] = {
+        {SIM_S(2), SIM_KEY, true},
+        {SIM_S(10), SIM_DOOR, true},
+        {SIM_MIN(90), SIM_DOOR, false},
+        {SIM_MIN(300), SIM_END},
+    };
+    static const sim_step_t door_while_driving[] = {
+        {SIM_S(2), SIM_KEY, true},
+        {SIM_S(3), SIM_IGN, true},
+        {SIM_S(30), SIM_DOOR, true},
+        {SIM_S(40), SIM_DOOR, false},
+        {SIM_MIN(45), SIM_IGN, false},
+        {SIM_MIN(300), SIM_END},
+    };
+    static const sim_step_t key_walks_away[] = {
+        {SIM_S(2), SIM_KEY, true},
+        {SIM_S(100), SIM_KEY, false},
+        {SIM_MIN(300), SIM_END},
+    };
+    static const sim_step_t ign_left_on[] = {
+        {SIM_S(1), SIM_IGN, true},
+        {SIM_S(2), SIM_KEY, true},
+        {SIM_MIN(600), SIM_END},
+    };
+    bool ok = true;
+
+    ok &= sim_script("boot without key", no_key, "scan",
+                     SIM_S(MKEY_SCAN_LIMIT_CYCLES));
+    ok &= sim_script("park, door open 5-20 s", park_and_leave, "door",
+                     SIM_S(20) + (int64_t)MKEY_IGN_DOOR_SLEEP_MS * 1000);
+    ok &= sim_script("park, door never opens", park_no_door, "hard",
+                     SIM_S(2) + (int64_t)MKEY_IGN_MAX_SLEEP_MS * 1000);
+    ok &= sim_script("drive 2 h, park, door", drive_then_park, "door",
+                     SIM_MIN(121) + SIM_S(4) + (int64_t)MKEY_IGN_DOOR_SLEEP_MS * 1000);
+    ok &= sim_script("door held open 90 min", door_held_open, "door",
+                     SIM_MIN(90) + (int64_t)MKEY_IGN_DOOR_SLEEP_MS * 1000);
+    ok &= sim_script("door only while driving", door_while_driving, "hard",
+                     SIM_MIN(45) + (int64_t)MKEY_IGN_MAX_SLEEP_MS * 1000);
+    ok &= sim_script("key walks away", key_walks_away, "scan",
+                     SIM_S(100) + SIM_S(MKEY_SCAN_LIMIT_CYCLES));
+    ok &= sim_script("IGN left on 10 h", ign_left_on, NULL, 0);
+    ok &= sim_random(SIM_RANDOM_HOURS);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Output levels only; the host build has no pin configuration.
+typedef int gpio_num_t;
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level);
+int gpio_get_level(gpio_num_t gpio_num);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "esp_err.h"
+#include "sdkconfig.h"  // as on the target, the CONFIG_* values come with it
+
+typedef enum {
+  ESP_LOG_NONE = 0,
+  ESP_LOG_ERROR,
+  ESP_LOG_WARN,
+  ESP_LOG_INFO,
+  ESP_LOG_DEBUG,
+  ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+// Messages up to this level are printed (mock_log_level, default WARN).
+extern esp_log_level_t mock_log_level;
+
+void mock_log(esp_log_level_t level, const char *tag, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, ...) mock_log(ESP_LOG_ERROR, tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) mock_log(ESP_LOG_WARN, tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) mock_log(ESP_LOG_INFO, tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) mock_log(ESP_LOG_DEBUG, tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) mock_log(ESP_LOG_VERBOSE, tag, __VA_ARGS__)
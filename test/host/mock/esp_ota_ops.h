@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+
+typedef uint32_t esp_ota_handle_t;
+
+#define OTA_SIZE_UNKNOWN            0xffffffff
+#define OTA_WITH_SEQUENTIAL_WRITES  0xfffffffe
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start);
+const esp_partition_t *esp_ota_get_running_partition(void);
+esp_err_t esp_ota_begin(const esp_partition_t *part, size_t image_size,
+                        esp_ota_handle_t *out);
+esp_err_t esp_ota_write_with_offset(esp_ota_handle_t handle, const void *data,
+                                    size_t len, uint32_t offset);
+esp_err_t esp_ota_end(esp_ota_handle_t handle);
+esp_err_t esp_ota_abort(esp_ota_handle_t handle);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *part);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  const char *label;
+  uint8_t *mem;     // mock: contents of the partition
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset,
+                             void *dst, size_t len);
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset,
+                              const void *src, size_t len);
+esp_err_t esp_partition_erase_range(const esp_partition_t *part,
+                                    size_t offset, size_t len);
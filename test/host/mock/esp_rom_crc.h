@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// Same convention as the ROM: pass the previous CRC to continue a stream.
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
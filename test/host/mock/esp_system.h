@@ -0,0 +1,6 @@
+#pragma once
+
+#include "esp_err.h"
+
+// mock: counts the restart and returns
+void esp_restart(void);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "esp_system.h"   // pulled in by portmacro.h on the target
+
+// FreeRTOS on POSIX threads, just what the firmware modules use. One tick is
+// one millisecond.
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              1
+#define pdFAIL              0
+#define portMAX_DELAY       ((TickType_t)0xffffffff)
+#define portTICK_PERIOD_MS  1
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(ms))
+
+// Critical sections become one process-wide recursive mutex.
+typedef struct {
+  int unused;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+
+void mock_critical_enter(void);
+void mock_critical_exit(void);
+
+#define portENTER_CRITICAL(mux)     ((void)(mux), mock_critical_enter())
+#define portEXIT_CRITICAL(mux)      ((void)(mux), mock_critical_exit())
+#define portENTER_CRITICAL_ISR(mux) ((void)(mux), mock_critical_enter())
+#define portEXIT_CRITICAL_ISR(mux)  ((void)(mux), mock_critical_exit())
+#define portYIELD_FROM_ISR(woken)   ((void)(woken))
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "freertos/queue.h"
+
+// A binary semaphore is a queue of one empty item, as in FreeRTOS.
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef pthread_t *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+// Tasks run as detached threads and live until the process exits.
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t prio, TaskHandle_t *out);
+void vTaskDelay(TickType_t ticks);
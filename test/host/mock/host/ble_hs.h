@@ -0,0 +1,204 @@
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_err.h"
+
+/* mbufs: a single flat buffer per packet */
+struct os_mbuf {
+  uint16_t om_len;
+  uint16_t om_size;
+  uint8_t *om_data;
+};
+
+#define OS_MBUF_PKTLEN(om) ((om)->om_len)
+
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len);
+int os_mbuf_copydata(const struct os_mbuf *om, int off, int len, void *dst);
+int os_mbuf_free_chain(struct os_mbuf *om);
+struct os_mbuf *os_msys_get_pkthdr(uint16_t size, uint16_t user_hdr_len);
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len);
+int ble_hs_mbuf_to_flat(const struct os_mbuf *om, void *flat, uint16_t max_len,
+                        uint16_t *out_len);
+
+/* uuids */
+typedef struct {
+  uint8_t type;
+} ble_uuid_t;
+
+typedef struct {
+  ble_uuid_t u;
+  uint16_t value;
+} ble_uuid16_t;
+
+typedef struct {
+  ble_uuid_t u;
+  uint8_t value[16];
+} ble_uuid128_t;
+
+#define BLE_UUID_TYPE_16  16
+#define BLE_UUID_TYPE_128 128
+#define BLE_UUID16_INIT(v) {.u = {.type = BLE_UUID_TYPE_16}, .value = (v)}
+#define BLE_UUID128_INIT(...) \
+  {.u = {.type = BLE_UUID_TYPE_128}, .value = {__VA_ARGS__}}
+#define BLE_UUID16_DECLARE(v) \
+  ((const ble_uuid_t *)(&(ble_uuid16_t)BLE_UUID16_INIT(v)))
+
+uint16_t ble_uuid_u16(const ble_uuid_t *uuid);
+int ble_uuid_cmp(const ble_uuid_t *a, const ble_uuid_t *b);
+
+/* GATT server */
+struct ble_gatt_chr_def;
+
+struct ble_gatt_access_ctxt {
+  uint8_t op;
+  struct os_mbuf *om;
+  const struct ble_gatt_chr_def *chr;
+};
+
+typedef int ble_gatt_access_fn(uint16_t conn_handle, uint16_t attr_handle,
+                               struct ble_gatt_access_ctxt *ctxt, void *arg);
+
+struct ble_gatt_chr_def {
+  const ble_uuid_t *uuid;
+  ble_gatt_access_fn *access_cb;
+  void *arg;
+  void *descriptors;
+  uint16_t flags;
+  uint8_t min_key_size;
+  uint16_t *val_handle;
+};
+
+struct ble_gatt_svc_def {
+  uint8_t type;
+  const ble_uuid_t *uuid;
+  const struct ble_gatt_svc_def **includes;
+  const struct ble_gatt_chr_def *characteristics;
+};
+
+#define BLE_GATT_SVC_TYPE_PRIMARY     1
+#define BLE_GATT_CHR_F_READ           0x0002
+#define BLE_GATT_CHR_F_WRITE_NO_RSP   0x0004
+#define BLE_GATT_CHR_F_WRITE          0x0008
+#define BLE_GATT_CHR_F_NOTIFY         0x0010
+#define BLE_GATT_CHR_F_READ_ENC       0x0200
+#define BLE_GATT_CHR_F_WRITE_ENC      0x1000
+#define BLE_GATT_CHR_F_WRITE_AUTHEN   0x2000
+#define BLE_GATT_ACCESS_OP_READ_CHR   0
+#define BLE_GATT_ACCESS_OP_WRITE_CHR  1
+
+#define BLE_ATT_ERR_WRITE_NOT_PERMITTED     0x03
+#define BLE_ATT_ERR_INSUFFICIENT_AUTHEN     0x05
+#define BLE_ATT_ERR_REQ_NOT_SUPPORTED       0x06
+#define BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN  0x0d
+#define BLE_ATT_ERR_UNLIKELY                0x0e
+#define BLE_ATT_ERR_INSUFFICIENT_RES        0x11
+
+#define BLE_HS_EALREADY           2
+#define BLE_HS_EINVAL             3
+#define BLE_HS_ENOMEM             6
+#define BLE_HS_ENOTCONN           7
+#define BLE_HS_EAPP               9
+#define BLE_HS_ETIMEOUT           13
+#define BLE_HS_EBUSY              15
+#define BLE_HS_CONN_HANDLE_NONE   0xffff
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs);
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *defs);
+int ble_gattc_notify_custom(uint16_t conn_handle, uint16_t attr_handle,
+                            struct os_mbuf *om);
+uint16_t ble_att_mtu(uint16_t conn_handle);
+
+/* GAP: every mock link is encrypted and bonded */
+struct ble_gap_sec_state {
+  unsigned encrypted : 1;
+  unsigned authenticated : 1;
+  unsigned bonded : 1;
+  unsigned key_size : 5;
+};
+
+struct ble_gap_conn_desc {
+  struct ble_gap_sec_state sec_state;
+  uint16_t conn_handle;
+};
+
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc);
+int ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type);
+
+/* extended and periodic advertising: recorded per instance, see mock.h */
+#define BLE_HS_ADV_TYPE_MFG_DATA  0xff
+#define BLE_HCI_LE_PHY_1M         1
+#define BLE_HCI_LE_PHY_2M         2
+
+struct ble_gap_ext_adv_params {
+  unsigned connectable : 1;
+  unsigned scannable : 1;
+  unsigned directed : 1;
+  unsigned legacy_pdu : 1;
+  uint32_t itvl_min;
+  uint32_t itvl_max;
+  uint8_t own_addr_type;
+  uint8_t primary_phy;
+  uint8_t secondary_phy;
+  uint8_t sid;
+};
+
+struct ble_gap_periodic_adv_params {
+  unsigned include_tx_power : 1;
+  uint16_t itvl_min;
+  uint16_t itvl_max;
+};
+
+struct ble_gap_event;
+typedef int ble_gap_event_fn(struct ble_gap_event *event, void *arg);
+
+int ble_gap_ext_adv_configure(uint8_t instance,
+                              const struct ble_gap_ext_adv_params *params,
+                              int8_t *selected_tx_power, ble_gap_event_fn *cb,
+                              void *cb_arg);
+int ble_gap_ext_adv_set_data(uint8_t instance, struct os_mbuf *data);
+int ble_gap_ext_adv_start(uint8_t instance, int duration, int max_events);
+int ble_gap_periodic_adv_configure(uint8_t instance,
+                                   const struct ble_gap_periodic_adv_params *params);
+int ble_gap_periodic_adv_set_data(uint8_t instance, struct os_mbuf *data);
+int ble_gap_periodic_adv_start(uint8_t instance);
+int ble_hs_synced(void);
+
+/* host event queue: events run when the harness drains it (the host task) */
+struct ble_npl_event;
+typedef void ble_npl_event_fn(struct ble_npl_event *ev);
+
+struct ble_npl_event {
+  ble_npl_event_fn *fn;
+  void *arg;
+  bool queued;
+  struct ble_npl_event *next;
+};
+
+struct ble_npl_eventq {
+  struct ble_npl_event *head;
+};
+
+void ble_npl_event_init(struct ble_npl_event *ev, ble_npl_event_fn *fn,
+                        void *arg);
+void *ble_npl_event_get_arg(struct ble_npl_event *ev);
+void ble_npl_eventq_put(struct ble_npl_eventq *evq, struct ble_npl_event *ev);
+struct ble_npl_eventq *nimble_port_get_dflt_eventq(void);
+
+/* callouts: one tick per ms, expired by the harness (mock_callouts_expire) */
+struct ble_npl_callout {
+  struct ble_npl_event ev;
+  struct ble_npl_eventq *evq;
+  uint32_t ticks;
+  bool active;
+};
+
+void ble_npl_callout_init(struct ble_npl_callout *co, struct ble_npl_eventq *evq,
+                          ble_npl_event_fn *fn, void *arg);
+int ble_npl_callout_reset(struct ble_npl_callout *co, uint32_t ticks);
+void ble_npl_callout_stop(struct ble_npl_callout *co);
+bool ble_npl_callout_is_active(struct ble_npl_callout *co);
+uint32_t ble_npl_time_ms_to_ticks32(uint32_t ms);
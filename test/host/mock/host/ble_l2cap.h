@@ -0,0 +1,43 @@
+#pragma once
+
+#include "host/ble_hs.h"
+
+/* LE credit based channels, server side only */
+struct ble_l2cap_chan;
+
+struct ble_l2cap_event {
+  uint8_t type;
+  union {
+    struct {
+      uint16_t conn_handle;
+      struct ble_l2cap_chan *chan;
+      uint16_t peer_sdu_size;
+    } accept;
+    struct {
+      int status;
+      uint16_t conn_handle;
+      struct ble_l2cap_chan *chan;
+    } connect;
+    struct {
+      uint16_t conn_handle;
+      struct ble_l2cap_chan *chan;
+    } disconnect;
+    struct {
+      uint16_t conn_handle;
+      struct ble_l2cap_chan *chan;
+      struct os_mbuf *sdu_rx;
+    } receive;
+  };
+};
+
+#define BLE_L2CAP_EVENT_COC_CONNECTED      0
+#define BLE_L2CAP_EVENT_COC_DISCONNECTED   1
+#define BLE_L2CAP_EVENT_COC_ACCEPT         2
+#define BLE_L2CAP_EVENT_COC_DATA_RECEIVED  3
+
+typedef int ble_l2cap_event_fn(struct ble_l2cap_event *event, void *arg);
+
+int ble_l2cap_create_server(uint16_t psm, uint16_t mtu, ble_l2cap_event_fn *cb,
+                            void *cb_arg);
+int ble_l2cap_recv_ready(struct ble_l2cap_chan *chan, struct os_mbuf *sdu_rx);
+int ble_l2cap_disconnect(struct ble_l2cap_chan *chan);
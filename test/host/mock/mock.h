@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "host/ble_hs.h"
+
+/****************************************************
+ * FLASH
+*****************************************************/
+
+// Cost of the flash operations the writer task waits for (slow flash).
+typedef struct {
+  uint32_t program_us_per_kib;
+  uint32_t erase_us_per_sector;
+} mock_flash_timing_t;
+
+void mock_flash_timing(const mock_flash_timing_t *timing);
+
+// Fills the running partition (source of COPY and HASH) and erases the
+// update partition.
+void mock_flash_reset(const uint8_t *running, uint32_t len);
+
+// Programming that reaches past `offset` of the update partition fails from
+// now on (a worn or protected sector); 0 turns it off.
+void mock_flash_fail_at(uint32_t offset);
+
+// What image validation (esp_image_verify, esp_ota_end) accepts: the update
+// partition holds `len` bytes equal to `image`.
+void mock_ota_expect(const uint8_t *image, uint32_t len);
+
+typedef struct {
+  uint32_t begins;
+  uint32_t aborts;
+  uint32_t aborts_unopened;   // esp_ota_abort() of a handle never begun
+  uint32_t ends;
+  uint32_t ends_unopened;     // esp_ota_end() of a handle not open
+  uint32_t verifies;          // esp_image_verify() of the update partition
+  uint32_t boots_set;
+  uint32_t restarts;
+} mock_ota_stats_t;
+
+void mock_ota_stats(mock_ota_stats_t *out);
+
+/****************************************************
+ * TIMERS AND GPIO
+*****************************************************/
+
+// esp_timer_start_once() fails with ESP_FAIL while set.
+void mock_timer_fail(bool on);
+
+// Called for every gpio_set_level(), from whatever task set the pin.
+typedef void (*mock_gpio_fn_t)(int pin, uint32_t level, int64_t at_us);
+
+void mock_gpio_set(mock_gpio_fn_t fn);
+
+/****************************************************
+ * NIMBLE
+*****************************************************/
+
+// Called for every notification, from whatever task sent it.
+typedef void (*mock_notify_fn_t)(uint16_t conn_handle, uint16_t attr_handle,
+                                 const uint8_t *data, uint16_t len);
+
+void mock_notify_set(mock_notify_fn_t fn);
+
+// Notifications fail with BLE_HS_ENOMEM while set (full host buffers).
+void mock_notify_congested(bool on);
+
+void mock_att_mtu_set(uint16_t mtu);
+
+// Access callbacks of the registered services, called like the host task.
+int mock_gatt_write(uint16_t conn_handle, const ble_uuid_t *uuid,
+                    const void *data, uint16_t len);
+int mock_gatt_read(uint16_t conn_handle, const ble_uuid_t *uuid, void *out,
+                   uint16_t max_len, uint16_t *out_len);
+
+// Runs the events posted to the host queue on the calling thread. Returns
+// how many ran.
+int mock_host_run(void);
+
+// Posts every armed callout to its queue, as if its time had come, and
+// disarms it. Returns how many expired.
+int mock_callouts_expire(void);
+
+// An extended advertising instance as the firmware set it up.
+#define MOCK_ADV_DATA_MAX 64
+
+typedef struct {
+  bool configured;
+  bool started;
+  struct ble_gap_ext_adv_params params;
+  uint8_t data[MOCK_ADV_DATA_MAX];
+  uint16_t data_len;
+  uint32_t data_sets;         // ble_gap_ext_adv_set_data() calls
+  bool periodic_configured;
+  bool periodic_started;
+  struct ble_gap_periodic_adv_params periodic_params;
+  uint8_t periodic_data[MOCK_ADV_DATA_MAX];
+  uint16_t periodic_data_len;
+  uint32_t periodic_data_sets;
+} mock_ext_adv_t;
+
+void mock_ext_adv_get(uint8_t instance, mock_ext_adv_t *out);
+
+// Advertising data updates fail with BLE_HS_EBUSY while set.
+void mock_ext_adv_fail(bool on);
+
+// L2CAP peer: opens the channel of the registered server, sends one SDU.
+// Returns false while the server has no receive buffer posted (no credits).
+bool mock_l2cap_connect(uint16_t conn_handle);
+bool mock_l2cap_can_send(void);
+bool mock_l2cap_send(const void *sdu, uint16_t len);
+void mock_l2cap_disconnect(void);
+
+/****************************************************
+ * FIRMWARE COLLABORATORS
+*****************************************************/
+
+// Levels the gap/power stubs were last asked for.
+typedef struct {
+  int link_profile;           // gap_link_profile_t of the last request
+  uint32_t adv_status_changes;
+  bool ota_lock;              // MKEY_POWER_LOCK_OTA
+  bool actuator_lock;         // MKEY_POWER_LOCK_ACTUATOR
+  bool off_host_thread;       // link, advertising or OTA lock touched
+                              // outside the host thread
+} mock_app_state_t;
+
+void mock_app_state(mock_app_state_t *out);
+
+// The thread that plays the NimBLE host task (defaults to the first caller).
+void mock_host_thread_set(void);
+bool mock_on_host_thread(void);
@@ -0,0 +1,185 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "gap.h"
+#include "mkey.h"
+#include "mkey_keys.h"
+#include "mkey_power.h"
+#include "ota_dedup.h"
+#include "ota_resume.h"
+
+#include "esp_rom_crc.h"
+
+#include "mock.h"
+
+// What gatt_svr.c needs from the rest of the firmware: the link and
+// advertising requests are recorded, the checkpoint lives in memory (NVS) and
+// block hashes are CRC based (mbedtls).
+
+static struct {
+  pthread_mutex_t lock;
+  mock_app_state_t state;
+  bool host_set;
+  pthread_t host;
+  bool resume_valid;
+  ota_resume_t resume;
+} s_app = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void mock_app_state(mock_app_state_t *out) {
+  pthread_mutex_lock(&s_app.lock);
+  *out = s_app.state;
+  pthread_mutex_unlock(&s_app.lock);
+}
+
+void mock_host_thread_set(void) {
+  s_app.host = pthread_self();
+  s_app.host_set = true;
+}
+
+bool mock_on_host_thread(void) {
+  if (!s_app.host_set) {
+    mock_host_thread_set();
+  }
+  return pthread_equal(s_app.host, pthread_self());
+}
+
+// host task only in the firmware; a call from anywhere else is recorded
+static void host_only(void) {
+  if (!mock_on_host_thread()) {
+    s_app.state.off_host_thread = true;
+  }
+}
+
+/****************************************************
+ * GAP
+*****************************************************/
+void gap_link_profile_set(uint16_t conn_handle, gap_link_profile_t profile) {
+  pthread_mutex_lock(&s_app.lock);
+  host_only();
+  s_app.state.link_profile = profile;
+  pthread_mutex_unlock(&s_app.lock);
+}
+
+bool gap_link_get(uint16_t conn_handle, gap_link_t *out) {
+  memset(out, 0, sizeof(*out));
+  out->conn_handle = conn_handle;
+  out->tx_phy = 2;
+  out->rx_phy = 2;
+  out->conn_itvl = GAP_LINK_FAST_ITVL_MIN;
+  out->supervision_timeout = GAP_LINK_FAST_TIMEOUT;
+  out->max_tx_octets = GAP_LINK_DLE_TX_OCTETS;
+  out->max_rx_octets = GAP_LINK_DLE_TX_OCTETS;
+  out->mtu = ble_att_mtu(conn_handle);
+  return true;
+}
+
+void gap_adv_status_changed(void) {
+  pthread_mutex_lock(&s_app.lock);
+  host_only();
+  s_app.state.adv_status_changes++;
+  pthread_mutex_unlock(&s_app.lock);
+}
+
+void gap_scan_open(bool open) {}
+
+void gap_radio_stats_get(gap_radio_stats_t *out) {
+  memset(out, 0, sizeof(*out));
+  out->scan_profile = GAP_SCAN_PROFILE_SEARCH;
+}
+
+void gap_scan_stats_get(gap_scan_stats_t *out) {
+  memset(out, 0, sizeof(*out));
+  out->filter = GAP_SCAN_FILTER_ACCEPT_LIST;
+}
+
+/****************************************************
+ * POWER / KEYS
+*****************************************************/
+void mkey_power_hold(mkey_power_lock_t lock, bool on) {
+  pthread_mutex_lock(&s_app.lock);
+  if (lock == MKEY_POWER_LOCK_OTA) {
+    host_only();
+    s_app.state.ota_lock = on;
+  } else if (lock == MKEY_POWER_LOCK_ACTUATOR) {
+    s_app.state.actuator_lock = on;
+  }
+  pthread_mutex_unlock(&s_app.lock);
+}
+
+bool mkey_enroll_allowed(void) { return false; }
+
+uint16_t mkey_keys_count(void) { return 0; }
+
+uint16_t mkey_keys_enabled(void) { return 0; }
+
+uint32_t mkey_keys_generation(void) { return 0; }
+
+bool mkey_keys_pending(uint16_t *count) { return false; }
+
+esp_err_t mkey_keys_begin(void) { return ESP_ERR_NOT_SUPPORTED; }
+
+esp_err_t mkey_keys_put(const mkey_key_t *key) { return ESP_ERR_NOT_SUPPORTED; }
+
+esp_err_t mkey_keys_remove(const uint8_t addr[6]) { return ESP_ERR_NOT_SUPPORTED; }
+
+esp_err_t mkey_keys_clear(void) { return ESP_ERR_NOT_SUPPORTED; }
+
+esp_err_t mkey_keys_commit(void) { return ESP_ERR_NOT_SUPPORTED; }
+
+void mkey_keys_abort(void) {}
+
+/****************************************************
+ * RESUME / DEDUP
+*****************************************************/
+esp_err_t ota_resume_load(ota_resume_t *rec) {
+  esp_err_t err = ESP_ERR_NOT_FOUND;
+
+  pthread_mutex_lock(&s_app.lock);
+  if (s_app.resume_valid) {
+    *rec = s_app.resume;
+    err = ESP_OK;
+  }
+  pthread_mutex_unlock(&s_app.lock);
+  return err;
+}
+
+esp_err_t ota_resume_save(const ota_resume_t *rec) {
+  pthread_mutex_lock(&s_app.lock);
+  s_app.resume = *rec;
+  s_app.resume_valid = true;
+  pthread_mutex_unlock(&s_app.lock);
+  return ESP_OK;
+}
+
+void ota_resume_clear(void) {
+  pthread_mutex_lock(&s_app.lock);
+  s_app.resume_valid = false;
+  pthread_mutex_unlock(&s_app.lock);
+}
+
+esp_err_t ota_dedup_hash_block(const esp_partition_t *part, uint32_t block,
+                               uint8_t *scratch, size_t scratch_len,
+                               uint8_t hash[OTA_DEDUP_HASH_LEN]) {
+  const uint32_t start = block * OTA_DEDUP_BLOCK_SIZE;
+  uint32_t a = 0;
+  uint32_t b = block;
+
+  memset(hash, 0, OTA_DEDUP_HASH_LEN);
+  if (start + OTA_DEDUP_BLOCK_SIZE > part->size) {
+    return ESP_OK;
+  }
+  for (uint32_t done = 0; done < OTA_DEDUP_BLOCK_SIZE; done += scratch_len) {
+    size_t n = OTA_DEDUP_BLOCK_SIZE - done;
+    if (n > scratch_len) {
+      n = scratch_len;
+    }
+    esp_partition_read(part, start + done, scratch, n);
+    a = esp_rom_crc32_le(a, scratch, n);
+    b = esp_rom_crc32_le(b ^ 0x5A5A5A5A, scratch, n);
+  }
+  memcpy(hash, &a, 4);
+  memcpy(hash + 4, &b, 4);
+  return ESP_OK;
+}
@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+struct mock_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint8_t *items;
+  UBaseType_t len;
+  UBaseType_t size;
+  UBaseType_t head;
+  UBaseType_t count;
+};
+
+typedef struct {
+  TaskFunction_t fn;
+  void *arg;
+} mock_task_t;
+
+static pthread_mutex_t s_critical;
+static pthread_once_t s_critical_once = PTHREAD_ONCE_INIT;
+
+static void critical_init(void) {
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&s_critical, &attr);
+}
+
+void mock_critical_enter(void) {
+  pthread_once(&s_critical_once, critical_init);
+  pthread_mutex_lock(&s_critical);
+}
+
+void mock_critical_exit(void) {
+  pthread_mutex_unlock(&s_critical);
+}
+
+// Absolute CLOCK_MONOTONIC deadline `ticks` ms from now.
+static void deadline_from(TickType_t ticks, struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec += ticks / 1000;
+  ts->tv_nsec += (long)(ticks % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+// Waits on the queue condition; false once the wait is over.
+static bool queue_wait(QueueHandle_t q, TickType_t wait,
+                       const struct timespec *ts) {
+  if (wait == 0) {
+    return false;
+  }
+  if (wait == portMAX_DELAY) {
+    pthread_cond_wait(&q->changed, &q->lock);
+    return true;
+  }
+  return pthread_cond_timedwait(&q->changed, &q->lock, ts) != ETIMEDOUT;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size) {
+  QueueHandle_t q = calloc(1, sizeof(*q));
+  pthread_condattr_t attr;
+
+  if (q == NULL) {
+    return NULL;
+  }
+  q->items = calloc(len, item_size ? item_size : 1);
+  q->len = len;
+  q->size = item_size;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&q->changed, &attr);
+  return q;
+}
+
+void vQueueDelete(QueueHandle_t q) {
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->changed);
+  free(q->items);
+  free(q);
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait) {
+  struct timespec ts;
+
+  deadline_from(wait, &ts);
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->len) {
+    if (!queue_wait(q, wait, &ts) && q->count == q->len) {
+      pthread_mutex_unlock(&q->lock);
+      return pdFALSE;
+    }
+  }
+  if (q->size) {
+    memcpy(&q->items[((q->head + q->count) % q->len) * q->size], item, q->size);
+  }
+  q->count++;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+  return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item,
+                             BaseType_t *woken) {
+  if (woken) {
+    *woken = pdFALSE;
+  }
+  return xQueueSend(q, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait) {
+  struct timespec ts;
+
+  deadline_from(wait, &ts);
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0) {
+    if (!queue_wait(q, wait, &ts) && q->count == 0) {
+      pthread_mutex_unlock(&q->lock);
+      return pdFALSE;
+    }
+  }
+  if (q->size) {
+    memcpy(item, &q->items[q->head * q->size], q->size);
+  }
+  q->head = (q->head + 1) % q->len;
+  q->count--;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+  UBaseType_t n;
+
+  pthread_mutex_lock(&q->lock);
+  n = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+  return xQueueCreate(1, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait) {
+  return xQueueReceive(sem, NULL, wait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+  return xQueueSend(sem, NULL, 0);
+}
+
+static void *task_main(void *arg) {
+  mock_task_t task = *(mock_task_t *)arg;
+
+  free(arg);
+  task.fn(task.arg);
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t prio, TaskHandle_t *out) {
+  mock_task_t *task = malloc(sizeof(*task));
+  pthread_t *thread = malloc(sizeof(*thread));
+
+  if (task == NULL || thread == NULL) {
+    free(task);
+    free(thread);
+    return pdFAIL;
+  }
+  task->fn = fn;
+  task->arg = arg;
+  if (pthread_create(thread, NULL, task_main, task) != 0) {
+    free(task);
+    free(thread);
+    return pdFAIL;
+  }
+  pthread_detach(*thread);
+  if (out) {
+    *out = thread;
+  }
+  return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  const struct timespec ts = {
+      .tv_sec = ticks / 1000,
+      .tv_nsec = (long)(ticks % 1000) * 1000000L,
+  };
+
+  nanosleep(&ts, NULL);
+}
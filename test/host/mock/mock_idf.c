@@ -0,0 +1,477 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_image_format.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+
+#include "mock.h"
+
+#define MOCK_PARTITION_SIZE   (1024 * 1024)
+#define MOCK_TIMERS_MAX       8
+#define MOCK_GPIO_COUNT       32
+
+/****************************************************
+ * LOG
+*****************************************************/
+esp_log_level_t mock_log_level = ESP_LOG_WARN;
+
+void mock_log(esp_log_level_t level, const char *tag, const char *fmt, ...) {
+  static const char letters[] = "?EWIDV";
+  va_list ap;
+
+  if (level > mock_log_level) {
+    return;
+  }
+  fprintf(stderr, "%c (%lld) %s: ", letters[level],
+          (long long)(esp_timer_get_time() / 1000), tag);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+const char *esp_err_to_name(esp_err_t err) {
+  switch (err) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_OTA_VALIDATE_FAILED: return "ESP_ERR_OTA_VALIDATE_FAILED";
+    case ESP_ERR_IMAGE_INVALID: return "ESP_ERR_IMAGE_INVALID";
+    default: return "UNKNOWN_ERROR";
+  }
+}
+
+/****************************************************
+ * TIME
+*****************************************************/
+int64_t esp_timer_get_time(void) {
+  static struct timespec t0;
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (t0.tv_sec == 0 && t0.tv_nsec == 0) {
+    t0 = ts;
+  }
+  return (int64_t)(ts.tv_sec - t0.tv_sec) * 1000000 +
+         (ts.tv_nsec - t0.tv_nsec) / 1000;
+}
+
+static void sleep_us(uint64_t us) {
+  const struct timespec ts = {
+      .tv_sec = us / 1000000,
+      .tv_nsec = (long)(us % 1000000) * 1000,
+  };
+
+  if (us) {
+    nanosleep(&ts, NULL);
+  }
+}
+
+// One-shot timers served by a single thread, like the esp_timer task.
+struct mock_esp_timer {
+  esp_timer_create_args_t args;
+  int64_t due_us;           // 0 while stopped
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t thread;
+  bool running;
+  struct mock_esp_timer *timers[MOCK_TIMERS_MAX];
+  int count;
+  bool fail;
+} s_timers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
+static void *timer_main(void *arg) {
+  pthread_mutex_lock(&s_timers.lock);
+  while (1) {
+    struct mock_esp_timer *next = NULL;
+
+    for (int i = 0; i < s_timers.count; i++) {
+      struct mock_esp_timer *t = s_timers.timers[i];
+      if (t->due_us && (next == NULL || t->due_us < next->due_us)) {
+        next = t;
+      }
+    }
+    if (next == NULL) {
+      pthread_cond_wait(&s_timers.changed, &s_timers.lock);
+      continue;
+    }
+    const int64_t wait = next->due_us - esp_timer_get_time();
+    if (wait > 0) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += wait / 1000000;
+      ts.tv_nsec += (long)(wait % 1000000) * 1000;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&s_timers.changed, &s_timers.lock, &ts);
+      continue;
+    }
+    next->due_us = 0;
+    pthread_mutex_unlock(&s_timers.lock);
+    next->args.callback(next->args.arg);
+    pthread_mutex_lock(&s_timers.lock);
+  }
+  return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *out) {
+  struct mock_esp_timer *t;
+
+  pthread_mutex_lock(&s_timers.lock);
+  if (s_timers.count == MOCK_TIMERS_MAX ||
+      (t = calloc(1, sizeof(*t))) == NULL) {
+    pthread_mutex_unlock(&s_timers.lock);
+    return ESP_ERR_NO_MEM;
+  }
+  t->args = *args;
+  s_timers.timers[s_timers.count++] = t;
+  if (!s_timers.running) {
+    pthread_create(&s_timers.thread, NULL, timer_main, NULL);
+    pthread_detach(s_timers.thread);
+    s_timers.running = true;
+  }
+  pthread_mutex_unlock(&s_timers.lock);
+  *out = t;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&s_timers.lock);
+  if (s_timers.fail) {
+    err = ESP_FAIL;
+  } else if (timer->due_us) {
+    err = ESP_ERR_INVALID_STATE;
+  } else {
+    // 0 is "stopped", so an immediate timer is due 1 us from now
+    timer->due_us = esp_timer_get_time() + (int64_t)timeout_us + 1;
+    pthread_cond_broadcast(&s_timers.changed);
+  }
+  pthread_mutex_unlock(&s_timers.lock);
+  return err;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&s_timers.lock);
+  if (timer->due_us == 0) {
+    err = ESP_ERR_INVALID_STATE;
+  }
+  timer->due_us = 0;
+  pthread_mutex_unlock(&s_timers.lock);
+  return err;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+  bool active;
+
+  pthread_mutex_lock(&s_timers.lock);
+  active = timer->due_us != 0;
+  pthread_mutex_unlock(&s_timers.lock);
+  return active;
+}
+
+void mock_timer_fail(bool on) {
+  pthread_mutex_lock(&s_timers.lock);
+  s_timers.fail = on;
+  pthread_mutex_unlock(&s_timers.lock);
+}
+
+/****************************************************
+ * GPIO
+*****************************************************/
+static struct {
+  pthread_mutex_t lock;
+  uint32_t levels[MOCK_GPIO_COUNT];
+  mock_gpio_fn_t fn;
+} s_gpio = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void mock_gpio_set(mock_gpio_fn_t fn) {
+  pthread_mutex_lock(&s_gpio.lock);
+  s_gpio.fn = fn;
+  pthread_mutex_unlock(&s_gpio.lock);
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level) {
+  if (gpio_num < 0 || gpio_num >= MOCK_GPIO_COUNT) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  pthread_mutex_lock(&s_gpio.lock);
+  s_gpio.levels[gpio_num] = level != 0;
+  if (s_gpio.fn) {
+    s_gpio.fn(gpio_num, level != 0, esp_timer_get_time());
+  }
+  pthread_mutex_unlock(&s_gpio.lock);
+  return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num) {
+  int level;
+
+  if (gpio_num < 0 || gpio_num >= MOCK_GPIO_COUNT) {
+    return 0;
+  }
+  pthread_mutex_lock(&s_gpio.lock);
+  level = (int)s_gpio.levels[gpio_num];
+  pthread_mutex_unlock(&s_gpio.lock);
+  return level;
+}
+
+/****************************************************
+ * FLASH AND OTA
+*****************************************************/
+static uint8_t s_running_mem[MOCK_PARTITION_SIZE];
+static uint8_t s_update_mem[MOCK_PARTITION_SIZE];
+
+static const esp_partition_t s_running = {
+    .address = 0x10000,
+    .size = MOCK_PARTITION_SIZE,
+    .label = "ota_0",
+    .mem = s_running_mem,
+};
+
+static const esp_partition_t s_update = {
+    .address = 0x110000,
+    .size = MOCK_PARTITION_SIZE,
+    .label = "ota_1",
+    .mem = s_update_mem,
+};
+
+static struct {
+  pthread_mutex_t lock;
+  mock_flash_timing_t timing;
+  esp_ota_handle_t next_handle;
+  esp_ota_handle_t open;          // 0 when no update is open
+  bool need_erase;                // open handle begun with OTA_WITH_SEQUENTIAL_WRITES
+  uint32_t wrote;                 // bytes written through the open handle
+  uint32_t fail_at;               // programming past this offset fails, 0: never
+  const uint8_t *expect;
+  uint32_t expect_len;
+  mock_ota_stats_t stats;
+} s_ota = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .next_handle = 1,
+};
+
+void mock_flash_timing(const mock_flash_timing_t *timing) {
+  s_ota.timing = *timing;
+}
+
+void mock_flash_fail_at(uint32_t offset) {
+  s_ota.fail_at = offset;
+}
+
+void mock_flash_reset(const uint8_t *running, uint32_t len) {
+  memset(s_running_mem, 0xFF, sizeof(s_running_mem));
+  memcpy(s_running_mem, running, len < sizeof(s_running_mem) ? len : sizeof(s_running_mem));
+  memset(s_update_mem, 0xFF, sizeof(s_update_mem));
+}
+
+void mock_ota_expect(const uint8_t *image, uint32_t len) {
+  s_ota.expect = image;
+  s_ota.expect_len = len;
+}
+
+void mock_ota_stats(mock_ota_stats_t *out) {
+  pthread_mutex_lock(&s_ota.lock);
+  *out = s_ota.stats;
+  pthread_mutex_unlock(&s_ota.lock);
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset,
+                             void *dst, size_t len) {
+  if (offset + len > part->size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(dst, part->mem + offset, len);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset,
+                              const void *src, size_t len) {
+  if (offset + len > part->size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (part == &s_update && s_ota.fail_at && offset + len > s_ota.fail_at) {
+    return ESP_FAIL;
+  }
+  sleep_us((uint64_t)s_ota.timing.program_us_per_kib * len / 1024);
+  // NOR flash: programming only clears bits
+  for (size_t i = 0; i < len; i++) {
+    part->mem[offset + i] &= ((const uint8_t *)src)[i];
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part,
+                                    size_t offset, size_t len) {
+  if (offset % SPI_FLASH_SEC_SIZE || len % SPI_FLASH_SEC_SIZE ||
+      offset + len > part->size) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  sleep_us((uint64_t)s_ota.timing.erase_us_per_sector * (len / SPI_FLASH_SEC_SIZE));
+  memset(part->mem + offset, 0xFF, len);
+  return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start) {
+  return &s_update;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void) {
+  return &s_running;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *part, size_t image_size,
+                        esp_ota_handle_t *out) {
+  pthread_mutex_lock(&s_ota.lock);
+  s_ota.open = s_ota.next_handle++;
+  s_ota.need_erase = image_size == OTA_WITH_SEQUENTIAL_WRITES;
+  s_ota.wrote = 0;
+  s_ota.stats.begins++;
+  *out = s_ota.open;
+  pthread_mutex_unlock(&s_ota.lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_write_with_offset(esp_ota_handle_t handle, const void *data,
+                                    size_t len, uint32_t offset) {
+  if (handle == 0 || handle != s_ota.open) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  // as in IDF: offset writes need the partition erased by esp_ota_begin()
+  if (s_ota.need_erase) {
+    fprintf(stderr, "esp_ota_write_with_offset: handle begun with "
+                    "OTA_WITH_SEQUENTIAL_WRITES\n");
+    abort();
+  }
+  esp_err_t err = esp_partition_write(&s_update, offset, data, len);
+  if (err == ESP_OK) {
+    s_ota.wrote += len;
+  }
+  return err;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&s_ota.lock);
+  if (handle == 0 || handle != s_ota.open) {
+    s_ota.stats.ends_unopened++;
+    err = ESP_ERR_NOT_FOUND;
+  } else {
+    s_ota.open = 0;
+    s_ota.stats.ends++;
+    if (s_ota.wrote == 0) {
+      // nothing went through the handle: IDF refuses to validate
+      err = ESP_ERR_INVALID_ARG;
+    } else if (s_ota.expect &&
+               memcmp(s_update_mem, s_ota.expect, s_ota.expect_len) != 0) {
+      err = ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+  }
+  pthread_mutex_unlock(&s_ota.lock);
+  return err;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&s_ota.lock);
+  if (handle == 0 || handle != s_ota.open) {
+    s_ota.stats.aborts_unopened++;
+    err = ESP_ERR_NOT_FOUND;
+  } else {
+    s_ota.open = 0;
+    s_ota.stats.aborts++;
+  }
+  pthread_mutex_unlock(&s_ota.lock);
+  return err;
+}
+
+esp_err_t esp_image_verify(esp_image_load_mode_t mode,
+                           const esp_partition_pos_t *part,
+                           esp_image_metadata_t *data) {
+  esp_err_t err = ESP_OK;
+
+  pthread_mutex_lock(&s_ota.lock);
+  s_ota.stats.verifies++;
+  if (part->offset != s_update.address) {
+    err = ESP_ERR_INVALID_ARG;
+  } else if (s_ota.expect &&
+             memcmp(s_update_mem, s_ota.expect, s_ota.expect_len) != 0) {
+    err = ESP_ERR_IMAGE_INVALID;
+  } else {
+    data->start_addr = part->offset;
+    data->image_len = s_ota.expect_len;
+  }
+  pthread_mutex_unlock(&s_ota.lock);
+  return err;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *part) {
+  pthread_mutex_lock(&s_ota.lock);
+  s_ota.stats.boots_set++;
+  pthread_mutex_unlock(&s_ota.lock);
+  return ESP_OK;
+}
+
+void esp_restart(void) {
+  pthread_mutex_lock(&s_ota.lock);
+  s_ota.stats.restarts++;
+  pthread_mutex_unlock(&s_ota.lock);
+}
+
+static uint32_t s_crc_table[256];
+static pthread_once_t s_crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    }
+    s_crc_table[i] = c;
+  }
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+  pthread_once(&s_crc_once, crc_init);
+  crc = ~crc;
+  while (len--) {
+    crc = s_crc_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
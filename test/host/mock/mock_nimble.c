@@ -0,0 +1,567 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host/ble_hs.h"
+#include "host/ble_l2cap.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+
+#include "mock.h"
+
+#define MOCK_SVCS_MAX 4
+#define MOCK_CALLOUTS_MAX 8
+#define MOCK_ADV_INSTANCES 2
+
+static struct {
+  pthread_mutex_t lock;
+  mock_notify_fn_t notify;
+  bool congested;
+  uint16_t mtu;
+  const struct ble_gatt_svc_def *svcs[MOCK_SVCS_MAX];
+  int svc_count;
+  struct ble_npl_eventq dflt_q;
+  struct ble_npl_callout *callouts[MOCK_CALLOUTS_MAX];
+  int callout_count;
+  mock_ext_adv_t adv[MOCK_ADV_INSTANCES];
+  bool adv_fail;
+} s_hs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .mtu = 247,
+};
+
+/****************************************************
+ * MBUF
+*****************************************************/
+static struct os_mbuf *mbuf_alloc(uint16_t size) {
+  struct os_mbuf *om = calloc(1, sizeof(*om) + size);
+
+  if (om == NULL) {
+    return NULL;
+  }
+  om->om_size = size;
+  om->om_data = (uint8_t *)(om + 1);
+  return om;
+}
+
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len) {
+  if (om->om_len + len > om->om_size) {
+    return BLE_HS_ENOMEM;
+  }
+  memcpy(om->om_data + om->om_len, data, len);
+  om->om_len += len;
+  return 0;
+}
+
+int os_mbuf_copydata(const struct os_mbuf *om, int off, int len, void *dst) {
+  if (off < 0 || len < 0 || off + len > om->om_len) {
+    return -1;
+  }
+  memcpy(dst, om->om_data + off, len);
+  return 0;
+}
+
+int os_mbuf_free_chain(struct os_mbuf *om) {
+  free(om);
+  return 0;
+}
+
+struct os_mbuf *os_msys_get_pkthdr(uint16_t size, uint16_t user_hdr_len) {
+  return mbuf_alloc(size);
+}
+
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len) {
+  struct os_mbuf *om = mbuf_alloc(len);
+
+  if (om) {
+    os_mbuf_append(om, buf, len);
+  }
+  return om;
+}
+
+int ble_hs_mbuf_to_flat(const struct os_mbuf *om, void *flat, uint16_t max_len,
+                        uint16_t *out_len) {
+  const uint16_t n = om->om_len < max_len ? om->om_len : max_len;
+
+  memcpy(flat, om->om_data, n);
+  if (out_len) {
+    *out_len = n;
+  }
+  return om->om_len > max_len ? BLE_HS_EBUSY : 0;
+}
+
+/****************************************************
+ * UUID
+*****************************************************/
+uint16_t ble_uuid_u16(const ble_uuid_t *uuid) {
+  return uuid->type == BLE_UUID_TYPE_16 ? ((const ble_uuid16_t *)uuid)->value : 0;
+}
+
+int ble_uuid_cmp(const ble_uuid_t *a, const ble_uuid_t *b) {
+  if (a->type != b->type) {
+    return a->type - b->type;
+  }
+  if (a->type == BLE_UUID_TYPE_16) {
+    return ((const ble_uuid16_t *)a)->value - ((const ble_uuid16_t *)b)->value;
+  }
+  return memcmp(((const ble_uuid128_t *)a)->value,
+                ((const ble_uuid128_t *)b)->value, 16);
+}
+
+/****************************************************
+ * GATT
+*****************************************************/
+void ble_svc_gap_init(void) {}
+
+void ble_svc_gatt_init(void) {}
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs) {
+  return 0;
+}
+
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *defs) {
+  uint16_t handle = 1;
+
+  if (s_hs.svc_count == MOCK_SVCS_MAX) {
+    return BLE_HS_ENOMEM;
+  }
+  s_hs.svcs[s_hs.svc_count++] = defs;
+  // value handles in registration order
+  for (const struct ble_gatt_svc_def *svc = defs; svc->type; svc++) {
+    for (const struct ble_gatt_chr_def *chr = svc->characteristics; chr->uuid; chr++) {
+      if (chr->val_handle) {
+        *chr->val_handle = handle;
+      }
+      handle += 2;
+    }
+  }
+  return 0;
+}
+
+static const struct ble_gatt_chr_def *gatt_find(const ble_uuid_t *uuid) {
+  for (int i = 0; i < s_hs.svc_count; i++) {
+    for (const struct ble_gatt_svc_def *svc = s_hs.svcs[i]; svc->type; svc++) {
+      for (const struct ble_gatt_chr_def *chr = svc->characteristics; chr->uuid; chr++) {
+        if (ble_uuid_cmp(chr->uuid, uuid) == 0) {
+          return chr;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+int mock_gatt_write(uint16_t conn_handle, const ble_uuid_t *uuid,
+                    const void *data, uint16_t len) {
+  const struct ble_gatt_chr_def *chr = gatt_find(uuid);
+  struct ble_gatt_access_ctxt ctxt = {.op = BLE_GATT_ACCESS_OP_WRITE_CHR};
+  int rc;
+
+  if (chr == NULL) {
+    return BLE_ATT_ERR_UNLIKELY;
+  }
+  ctxt.chr = chr;
+  ctxt.om = ble_hs_mbuf_from_flat(data, len);
+  rc = chr->access_cb(conn_handle, chr->val_handle ? *chr->val_handle : 0,
+                      &ctxt, chr->arg);
+  os_mbuf_free_chain(ctxt.om);
+  return rc;
+}
+
+int mock_gatt_read(uint16_t conn_handle, const ble_uuid_t *uuid, void *out,
+                   uint16_t max_len, uint16_t *out_len) {
+  const struct ble_gatt_chr_def *chr = gatt_find(uuid);
+  struct ble_gatt_access_ctxt ctxt = {.op = BLE_GATT_ACCESS_OP_READ_CHR};
+  int rc;
+
+  if (chr == NULL) {
+    return BLE_ATT_ERR_UNLIKELY;
+  }
+  ctxt.chr = chr;
+  ctxt.om = mbuf_alloc(512);
+  rc = chr->access_cb(conn_handle, 0, &ctxt, chr->arg);
+  if (rc == 0) {
+    ble_hs_mbuf_to_flat(ctxt.om, out, max_len, out_len);
+  }
+  os_mbuf_free_chain(ctxt.om);
+  return rc;
+}
+
+int ble_gattc_notify_custom(uint16_t conn_handle, uint16_t attr_handle,
+                            struct os_mbuf *om) {
+  mock_notify_fn_t fn;
+
+  pthread_mutex_lock(&s_hs.lock);
+  fn = s_hs.notify;
+  if (s_hs.congested) {
+    pthread_mutex_unlock(&s_hs.lock);
+    os_mbuf_free_chain(om);
+    return BLE_HS_ENOMEM;
+  }
+  pthread_mutex_unlock(&s_hs.lock);
+  if (fn) {
+    fn(conn_handle, attr_handle, om->om_data, om->om_len);
+  }
+  os_mbuf_free_chain(om);
+  return 0;
+}
+
+void mock_notify_set(mock_notify_fn_t fn) {
+  pthread_mutex_lock(&s_hs.lock);
+  s_hs.notify = fn;
+  pthread_mutex_unlock(&s_hs.lock);
+}
+
+void mock_notify_congested(bool on) {
+  pthread_mutex_lock(&s_hs.lock);
+  s_hs.congested = on;
+  pthread_mutex_unlock(&s_hs.lock);
+}
+
+void mock_att_mtu_set(uint16_t mtu) {
+  s_hs.mtu = mtu;
+}
+
+uint16_t ble_att_mtu(uint16_t conn_handle) {
+  return s_hs.mtu;
+}
+
+int ble_hs_synced(void) {
+  return 1;
+}
+
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc) {
+  if (handle == BLE_HS_CONN_HANDLE_NONE) {
+    return BLE_HS_ENOTCONN;
+  }
+  memset(out_desc, 0, sizeof(*out_desc));
+  out_desc->conn_handle = handle;
+  out_desc->sec_state.encrypted = 1;
+  out_desc->sec_state.authenticated = 1;
+  out_desc->sec_state.bonded = 1;
+  out_desc->sec_state.key_size = 16;
+  return 0;
+}
+
+/****************************************************
+ * HOST EVENT QUEUE
+*****************************************************/
+void ble_npl_event_init(struct ble_npl_event *ev, ble_npl_event_fn *fn,
+                        void *arg) {
+  memset(ev, 0, sizeof(*ev));
+  ev->fn = fn;
+  ev->arg = arg;
+}
+
+void *ble_npl_event_get_arg(struct ble_npl_event *ev) {
+  return ev->arg;
+}
+
+void ble_npl_eventq_put(struct ble_npl_eventq *evq, struct ble_npl_event *ev) {
+  pthread_mutex_lock(&s_hs.lock);
+  // like NimBLE, an event already queued is not queued twice
+  if (!ev->queued) {
+    struct ble_npl_event **tail = &evq->head;
+    while (*tail) {
+      tail = &(*tail)->next;
+    }
+    ev->next = NULL;
+    ev->queued = true;
+    *tail = ev;
+  }
+  pthread_mutex_unlock(&s_hs.lock);
+}
+
+struct ble_npl_eventq *nimble_port_get_dflt_eventq(void) {
+  return &s_hs.dflt_q;
+}
+
+int mock_host_run(void) {
+  int n = 0;
+
+  while (1) {
+    struct ble_npl_event *ev;
+
+    pthread_mutex_lock(&s_hs.lock);
+    ev = s_hs.dflt_q.head;
+    if (ev) {
+      s_hs.dflt_q.head = ev->next;
+      ev->queued = false;
+    }
+    pthread_mutex_unlock(&s_hs.lock);
+    if (ev == NULL) {
+      return n;
+    }
+    ev->fn(ev);
+    n++;
+  }
+}
+
+void ble_npl_callout_init(struct ble_npl_callout *co, struct ble_npl_eventq *evq,
+                          ble_npl_event_fn *fn, void *arg) {
+  memset(co, 0, sizeof(*co));
+  ble_npl_event_init(&co->ev, fn, arg);
+  co->evq = evq;
+  pthread_mutex_lock(&s_hs.lock);
+  assert(s_hs.callout_count < MOCK_CALLOUTS_MAX);
+  s_hs.callouts[s_hs.callout_count++] = co;
+  pthread_mutex_unlock(&s_hs.lock);
+}
+
+int ble_npl_callout_reset(struct ble_npl_callout *co, uint32_t ticks) {
+  pthread_mutex_lock(&s_hs.lock);
+  co->ticks = ticks;
+  co->active = true;
+  pthread_mutex_unlock(&s_hs.lock);
+  return 0;
+}
+
+void ble_npl_callout_stop(struct ble_npl_callout *co) {
+  pthread_mutex_lock(&s_hs.lock);
+  co->active = false;
+  pthread_mutex_unlock(&s_hs.lock);
+}
+
+bool ble_npl_callout_is_active(struct ble_npl_callout *co) {
+  bool active;
+
+  pthread_mutex_lock(&s_hs.lock);
+  active = co->active;
+  pthread_mutex_unlock(&s_hs.lock);
+  return active;
+}
+
+uint32_t ble_npl_time_ms_to_ticks32(uint32_t ms) {
+  return ms;
+}
+
+int mock_callouts_expire(void) {
+  struct ble_npl_callout *due[MOCK_CALLOUTS_MAX];
+  int n = 0;
+
+  pthread_mutex_lock(&s_hs.lock);
+  for (int i = 0; i < s_hs.callout_count; i++) {
+    if (s_hs.callouts[i]->active) {
+      s_hs.callouts[i]->active = false;
+      due[n++] = s_hs.callouts[i];
+    }
+  }
+  pthread_mutex_unlock(&s_hs.lock);
+  for (int i = 0; i < n; i++) {
+    ble_npl_eventq_put(due[i]->evq, &due[i]->ev);
+  }
+  return n;
+}
+
+/****************************************************
+ * EXTENDED AND PERIODIC ADVERTISING
+*****************************************************/
+int ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type) {
+  *out_addr_type = 0;
+  return 0;
+}
+
+static mock_ext_adv_t *adv_get(uint8_t instance) {
+  return instance < MOCK_ADV_INSTANCES ? &s_hs.adv[instance] : NULL;
+}
+
+// Copies the AD structures into `dst` and frees the mbuf, like the stack.
+static int adv_data_take(struct os_mbuf *om, uint8_t *dst, uint16_t *len,
+                         uint32_t *sets) {
+  int rc = 0;
+
+  if (s_hs.adv_fail) {
+    rc = BLE_HS_EBUSY;
+  } else if (om->om_len > MOCK_ADV_DATA_MAX) {
+    rc = BLE_HS_ENOMEM;
+  } else {
+    memcpy(dst, om->om_data, om->om_len);
+    *len = om->om_len;
+    (*sets)++;
+  }
+  os_mbuf_free_chain(om);
+  return rc;
+}
+
+int ble_gap_ext_adv_configure(uint8_t instance,
+                              const struct ble_gap_ext_adv_params *params,
+                              int8_t *selected_tx_power, ble_gap_event_fn *cb,
+                              void *cb_arg) {
+  mock_ext_adv_t *adv = adv_get(instance);
+
+  if (adv == NULL) {
+    return BLE_HS_EINVAL;
+  }
+  pthread_mutex_lock(&s_hs.lock);
+  memset(adv, 0, sizeof(*adv));
+  adv->configured = true;
+  adv->params = *params;
+  pthread_mutex_unlock(&s_hs.lock);
+  return 0;
+}
+
+int ble_gap_ext_adv_set_data(uint8_t instance, struct os_mbuf *data) {
+  mock_ext_adv_t *adv = adv_get(instance);
+  int rc;
+
+  if (adv == NULL || !adv->configured) {
+    os_mbuf_free_chain(data);
+    return BLE_HS_EINVAL;
+  }
+  pthread_mutex_lock(&s_hs.lock);
+  rc = adv_data_take(data, adv->data, &adv->data_len, &adv->data_sets);
+  pthread_mutex_unlock(&s_hs.lock);
+  return rc;
+}
+
+int ble_gap_ext_adv_start(uint8_t instance, int duration, int max_events) {
+  mock_ext_adv_t *adv = adv_get(instance);
+
+  if (adv == NULL || !adv->configured) {
+    return BLE_HS_EINVAL;
+  }
+  adv->started = true;
+  return 0;
+}
+
+int ble_gap_periodic_adv_configure(uint8_t instance,
+                                   const struct ble_gap_periodic_adv_params *params) {
+  mock_ext_adv_t *adv = adv_get(instance);
+
+  if (adv == NULL || !adv->configured) {
+    return BLE_HS_EINVAL;
+  }
+  adv->periodic_configured = true;
+  adv->periodic_params = *params;
+  return 0;
+}
+
+int ble_gap_periodic_adv_set_data(uint8_t instance, struct os_mbuf *data) {
+  mock_ext_adv_t *adv = adv_get(instance);
+  int rc;
+
+  if (adv == NULL || !adv->periodic_configured) {
+    os_mbuf_free_chain(data);
+    return BLE_HS_EINVAL;
+  }
+  pthread_mutex_lock(&s_hs.lock);
+  rc = adv_data_take(data, adv->periodic_data, &adv->periodic_data_len,
+                     &adv->periodic_data_sets);
+  pthread_mutex_unlock(&s_hs.lock);
+  return rc;
+}
+
+int ble_gap_periodic_adv_start(uint8_t instance) {
+  mock_ext_adv_t *adv = adv_get(instance);
+
+  if (adv == NULL || !adv->periodic_configured) {
+    return BLE_HS_EINVAL;
+  }
+  adv->periodic_started = true;
+  return 0;
+}
+
+void mock_ext_adv_get(uint8_t instance, mock_ext_adv_t *out) {
+  pthread_mutex_lock(&s_hs.lock);
+  *out = s_hs.adv[instance];
+  pthread_mutex_unlock(&s_hs.lock);
+}
+
+void mock_ext_adv_fail(bool on) {
+  s_hs.adv_fail = on;
+}
+
+/****************************************************
+ * L2CAP
+*****************************************************/
+struct ble_l2cap_chan {
+  uint16_t conn_handle;
+  struct os_mbuf *rx;       // receive buffer posted by the server
+  bool open;
+};
+
+static struct {
+  ble_l2cap_event_fn *cb;
+  void *cb_arg;
+  uint16_t mtu;
+  struct ble_l2cap_chan chan;
+} s_l2cap;
+
+int ble_l2cap_create_server(uint16_t psm, uint16_t mtu, ble_l2cap_event_fn *cb,
+                            void *cb_arg) {
+  s_l2cap.cb = cb;
+  s_l2cap.cb_arg = cb_arg;
+  s_l2cap.mtu = mtu;
+  return 0;
+}
+
+int ble_l2cap_recv_ready(struct ble_l2cap_chan *chan, struct os_mbuf *sdu_rx) {
+  if (chan->rx) {
+    return BLE_HS_EALREADY;
+  }
+  chan->rx = sdu_rx;
+  return 0;
+}
+
+int ble_l2cap_disconnect(struct ble_l2cap_chan *chan) {
+  struct ble_l2cap_event ev = {.type = BLE_L2CAP_EVENT_COC_DISCONNECTED};
+
+  if (!chan->open) {
+    return BLE_HS_ENOTCONN;
+  }
+  chan->open = false;
+  if (chan->rx) {
+    os_mbuf_free_chain(chan->rx);
+    chan->rx = NULL;
+  }
+  ev.disconnect.conn_handle = chan->conn_handle;
+  ev.disconnect.chan = chan;
+  s_l2cap.cb(&ev, s_l2cap.cb_arg);
+  return 0;
+}
+
+bool mock_l2cap_connect(uint16_t conn_handle) {
+  struct ble_l2cap_event ev = {.type = BLE_L2CAP_EVENT_COC_ACCEPT};
+
+  if (s_l2cap.cb == NULL || s_l2cap.chan.open) {
+    return false;
+  }
+  s_l2cap.chan = (struct ble_l2cap_chan){.conn_handle = conn_handle};
+  ev.accept.conn_handle = conn_handle;
+  ev.accept.chan = &s_l2cap.chan;
+  ev.accept.peer_sdu_size = s_l2cap.mtu;
+  if (s_l2cap.cb(&ev, s_l2cap.cb_arg) != 0) {
+    return false;
+  }
+  ev = (struct ble_l2cap_event){.type = BLE_L2CAP_EVENT_COC_CONNECTED};
+  ev.connect.conn_handle = conn_handle;
+  ev.connect.chan = &s_l2cap.chan;
+  s_l2cap.chan.open = true;
+  s_l2cap.cb(&ev, s_l2cap.cb_arg);
+  return true;
+}
+
+bool mock_l2cap_can_send(void) {
+  return s_l2cap.chan.open && s_l2cap.chan.rx != NULL;
+}
+
+bool mock_l2cap_send(const void *sdu, uint16_t len) {
+  struct ble_l2cap_event ev = {.type = BLE_L2CAP_EVENT_COC_DATA_RECEIVED};
+  struct os_mbuf *rx = s_l2cap.chan.rx;
+
+  if (!mock_l2cap_can_send() || len > rx->om_size) {
+    return false;
+  }
+  s_l2cap.chan.rx = NULL;
+  rx->om_len = 0;
+  os_mbuf_append(rx, sdu, len);
+  ev.receive.conn_handle = s_l2cap.chan.conn_handle;
+  ev.receive.chan = &s_l2cap.chan;
+  ev.receive.sdu_rx = rx;
+  s_l2cap.cb(&ev, s_l2cap.cb_arg);
+  return true;
+}
+
+void mock_l2cap_disconnect(void) {
+  ble_l2cap_disconnect(&s_l2cap.chan);
+}
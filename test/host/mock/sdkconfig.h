@@ -0,0 +1,13 @@
+#pragma once
+
+// Configuration the host build compiles the firmware sources with; mirrors
+// the values of the project's sdkconfig that the mocked modules look at.
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS      3
+#define CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM    1
+#define CONFIG_BT_NIMBLE_WHITELIST_SIZE       12
+#define CONFIG_BT_NIMBLE_EXT_ADV              1
+#define CONFIG_BT_NIMBLE_MAX_EXT_ADV_INSTANCES 2
+#define CONFIG_BT_NIMBLE_ENABLE_PERIODIC_ADV  1
+#define CONFIG_ESP_TASK_WDT_TIMEOUT_S         5
+#define CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ       160
+#define CONFIG_XTAL_FREQ                      40
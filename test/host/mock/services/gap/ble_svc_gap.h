@@ -0,0 +1,5 @@
+#pragma once
+
+#include "host/ble_hs.h"
+
+void ble_svc_gap_init(void);
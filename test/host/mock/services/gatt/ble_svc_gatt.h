@@ -0,0 +1,5 @@
+#pragma once
+
+#include "host/ble_hs.h"
+
+void ble_svc_gatt_init(void);
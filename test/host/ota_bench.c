@@ -0,0 +1,649 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gatt_svr.h"
+#include "ota_dedup.h"
+#include "ota_l2cap.h"
+#include "ota_writer.h"
+
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+
+#include "mock.h"
+
+// Replays OTA sessions against gatt_svr.c and the writer task with mocked
+// flash and NimBLE, and reports what the host task sees: throughput, CPU per
+// packet and the worst time a single write blocked it.
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define BENCH_CONN            1
+#define BENCH_IMAGE_SIZE      (128 * 1024)
+#define BENCH_WAIT_MS         5000
+#define BENCH_BLOCKS          (BENCH_IMAGE_SIZE / OTA_DEDUP_BLOCK_SIZE)
+
+// Programming and erase cost of the flash chip (datasheet typicals of a
+// GD25Q32 class part and a worn, slow one)
+static const mock_flash_timing_t flash_nominal = {350, 18000};
+static const mock_flash_timing_t flash_slow = {2800, 100000};
+
+/****************************************************
+ * ESTRUCUTURES
+*****************************************************/
+typedef struct {
+  const char *name;
+  uint8_t flags;                // OTA_REQUEST_F_*
+  uint16_t chunk;               // image bytes per packet
+  uint8_t loss_pct;             // frames that never reach the device
+  uint8_t corrupt_pct;          // frames with a flipped payload byte
+  uint8_t dup_pct;              // frames sent twice
+  bool dedup;                   // HASH_REQ, then COPY for unchanged blocks
+  bool resume;                  // RESUME instead of REQUEST
+  bool l2cap;                   // data as OTA_L2CAP_SDU_SIZE SDUs on the CoC
+  uint32_t interrupt_at;        // drop the link once this much was sent
+  uint32_t fail_at;             // flash refuses to program past this offset
+  const mock_flash_timing_t *flash;
+} scenario_t;
+
+typedef struct {
+  bool ok;
+  uint32_t link_bytes;          // bytes written on the link, resends included
+  uint32_t image_bytes;         // intact image bytes accepted this session
+  uint32_t packets;
+  uint32_t rejected;            // writes refused for lack of a buffer
+  uint32_t gaps;                // GAP reports acted on
+  uint32_t sent_max;            // furthest image offset sent
+  uint32_t progress_bad;        // progress readings ahead of what was sent
+  int64_t wall_us;
+  uint64_t cpu_ns;              // host thread CPU spent in data writes
+  uint32_t lat_max_us;          // slowest single data write
+  uint32_t fw_cb_avg_us;        // receive path as timed by the firmware
+  uint32_t fw_cb_max_us;
+  uint32_t fw_rx_bytes;         // image bytes the firmware counted
+} result_t;
+
+#define INBOX_LEN 16
+
+// notifications of the OTA control characteristic, from any thread
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint32_t credits;
+  uint8_t hashes[BENCH_BLOCKS][OTA_DEDUP_HASH_LEN];
+  uint32_t hashes_rx;
+  uint8_t msgs[INBOX_LEN][16];
+  uint8_t head;
+  uint8_t count;
+} inbox = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
+static uint8_t image[BENCH_IMAGE_SIZE];
+static uint8_t running[BENCH_IMAGE_SIZE];
+static uint32_t rng_state = 0x2545F491;
+
+/****************************************************
+ * CLIENT SIDE
+*****************************************************/
+static uint32_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static bool chance(uint8_t pct) { return pct && rng() % 100 < pct; }
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void on_notify(uint16_t conn_handle, uint16_t attr_handle,
+                      const uint8_t *data, uint16_t len) {
+  pthread_mutex_lock(&inbox.lock);
+  if (data[0] == SVR_CHR_OTA_CONTROL_CREDIT && len >= 3) {
+    inbox.credits += data[1] | (data[2] << 8);
+  } else if (data[0] == SVR_CHR_OTA_CONTROL_HASHES && len >= 4) {
+    const uint16_t first = data[1] | (data[2] << 8);
+    for (int i = 0; i < data[3] && first + i < BENCH_BLOCKS; i++) {
+      memcpy(inbox.hashes[first + i], &data[4 + i * OTA_DEDUP_HASH_LEN],
+             OTA_DEDUP_HASH_LEN);
+    }
+    inbox.hashes_rx += data[3];
+  } else if (data[0] != SVR_CHR_OTA_CONTROL_LINK && inbox.count < INBOX_LEN) {
+    const uint8_t slot = (inbox.head + inbox.count++) % INBOX_LEN;
+    memset(inbox.msgs[slot], 0, sizeof(inbox.msgs[slot]));
+    memcpy(inbox.msgs[slot], data, len < 16 ? len : 16);
+  }
+  pthread_cond_broadcast(&inbox.changed);
+  pthread_mutex_unlock(&inbox.lock);
+}
+
+static void inbox_reset(void) {
+  pthread_mutex_lock(&inbox.lock);
+  inbox.credits = 0;
+  inbox.hashes_rx = 0;
+  inbox.count = 0;
+  pthread_mutex_unlock(&inbox.lock);
+}
+
+// Next control message, or false if none arrived (no waiting: the host task
+// answers control writes before they return).
+static bool inbox_pop(uint8_t msg[16]) {
+  bool got = false;
+
+  pthread_mutex_lock(&inbox.lock);
+  if (inbox.count) {
+    memcpy(msg, inbox.msgs[inbox.head], 16);
+    inbox.head = (inbox.head + 1) % INBOX_LEN;
+    inbox.count--;
+    got = true;
+  }
+  pthread_mutex_unlock(&inbox.lock);
+  return got;
+}
+
+// Waits until `cond` holds on the inbox, running host events meanwhile.
+static bool inbox_wait(bool (*cond)(void *), void *arg) {
+  const int64_t end = esp_timer_get_time() + BENCH_WAIT_MS * 1000LL;
+
+  while (esp_timer_get_time() < end) {
+    struct timespec ts;
+    bool done;
+
+    mock_host_run();
+    pthread_mutex_lock(&inbox.lock);
+    done = cond(arg);
+    if (!done) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 1000000;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&inbox.changed, &inbox.lock, &ts);
+    }
+    pthread_mutex_unlock(&inbox.lock);
+    if (done) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool take_credit(void *arg) {
+  if (inbox.credits == 0) {
+    return false;
+  }
+  inbox.credits--;
+  return true;
+}
+
+static bool l2cap_credit(void *arg) {
+  return mock_l2cap_can_send();
+}
+
+static bool hashes_in(void *arg) {
+  return inbox.hashes_rx >= *(uint32_t *)arg;
+}
+
+static uint64_t thread_cpu_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int control(const uint8_t *req, uint16_t len) {
+  return mock_gatt_write(BENCH_CONN, &gatt_svr_chr_ota_control_uuid.u, req, len);
+}
+
+// One write to the data characteristic, timed like the host task sees it.
+static int data_write(const scenario_t *sc, result_t *res, const uint8_t *pkt,
+                      uint16_t len) {
+  int64_t t0;
+  uint64_t c0;
+  uint32_t dt;
+  int rc;
+
+  if ((sc->flags & OTA_REQUEST_F_STREAM) && !inbox_wait(take_credit, NULL)) {
+    return BLE_HS_ETIMEOUT;
+  }
+  c0 = thread_cpu_ns();
+  t0 = esp_timer_get_time();
+  rc = mock_gatt_write(BENCH_CONN, &gatt_svr_chr_ota_data_uuid.u, pkt, len);
+  dt = esp_timer_get_time() - t0;
+  res->cpu_ns += thread_cpu_ns() - c0;
+  res->packets++;
+  res->link_bytes += len;
+  if (dt > res->lat_max_us) {
+    res->lat_max_us = dt;
+  }
+  mock_host_run();
+  return rc;
+}
+
+// COPY of the unchanged block at `offset`, spending a credit like a packet.
+static int copy_block(const scenario_t *sc, result_t *res, uint32_t offset,
+                      uint32_t len) {
+  uint8_t req[9] = {SVR_CHR_OTA_CONTROL_COPY};
+
+  if ((sc->flags & OTA_REQUEST_F_STREAM) && !inbox_wait(take_credit, NULL)) {
+    return BLE_HS_ETIMEOUT;
+  }
+  put_le32(&req[1], len);
+  put_le32(&req[5], offset);
+  res->link_bytes += sizeof(req);
+  return control(req, sc->flags & OTA_REQUEST_F_FRAMED ? 9 : 5);
+}
+
+// Hashes of the running image; a block is copied when it matches the new one.
+static bool dedup_plan(bool same[BENCH_BLOCKS]) {
+  static const esp_partition_t new_image = {
+      .size = BENCH_IMAGE_SIZE, .mem = image};
+  uint8_t req[5] = {SVR_CHR_OTA_CONTROL_HASH_REQ, 0, 0, BENCH_BLOCKS & 0xFF,
+                    BENCH_BLOCKS >> 8};
+  uint8_t scratch[512];
+  uint32_t want = BENCH_BLOCKS;
+
+  control(req, sizeof(req));
+  if (!inbox_wait(hashes_in, &want)) {
+    return false;
+  }
+  for (uint32_t b = 0; b < BENCH_BLOCKS; b++) {
+    uint8_t hash[OTA_DEDUP_HASH_LEN];
+    ota_dedup_hash_block(&new_image, b, scratch, sizeof(scratch), hash);
+    same[b] = memcmp(hash, inbox.hashes[b], OTA_DEDUP_HASH_LEN) == 0;
+  }
+  return true;
+}
+
+// The progress the firmware reports can never be ahead of what was sent.
+static void check_progress(const scenario_t *sc, result_t *res, uint32_t offset) {
+  const uint8_t pct = gatt_svr_ota_progress();
+
+  if (offset > res->sent_max) {
+    res->sent_max = offset;
+  }
+  // past a flash fault the session is gone and shows no progress
+  if (sc->fail_at) {
+    return;
+  }
+  if (pct > 100 || (uint64_t)pct * BENCH_IMAGE_SIZE / 100 > res->sent_max) {
+    res->progress_bad++;
+  }
+}
+
+// Sends the image from `*offset` up to `end`; framed sessions rewind on GAP
+// reports.
+static int send_stream(const scenario_t *sc, result_t *res, uint32_t *offset,
+                       uint32_t end, const bool *same) {
+  const bool framed = sc->flags & OTA_REQUEST_F_FRAMED;
+  uint8_t pkt[OTA_WRITER_BUF_SIZE];
+  uint8_t msg[16];
+  int rc;
+
+  while (*offset < end) {
+    const uint32_t off = *offset;
+    uint16_t n = BENCH_IMAGE_SIZE - off < sc->chunk ? BENCH_IMAGE_SIZE - off
+                                                    : sc->chunk;
+
+    if (same && off % OTA_DEDUP_BLOCK_SIZE == 0 &&
+        same[off / OTA_DEDUP_BLOCK_SIZE]) {
+      rc = copy_block(sc, res, off, OTA_DEDUP_BLOCK_SIZE);
+      *offset += OTA_DEDUP_BLOCK_SIZE;
+    } else {
+      // packets never straddle a block, so COPY can follow any of them
+      if (same && off / OTA_DEDUP_BLOCK_SIZE !=
+                      (off + n - 1) / OTA_DEDUP_BLOCK_SIZE) {
+        n = OTA_DEDUP_BLOCK_SIZE - off % OTA_DEDUP_BLOCK_SIZE;
+      }
+      if (framed) {
+        put_le32(&pkt[0], off);
+        put_le32(&pkt[4], esp_rom_crc32_le(0, &image[off], n));
+        memcpy(&pkt[GATT_SVR_OTA_FRAME_HDR_LEN], &image[off], n);
+      } else {
+        memcpy(pkt, &image[off], n);
+      }
+      const uint16_t len = n + (framed ? GATT_SVR_OTA_FRAME_HDR_LEN : 0);
+      const bool corrupt = framed && chance(sc->corrupt_pct);
+      if (corrupt) {
+        pkt[len - 1] ^= 0x5A;
+      }
+      if (framed && chance(sc->loss_pct)) {
+        rc = 0;
+      } else {
+        rc = data_write(sc, res, pkt, len);
+        res->image_bytes += rc == 0 && !corrupt ? n : 0;
+        if (rc == 0 && framed && chance(sc->dup_pct)) {
+          rc = data_write(sc, res, pkt, len);
+          res->image_bytes += rc == 0 && !corrupt ? n : 0;
+        }
+      }
+      if (rc == BLE_ATT_ERR_INSUFFICIENT_RES && !(sc->flags & OTA_REQUEST_F_STREAM)) {
+        // write with response: the client retries after the error
+        res->rejected++;
+        continue;
+      }
+      *offset += n;
+    }
+    if (rc != 0) {
+      return rc;
+    }
+    check_progress(sc, res, *offset);
+
+    while (inbox_pop(msg)) {
+      if (msg[0] == SVR_CHR_OTA_CONTROL_GAP && get_le32(&msg[1]) < *offset) {
+        *offset = get_le32(&msg[1]);
+        res->gaps++;
+      } else if (msg[0] == SVR_CHR_OTA_CONTROL_DATA_NAK) {
+        return BLE_HS_EAPP;
+      }
+    }
+  }
+  return 0;
+}
+
+// Sends the image from `*offset` on the L2CAP channel, one SDU per credit.
+// The host task is timed per SDU, like data_write() per GATT write.
+static int send_l2cap(const scenario_t *sc, result_t *res, uint32_t *offset) {
+  uint8_t msg[16];
+  int64_t t0;
+  uint64_t c0;
+  uint32_t dt;
+
+  while (*offset < BENCH_IMAGE_SIZE) {
+    const uint32_t off = *offset;
+    const uint16_t n = BENCH_IMAGE_SIZE - off < OTA_L2CAP_SDU_SIZE
+                           ? BENCH_IMAGE_SIZE - off
+                           : OTA_L2CAP_SDU_SIZE;
+
+    if (!inbox_wait(l2cap_credit, NULL)) {
+      return BLE_HS_ETIMEOUT;
+    }
+    c0 = thread_cpu_ns();
+    t0 = esp_timer_get_time();
+    if (!mock_l2cap_send(&image[off], n)) {
+      return BLE_HS_EAPP;
+    }
+    dt = esp_timer_get_time() - t0;
+    res->cpu_ns += thread_cpu_ns() - c0;
+    res->packets++;
+    res->link_bytes += n;
+    res->image_bytes += n;
+    if (dt > res->lat_max_us) {
+      res->lat_max_us = dt;
+    }
+    mock_host_run();
+    *offset += n;
+    check_progress(sc, res, *offset);
+    while (inbox_pop(msg)) {
+      if (msg[0] == SVR_CHR_OTA_CONTROL_DATA_NAK) {
+        return BLE_HS_EAPP;
+      }
+    }
+  }
+  return 0;
+}
+
+static void read_fw_stats(result_t *res) {
+  uint8_t val[GATT_SVR_OTA_STATS_LEN];
+  uint16_t len = 0;
+
+  mock_gatt_read(BENCH_CONN, &gatt_svr_chr_ota_stats_uuid.u, val, sizeof(val), &len);
+  if (len == sizeof(val)) {
+    res->fw_rx_bytes = get_le32(&val[0]);
+    res->fw_cb_avg_us = get_le32(&val[9 * 4]);
+    res->fw_cb_max_us = get_le32(&val[10 * 4]);
+  }
+}
+
+// Packet size handshake, then REQUEST (or RESUME with the image CRC).
+// Returns false unless acked; `*offset` is where the client continues.
+static bool open_session(const scenario_t *sc, uint32_t *offset) {
+  const uint8_t size_req[2] = {sc->chunk & 0xFF, sc->chunk >> 8};
+  uint8_t req[10] = {sc->resume ? SVR_CHR_OTA_CONTROL_RESUME
+                                : SVR_CHR_OTA_CONTROL_REQUEST,
+                     sc->flags};
+  uint8_t msg[16];
+
+  mock_gatt_write(BENCH_CONN, &gatt_svr_chr_ota_data_uuid.u, size_req,
+                  sizeof(size_req));
+  put_le32(&req[2], BENCH_IMAGE_SIZE);
+  put_le32(&req[6], esp_rom_crc32_le(0, image, sizeof(image)));
+  inbox_reset();
+  control(req, sc->resume ? 10 : 6);
+  if (!inbox_pop(msg)) {
+    return false;
+  }
+  if (msg[0] == SVR_CHR_OTA_CONTROL_RESUME_ACK) {
+    *offset = get_le32(&msg[1]);
+    return true;
+  }
+  *offset = 0;
+  return msg[0] == SVR_CHR_OTA_CONTROL_REQUEST_ACK;
+}
+
+/****************************************************
+ * SCENARIOS
+*****************************************************/
+static void run(const scenario_t *sc, result_t *res) {
+  bool same[BENCH_BLOCKS];
+  mock_ota_stats_t before;
+  mock_ota_stats_t after;
+  mock_app_state_t app;
+  uint32_t offset = 0;
+  uint8_t msg[16];
+  int64_t t0;
+  int rc;
+
+  memset(res, 0, sizeof(*res));
+  mock_flash_timing(sc->flash);
+  mock_flash_reset(running, sizeof(running));
+  mock_ota_expect(image, sizeof(image));
+  mock_ota_stats(&before);
+
+  t0 = esp_timer_get_time();
+  if (!open_session(sc, &offset)) {
+    return;
+  }
+  if (sc->l2cap && !mock_l2cap_connect(BENCH_CONN)) {
+    return;
+  }
+  if (sc->dedup && !dedup_plan(same)) {
+    return;
+  }
+  if (sc->fail_at) {
+    // the writer task hits the bad sector: DATA_NAK, and DONE is refused
+    mock_flash_fail_at(sc->fail_at);
+    rc = sc->l2cap ? send_l2cap(sc, res, &offset)
+                   : send_stream(sc, res, &offset, BENCH_IMAGE_SIZE, NULL);
+    mock_flash_fail_at(0);
+    if (sc->l2cap) {
+      mock_l2cap_disconnect();
+    }
+    control((const uint8_t[]){SVR_CHR_OTA_CONTROL_DONE}, 1);
+    mock_ota_stats(&after);
+    mock_app_state(&app);
+    res->ok = rc == BLE_HS_EAPP && inbox_pop(msg) &&
+              msg[0] == SVR_CHR_OTA_CONTROL_DONE_NAK &&
+              after.ends == before.ends && after.aborts == before.aborts + 1 &&
+              after.verifies == before.verifies &&
+              after.boots_set == before.boots_set &&
+              after.aborts_unopened == 0 && after.ends_unopened == 0 &&
+              !app.ota_lock && !app.off_host_thread;
+    return;
+  }
+  if (sc->interrupt_at) {
+    // the link drops mid-transfer; the checkpoint survives it
+    rc = send_stream(sc, res, &offset, sc->interrupt_at, NULL);
+    gatt_svr_conn_closed(BENCH_CONN);
+    if (rc != 0 || !open_session(sc, &offset) || offset == 0) {
+      return;
+    }
+    res->image_bytes = 0;
+  }
+
+  while (1) {
+    rc = sc->l2cap ? send_l2cap(sc, res, &offset)
+                   : send_stream(sc, res, &offset, BENCH_IMAGE_SIZE,
+                                 sc->dedup ? same : NULL);
+    if (rc != 0) {
+      fprintf(stderr, "%s: data path failed at %lu (rc=%d)\n", sc->name,
+              (unsigned long)offset, rc);
+      return;
+    }
+    read_fw_stats(res);
+
+    // framed: DONE carries the stream length and may come back as a GAP
+    uint8_t done[5] = {SVR_CHR_OTA_CONTROL_DONE};
+    put_le32(&done[1], BENCH_IMAGE_SIZE);
+    control(done, sc->flags & OTA_REQUEST_F_FRAMED ? 5 : 1);
+    if (!inbox_pop(msg)) {
+      return;
+    }
+    if (msg[0] == SVR_CHR_OTA_CONTROL_GAP) {
+      offset = get_le32(&msg[1]);
+      res->gaps++;
+      continue;
+    }
+    break;
+  }
+  if (sc->l2cap) {
+    mock_l2cap_disconnect();
+  }
+  // the DONE handler waits REBOOT_DEEP_SLEEP_TIMEOUT before restarting
+  res->wall_us = esp_timer_get_time() - t0 - REBOOT_DEEP_SLEEP_TIMEOUT * 1000LL;
+
+  mock_ota_stats(&after);
+  mock_app_state(&app);
+  res->ok = msg[0] == SVR_CHR_OTA_CONTROL_DONE_ACK &&
+            // every handle begun is given back, the image checked once
+            after.ends == before.ends &&
+            after.aborts - before.aborts == after.begins - before.begins &&
+            after.verifies == before.verifies + 1 &&
+            after.boots_set == before.boots_set + 1 &&
+            after.aborts_unopened == 0 && after.ends_unopened == 0 &&
+            !app.ota_lock && !app.off_host_thread && res->progress_bad == 0 &&
+            // frame headers and corrupted frames are not counted as received
+            res->fw_rx_bytes == res->image_bytes;
+}
+
+// Control ops outside a session: DONE is refused, HASH_REQ and COPY are
+// ignored, and a refused REQUEST leaves no update handle to abort or end.
+static bool check_stray_ops(void) {
+  const uint8_t done[1] = {SVR_CHR_OTA_CONTROL_DONE};
+  const uint8_t hash_req[5] = {SVR_CHR_OTA_CONTROL_HASH_REQ, 0, 0, 1, 0};
+  const uint8_t copy[5] = {SVR_CHR_OTA_CONTROL_COPY, 0, 0x10, 0, 0};
+  const uint8_t bad_request[6] = {SVR_CHR_OTA_CONTROL_REQUEST, 0x80};
+  mock_ota_stats_t before;
+  mock_ota_stats_t after;
+  uint8_t msg[16];
+  bool ok = true;
+
+  mock_ota_stats(&before);
+  inbox_reset();
+  control(done, sizeof(done));
+  ok &= inbox_pop(msg) && msg[0] == SVR_CHR_OTA_CONTROL_DONE_NAK;
+  control(hash_req, sizeof(hash_req));
+  control(copy, sizeof(copy));
+  mock_host_run();
+  ok &= inbox.hashes_rx == 0 && inbox.count == 0 && inbox.credits == 0;
+  control(bad_request, sizeof(bad_request));
+  ok &= inbox_pop(msg) && msg[0] == SVR_CHR_OTA_CONTROL_REQUEST_NAK;
+  control(done, sizeof(done));
+  ok &= inbox_pop(msg) && msg[0] == SVR_CHR_OTA_CONTROL_DONE_NAK;
+  mock_ota_stats(&after);
+  ok &= after.begins == before.begins && after.ends == before.ends &&
+        after.verifies == before.verifies &&
+        after.aborts_unopened == 0 && after.ends_unopened == 0 &&
+        after.boots_set == before.boots_set;
+  printf("%-28s %s\n", "stray control ops", ok ? "ok" : "FAIL");
+  return ok;
+}
+
+static void print_result(const scenario_t *sc, const result_t *res) {
+  const uint32_t bps = res->wall_us > 0
+                           ? (uint64_t)BENCH_IMAGE_SIZE * 1000000 / res->wall_us
+                           : 0;
+
+  printf("%-28s %8lu %7lu %9lu %6lu %8.1f %8lu %5lu/%-6lu %5lu %5lu  %s\n",
+         sc->name, (unsigned long)res->link_bytes,
+         (unsigned long)(res->wall_us / 1000), (unsigned long)bps,
+         (unsigned long)res->packets,
+         res->packets ? res->cpu_ns / 1000.0 / res->packets : 0.0,
+         (unsigned long)res->lat_max_us, (unsigned long)res->fw_cb_avg_us,
+         (unsigned long)res->fw_cb_max_us, (unsigned long)res->rejected,
+         (unsigned long)res->gaps, res->ok ? "ok" : "FAIL");
+  if (res->progress_bad) {
+    printf("  %lu progress readings unset or ahead of the data sent\n",
+           (unsigned long)res->progress_bad);
+  }
+}
+
+int main(void) {
+  static const scenario_t scenarios[] = {
+      {"write 128", 0, 128, .flash = &flash_nominal},
+      {"write 244", 0, 244, .flash = &flash_nominal},
+      {"write 512", 0, 512, .flash = &flash_nominal},
+      {"stream 244", OTA_REQUEST_F_STREAM, 244, .flash = &flash_nominal},
+      {"stream 495", OTA_REQUEST_F_STREAM, 495, .flash = &flash_nominal},
+      {"framed 487 lossy", OTA_REQUEST_F_STREAM | OTA_REQUEST_F_FRAMED, 487,
+       .loss_pct = 2, .corrupt_pct = 1, .dup_pct = 2, .flash = &flash_nominal},
+      {"framed 236 very lossy", OTA_REQUEST_F_STREAM | OTA_REQUEST_F_FRAMED, 236,
+       .loss_pct = 10, .corrupt_pct = 3, .dup_pct = 5, .flash = &flash_nominal},
+      {"framed 487 dedup", OTA_REQUEST_F_STREAM | OTA_REQUEST_F_FRAMED, 487,
+       .dedup = true, .flash = &flash_nominal},
+      {"resume 495 after link loss", OTA_REQUEST_F_STREAM, 495, .resume = true,
+       .interrupt_at = 80 * 1024, .flash = &flash_nominal},
+      {"write 512 slow flash", 0, 512, .flash = &flash_slow},
+      {"stream 495 slow flash", OTA_REQUEST_F_STREAM, 495, .flash = &flash_slow},
+      {"l2cap 2048", 0, 512, .l2cap = true, .flash = &flash_nominal},
+      {"l2cap 2048 slow flash", 0, 512, .l2cap = true, .flash = &flash_slow},
+      {"write 512 flash fault", 0, 512, .fail_at = 64 * 1024,
+       .flash = &flash_nominal},
+      {"l2cap 2048 flash fault", 0, 512, .l2cap = true,
+       .fail_at = 64 * 1024, .flash = &flash_nominal},
+  };
+  int failed = 0;
+
+  // lossy scenarios warn about every gap they cause on purpose
+  mock_log_level = ESP_LOG_ERROR;
+  for (size_t i = 0; i < sizeof(image); i++) {
+    image[i] = rng();
+  }
+  // the running image differs from the new one in every fourth block
+  memcpy(running, image, sizeof(running));
+  for (uint32_t b = 0; b < BENCH_BLOCKS; b += 4) {
+    running[b * OTA_DEDUP_BLOCK_SIZE + 100] ^= 0xFF;
+  }
+
+  mock_host_thread_set();
+  mock_notify_set(on_notify);
+  mock_att_mtu_set(247);
+  gatt_svr_init();
+
+  printf("%-28s %8s %7s %9s %6s %8s %8s %12s %5s %5s\n", "scenario",
+         "link B", "ms", "image B/s", "pkts", "cpu us", "blk us", "fw avg/max",
+         "rej", "gaps");
+  for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    result_t res;
+    run(&scenarios[i], &res);
+    print_result(&scenarios[i], &res);
+    failed += !res.ok;
+  }
+  failed += !check_stray_ops();
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,270 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gap.h"
+#include "mkey_presence.h"
+
+// Replays synthetic RSSI traces of a tag through the presence tracker and
+// reports how it behaves against what the tag really did: unlocks while the
+// key was clearly away (a reflection let it in), relocks while it was clearly
+// in range (a fade or a burst of lost reports threw it out), and how long the
+// unlock took once the key came into range. Traces follow a log-distance
+// path loss model with shadowing, multipath spikes, deep fades, lost reports
+// and body blockage. Through the accept list the scanner reports every
+// advertisement of the tag; an open scan keeps the duplicate filter of the
+// controller, which lets the first advertisement after each scan restart
+// through and drops the rest.
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define REPLAY_S(s)           ((int64_t)((s) * 1000000))
+#define REPLAY_TICK_US        REPLAY_S(0.05)   // control loop granularity
+#define REPLAY_ENTER_DBM      (-70)
+#define REPLAY_ADV_MS         200      // advertising interval of the tag
+
+// RSSI at 1 m and path loss exponent of a key fob carried in a pocket
+#define REPLAY_RSSI_1M        (-59.0)
+#define REPLAY_PATH_LOSS_N    2.5
+
+#define REPLAY_WAYPOINTS      4
+
+// Acceptance: no unlock from a key that is clearly away, at most one relock
+// per hour of a key that clearly stays in range, and the unlock within this
+// long of the key coming into range.
+#define REPLAY_UNLOCK_MAX_MS  2000
+#define REPLAY_RELOCK_MAX_PH  1.0
+
+/****************************************************
+ * TYPES
+*****************************************************/
+typedef struct {
+    float t_s;
+    float dist_m;
+} replay_waypoint_t;
+
+typedef struct {
+    const char *name;
+    uint16_t runs;                  // seeds the trace is replayed with
+    float len_s;
+    replay_waypoint_t path[REPLAY_WAYPOINTS];  // distance over time, linear
+    uint8_t waypoints;
+    uint16_t period_ms;             // report interval of the scanner
+    uint8_t loss_pct;               // reports that never arrive
+    float sigma_db;                 // shadowing of every report
+    uint8_t spike_pct;              // reports boosted by a reflection
+    float spike_db;
+    uint8_t fade_pct;               // reports in a deep fade
+    float fade_db;
+    float block_every_s;            // body blockage: no reports for block_s
+    float block_s;
+    uint16_t dup_reset_ms;          // open scan restart period, 0: accept list
+} replay_trace_t;
+
+typedef struct {
+    uint32_t unlocks;
+    uint32_t false_unlocks;         // became present while clearly away
+    uint32_t relocks;
+    uint32_t false_relocks;         // dropped while clearly in range
+    uint32_t timed;                 // unlocks timed from entering range
+    int64_t unlock_sum_us;
+    int64_t unlock_max_us;
+    int64_t relock_sum_us;          // from leaving range to the drop
+    uint32_t relocks_timed;
+    double hours;
+} replay_result_t;
+
+/****************************************************
+ * VARIABLES
+*****************************************************/
+static const uint8_t s_addr[6] = {0xC0, 0xFF, 0xEE, 0x00, 0x00, 0x01};
+static uint32_t s_rng;
+
+/****************************************************
+ * TRACE MODEL
+*****************************************************/
+static uint32_t rng(void) {
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+static bool chance(uint8_t pct) { return pct && rng() % 100 < pct; }
+
+static double rng_unit(void) { return (rng() + 0.5) / 4294967296.0; }
+
+static double rng_gauss(void) {
+    return sqrt(-2.0 * log(rng_unit())) * cos(2.0 * M_PI * rng_unit());
+}
+
+static double trace_dist(const replay_trace_t *tr, double t_s) {
+    const replay_waypoint_t *w = tr->path;
+
+    if (t_s <= w[0].t_s) {
+        return w[0].dist_m;
+    }
+    for (uint8_t i = 1; i < tr->waypoints; i++) {
+        if (t_s <= w[i].t_s) {
+            const double f = (t_s - w[i - 1].t_s) / (w[i].t_s - w[i - 1].t_s);
+            return w[i - 1].dist_m + f * (w[i].dist_m - w[i - 1].dist_m);
+        }
+    }
+    return w[tr->waypoints - 1].dist_m;
+}
+
+// Mean RSSI at the key's true position, i.e. without any channel effect.
+static double trace_mean_dbm(const replay_trace_t *tr, double t_s) {
+    return REPLAY_RSSI_1M - 10.0 * REPLAY_PATH_LOSS_N * log10(trace_dist(tr, t_s));
+}
+
+static bool trace_blocked(const replay_trace_t *tr, double t_s) {
+    return tr->block_s > 0 &&
+           fmod(t_s, tr->block_every_s) >= tr->block_every_s - tr->block_s;
+}
+
+/****************************************************
+ * REPLAY
+*****************************************************/
+static void replay_once(const replay_trace_t *tr, replay_result_t *res) {
+    const int64_t len_us = REPLAY_S(tr->len_s);
+    mkey_presence_t p;
+    int64_t next_report_us = REPLAY_S(tr->period_ms / 1000.0 * rng_unit());
+    int64_t filter_open_us = 0;     // duplicate filter passes the tag from
+    int64_t in_since_us = -1;       // key in range since, -1 when not
+    int64_t out_since_us = -1;      // key clearly away after being in range
+    bool was_in = false;
+    bool present = false;
+
+    mkey_presence_init(&p, (int64_t)MKEY_BEACON_STALE_MS * 1000);
+    for (int64_t now = 0; now <= len_us; now += REPLAY_TICK_US) {
+        const double t_s = now / 1e6;
+        const double mean = trace_mean_dbm(tr, t_s);
+        const bool in = mean >= REPLAY_ENTER_DBM;
+        const bool away = mean < REPLAY_ENTER_DBM - MKEY_PRESENCE_HYST_DB;
+
+        if (in && in_since_us < 0) {
+            in_since_us = now;
+        } else if (!in) {
+            in_since_us = -1;
+        }
+        was_in |= in;
+        if (away && was_in && out_since_us < 0) {
+            out_since_us = now;
+        } else if (!away) {
+            out_since_us = -1;
+        }
+
+        while (next_report_us <= now) {
+            const int64_t at_us = next_report_us;
+
+            // the scanner hears the tag about once per period, with jitter
+            next_report_us += REPLAY_S(tr->period_ms / 1000.0 * (0.8 + 0.4 * rng_unit()));
+            if (chance(tr->loss_pct) || trace_blocked(tr, t_s)) {
+                continue;
+            }
+            // and with the duplicate filter on, only once per scan restart
+            if (tr->dup_reset_ms) {
+                const int64_t reset_us = (int64_t)tr->dup_reset_ms * 1000;
+
+                if (at_us < filter_open_us) {
+                    continue;
+                }
+                filter_open_us = (at_us / reset_us + 1) * reset_us;
+            }
+            double rssi = mean + tr->sigma_db * rng_gauss();
+            if (chance(tr->spike_pct)) {
+                rssi += tr->spike_db;
+            } else if (chance(tr->fade_pct)) {
+                rssi -= tr->fade_db;
+            }
+            mkey_presence_sample(&p, s_addr, (int)lround(rssi), REPLAY_ENTER_DBM, now);
+        }
+        mkey_presence_update(&p, now);
+
+        const bool now_present = mkey_presence_any(&p);
+        if (now_present && !present) {
+            res->unlocks++;
+            res->false_unlocks += away;
+            if (in_since_us >= 0) {
+                const int64_t dt = now - in_since_us;
+                res->timed++;
+                res->unlock_sum_us += dt;
+                if (dt > res->unlock_max_us) {
+                    res->unlock_max_us = dt;
+                }
+            }
+        } else if (!now_present && present) {
+            res->relocks++;
+            res->false_relocks += in;
+            if (out_since_us >= 0) {
+                res->relock_sum_us += now - out_since_us;
+                res->relocks_timed++;
+            }
+        }
+        present = now_present;
+    }
+    res->hours += tr->len_s / 3600.0;
+}
+
+static bool replay(const replay_trace_t *tr) {
+    replay_result_t res = {0};
+    bool ok;
+
+    for (uint16_t run = 0; run < tr->runs; run++) {
+        s_rng = 0x2545F491u + run * 0x9E3779B9u;
+        replay_once(tr, &res);
+    }
+    const double relock_ph = res.false_relocks / res.hours;
+    ok = res.false_unlocks == 0 && relock_ph <= REPLAY_RELOCK_MAX_PH &&
+         res.unlock_max_us <= (int64_t)REPLAY_UNLOCK_MAX_MS * 1000;
+
+    printf("%-26s %5.1f %7lu %6lu %8.2f %6lu/%-6lu %8lu  %s\n", tr->name,
+           res.hours, (unsigned long)res.unlocks,
+           (unsigned long)res.false_unlocks, relock_ph,
+           (unsigned long)(res.timed ? res.unlock_sum_us / res.timed / 1000 : 0),
+           (unsigned long)(res.unlock_max_us / 1000),
+           (unsigned long)(res.relocks_timed
+                               ? res.relock_sum_us / res.relocks_timed / 1000
+                               : 0),
+           ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main(void) {
+    static const replay_trace_t traces[] = {
+        // the owner walks up to the vehicle and stays next to it
+        {"approach, walking", 40, 40, {{0, 15}, {12, 0.8}}, 2,
+         REPLAY_ADV_MS, 10, 4, 1, 14, 3, 15},
+        {"approach, lossy scan", 40, 40, {{0, 15}, {8, 1.0}}, 2,
+         REPLAY_ADV_MS, 35, 5, 2, 14, 5, 15},
+        // key parked a few meters away, the channel full of reflections
+        {"parked 8 m, reflections", 1, 4 * 3600, {{0, 8}}, 1,
+         REPLAY_ADV_MS, 10, 3, 1, 16, 0, 0},
+        // a key behind a wall, heard now and then: after every gap longer
+        // than the stale time the tracker starts from an empty window
+        {"behind a wall, rarely", 1, 4 * 3600, {{0, 10}}, 1,
+         REPLAY_ADV_MS, 97, 3, 5, 20, 0, 0},
+        // key at the door, in a pocket: deep fades and body blockage
+        {"at the door, body fades", 1, 4 * 3600, {{0, 2}}, 1,
+         REPLAY_ADV_MS, 15, 4, 0, 0, 6, 18, 45, 2},
+        // open scan (a key batch, or more tags than the accept list holds):
+        // the duplicate filter lets one report per restart through
+        {"approach, open scan", 40, 40, {{0, 15}, {12, 0.8}}, 2,
+         REPLAY_ADV_MS, 10, 4, 1, 14, 3, 15, 0, 0, GAP_SCAN_DUP_RESET_MS},
+        {"parked 8 m, open scan", 1, 4 * 3600, {{0, 8}}, 1,
+         REPLAY_ADV_MS, 10, 3, 1, 16, 0, 0, 0, 0, GAP_SCAN_DUP_RESET_MS},
+        // the owner leaves: relock time is informational
+        {"walk away", 40, 40, {{0, 1}, {10, 1}, {20, 15}}, 3,
+         REPLAY_ADV_MS, 10, 4, 1, 14, 3, 15},
+    };
+    int failed = 0;
+
+    printf("%-26s %5s %7s %6s %8s %13s %8s\n", "trace", "hours", "unlocks",
+           "false", "relock/h", "unlock avg/max", "relock");
+    for (size_t i = 0; i < sizeof(traces) / sizeof(traces[0]); i++) {
+        failed += !replay(&traces[i]);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
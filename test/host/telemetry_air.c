@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gap.h"
+#include "gatt_svr.h"
+#include "mkey.h"
+#include "telemetry.h"
+
+#include "mock.h"
+
+// Brings up the telemetry set of telemetry.c the way sync_cb does, with the
+// extended and periodic advertising the project's sdkconfig enables, and
+// reads back what went on air: set parameters, the AD structure carrying the
+// record, updates on a change only, the refresh timer and a controller that
+// refuses the data.
+
+/****************************************************
+ * DEFINES
+*****************************************************/
+#define AIR_AD_LEN            (4 + TELEMETRY_LEN)
+
+/****************************************************
+ * COLLABORATORS
+*****************************************************/
+static struct {
+  uint8_t status;
+  mkey_counters_t counters;
+  uint8_t ota_progress;
+} s_fw = {
+    .status = GAP_ADV_ST_DOOR | GAP_ADV_ST_RELAY,
+    .ota_progress = 0xFF,
+};
+
+uint8_t gap_adv_status_get(void) {
+  return s_fw.status;
+}
+
+void mkey_counters_get(mkey_counters_t *out) {
+  *out = s_fw.counters;
+}
+
+uint8_t gatt_svr_ota_progress(void) {
+  return s_fw.ota_progress;
+}
+
+/****************************************************
+ * HELPERS
+*****************************************************/
+static int check(bool ok, const char *what) {
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+  }
+  return !ok;
+}
+
+// The AD structure is the manufacturer data of GAP_MFG_COMPANY_ID and the
+// record matches what telemetry_pack() reports right now, sequence and
+// uptime aside.
+static bool ad_ok(const uint8_t *ad, uint16_t len) {
+  uint8_t now[TELEMETRY_LEN];
+
+  if (len != AIR_AD_LEN || ad[0] != AIR_AD_LEN - 1 ||
+      ad[1] != BLE_HS_ADV_TYPE_MFG_DATA ||
+      ad[2] != (GAP_MFG_COMPANY_ID & 0xFF) || ad[3] != GAP_MFG_COMPANY_ID >> 8) {
+    return false;
+  }
+  telemetry_pack(now);
+  now[2] = ad[4 + 2];
+  memcpy(&now[8], &ad[4 + 8], 4);
+  return memcmp(&ad[4], now, TELEMETRY_LEN) == 0;
+}
+
+static void report(const char *what, const mock_ext_adv_t *adv) {
+  printf("%-24s ext %2lu sets, periodic %2lu sets, seq %u\n", what,
+         (unsigned long)adv->data_sets, (unsigned long)adv->periodic_data_sets,
+         adv->data_len ? adv->data[4 + 2] : 0);
+}
+
+int main(void) {
+  mock_ext_adv_t adv;
+  mock_ext_adv_t before;
+  mock_ext_adv_t legacy;
+  int failed = 0;
+
+  failed += check(TELEMETRY_ENABLED, "telemetry compiled in with the sdkconfig");
+
+  // bring-up after a host sync
+  telemetry_start();
+  mock_ext_adv_get(GAP_ADV_INSTANCE_TELEMETRY, &adv);
+  report("start", &adv);
+  failed += check(adv.configured && adv.started, "telemetry set started");
+  failed += check(!adv.params.connectable && !adv.params.scannable &&
+                      !adv.params.legacy_pdu,
+                  "non-connectable, non-scannable extended PDUs");
+  failed += check(adv.params.itvl_min == TELEMETRY_ADV_ITVL &&
+                      adv.params.sid == TELEMETRY_SID &&
+                      adv.params.secondary_phy == BLE_HCI_LE_PHY_2M,
+                  "set interval, SID and secondary PHY");
+  failed += check(ad_ok(adv.data, adv.data_len), "extended data carries the record");
+  failed += check(adv.periodic_started &&
+                      adv.periodic_params.itvl_min == TELEMETRY_PERIODIC_ITVL,
+                  "periodic advertising started");
+  failed += check(adv.periodic_data_len == adv.data_len &&
+                      memcmp(adv.periodic_data, adv.data, adv.data_len) == 0,
+                  "periodic data repeats the record");
+  mock_ext_adv_get(GAP_ADV_INSTANCE_LEGACY, &legacy);
+  failed += check(!legacy.configured, "connectable set left to gap.c");
+
+  // nothing changed: nothing is sent
+  before = adv;
+  telemetry_update();
+  mock_ext_adv_get(GAP_ADV_INSTANCE_TELEMETRY, &adv);
+  failed += check(adv.data_sets == before.data_sets, "no update without a change");
+
+  // a status change and an unlock go out with a new sequence number
+  s_fw.status &= ~GAP_ADV_ST_RELAY;
+  s_fw.counters.unlocks++;
+  s_fw.counters.last_unlock = MKEY_UNLOCK_BEACON;
+  telemetry_update();
+  mock_ext_adv_get(GAP_ADV_INSTANCE_TELEMETRY, &adv);
+  report("status change", &adv);
+  failed += check(adv.data_sets == before.data_sets + 1 &&
+                      adv.periodic_data_sets == before.periodic_data_sets + 1,
+                  "change sent on both sets");
+  failed += check(adv.data[4 + 2] == (uint8_t)(before.data[4 + 2] + 1),
+                  "sequence bumped");
+  failed += check(ad_ok(adv.data, adv.data_len) && adv.data[4 + 3] == s_fw.status &&
+                      adv.data[4 + 4] == MKEY_UNLOCK_BEACON,
+                  "record carries the new status");
+
+  // the refresh timer resends the same record (uptime only)
+  before = adv;
+  failed += check(mock_callouts_expire() == 1, "refresh timer armed");
+  mock_host_run();
+  mock_ext_adv_get(GAP_ADV_INSTANCE_TELEMETRY, &adv);
+  report("refresh", &adv);
+  failed += check(adv.data_sets == before.data_sets + 1, "refresh resends");
+  failed += check(mock_callouts_expire() == 1, "refresh timer rearmed");
+  mock_host_run();
+
+  // the controller refuses the data: the change is retried on the next update
+  mock_ext_adv_get(GAP_ADV_INSTANCE_TELEMETRY, &before);
+  mock_ext_adv_fail(true);
+  s_fw.ota_progress = 40;
+  telemetry_update();
+  mock_ext_adv_fail(false);
+  telemetry_update();
+  mock_ext_adv_get(GAP_ADV_INSTANCE_TELEMETRY, &adv);
+  report("refused, then retried", &adv);
+  failed += check(adv.data_sets == before.data_sets + 1 && adv.data[4 + 6] == 40,
+                  "refused change sent on the next update");
+
+  printf("telemetry: %s\n", failed ? "FAIL" : "ok");
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}